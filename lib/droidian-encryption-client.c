@@ -0,0 +1,705 @@
+/* droidian-encryption-client.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define G_LOG_DOMAIN "droidian-encryption-client"
+
+#define SERVICE_BUS_NAME "org.droidian.EncryptionService"
+#define ENCRYPTION_OBJECT_PATH "/Encryption"
+
+#include "droidian-encryption-client.h"
+
+/**
+ * SECTION:droidian-encryption-client
+ * @short_description: Shared access to droidian-encryption-service
+ *
+ * Every #DroidianEncryptionClient in a process is the same object, backed
+ * by a single proxy: properties are cached and kept up to date through
+ * signals, so there is no need to poll the service.
+ */
+
+struct _DroidianEncryptionClient
+{
+  GObject parent_instance;
+
+  GCancellable *cancellable;
+  DroidianEncryptionServiceDbusEncryption *proxy;
+  DroidianEncryptionServiceDbusJob *job;
+  GError *error;
+
+  /* Calls made before the proxy was ready */
+  GQueue pending_calls;
+};
+
+typedef struct {
+  const char *method;
+  GVariant *parameters;
+} MethodCall;
+
+enum {
+  PROP_0,
+  PROP_READY,
+  PROP_STATUS,
+  PROP_JOB,
+  N_PROPS
+};
+static GParamSpec *props[N_PROPS] = { NULL };
+
+enum {
+  READY,
+  PROGRESS_CHANGED,
+  N_SIGNALS
+};
+static guint signals[N_SIGNALS] = { 0 };
+
+G_DEFINE_TYPE (DroidianEncryptionClient, droidian_encryption_client, G_TYPE_OBJECT)
+
+static void
+method_call_free (MethodCall *call)
+{
+  g_variant_unref (call->parameters);
+  g_free (call);
+}
+
+static void
+on_call_done (GDBusProxy   *proxy,
+              GAsyncResult *result,
+              GTask        *task)
+{
+  GError *error = NULL;
+  GVariant *reply;
+
+  if (!(reply = g_dbus_proxy_call_finish (proxy, result, &error)))
+      g_task_return_error (task, error);
+  else
+      g_task_return_pointer (task, reply, (GDestroyNotify) g_variant_unref);
+
+  g_object_unref (task);
+}
+
+static void
+dispatch_call (DroidianEncryptionClient *self,
+               GTask                    *task)
+{
+  MethodCall *call = g_task_get_task_data (task);
+
+  if (!self->proxy)
+    {
+      g_task_return_error (task, g_error_copy (self->error));
+      g_object_unref (task);
+      return;
+    }
+
+  g_dbus_proxy_call (G_DBUS_PROXY (self->proxy),
+                     call->method,
+                     call->parameters,
+                     G_DBUS_CALL_FLAGS_NONE,
+                     -1,
+                     g_task_get_cancellable (task),
+                     (GAsyncReadyCallback) on_call_done,
+                     task);
+}
+
+static void
+call_async (DroidianEncryptionClient *self,
+            const char               *method,
+            GVariant                 *parameters,
+            gpointer                  source_tag,
+            GCancellable             *cancellable,
+            GAsyncReadyCallback       callback,
+            gpointer                  user_data)
+{
+  MethodCall *call;
+  GTask *task;
+
+  g_return_if_fail (DROIDIAN_ENCRYPTION_IS_CLIENT (self));
+
+  call = g_new0 (MethodCall, 1);
+  call->method = method;
+  call->parameters = g_variant_ref_sink (parameters ? parameters : g_variant_new ("()"));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, source_tag);
+  g_task_set_task_data (task, call, (GDestroyNotify) method_call_free);
+
+  if (self->proxy || self->error)
+      dispatch_call (self, task);
+  else
+      g_queue_push_tail (&self->pending_calls, task);
+}
+
+static GVariant *
+call_finish (DroidianEncryptionClient  *self,
+             GAsyncResult              *result,
+             gpointer                   source_tag,
+             GError                   **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) == source_tag, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+on_job_progress_changed (DroidianEncryptionClient         *self,
+                         const char                       *stage,
+                         double                            progress,
+                         DroidianEncryptionServiceDbusJob *job)
+{
+  g_return_if_fail (DROIDIAN_ENCRYPTION_IS_CLIENT (self));
+
+  if (job == self->job)
+      g_signal_emit (self, signals[PROGRESS_CHANGED], 0, stage, progress);
+}
+
+static void
+on_job_proxy_ready (GObject                  *source_object,
+                    GAsyncResult             *result,
+                    DroidianEncryptionClient *self)
+{
+  g_autoptr (GError) error = NULL;
+  DroidianEncryptionServiceDbusJob *job;
+
+  if (!(job = droidian_encryption_service_dbus_job_proxy_new_finish (result, &error)))
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+          g_warning ("Unable to track the encryption job: %s", error->message);
+      return;
+    }
+
+  /* Superseded by a newer job in the meantime */
+  if (g_strcmp0 (g_dbus_proxy_get_object_path (G_DBUS_PROXY (job)),
+                 droidian_encryption_service_dbus_encryption_get_job (self->proxy)) != 0)
+    {
+      g_object_unref (job);
+      return;
+    }
+
+  g_clear_object (&self->job);
+  self->job = job;
+  g_signal_connect_object (self->job, "progress-changed",
+                           G_CALLBACK (on_job_progress_changed),
+                           self, G_CONNECT_SWAPPED);
+
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_JOB]);
+}
+
+static void
+update_job (DroidianEncryptionClient *self)
+{
+  const char *path = droidian_encryption_service_dbus_encryption_get_job (self->proxy);
+
+  if (self->job && g_strcmp0 (g_dbus_proxy_get_object_path (G_DBUS_PROXY (self->job)), path) == 0)
+      return;
+
+  if (self->job)
+    {
+      g_clear_object (&self->job);
+      g_object_notify_by_pspec (G_OBJECT (self), props[PROP_JOB]);
+    }
+
+  if (!path || g_strcmp0 (path, "/") == 0)
+      return;
+
+  droidian_encryption_service_dbus_job_proxy_new (g_dbus_proxy_get_connection (G_DBUS_PROXY (self->proxy)),
+                                                  G_DBUS_PROXY_FLAGS_NONE,
+                                                  SERVICE_BUS_NAME,
+                                                  path,
+                                                  self->cancellable,
+                                                  (GAsyncReadyCallback) on_job_proxy_ready,
+                                                  self);
+}
+
+static void
+on_proxy_status_changed (DroidianEncryptionClient *self,
+                         GParamSpec               *pspec,
+                         GObject                  *proxy)
+{
+  g_return_if_fail (DROIDIAN_ENCRYPTION_IS_CLIENT (self));
+
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_STATUS]);
+}
+
+static void
+on_proxy_job_changed (DroidianEncryptionClient *self,
+                      GParamSpec               *pspec,
+                      GObject                  *proxy)
+{
+  g_return_if_fail (DROIDIAN_ENCRYPTION_IS_CLIENT (self));
+
+  update_job (self);
+}
+
+static void
+on_proxy_ready (GObject                  *source_object,
+                GAsyncResult             *result,
+                DroidianEncryptionClient *self)
+{
+  DroidianEncryptionServiceDbusEncryption *proxy;
+  GError *error = NULL;
+  GTask *task;
+
+  /* Cancelled on dispose: self might be gone already, don't touch it */
+  proxy = droidian_encryption_service_dbus_encryption_proxy_new_for_bus_finish (result, &error);
+  if (!proxy && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      g_error_free (error);
+      return;
+    }
+
+  g_return_if_fail (DROIDIAN_ENCRYPTION_IS_CLIENT (self));
+
+  self->proxy = proxy;
+  self->error = error;
+
+  if (self->proxy)
+    {
+      g_signal_connect_object (self->proxy, "notify::status",
+                               G_CALLBACK (on_proxy_status_changed),
+                               self, G_CONNECT_SWAPPED);
+      g_signal_connect_object (self->proxy, "notify::job",
+                               G_CALLBACK (on_proxy_job_changed),
+                               self, G_CONNECT_SWAPPED);
+      update_job (self);
+    }
+  else
+    {
+      g_warning ("Unable to reach droidian-encryption-service: %s", self->error->message);
+    }
+
+  while ((task = g_queue_pop_head (&self->pending_calls)))
+      dispatch_call (self, task);
+
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_READY]);
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_STATUS]);
+  g_signal_emit (self, signals[READY], 0);
+}
+
+/**
+ * droidian_encryption_client_is_ready:
+ * @self: a #DroidianEncryptionClient
+ *
+ * Returns: %TRUE once the properties of the service have been fetched
+ */
+gboolean
+droidian_encryption_client_is_ready (DroidianEncryptionClient *self)
+{
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_IS_CLIENT (self), FALSE);
+
+  return self->proxy != NULL;
+}
+
+/**
+ * droidian_encryption_client_get_status:
+ * @self: a #DroidianEncryptionClient
+ *
+ * Returns: the cached encryption status
+ */
+DroidianEncryptionClientStatus
+droidian_encryption_client_get_status (DroidianEncryptionClient *self)
+{
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_IS_CLIENT (self), DROIDIAN_ENCRYPTION_CLIENT_STATUS_UNKNOWN);
+
+  if (!self->proxy)
+      return DROIDIAN_ENCRYPTION_CLIENT_STATUS_UNKNOWN;
+
+  return droidian_encryption_service_dbus_encryption_get_status (self->proxy);
+}
+
+/**
+ * droidian_encryption_client_get_proxy: (skip)
+ * @self: a #DroidianEncryptionClient
+ *
+ * Returns: (transfer none) (nullable): the shared proxy, %NULL until ready
+ */
+DroidianEncryptionServiceDbusEncryption *
+droidian_encryption_client_get_proxy (DroidianEncryptionClient *self)
+{
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_IS_CLIENT (self), NULL);
+
+  return self->proxy;
+}
+
+/**
+ * droidian_encryption_client_get_job: (skip)
+ * @self: a #DroidianEncryptionClient
+ *
+ * Returns: (transfer none) (nullable): the current job, if any
+ */
+DroidianEncryptionServiceDbusJob *
+droidian_encryption_client_get_job (DroidianEncryptionClient *self)
+{
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_IS_CLIENT (self), NULL);
+
+  return self->job;
+}
+
+void
+droidian_encryption_client_refresh_status (DroidianEncryptionClient *self,
+                                           GCancellable             *cancellable,
+                                           GAsyncReadyCallback       callback,
+                                           gpointer                  user_data)
+{
+  call_async (self, "RefreshStatus", NULL, droidian_encryption_client_refresh_status,
+              cancellable, callback, user_data);
+}
+
+gboolean
+droidian_encryption_client_refresh_status_finish (DroidianEncryptionClient  *self,
+                                                  GAsyncResult              *result,
+                                                  GError                   **error)
+{
+  g_autoptr (GVariant) reply = call_finish (self, result, droidian_encryption_client_refresh_status, error);
+
+  return reply != NULL;
+}
+
+void
+droidian_encryption_client_get_detailed_status (DroidianEncryptionClient *self,
+                                                GCancellable             *cancellable,
+                                                GAsyncReadyCallback       callback,
+                                                gpointer                  user_data)
+{
+  call_async (self, "GetDetailedStatus", NULL, droidian_encryption_client_get_detailed_status,
+              cancellable, callback, user_data);
+}
+
+/**
+ * droidian_encryption_client_get_detailed_status_finish:
+ * @self: a #DroidianEncryptionClient
+ * @result: a #GAsyncResult
+ * @error: return location for a #GError
+ *
+ * Returns: (transfer full): an a{sv} dictionary, see GetDetailedStatus
+ */
+GVariant *
+droidian_encryption_client_get_detailed_status_finish (DroidianEncryptionClient  *self,
+                                                       GAsyncResult              *result,
+                                                       GError                   **error)
+{
+  g_autoptr (GVariant) reply = call_finish (self, result, droidian_encryption_client_get_detailed_status, error);
+  GVariant *status = NULL;
+
+  if (reply)
+      g_variant_get (reply, "(@a{sv})", &status);
+
+  return status;
+}
+
+void
+droidian_encryption_client_start (DroidianEncryptionClient *self,
+                                  const char               *passphrase,
+                                  GCancellable             *cancellable,
+                                  GAsyncReadyCallback       callback,
+                                  gpointer                  user_data)
+{
+  call_async (self, "Start", g_variant_new ("(s)", passphrase), droidian_encryption_client_start,
+              cancellable, callback, user_data);
+}
+
+/**
+ * droidian_encryption_client_start_finish:
+ * @self: a #DroidianEncryptionClient
+ * @result: a #GAsyncResult
+ * @error: return location for a #GError
+ *
+ * Returns: (transfer full): the object path of the job tracking the set-up
+ */
+char *
+droidian_encryption_client_start_finish (DroidianEncryptionClient  *self,
+                                         GAsyncResult              *result,
+                                         GError                   **error)
+{
+  g_autoptr (GVariant) reply = call_finish (self, result, droidian_encryption_client_start, error);
+  char *job = NULL;
+
+  if (reply)
+      g_variant_get (reply, "(o)", &job);
+
+  return job;
+}
+
+void
+droidian_encryption_client_migrate (DroidianEncryptionClient *self,
+                                    const char               *passphrase,
+                                    const char               *cipher,
+                                    const char               *cipher_mode,
+                                    guint                     sector_size,
+                                    GCancellable             *cancellable,
+                                    GAsyncReadyCallback       callback,
+                                    gpointer                  user_data)
+{
+  call_async (self, "Migrate",
+              g_variant_new ("(sssu)", passphrase, cipher ? cipher : "", cipher_mode ? cipher_mode : "", sector_size),
+              droidian_encryption_client_migrate,
+              cancellable, callback, user_data);
+}
+
+/**
+ * droidian_encryption_client_migrate_finish:
+ * @self: a #DroidianEncryptionClient
+ * @result: a #GAsyncResult
+ * @error: return location for a #GError
+ *
+ * Returns: (transfer full): the object path of the job tracking the set-up
+ */
+char *
+droidian_encryption_client_migrate_finish (DroidianEncryptionClient  *self,
+                                           GAsyncResult              *result,
+                                           GError                   **error)
+{
+  g_autoptr (GVariant) reply = call_finish (self, result, droidian_encryption_client_migrate, error);
+  char *job = NULL;
+
+  if (reply)
+      g_variant_get (reply, "(o)", &job);
+
+  return job;
+}
+
+void
+droidian_encryption_client_cancel (DroidianEncryptionClient *self,
+                                   GCancellable             *cancellable,
+                                   GAsyncReadyCallback       callback,
+                                   gpointer                  user_data)
+{
+  call_async (self, "Cancel", NULL, droidian_encryption_client_cancel,
+              cancellable, callback, user_data);
+}
+
+gboolean
+droidian_encryption_client_cancel_finish (DroidianEncryptionClient  *self,
+                                          GAsyncResult              *result,
+                                          GError                   **error)
+{
+  g_autoptr (GVariant) reply = call_finish (self, result, droidian_encryption_client_cancel, error);
+
+  return reply != NULL;
+}
+
+void
+droidian_encryption_client_pause (DroidianEncryptionClient *self,
+                                  GCancellable             *cancellable,
+                                  GAsyncReadyCallback       callback,
+                                  gpointer                  user_data)
+{
+  call_async (self, "Pause", NULL, droidian_encryption_client_pause,
+              cancellable, callback, user_data);
+}
+
+gboolean
+droidian_encryption_client_pause_finish (DroidianEncryptionClient  *self,
+                                         GAsyncResult              *result,
+                                         GError                   **error)
+{
+  g_autoptr (GVariant) reply = call_finish (self, result, droidian_encryption_client_pause, error);
+
+  return reply != NULL;
+}
+
+void
+droidian_encryption_client_resume (DroidianEncryptionClient *self,
+                                   GCancellable             *cancellable,
+                                   GAsyncReadyCallback       callback,
+                                   gpointer                  user_data)
+{
+  call_async (self, "Resume", NULL, droidian_encryption_client_resume,
+              cancellable, callback, user_data);
+}
+
+gboolean
+droidian_encryption_client_resume_finish (DroidianEncryptionClient  *self,
+                                          GAsyncResult              *result,
+                                          GError                   **error)
+{
+  g_autoptr (GVariant) reply = call_finish (self, result, droidian_encryption_client_resume, error);
+
+  return reply != NULL;
+}
+
+void
+droidian_encryption_client_set_rate_limit (DroidianEncryptionClient *self,
+                                           guint64                   bytes_per_second,
+                                           GCancellable             *cancellable,
+                                           GAsyncReadyCallback       callback,
+                                           gpointer                  user_data)
+{
+  call_async (self, "SetRateLimit", g_variant_new ("(t)", bytes_per_second),
+              droidian_encryption_client_set_rate_limit,
+              cancellable, callback, user_data);
+}
+
+gboolean
+droidian_encryption_client_set_rate_limit_finish (DroidianEncryptionClient  *self,
+                                                  GAsyncResult              *result,
+                                                  GError                   **error)
+{
+  g_autoptr (GVariant) reply = call_finish (self, result, droidian_encryption_client_set_rate_limit, error);
+
+  return reply != NULL;
+}
+
+static void
+droidian_encryption_client_get_property (GObject    *object,
+                                         guint       prop_id,
+                                         GValue     *value,
+                                         GParamSpec *pspec)
+{
+  DroidianEncryptionClient *self = DROIDIAN_ENCRYPTION_CLIENT (object);
+
+  switch (prop_id)
+    {
+    case PROP_READY:
+      g_value_set_boolean (value, droidian_encryption_client_is_ready (self));
+      break;
+
+    case PROP_STATUS:
+      g_value_set_int (value, droidian_encryption_client_get_status (self));
+      break;
+
+    case PROP_JOB:
+      g_value_set_object (value, self->job);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
+static void
+droidian_encryption_client_constructed (GObject *obj)
+{
+  DroidianEncryptionClient *self = DROIDIAN_ENCRYPTION_CLIENT (obj);
+
+  G_OBJECT_CLASS (droidian_encryption_client_parent_class)->constructed (obj);
+
+  self->cancellable = g_cancellable_new ();
+  self->proxy = NULL;
+  self->job = NULL;
+  self->error = NULL;
+  g_queue_init (&self->pending_calls);
+
+  /* Properties are fetched once, then followed through PropertiesChanged */
+  droidian_encryption_service_dbus_encryption_proxy_new_for_bus (G_BUS_TYPE_SYSTEM,
+                                                                 G_DBUS_PROXY_FLAGS_NONE,
+                                                                 SERVICE_BUS_NAME,
+                                                                 ENCRYPTION_OBJECT_PATH,
+                                                                 self->cancellable,
+                                                                 (GAsyncReadyCallback) on_proxy_ready,
+                                                                 self);
+}
+
+static void
+droidian_encryption_client_dispose (GObject *obj)
+{
+  DroidianEncryptionClient *self = DROIDIAN_ENCRYPTION_CLIENT (obj);
+  GTask *task;
+
+  g_debug ("Client dispose");
+
+  if (self->cancellable)
+      g_cancellable_cancel (self->cancellable);
+
+  while ((task = g_queue_pop_head (&self->pending_calls)))
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Client disposed");
+      g_object_unref (task);
+    }
+
+  g_clear_object (&self->cancellable);
+  g_clear_object (&self->job);
+  g_clear_object (&self->proxy);
+  g_clear_error (&self->error);
+
+  G_OBJECT_CLASS (droidian_encryption_client_parent_class)->dispose (obj);
+}
+
+static void
+droidian_encryption_client_class_init (DroidianEncryptionClientClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->constructed  = droidian_encryption_client_constructed;
+  object_class->dispose      = droidian_encryption_client_dispose;
+  object_class->get_property = droidian_encryption_client_get_property;
+
+  props[PROP_READY] =
+    g_param_spec_boolean ("ready", "Ready", "Whether the service properties are available",
+                          FALSE,
+                          G_PARAM_READABLE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS);
+
+  props[PROP_STATUS] =
+    g_param_spec_int ("status", "Status", "The cached encryption status",
+                      DROIDIAN_ENCRYPTION_CLIENT_STATUS_UNKNOWN, DROIDIAN_ENCRYPTION_CLIENT_STATUS_FAILED,
+                      DROIDIAN_ENCRYPTION_CLIENT_STATUS_UNKNOWN,
+                      G_PARAM_READABLE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS);
+
+  props[PROP_JOB] =
+    g_param_spec_object ("job", "Job", "The current encryption job",
+                         DROIDIAN_ENCRYPTION_SERVICE_DBUS_TYPE_JOB,
+                         G_PARAM_READABLE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class, N_PROPS, props);
+
+  signals[READY] =
+    g_signal_new ("ready",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE, 0);
+
+  signals[PROGRESS_CHANGED] =
+    g_signal_new ("progress-changed",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE, 2, G_TYPE_STRING, G_TYPE_DOUBLE);
+}
+
+static void
+droidian_encryption_client_init (DroidianEncryptionClient *self)
+{
+  (void) self;
+}
+
+/**
+ * droidian_encryption_client_get_default:
+ *
+ * Returns: (transfer full): the #DroidianEncryptionClient shared by the process
+ */
+DroidianEncryptionClient *
+droidian_encryption_client_get_default (void)
+{
+  static DroidianEncryptionClient *instance = NULL;
+  static GMutex mutex;
+
+  g_mutex_lock (&mutex);
+
+  if (instance == NULL)
+    {
+      instance = g_object_new (DROIDIAN_ENCRYPTION_TYPE_CLIENT, NULL);
+      g_object_add_weak_pointer (G_OBJECT (instance), (gpointer) &instance);
+    }
+  else
+    {
+      g_object_ref (instance);
+    }
+
+  g_mutex_unlock (&mutex);
+
+  return instance;
+}
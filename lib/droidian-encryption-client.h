@@ -0,0 +1,124 @@
+/* droidian-encryption-client.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONCLIENT_H
+#define DROIDIANENCRYPTIONCLIENT_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <gio/gio.h>
+
+#include "droidian-encryption-dbus.h"
+
+G_BEGIN_DECLS
+
+/* Mirrors the Status property of org.droidian.EncryptionService.Encryption */
+typedef enum {
+  DROIDIAN_ENCRYPTION_CLIENT_STATUS_UNKNOWN = 0,
+  DROIDIAN_ENCRYPTION_CLIENT_STATUS_UNSUPPORTED,
+  DROIDIAN_ENCRYPTION_CLIENT_STATUS_UNCONFIGURED,
+  DROIDIAN_ENCRYPTION_CLIENT_STATUS_CONFIGURING,
+  DROIDIAN_ENCRYPTION_CLIENT_STATUS_CONFIGURED,
+  DROIDIAN_ENCRYPTION_CLIENT_STATUS_ENCRYPTING,
+  DROIDIAN_ENCRYPTION_CLIENT_STATUS_ENCRYPTED,
+  DROIDIAN_ENCRYPTION_CLIENT_STATUS_FAILED,
+} DroidianEncryptionClientStatus;
+
+#define DROIDIAN_ENCRYPTION_TYPE_CLIENT droidian_encryption_client_get_type ()
+G_DECLARE_FINAL_TYPE (DroidianEncryptionClient, droidian_encryption_client,
+                      DROIDIAN_ENCRYPTION, CLIENT, GObject)
+
+DroidianEncryptionClient *droidian_encryption_client_get_default (void);
+gboolean droidian_encryption_client_is_ready (DroidianEncryptionClient *self);
+DroidianEncryptionClientStatus droidian_encryption_client_get_status (DroidianEncryptionClient *self);
+DroidianEncryptionServiceDbusEncryption *droidian_encryption_client_get_proxy (DroidianEncryptionClient *self);
+DroidianEncryptionServiceDbusJob *droidian_encryption_client_get_job (DroidianEncryptionClient *self);
+
+void droidian_encryption_client_refresh_status (DroidianEncryptionClient *self,
+                                                GCancellable             *cancellable,
+                                                GAsyncReadyCallback       callback,
+                                                gpointer                  user_data);
+gboolean droidian_encryption_client_refresh_status_finish (DroidianEncryptionClient  *self,
+                                                           GAsyncResult              *result,
+                                                           GError                   **error);
+
+void droidian_encryption_client_get_detailed_status (DroidianEncryptionClient *self,
+                                                     GCancellable             *cancellable,
+                                                     GAsyncReadyCallback       callback,
+                                                     gpointer                  user_data);
+GVariant *droidian_encryption_client_get_detailed_status_finish (DroidianEncryptionClient  *self,
+                                                                 GAsyncResult              *result,
+                                                                 GError                   **error);
+
+void droidian_encryption_client_start (DroidianEncryptionClient *self,
+                                       const char               *passphrase,
+                                       GCancellable             *cancellable,
+                                       GAsyncReadyCallback       callback,
+                                       gpointer                  user_data);
+char *droidian_encryption_client_start_finish (DroidianEncryptionClient  *self,
+                                               GAsyncResult              *result,
+                                               GError                   **error);
+
+void droidian_encryption_client_migrate (DroidianEncryptionClient *self,
+                                         const char               *passphrase,
+                                         const char               *cipher,
+                                         const char               *cipher_mode,
+                                         guint                     sector_size,
+                                         GCancellable             *cancellable,
+                                         GAsyncReadyCallback       callback,
+                                         gpointer                  user_data);
+char *droidian_encryption_client_migrate_finish (DroidianEncryptionClient  *self,
+                                                 GAsyncResult              *result,
+                                                 GError                   **error);
+
+void droidian_encryption_client_cancel (DroidianEncryptionClient *self,
+                                        GCancellable             *cancellable,
+                                        GAsyncReadyCallback       callback,
+                                        gpointer                  user_data);
+gboolean droidian_encryption_client_cancel_finish (DroidianEncryptionClient  *self,
+                                                   GAsyncResult              *result,
+                                                   GError                   **error);
+
+void droidian_encryption_client_pause (DroidianEncryptionClient *self,
+                                       GCancellable             *cancellable,
+                                       GAsyncReadyCallback       callback,
+                                       gpointer                  user_data);
+gboolean droidian_encryption_client_pause_finish (DroidianEncryptionClient  *self,
+                                                  GAsyncResult              *result,
+                                                  GError                   **error);
+
+void droidian_encryption_client_resume (DroidianEncryptionClient *self,
+                                        GCancellable             *cancellable,
+                                        GAsyncReadyCallback       callback,
+                                        gpointer                  user_data);
+gboolean droidian_encryption_client_resume_finish (DroidianEncryptionClient  *self,
+                                                   GAsyncResult              *result,
+                                                   GError                   **error);
+
+void droidian_encryption_client_set_rate_limit (DroidianEncryptionClient *self,
+                                                guint64                   bytes_per_second,
+                                                GCancellable             *cancellable,
+                                                GAsyncReadyCallback       callback,
+                                                gpointer                  user_data);
+gboolean droidian_encryption_client_set_rate_limit_finish (DroidianEncryptionClient  *self,
+                                                           GAsyncResult              *result,
+                                                           GError                   **error);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONCLIENT_H */
@@ -18,7 +18,10 @@
 
 #define G_LOG_DOMAIN "droidian-encryption-service-config"
 
+/* The tests point it to a file of their own */
+#ifndef CONFIGURATION_FILE
 #define CONFIGURATION_FILE "/etc/droidian-encryption-service.conf"
+#endif
 #define CONFIGURATION_FILE_SECTION "droidian-encryption-service"
 
 #define DEFAULT_HEADER "/dev/droidian/droidian-reserved"
@@ -26,8 +29,19 @@
 #define DEFAULT_NAME "droidian_encrypted"
 #define DEFAULT_CIPHER "aes"
 #define DEFAULT_CIPHER_MODE "xts-plain64"
-#define DEFAULT_SECTOR_SIZE 4096
+#define DEFAULT_SECTOR_SIZE 0
 #define DEFAULT_SECTOR_SIZE_FORCE FALSE
+#define DEFAULT_METADATA_SIZE 0
+#define DEFAULT_KEYSLOTS_SIZE 0
+#define DEFAULT_MIGRATION_KEY_SIZE 0
+#define DEFAULT_KEYSLOT_ITERATION_TIME 2000
+#define DEFAULT_PROGRESS_SIGNAL_MAX_RATE 2
+#define DEFAULT_OPPORTUNISTIC_SCHEDULING TRUE
+#define DEFAULT_LOGIND_BUS_ADDRESS ""
+#define DEFAULT_PAUSE_ON_SLEEP TRUE
+#define DEFAULT_SLEEP_RESUME_DELAY 10
+#define DEFAULT_TRIM_AFTER_ENCRYPTION TRUE
+#define DEFAULT_TRIM_RATE_LIMIT (256 * 1024 * 1024)
 
 #define CREATE_CONFIG_GET_STRING(KEY, DEFAULT) \
   char * \
@@ -128,6 +142,17 @@ CREATE_CONFIG_GET_STRING  (cipher, DEFAULT_CIPHER);
 CREATE_CONFIG_GET_STRING  (cipher_mode, DEFAULT_CIPHER_MODE);
 CREATE_CONFIG_GET_INTEGER (sector_size, DEFAULT_SECTOR_SIZE);
 CREATE_CONFIG_GET_BOOLEAN (sector_size_force, DEFAULT_SECTOR_SIZE_FORCE);
+CREATE_CONFIG_GET_INTEGER (metadata_size, DEFAULT_METADATA_SIZE);
+CREATE_CONFIG_GET_INTEGER (keyslots_size, DEFAULT_KEYSLOTS_SIZE);
+CREATE_CONFIG_GET_INTEGER (migration_key_size, DEFAULT_MIGRATION_KEY_SIZE);
+CREATE_CONFIG_GET_INTEGER (keyslot_iteration_time, DEFAULT_KEYSLOT_ITERATION_TIME);
+CREATE_CONFIG_GET_INTEGER (progress_signal_max_rate, DEFAULT_PROGRESS_SIGNAL_MAX_RATE);
+CREATE_CONFIG_GET_BOOLEAN (opportunistic_scheduling, DEFAULT_OPPORTUNISTIC_SCHEDULING);
+CREATE_CONFIG_GET_STRING  (logind_bus_address, DEFAULT_LOGIND_BUS_ADDRESS);
+CREATE_CONFIG_GET_BOOLEAN (pause_on_sleep, DEFAULT_PAUSE_ON_SLEEP);
+CREATE_CONFIG_GET_INTEGER (sleep_resume_delay, DEFAULT_SLEEP_RESUME_DELAY);
+CREATE_CONFIG_GET_BOOLEAN (trim_after_encryption, DEFAULT_TRIM_AFTER_ENCRYPTION);
+CREATE_CONFIG_GET_INTEGER (trim_rate_limit, DEFAULT_TRIM_RATE_LIMIT);
 
 static void
 droidian_encryption_service_config_constructed (GObject *obj)
@@ -37,6 +37,17 @@ char *droidian_encryption_service_config_get_cipher (DroidianEncryptionServiceCo
 char *droidian_encryption_service_config_get_cipher_mode (DroidianEncryptionServiceConfig *self);
 gint  droidian_encryption_service_config_get_sector_size (DroidianEncryptionServiceConfig *self);
 gboolean  droidian_encryption_service_config_get_sector_size_force (DroidianEncryptionServiceConfig *self);
+gint  droidian_encryption_service_config_get_metadata_size (DroidianEncryptionServiceConfig *self);
+gint  droidian_encryption_service_config_get_keyslots_size (DroidianEncryptionServiceConfig *self);
+gint  droidian_encryption_service_config_get_migration_key_size (DroidianEncryptionServiceConfig *self);
+gint  droidian_encryption_service_config_get_keyslot_iteration_time (DroidianEncryptionServiceConfig *self);
+gint  droidian_encryption_service_config_get_progress_signal_max_rate (DroidianEncryptionServiceConfig *self);
+gboolean  droidian_encryption_service_config_get_opportunistic_scheduling (DroidianEncryptionServiceConfig *self);
+char *droidian_encryption_service_config_get_logind_bus_address (DroidianEncryptionServiceConfig *self);
+gboolean  droidian_encryption_service_config_get_pause_on_sleep (DroidianEncryptionServiceConfig *self);
+gint  droidian_encryption_service_config_get_sleep_resume_delay (DroidianEncryptionServiceConfig *self);
+gboolean  droidian_encryption_service_config_get_trim_after_encryption (DroidianEncryptionServiceConfig *self);
+gint  droidian_encryption_service_config_get_trim_rate_limit (DroidianEncryptionServiceConfig *self);
 
 G_END_DECLS
 
@@ -20,6 +20,9 @@
 
 #include "dbus.h"
 
+/* Exit after five minutes without calls */
+#define IDLE_TIMEOUT_SECONDS 300
+
 struct _DroidianEncryptionServiceDbus
 {
   GObject parent_instance;
@@ -27,7 +30,10 @@ struct _DroidianEncryptionServiceDbus
   uint owned_id;
   uint devicestate_id;
 
-  gint64 last_call_timestamp;
+  /* Seconds, monotonic. Written from the GDBus worker threads. */
+  gint last_call_timestamp;
+  /* Main context only */
+  guint idle_timeout_id;
 
   GDBusConnection *connection;
 };
@@ -76,21 +82,46 @@ on_name_lost (GDBusConnection *connection,
   g_debug ("Name lost: %s!", name);
 }
 
+static gint
+get_timestamp (void)
+{
+  return (gint) (g_get_monotonic_time () / G_USEC_PER_SEC);
+}
+
 static gboolean
 on_idle_timeout_elapsed (DroidianEncryptionServiceDbus *self)
 {
+  gint remaining;
+
   g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_DBUS (self), G_SOURCE_REMOVE);
 
-  g_warning ("Timeout callback");
+  self->idle_timeout_id = 0;
 
-  if ((g_get_monotonic_time () - self->last_call_timestamp) > 300 * 1000000)
+  /* Calls came in meanwhile: sleep until the deadline they pushed back */
+  remaining = g_atomic_int_get (&self->last_call_timestamp) + IDLE_TIMEOUT_SECONDS - get_timestamp ();
+  if (remaining > 0)
     {
-      /* More than five minutes since the last call, tell listeners we can exit */
-      g_signal_emit (self, signals[SIGNAL_TIMEOUT_REACHED], 0, self);
+      self->idle_timeout_id = g_timeout_add_seconds (remaining, G_SOURCE_FUNC (on_idle_timeout_elapsed), self);
       return G_SOURCE_REMOVE;
     }
 
-  return G_SOURCE_CONTINUE;
+  g_debug ("Idle timeout elapsed");
+
+  /* Listeners re-arm the deadline if they can't exit yet */
+  g_signal_emit (self, signals[SIGNAL_TIMEOUT_REACHED], 0, self);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+arm_idle_timeout (DroidianEncryptionServiceDbus *self)
+{
+  if (!self->idle_timeout_id)
+      self->idle_timeout_id = g_timeout_add_seconds (IDLE_TIMEOUT_SECONDS,
+                                                     G_SOURCE_FUNC (on_idle_timeout_elapsed),
+                                                     self);
+
+  return G_SOURCE_REMOVE;
 }
 
 void
@@ -98,7 +129,15 @@ droidian_encryption_service_dbus_register_timestamp (DroidianEncryptionServiceDb
 {
   g_return_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_DBUS (self));
 
-  self->last_call_timestamp = g_get_monotonic_time ();
+  /*
+   * Called from the GDBus worker threads as well. The timestamp is all
+   * they touch: a single deadline, checked when it expires rather than
+   * periodically, is only ever armed on the main context.
+   */
+  g_atomic_int_set (&self->last_call_timestamp, get_timestamp ());
+  g_main_context_invoke_full (NULL, G_PRIORITY_DEFAULT,
+                              G_SOURCE_FUNC (arm_idle_timeout),
+                              g_object_ref (self), g_object_unref);
 }
 
 GDBusConnection*
@@ -119,10 +158,10 @@ droidian_encryption_service_dbus_constructed (GObject *obj)
   self->devicestate_id = 0;
   self->owned_id = 0;
   self->connection = NULL;
+  self->idle_timeout_id = 0;
 
   /* Start idle timeout */
   droidian_encryption_service_dbus_register_timestamp (self);
-  g_timeout_add_seconds (60, G_SOURCE_FUNC (on_idle_timeout_elapsed), self);
 }
 
 void
@@ -149,6 +188,8 @@ droidian_encryption_service_dbus_dispose (GObject *obj)
 
   g_debug ("Dbus dispose");
 
+  g_clear_handle_id (&self->idle_timeout_id, g_source_remove);
+
   G_OBJECT_CLASS (droidian_encryption_service_dbus_parent_class)->dispose (obj);
 
   g_bus_unown_name (self->owned_id);
@@ -0,0 +1,53 @@
+/* clock.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "clock.h"
+
+static const DroidianEncryptionHelperClock system_clock = {
+  .get_monotonic_time = g_get_monotonic_time,
+  .get_real_time = g_get_real_time,
+  .poll = poll,
+};
+
+static const DroidianEncryptionHelperClock *current_clock = &system_clock;
+
+void
+droidian_encryption_helper_clock_set (const DroidianEncryptionHelperClock *clock)
+{
+  current_clock = clock ? clock : &system_clock;
+}
+
+gint64
+droidian_encryption_helper_clock_get_monotonic_time (void)
+{
+  return current_clock->get_monotonic_time ();
+}
+
+gint64
+droidian_encryption_helper_clock_get_real_time (void)
+{
+  return current_clock->get_real_time ();
+}
+
+int
+droidian_encryption_helper_clock_poll (struct pollfd *fds,
+                                       nfds_t         nfds,
+                                       int            timeout_msec)
+{
+  return current_clock->poll (fds, nfds, timeout_msec);
+}
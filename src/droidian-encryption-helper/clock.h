@@ -0,0 +1,52 @@
+/* clock.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONHELPERCLOCK_H
+#define DROIDIANENCRYPTIONHELPERCLOCK_H
+
+#include <glib.h>
+#include <poll.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Time source used by the pacing, throttling and statistics code.
+ * Everything defaults to the system clocks; a simulation build can
+ * install a virtual clock, so that waits advance time instead of
+ * sleeping.
+ */
+typedef struct {
+  gint64 (*get_monotonic_time) (void);
+  gint64 (*get_real_time) (void);
+  int (*poll) (struct pollfd *fds,
+               nfds_t         nfds,
+               int            timeout_msec);
+} DroidianEncryptionHelperClock;
+
+/* Must be called before any thread is started */
+void droidian_encryption_helper_clock_set (const DroidianEncryptionHelperClock *clock);
+
+gint64 droidian_encryption_helper_clock_get_monotonic_time (void);
+gint64 droidian_encryption_helper_clock_get_real_time (void);
+int droidian_encryption_helper_clock_poll (struct pollfd *fds,
+                                           nfds_t         nfds,
+                                           int            timeout_msec);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONHELPERCLOCK_H */
@@ -0,0 +1,61 @@
+/* control-protocol.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONHELPERCONTROLPROTOCOL_H
+#define DROIDIANENCRYPTIONHELPERCONTROLPROTOCOL_H
+
+/*
+ * The helper listens on a SOCK_SEQPACKET unix socket. Every request is a
+ * single packet, answered by a single packet starting either with
+ * "OK" or "ERROR", optionally followed by space separated key=value pairs.
+ * Clients are served concurrently, so a pending PAUSE or STOP doesn't
+ * delay the requests of other clients.
+ *
+ * STATUS          state, pause, rate limit and position
+ * STATS           bytes processed, time spent running, throttled and paused,
+ *                 time spent recovering an interrupted reencryption, bytes
+ *                 written to the devices against the daily budget, and the
+ *                 energy measured per pacing mode
+ * PAUSE           answered once the current hotzone has been completed,
+ *                 a throttling sleep is cut short
+ * RESUME
+ * RATE-LIMIT <n>  bytes per second, 0 removes the limit
+ * MODE <mode>     "boost" runs unthrottled, "background" applies the
+ *                 background rate limit. An explicit RATE-LIMIT wins.
+ * STOP            answered once the reencryption checkpoint has been written
+ */
+
+#define DROIDIAN_ENCRYPTION_HELPER_CONTROL_SOCKET_NAME "droidian-encryption-helper.sock"
+#define DROIDIAN_ENCRYPTION_HELPER_CONTROL_SOCKET "/run/" DROIDIAN_ENCRYPTION_HELPER_CONTROL_SOCKET_NAME
+#define DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX 1024
+
+#define DROIDIAN_ENCRYPTION_HELPER_CONTROL_STATUS "STATUS"
+#define DROIDIAN_ENCRYPTION_HELPER_CONTROL_STATS "STATS"
+#define DROIDIAN_ENCRYPTION_HELPER_CONTROL_PAUSE "PAUSE"
+#define DROIDIAN_ENCRYPTION_HELPER_CONTROL_RESUME "RESUME"
+#define DROIDIAN_ENCRYPTION_HELPER_CONTROL_RATE_LIMIT "RATE-LIMIT"
+#define DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE "MODE"
+#define DROIDIAN_ENCRYPTION_HELPER_CONTROL_STOP "STOP"
+
+#define DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE_BOOST "boost"
+#define DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE_BACKGROUND "background"
+
+#define DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_OK "OK"
+#define DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_ERROR "ERROR"
+
+#endif /* DROIDIANENCRYPTIONHELPERCONTROLPROTOCOL_H */
@@ -0,0 +1,944 @@
+/* control.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "clock.h"
+#include "control.h"
+#include "flight-recorder.h"
+
+typedef enum {
+  CONTROL_STATE_WAITING,
+  CONTROL_STATE_RUNNING,
+  CONTROL_STATE_PAUSED,
+  CONTROL_STATE_OVER_BUDGET,
+  CONTROL_STATE_STOPPED,
+} ControlState;
+
+static const char *control_state_names[] = {
+  [CONTROL_STATE_WAITING] = "waiting",
+  [CONTROL_STATE_RUNNING] = "running",
+  [CONTROL_STATE_PAUSED] = "paused",
+  [CONTROL_STATE_OVER_BUDGET] = "over-budget",
+  [CONTROL_STATE_STOPPED] = "stopped",
+};
+
+typedef enum {
+  CONTROL_MODE_BOOST,
+  CONTROL_MODE_BACKGROUND,
+} ControlMode;
+
+typedef struct {
+  char *stamp_name;
+  guint64 rate_limit;
+} ControlMilestone;
+
+static const char *control_mode_names[] = {
+  [CONTROL_MODE_BOOST] = DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE_BOOST,
+  [CONTROL_MODE_BACKGROUND] = DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE_BACKGROUND,
+};
+
+static const DroidianEncryptionHistoryPacing control_mode_pacing[] = {
+  [CONTROL_MODE_BOOST] = DROIDIAN_ENCRYPTION_HISTORY_PACING_BOOST,
+  [CONTROL_MODE_BACKGROUND] = DROIDIAN_ENCRYPTION_HISTORY_PACING_BACKGROUND,
+};
+
+struct _DroidianEncryptionHelperControl
+{
+  int run_fd;
+  int listen_fd;
+  int wakeup_fd; /* wakes up the reencryption thread */
+  int quit_fd;   /* stops the control thread */
+  int inotify_fd; /* watches /run for milestone stamps */
+  GThread *thread;
+  GThreadPool *clients; /* so that a blocking request doesn't hold the others */
+
+  gint stop_requested;
+
+  /* Everything below is protected by the mutex */
+  GMutex mutex;
+  GCond cond;
+  ControlState state;
+  gboolean paused;
+  guint64 rate_limit;
+  ControlMode mode;
+  guint64 background_rate_limit;
+  guint64 boot_rate_limit;
+  GArray *milestones;
+  gint reached_milestone;
+  guint64 offset;
+  guint64 size;
+
+  /* Statistics */
+  gint64 started_at;
+  gint64 started_at_real;
+  gboolean have_start_offset;
+  guint64 start_offset;
+  gint64 throttled_usec;
+  gint64 paused_usec;
+  gint64 recovery_usec;
+
+  /* Throttling window */
+  gint64 window_start;
+  guint64 window_offset;
+
+  /* Write accounting */
+  DroidianEncryptionHelperWriteCounter *write_counter;
+  guint64 written_bytes;
+  guint64 write_budget;      /* per day, 0 disables it */
+  guint64 budget_used;       /* by the previous sessions, in the current window */
+  guint64 budget_base;       /* written_bytes when the current window started */
+  gint64 budget_window_end;
+
+  /* Energy accounting, per pacing mode */
+  DroidianEncryptionHelperEnergy *energy;
+  gint64 energy_sampled_at; /* 0 if the next interval can't be accounted */
+  guint64 energy_consumed;
+  guint64 energy_offset;
+  ControlMode energy_mode;
+  DroidianEncryptionHistoryEnergy energy_stats[DROIDIAN_ENCRYPTION_HISTORY_PACING_MODES];
+};
+
+static void
+notify (int fd)
+{
+  guint64 value = 1;
+  ssize_t result;
+
+  /* write() is async-signal-safe */
+  result = write (fd, &value, sizeof (value));
+  (void) result;
+}
+
+static void
+drain (int fd)
+{
+  guint64 value;
+  ssize_t result;
+
+  result = read (fd, &value, sizeof (value));
+  (void) result;
+}
+
+void
+droidian_encryption_helper_control_request_stop (DroidianEncryptionHelperControl *self)
+{
+  g_atomic_int_set (&self->stop_requested, TRUE);
+  notify (self->wakeup_fd);
+}
+
+gboolean
+droidian_encryption_helper_control_should_stop (DroidianEncryptionHelperControl *self)
+{
+  return g_atomic_int_get (&self->stop_requested);
+}
+
+gboolean
+droidian_encryption_helper_control_wait (DroidianEncryptionHelperControl *self,
+                                         int                              timeout_msec)
+{
+  struct pollfd wakeup = {
+    .fd = self->wakeup_fd,
+    .events = POLLIN,
+  };
+
+  if (!droidian_encryption_helper_control_should_stop (self) &&
+      droidian_encryption_helper_clock_poll (&wakeup, 1, timeout_msec) > 0)
+      drain (self->wakeup_fd);
+
+  return !droidian_encryption_helper_control_should_stop (self);
+}
+
+void
+droidian_encryption_helper_control_set_running (DroidianEncryptionHelperControl *self)
+{
+  g_mutex_lock (&self->mutex);
+
+  self->state = CONTROL_STATE_RUNNING;
+  self->started_at = droidian_encryption_helper_clock_get_monotonic_time ();
+  self->started_at_real = droidian_encryption_helper_clock_get_real_time ();
+
+  g_mutex_unlock (&self->mutex);
+}
+
+gboolean
+droidian_encryption_helper_control_get_session (DroidianEncryptionHelperControl  *self,
+                                                DroidianEncryptionHistorySession *session)
+{
+  gboolean result = FALSE;
+
+  g_mutex_lock (&self->mutex);
+
+  /* Nothing worth recording if no hotzone has been processed */
+  if (!self->started_at || !self->have_start_offset)
+      goto out;
+
+  session->started_at = self->started_at_real;
+  session->start_offset = self->start_offset;
+  session->end_offset = self->offset;
+  session->active_usec =
+    droidian_encryption_helper_clock_get_monotonic_time () - self->started_at - self->paused_usec;
+  session->throttled_usec = self->throttled_usec;
+  session->paused_usec = self->paused_usec;
+
+  /* Include what has been flushed since the last hotzone */
+  if (self->write_counter)
+      self->written_bytes = droidian_encryption_helper_write_counter_get (self->write_counter);
+  session->written_bytes = self->written_bytes;
+  memcpy (session->energy, self->energy_stats, sizeof (session->energy));
+  result = TRUE;
+
+out:
+  g_mutex_unlock (&self->mutex);
+
+  return result;
+}
+
+void
+droidian_encryption_helper_control_set_recovery_time (DroidianEncryptionHelperControl *self,
+                                                      gint64                           recovery_usec)
+{
+  g_mutex_lock (&self->mutex);
+  self->recovery_usec = recovery_usec;
+  g_mutex_unlock (&self->mutex);
+}
+
+void
+droidian_encryption_helper_control_stopped (DroidianEncryptionHelperControl *self)
+{
+  g_mutex_lock (&self->mutex);
+
+  /* Reencryption is not running anymore, everything has been flushed */
+  self->state = CONTROL_STATE_STOPPED;
+  g_cond_broadcast (&self->cond);
+
+  g_mutex_unlock (&self->mutex);
+}
+
+void
+droidian_encryption_helper_control_set_background_rate_limit (DroidianEncryptionHelperControl *self,
+                                                              uint64_t                         rate_limit)
+{
+  g_mutex_lock (&self->mutex);
+  self->background_rate_limit = rate_limit;
+  g_mutex_unlock (&self->mutex);
+}
+
+void
+droidian_encryption_helper_control_set_boot_rate_limit (DroidianEncryptionHelperControl *self,
+                                                        uint64_t                         rate_limit)
+{
+  g_mutex_lock (&self->mutex);
+  self->boot_rate_limit = rate_limit;
+  self->window_start = 0;
+  g_mutex_unlock (&self->mutex);
+}
+
+void
+droidian_encryption_helper_control_set_write_counter (DroidianEncryptionHelperControl      *self,
+                                                      DroidianEncryptionHelperWriteCounter *write_counter)
+{
+  g_mutex_lock (&self->mutex);
+  g_clear_pointer (&self->write_counter, droidian_encryption_helper_write_counter_free);
+  self->write_counter = write_counter;
+  g_mutex_unlock (&self->mutex);
+}
+
+void
+droidian_encryption_helper_control_set_write_budget (DroidianEncryptionHelperControl *self,
+                                                     uint64_t                         write_budget,
+                                                     uint64_t                         used,
+                                                     gint64                           window_end)
+{
+  g_mutex_lock (&self->mutex);
+
+  self->write_budget = write_budget;
+  self->budget_used = used;
+  self->budget_base = self->written_bytes;
+
+  /* The window end comes from the history, in wall clock time */
+  self->budget_window_end = droidian_encryption_helper_clock_get_monotonic_time () +
+    MAX (window_end - droidian_encryption_helper_clock_get_real_time (), 0);
+
+  g_mutex_unlock (&self->mutex);
+}
+
+void
+droidian_encryption_helper_control_set_energy (DroidianEncryptionHelperControl *self,
+                                               DroidianEncryptionHelperEnergy  *energy)
+{
+  g_mutex_lock (&self->mutex);
+  g_clear_pointer (&self->energy, droidian_encryption_helper_energy_free);
+  self->energy = energy;
+  self->energy_sampled_at = 0;
+  g_mutex_unlock (&self->mutex);
+}
+
+static void
+sample_energy (DroidianEncryptionHelperControl *self,
+               gint64                           now)
+{
+  DroidianEncryptionHistoryEnergy *stats;
+  guint64 consumed;
+
+  if (!self->energy)
+      return;
+
+  if (!droidian_encryption_helper_energy_sample (self->energy, &consumed))
+    {
+      /* On external power, the next interval starts from the next sample on battery */
+      self->energy_sampled_at = 0;
+      return;
+    }
+
+  /* The interval since the previous hotzone, throttling included, goes to the mode it ran in */
+  if (self->energy_sampled_at && self->offset >= self->energy_offset)
+    {
+      stats = &self->energy_stats[control_mode_pacing[self->energy_mode]];
+      stats->energy_uj += consumed - self->energy_consumed;
+      stats->usec += now - self->energy_sampled_at;
+      stats->bytes += self->offset - self->energy_offset;
+    }
+
+  self->energy_sampled_at = now;
+  self->energy_consumed = consumed;
+  self->energy_offset = self->offset;
+  self->energy_mode = self->mode;
+}
+
+static gboolean
+check_milestones (DroidianEncryptionHelperControl *self)
+{
+  ControlMilestone *milestone;
+  gint index;
+
+  /* Milestones are ordered, the latest reached one wins even if earlier stamps are missing */
+  for (index = (gint) self->milestones->len - 1; index > self->reached_milestone; index--)
+    {
+      milestone = &g_array_index (self->milestones, ControlMilestone, index);
+
+      if (faccessat (self->run_fd, milestone->stamp_name, F_OK, 0) == -1)
+          continue;
+
+      self->reached_milestone = index;
+      self->boot_rate_limit = milestone->rate_limit;
+      self->window_start = 0;
+      droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_STAGE,
+                                                         DROIDIAN_ENCRYPTION_HELPER_STAGE_MILESTONE,
+                                                         index, milestone->rate_limit);
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+void
+droidian_encryption_helper_control_add_milestone (DroidianEncryptionHelperControl *self,
+                                                  const char                      *stamp_name,
+                                                  uint64_t                         rate_limit)
+{
+  ControlMilestone milestone = {
+    .stamp_name = g_strdup (stamp_name),
+    .rate_limit = rate_limit,
+  };
+
+  g_mutex_lock (&self->mutex);
+  g_array_append_val (self->milestones, milestone);
+
+  /* The stamp might be there already */
+  check_milestones (self);
+  g_mutex_unlock (&self->mutex);
+}
+
+gint
+droidian_encryption_helper_control_get_reached_milestone (DroidianEncryptionHelperControl *self)
+{
+  gint reached_milestone;
+
+  g_mutex_lock (&self->mutex);
+  reached_milestone = self->reached_milestone;
+  g_mutex_unlock (&self->mutex);
+
+  return reached_milestone;
+}
+
+static void
+handle_run_changes (DroidianEncryptionHelperControl *self)
+{
+  char buffer[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  ssize_t length;
+  gboolean reached;
+
+  /* Only the fact that something changed matters, the stamps are checked directly */
+  do
+      length = read (self->inotify_fd, buffer, sizeof (buffer));
+  while (length > 0 || (length < 0 && errno == EINTR));
+
+  g_mutex_lock (&self->mutex);
+  reached = check_milestones (self);
+  g_mutex_unlock (&self->mutex);
+
+  /* Let the reencryption thread pick the new rate up, or stop waiting for the stamp */
+  if (reached)
+      notify (self->wakeup_fd);
+}
+
+static guint64
+get_effective_rate_limit (DroidianEncryptionHelperControl *self)
+{
+  guint64 rate_limit;
+
+  /* A limit explicitly set by the user always wins over the mode */
+  if (self->rate_limit)
+      return self->rate_limit;
+
+  rate_limit = (self->mode == CONTROL_MODE_BOOST) ? 0 : self->background_rate_limit;
+
+  /* The boot ramp caps boost mode as well, the system is still starting up */
+  if (self->boot_rate_limit && (!rate_limit || self->boot_rate_limit < rate_limit))
+      rate_limit = self->boot_rate_limit;
+
+  return rate_limit;
+}
+
+static gint64
+get_throttle_delay (DroidianEncryptionHelperControl *self,
+                    guint64                          offset,
+                    gint64                           now)
+{
+  guint64 rate_limit = get_effective_rate_limit (self);
+  gint64 target;
+
+  if (!self->window_start || offset < self->window_offset)
+    {
+      self->window_start = now;
+      self->window_offset = offset;
+      return 0;
+    }
+
+  if (!rate_limit)
+      return 0;
+
+  /* When the current hotzone should have been completed at the given rate */
+  target = self->window_start +
+    (gint64) ((offset - self->window_offset) * G_USEC_PER_SEC / rate_limit);
+
+  return MAX (target - now, 0);
+}
+
+static void
+wait_for_budget (DroidianEncryptionHelperControl *self,
+                 gint64                           now)
+{
+  gint64 waited_from = now;
+
+  if (now >= self->budget_window_end)
+    {
+      /* The previous sessions are out of the window by now */
+      self->budget_used = 0;
+      self->budget_base = self->written_bytes;
+      self->budget_window_end = now + DROIDIAN_ENCRYPTION_HELPER_CONTROL_BUDGET_WINDOW;
+    }
+
+  if (self->budget_used + (self->written_bytes - self->budget_base) < self->write_budget)
+      return;
+
+  self->state = CONTROL_STATE_OVER_BUDGET;
+  droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_STAGE,
+                                                     DROIDIAN_ENCRYPTION_HELPER_STAGE_OVER_BUDGET,
+                                                     self->written_bytes, self->budget_window_end - now);
+  g_cond_broadcast (&self->cond);
+
+  while (now < self->budget_window_end && !droidian_encryption_helper_control_should_stop (self))
+    {
+      g_mutex_unlock (&self->mutex);
+      droidian_encryption_helper_control_wait (self, (int) MIN ((self->budget_window_end - now) / 1000 + 1, G_MAXINT));
+      g_mutex_lock (&self->mutex);
+      now = droidian_encryption_helper_clock_get_monotonic_time ();
+    }
+
+  self->state = CONTROL_STATE_RUNNING;
+  self->throttled_usec += now - waited_from;
+  self->budget_used = 0;
+  self->budget_base = self->written_bytes;
+  self->budget_window_end = now + DROIDIAN_ENCRYPTION_HELPER_CONTROL_BUDGET_WINDOW;
+  self->window_start = 0;
+
+  /* Idle while waiting, don't let it skew the figures */
+  self->energy_sampled_at = 0;
+  sample_energy (self, now);
+}
+
+static void
+wait_while_paused (DroidianEncryptionHelperControl *self,
+                   guint64                          offset,
+                   gint64                          *now)
+{
+  gint64 paused_at = *now;
+
+  if (!self->paused || droidian_encryption_helper_control_should_stop (self))
+      return;
+
+  /* Hotzone completed, acknowledge the pause request */
+  self->state = CONTROL_STATE_PAUSED;
+  droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_STAGE,
+                                                     DROIDIAN_ENCRYPTION_HELPER_STAGE_PAUSED, offset, 0);
+  g_cond_broadcast (&self->cond);
+
+  while (self->paused && !droidian_encryption_helper_control_should_stop (self))
+    {
+      g_mutex_unlock (&self->mutex);
+      droidian_encryption_helper_control_wait (self, -1);
+      g_mutex_lock (&self->mutex);
+    }
+
+  *now = droidian_encryption_helper_clock_get_monotonic_time ();
+
+  self->state = CONTROL_STATE_RUNNING;
+  self->paused_usec += *now - paused_at;
+  droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_STAGE,
+                                                     DROIDIAN_ENCRYPTION_HELPER_STAGE_RESUMED,
+                                                     *now - paused_at, 0);
+  self->window_start = 0;
+
+  self->energy_sampled_at = 0;
+  sample_energy (self, *now);
+}
+
+gboolean
+droidian_encryption_helper_control_checkpoint (DroidianEncryptionHelperControl *self,
+                                               uint64_t                         offset,
+                                               uint64_t                         size)
+{
+  gint64 now = droidian_encryption_helper_clock_get_monotonic_time ();
+  gint64 delay;
+
+  g_mutex_lock (&self->mutex);
+
+  self->offset = offset;
+  self->size = size;
+
+  if (!self->have_start_offset)
+    {
+      self->start_offset = offset;
+      self->have_start_offset = TRUE;
+    }
+
+  /* In case /run can't be watched */
+  if (self->reached_milestone + 1 < (gint) self->milestones->len)
+      check_milestones (self);
+
+  if (self->write_counter)
+      self->written_bytes = droidian_encryption_helper_write_counter_get (self->write_counter);
+
+  sample_energy (self, now);
+
+  /* A pause requested meanwhile is handled right after */
+  if (self->write_budget && !droidian_encryption_helper_control_should_stop (self))
+    {
+      wait_for_budget (self, now);
+      now = droidian_encryption_helper_clock_get_monotonic_time ();
+    }
+
+  wait_while_paused (self, offset, &now);
+
+  delay = get_throttle_delay (self, offset, now);
+
+  g_mutex_unlock (&self->mutex);
+
+  if (delay > 0)
+    {
+      /* Woken up early on control requests, the next hotzone will catch up */
+      droidian_encryption_helper_control_wait (self, (int) MIN (delay / 1000, G_MAXINT));
+
+      g_mutex_lock (&self->mutex);
+      self->throttled_usec += droidian_encryption_helper_clock_get_monotonic_time () - now;
+
+      /* A pause cut the throttling short, the hotzone is complete already */
+      now = droidian_encryption_helper_clock_get_monotonic_time ();
+      wait_while_paused (self, offset, &now);
+
+      g_mutex_unlock (&self->mutex);
+    }
+
+  return !droidian_encryption_helper_control_should_stop (self);
+}
+
+void
+droidian_encryption_helper_control_handle_request (DroidianEncryptionHelperControl *self,
+                                                   char                            *request,
+                                                   char                            *reply,
+                                                   gsize                            reply_size)
+{
+  const char *argument;
+  char *end;
+  guint64 rate_limit;
+  ControlMode mode;
+
+  g_strchomp (request);
+
+  if (g_strcmp0 (request, DROIDIAN_ENCRYPTION_HELPER_CONTROL_STATUS) == 0)
+    {
+      g_mutex_lock (&self->mutex);
+      g_snprintf (reply, reply_size,
+                  DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_OK
+                  " state=%s paused=%d rate_limit=%" G_GUINT64_FORMAT " mode=%s"
+                  " offset=%" G_GUINT64_FORMAT " size=%" G_GUINT64_FORMAT,
+                  control_state_names[self->state], self->paused, self->rate_limit,
+                  control_mode_names[self->mode], self->offset, self->size);
+      g_mutex_unlock (&self->mutex);
+    }
+  else if (g_strcmp0 (request, DROIDIAN_ENCRYPTION_HELPER_CONTROL_STATS) == 0)
+    {
+      g_mutex_lock (&self->mutex);
+      g_snprintf (reply, reply_size,
+                  DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_OK
+                  " bytes=%" G_GUINT64_FORMAT " elapsed_usec=%" G_GINT64_FORMAT
+                  " throttled_usec=%" G_GINT64_FORMAT " paused_usec=%" G_GINT64_FORMAT
+                  " recovery_usec=%" G_GINT64_FORMAT " written_bytes=%" G_GUINT64_FORMAT
+                  " write_budget=%" G_GUINT64_FORMAT " budget_used=%" G_GUINT64_FORMAT
+                  " boost_energy_uj=%" G_GUINT64_FORMAT " boost_energy_usec=%" G_GINT64_FORMAT
+                  " boost_energy_bytes=%" G_GUINT64_FORMAT
+                  " background_energy_uj=%" G_GUINT64_FORMAT " background_energy_usec=%" G_GINT64_FORMAT
+                  " background_energy_bytes=%" G_GUINT64_FORMAT,
+                  self->have_start_offset ? self->offset - self->start_offset : 0,
+                  self->started_at ? droidian_encryption_helper_clock_get_monotonic_time () - self->started_at : 0,
+                  self->throttled_usec, self->paused_usec, self->recovery_usec, self->written_bytes,
+                  self->write_budget, self->budget_used + (self->written_bytes - self->budget_base),
+                  self->energy_stats[DROIDIAN_ENCRYPTION_HISTORY_PACING_BOOST].energy_uj,
+                  self->energy_stats[DROIDIAN_ENCRYPTION_HISTORY_PACING_BOOST].usec,
+                  self->energy_stats[DROIDIAN_ENCRYPTION_HISTORY_PACING_BOOST].bytes,
+                  self->energy_stats[DROIDIAN_ENCRYPTION_HISTORY_PACING_BACKGROUND].energy_uj,
+                  self->energy_stats[DROIDIAN_ENCRYPTION_HISTORY_PACING_BACKGROUND].usec,
+                  self->energy_stats[DROIDIAN_ENCRYPTION_HISTORY_PACING_BACKGROUND].bytes);
+      g_mutex_unlock (&self->mutex);
+    }
+  else if (g_strcmp0 (request, DROIDIAN_ENCRYPTION_HELPER_CONTROL_PAUSE) == 0)
+    {
+      droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_CONTROL,
+                                                         DROIDIAN_ENCRYPTION_HELPER_REQUEST_PAUSE, 0, 0);
+
+      g_mutex_lock (&self->mutex);
+      self->paused = TRUE;
+      g_mutex_unlock (&self->mutex);
+
+      /* Cut a throttling sleep short, the hotzone before it is complete already */
+      notify (self->wakeup_fd);
+
+      /* Reply only once the running hotzone has been completed */
+      g_mutex_lock (&self->mutex);
+      while (self->state == CONTROL_STATE_RUNNING && self->paused &&
+             !droidian_encryption_helper_control_should_stop (self))
+          g_cond_wait (&self->cond, &self->mutex);
+
+      g_snprintf (reply, reply_size, DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_OK " state=%s",
+                  control_state_names[self->state]);
+      g_mutex_unlock (&self->mutex);
+    }
+  else if (g_strcmp0 (request, DROIDIAN_ENCRYPTION_HELPER_CONTROL_RESUME) == 0)
+    {
+      droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_CONTROL,
+                                                         DROIDIAN_ENCRYPTION_HELPER_REQUEST_RESUME, 0, 0);
+
+      g_mutex_lock (&self->mutex);
+      self->paused = FALSE;
+      g_mutex_unlock (&self->mutex);
+
+      notify (self->wakeup_fd);
+      g_strlcpy (reply, DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_OK, reply_size);
+    }
+  else if (g_str_has_prefix (request, DROIDIAN_ENCRYPTION_HELPER_CONTROL_RATE_LIMIT " "))
+    {
+      argument = request + strlen (DROIDIAN_ENCRYPTION_HELPER_CONTROL_RATE_LIMIT " ");
+      rate_limit = g_ascii_strtoull (argument, &end, 10);
+
+      if (end == argument || *end != '\0')
+        {
+          g_strlcpy (reply, DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_ERROR " invalid rate limit", reply_size);
+          return;
+        }
+
+      droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_CONTROL,
+                                                         DROIDIAN_ENCRYPTION_HELPER_REQUEST_RATE_LIMIT,
+                                                         rate_limit, 0);
+
+      g_mutex_lock (&self->mutex);
+      self->rate_limit = rate_limit;
+      self->window_start = 0;
+      g_mutex_unlock (&self->mutex);
+
+      notify (self->wakeup_fd);
+      g_strlcpy (reply, DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_OK, reply_size);
+    }
+  else if (g_str_has_prefix (request, DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE " "))
+    {
+      argument = request + strlen (DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE " ");
+
+      if (g_strcmp0 (argument, DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE_BOOST) == 0)
+          mode = CONTROL_MODE_BOOST;
+      else if (g_strcmp0 (argument, DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE_BACKGROUND) == 0)
+          mode = CONTROL_MODE_BACKGROUND;
+      else
+        {
+          g_strlcpy (reply, DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_ERROR " invalid mode", reply_size);
+          return;
+        }
+
+      droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_CONTROL,
+                                                         DROIDIAN_ENCRYPTION_HELPER_REQUEST_MODE, mode, 0);
+
+      g_mutex_lock (&self->mutex);
+      self->mode = mode;
+      self->window_start = 0;
+      g_mutex_unlock (&self->mutex);
+
+      /* Cut a throttling sleep short when boosting */
+      notify (self->wakeup_fd);
+      g_snprintf (reply, reply_size, DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_OK " mode=%s",
+                  control_mode_names[mode]);
+    }
+  else if (g_strcmp0 (request, DROIDIAN_ENCRYPTION_HELPER_CONTROL_STOP) == 0)
+    {
+      droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_CONTROL,
+                                                         DROIDIAN_ENCRYPTION_HELPER_REQUEST_STOP, 0, 0);
+      droidian_encryption_helper_control_request_stop (self);
+
+      /* Reply only once the checkpoint has been written */
+      g_mutex_lock (&self->mutex);
+      while (self->state != CONTROL_STATE_STOPPED)
+          g_cond_wait (&self->cond, &self->mutex);
+      g_mutex_unlock (&self->mutex);
+
+      g_strlcpy (reply, DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_OK " state=stopped", reply_size);
+    }
+  else
+    {
+      g_strlcpy (reply, DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_ERROR " unknown request", reply_size);
+    }
+}
+
+static void
+handle_client (gpointer                         data,
+               DroidianEncryptionHelperControl *self)
+{
+  char request[DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX];
+  char reply[DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX];
+  int client = GPOINTER_TO_INT (data) - 1;
+  struct timeval timeout = {
+    .tv_sec = 5,
+  };
+  ssize_t length;
+  sigset_t mask;
+
+  /* Pool threads might have been spawned before the mask was set */
+  sigfillset (&mask);
+  pthread_sigmask (SIG_BLOCK, &mask, NULL);
+
+  /* Don't let an idle client hold a pool thread */
+  setsockopt (client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+
+  while ((length = recv (client, request, sizeof (request) - 1, 0)) > 0)
+    {
+      request[length] = '\0';
+      droidian_encryption_helper_control_handle_request (self, request, reply, sizeof (reply));
+
+      if (send (client, reply, strlen (reply), MSG_NOSIGNAL) < 0)
+          break;
+    }
+
+  close (client);
+}
+
+static gpointer
+control_thread (DroidianEncryptionHelperControl *self)
+{
+  struct pollfd fds[3] = {
+    { .fd = self->listen_fd, .events = POLLIN },
+    { .fd = self->quit_fd, .events = POLLIN },
+    { .fd = self->inotify_fd, .events = POLLIN },
+  };
+  sigset_t mask;
+  int client;
+
+  /* Leave signals to the reencryption thread */
+  sigfillset (&mask);
+  pthread_sigmask (SIG_BLOCK, &mask, NULL);
+
+  while (TRUE)
+    {
+      if (poll (fds, G_N_ELEMENTS (fds), -1) < 0)
+        {
+          if (errno == EINTR)
+              continue;
+
+          g_printerr ("Control socket poll failed: errno %d\n", errno);
+          break;
+        }
+
+      if (fds[1].revents & POLLIN)
+          break;
+
+      if (fds[2].revents & POLLIN)
+          handle_run_changes (self);
+
+      if (!(fds[0].revents & POLLIN))
+          continue;
+
+      client = accept4 (self->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (client < 0)
+          continue;
+
+      /* PAUSE and STOP are answered once the reencryption thread acknowledges
+       * them, keep accepting STATUS and STOP requests meanwhile */
+      g_thread_pool_push (self->clients, GINT_TO_POINTER (client + 1), NULL);
+    }
+
+  return NULL;
+}
+
+gboolean
+droidian_encryption_helper_control_listen (DroidianEncryptionHelperControl *self,
+                                           GError                         **error)
+{
+  struct sockaddr_un address = {
+    .sun_family = AF_UNIX,
+  };
+
+  g_strlcpy (address.sun_path, DROIDIAN_ENCRYPTION_HELPER_CONTROL_SOCKET, sizeof (address.sun_path));
+
+  if ((self->listen_fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+      goto error;
+
+  /* Remove the socket left behind by a crashed helper, if any */
+  unlinkat (self->run_fd, DROIDIAN_ENCRYPTION_HELPER_CONTROL_SOCKET_NAME, 0);
+
+  if (bind (self->listen_fd, (struct sockaddr *) &address, sizeof (address)) < 0 ||
+      fchmodat (self->run_fd, DROIDIAN_ENCRYPTION_HELPER_CONTROL_SOCKET_NAME, 0600, 0) < 0 ||
+      listen (self->listen_fd, 4) < 0)
+      goto error;
+
+  self->clients = g_thread_pool_new ((GFunc) handle_client, self,
+                                     DROIDIAN_ENCRYPTION_HELPER_CONTROL_MAX_CLIENTS, FALSE, NULL);
+  self->thread = g_thread_new ("control", (GThreadFunc) control_thread, self);
+
+  return TRUE;
+
+error:
+  g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+               "Unable to create control socket: %s", g_strerror (errno));
+  return FALSE;
+}
+
+DroidianEncryptionHelperControl *
+droidian_encryption_helper_control_new (int run_fd)
+{
+  DroidianEncryptionHelperControl *self = g_new0 (DroidianEncryptionHelperControl, 1);
+
+  self->run_fd = run_fd;
+  self->listen_fd = -1;
+  self->inotify_fd = -1;
+  self->thread = NULL;
+  self->clients = NULL;
+  self->state = CONTROL_STATE_WAITING;
+  self->mode = CONTROL_MODE_BOOST;
+  self->milestones = g_array_new (FALSE, FALSE, sizeof (ControlMilestone));
+  self->reached_milestone = -1;
+
+  g_mutex_init (&self->mutex);
+  g_cond_init (&self->cond);
+
+  self->wakeup_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  self->quit_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (self->wakeup_fd < 0 || self->quit_fd < 0)
+    {
+      /* Waiting would be impossible without these */
+      g_printerr ("Unable to create eventfd: errno %d\n", errno);
+      droidian_encryption_helper_control_free (self);
+      return NULL;
+    }
+
+  /* Survives the move of /run to the real root. Milestones fall back to the
+   * reencryption thread wakeups if this fails. */
+  self->inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (self->inotify_fd < 0 ||
+      inotify_add_watch (self->inotify_fd, "/run", IN_CREATE | IN_MOVED_TO | IN_ATTRIB) < 0)
+      g_printerr ("Unable to watch /run: errno %d\n", errno);
+
+  return self;
+}
+
+void
+droidian_encryption_helper_control_free (DroidianEncryptionHelperControl *self)
+{
+  if (self->thread)
+    {
+      notify (self->quit_fd);
+      g_thread_join (self->thread);
+    }
+
+  if (self->clients)
+    {
+      /* Release the clients still waiting for an acknowledgement */
+      g_mutex_lock (&self->mutex);
+      self->state = CONTROL_STATE_STOPPED;
+      g_cond_broadcast (&self->cond);
+      g_mutex_unlock (&self->mutex);
+
+      g_thread_pool_free (self->clients, FALSE, TRUE);
+    }
+
+  if (self->listen_fd > -1)
+    {
+      close (self->listen_fd);
+      unlinkat (self->run_fd, DROIDIAN_ENCRYPTION_HELPER_CONTROL_SOCKET_NAME, 0);
+    }
+
+  if (self->wakeup_fd > -1)
+      close (self->wakeup_fd);
+
+  if (self->quit_fd > -1)
+      close (self->quit_fd);
+
+  if (self->inotify_fd > -1)
+      close (self->inotify_fd);
+
+  for (guint index = 0; index < self->milestones->len; index++)
+      g_free (g_array_index (self->milestones, ControlMilestone, index).stamp_name);
+  g_array_unref (self->milestones);
+
+  g_clear_pointer (&self->write_counter, droidian_encryption_helper_write_counter_free);
+  g_clear_pointer (&self->energy, droidian_encryption_helper_energy_free);
+
+  g_mutex_clear (&self->mutex);
+  g_cond_clear (&self->cond);
+  g_free (self);
+}
@@ -0,0 +1,89 @@
+/* control.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONHELPERCONTROL_H
+#define DROIDIANENCRYPTIONHELPERCONTROL_H
+
+#include <glib.h>
+#include <stdint.h>
+
+#include "control-protocol.h"
+#include "energy.h"
+#include "history.h"
+#include "write-counter.h"
+
+G_BEGIN_DECLS
+
+/* The write budget is enforced over a rolling window */
+#define DROIDIAN_ENCRYPTION_HELPER_CONTROL_BUDGET_WINDOW (24 * G_TIME_SPAN_HOUR)
+
+/* Clients served at the same time, the others wait in the queue */
+#define DROIDIAN_ENCRYPTION_HELPER_CONTROL_MAX_CLIENTS 4
+
+typedef struct _DroidianEncryptionHelperControl DroidianEncryptionHelperControl;
+
+DroidianEncryptionHelperControl *droidian_encryption_helper_control_new (int run_fd);
+void droidian_encryption_helper_control_free (DroidianEncryptionHelperControl *self);
+gboolean droidian_encryption_helper_control_listen (DroidianEncryptionHelperControl *self,
+                                                    GError                         **error);
+/* One request of the control protocol, as a client would send it. PAUSE and
+ * STOP block until the reencryption thread acknowledges them. */
+void droidian_encryption_helper_control_handle_request (DroidianEncryptionHelperControl *self,
+                                                        char                            *request,
+                                                        char                            *reply,
+                                                        gsize                            reply_size);
+
+/* Safe to call from a signal handler */
+void droidian_encryption_helper_control_request_stop (DroidianEncryptionHelperControl *self);
+gboolean droidian_encryption_helper_control_should_stop (DroidianEncryptionHelperControl *self);
+
+gboolean droidian_encryption_helper_control_wait (DroidianEncryptionHelperControl *self,
+                                                  int                              timeout_msec);
+void droidian_encryption_helper_control_set_running (DroidianEncryptionHelperControl *self);
+gboolean droidian_encryption_helper_control_get_session (DroidianEncryptionHelperControl  *self,
+                                                         DroidianEncryptionHistorySession *session);
+void droidian_encryption_helper_control_set_recovery_time (DroidianEncryptionHelperControl *self,
+                                                           gint64                           recovery_usec);
+void droidian_encryption_helper_control_set_background_rate_limit (DroidianEncryptionHelperControl *self,
+                                                                   uint64_t                         rate_limit);
+void droidian_encryption_helper_control_set_boot_rate_limit (DroidianEncryptionHelperControl *self,
+                                                             uint64_t                         rate_limit);
+void droidian_encryption_helper_control_add_milestone (DroidianEncryptionHelperControl *self,
+                                                       const char                      *stamp_name,
+                                                       uint64_t                         rate_limit);
+/* Index of the latest milestone reached, -1 if none */
+gint droidian_encryption_helper_control_get_reached_milestone (DroidianEncryptionHelperControl *self);
+/* Takes ownership of write_counter */
+void droidian_encryption_helper_control_set_write_counter (DroidianEncryptionHelperControl      *self,
+                                                           DroidianEncryptionHelperWriteCounter *write_counter);
+/* used: bytes written by the previous sessions in the window ending at window_end (wall clock) */
+void droidian_encryption_helper_control_set_write_budget (DroidianEncryptionHelperControl *self,
+                                                          uint64_t                         write_budget,
+                                                          uint64_t                         used,
+                                                          gint64                           window_end);
+/* Takes ownership of energy */
+void droidian_encryption_helper_control_set_energy (DroidianEncryptionHelperControl *self,
+                                                    DroidianEncryptionHelperEnergy  *energy);
+gboolean droidian_encryption_helper_control_checkpoint (DroidianEncryptionHelperControl *self,
+                                                        uint64_t                         offset,
+                                                        uint64_t                         size);
+void droidian_encryption_helper_control_stopped (DroidianEncryptionHelperControl *self);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONHELPERCONTROL_H */
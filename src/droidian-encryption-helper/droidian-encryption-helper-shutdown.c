@@ -0,0 +1,96 @@
+/* droidian-encryption-helper-shutdown.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control-protocol.h"
+
+/*
+ * Asks a running droidian-encryption-helper to stop, and returns as soon
+ * as it confirms that the reencryption checkpoint has been written.
+ */
+
+int
+main (void)
+{
+  struct sockaddr_un address = {
+    .sun_family = AF_UNIX,
+  };
+  char reply[DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX];
+  ssize_t length;
+  int fd;
+
+  strncpy (address.sun_path, DROIDIAN_ENCRYPTION_HELPER_CONTROL_SOCKET, sizeof (address.sun_path) - 1);
+
+  if ((fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+    {
+      fprintf (stderr, "Unable to create socket: %s\n", strerror (errno));
+      return EXIT_FAILURE;
+    }
+
+  if (connect (fd, (struct sockaddr *) &address, sizeof (address)) < 0)
+    {
+      /* Helper not running, nothing to do */
+      close (fd);
+      return EXIT_SUCCESS;
+    }
+
+  if (send (fd, DROIDIAN_ENCRYPTION_HELPER_CONTROL_STOP,
+            strlen (DROIDIAN_ENCRYPTION_HELPER_CONTROL_STOP), MSG_NOSIGNAL) < 0)
+    {
+      fprintf (stderr, "Unable to send stop request: %s\n", strerror (errno));
+      close (fd);
+      return EXIT_FAILURE;
+    }
+
+  /* Block until the helper acknowledges */
+  do
+      length = recv (fd, reply, sizeof (reply) - 1, 0);
+  while (length < 0 && errno == EINTR);
+
+  close (fd);
+
+  if (length < 0)
+    {
+      fprintf (stderr, "Unable to read stop reply: %s\n", strerror (errno));
+      return EXIT_FAILURE;
+    }
+  else if (length == 0)
+    {
+      /* Connection closed, the helper is gone */
+      return EXIT_SUCCESS;
+    }
+
+  reply[length] = '\0';
+  if (strncmp (reply, DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_OK,
+               strlen (DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_OK)) != 0)
+    {
+      fprintf (stderr, "Helper refused to stop: %s\n", reply);
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
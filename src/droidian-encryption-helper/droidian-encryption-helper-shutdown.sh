@@ -1,29 +0,0 @@
-#!/bin/sh
-#
-# Copyright 2022 Eugenio Paolantonio (g7)
-#
-# This program is free software: you can redistribute it and/or modify
-# it under the terms of the GNU General Public License as published by
-# the Free Software Foundation, either version 3 of the License, or
-# (at your option) any later version.
-#
-# This program is distributed in the hope that it will be useful,
-# but WITHOUT ANY WARRANTY; without even the implied warranty of
-# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-# GNU General Public License for more details.
-#
-# You should have received a copy of the GNU General Public License
-# along with this program.  If not, see <http://www.gnu.org/licenses/>.
-#
-
-[ -e /run/droidian-encryption-helper.pid ] || exit 0
-
-# Send SIGTERM
-kill -s TERM $(cat /run/droidian-encryption-helper.pid)
-
-while [ -e /run/droidian-encryption-helper.pid ]; do
-	sleep 0.5
-done
-
-
-exit 0
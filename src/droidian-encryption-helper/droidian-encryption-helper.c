@@ -19,25 +19,36 @@
 #define _GNU_SOURCE
 
 #include <glib.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
 #include <libcryptsetup.h>
 
+#include "clock.h"
+#include "control.h"
+#include "flight-recorder.h"
+#include "helper-config.h"
+#include "scheduling.h"
+
 /* TODO: Remove GLib dependency - it's already half way done */
 
 #define PASSPHRASE_MAX 256
+#define WRONG_PASSPHRASE_NOTICE "wrong-passphrase"
 
 #define RUN_DIR "/run"
 #define HALIUM_MOUNTED_STAMP_NAME "halium-mounted"
 #define HALIUM_MOUNTED_STAMP RUN_DIR "/" HALIUM_MOUNTED_STAMP_NAME
-#define DROIDIAN_ENCRYPTION_HELPER_PIDFILE_NAME "droidian-encryption-helper.pid"
-#define DROIDIAN_ENCRYPTION_HELPER_PIDFILE RUN_DIR "/" DROIDIAN_ENCRYPTION_HELPER_PIDFILE_NAME
 #define DROIDIAN_ENCRYPTION_HELPER_FAILURE_NAME "droidian-encryption-helper-failed"
 #define DROIDIAN_ENCRYPTION_HELPER_FAILURE RUN_DIR "/" DROIDIAN_ENCRYPTION_HELPER_FAILURE_NAME
+#define DROIDIAN_ENCRYPTION_HELPER_PROGRESS_NAME "droidian-encryption-helper.progress"
 #define DROIDIAN_BOOT_DONE_STAMP_NAME "boot-done"
 #define DROIDIAN_BOOT_DONE_STAMP RUN_DIR "/" DROIDIAN_BOOT_DONE_STAMP_NAME
+/* Touched by droidian-encryption-default-target.service */
+#define DEFAULT_TARGET_STAMP_NAME "droidian-encryption-default-target"
 
 typedef enum {
   DROIDIAN_ENCRYPTION_HELPER_MISSING_ARGUMENTS,
@@ -46,9 +57,12 @@ typedef enum {
   DROIDIAN_ENCRYPTION_HELPER_FAILED_TO_LOAD,
   DROIDIAN_ENCRYPTION_HELPER_FAILED_TO_LOAD_HEADER,
   DROIDIAN_ENCRYPTION_HELPER_FAILED_TO_ACTIVATE,
+  DROIDIAN_ENCRYPTION_HELPER_WRONG_PASSPHRASE,
+  DROIDIAN_ENCRYPTION_HELPER_FAILED_RECOVERY,
   DROIDIAN_ENCRYPTION_HELPER_FAILED_REENCRYPTION,
   DROIDIAN_ENCRYPTION_HELPER_FAILED_REENCRYPTION_RUN,
   DROIDIAN_ENCRYPTION_HELPER_FAILED_REGISTER_TERMINATION_HANDLERS,
+  DROIDIAN_ENCRYPTION_HELPER_FAILED_TO_CREATE_CONTROL,
 } DroidianEncryptionHelperError;
 
 
@@ -57,29 +71,56 @@ G_DEFINE_QUARK (droidian-encryption-helper-error-quark, droidian_encryption_help
 
 #define EXIT_UNABLE_TO_ACTIVATE 2
 
-static gboolean teardown = FALSE;
+static DroidianEncryptionHelperControl *control = NULL;
+static gint64 recovery_usec = 0;
+static char session_resilience[DROIDIAN_ENCRYPTION_HISTORY_RESILIENCE_MAX] = "";
+
+typedef struct {
+  int progress_fd;
+  const char *resilience;
+  DroidianEncryptionHelperConfig *pending_scheduling; /* applied at the first milestone */
+} ReencryptionContext;
 
 gint
 report_reencryption_status (uint64_t size, uint64_t offset, void *data)
 {
-  /* Silence warnings */
-  (void) size;
-  (void) offset;
-  (void) data;
+  ReencryptionContext *reencryption_context = data;
+  char progress[2 * 20 + 3];
+  int length;
+
+  if (reencryption_context->progress_fd > -1)
+    {
+      /* Fixed width, so that every update overwrites the previous one */
+      length = snprintf (progress, sizeof (progress), "%020" PRIu64 " %020" PRIu64 "\n", offset, size);
+      if (pwrite (reencryption_context->progress_fd, progress, length, 0) != length)
+          g_printerr ("Unable to publish progress: errno %d\n", errno);
+    }
 
-  /* TODO: Add a way to show progress */
-  return teardown ? 1 : 0;
+  droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_HOTZONE, 0, offset, size);
+
+  /* systemd has set up the cgroup hierarchy by default.target */
+  if (reencryption_context->pending_scheduling &&
+      droidian_encryption_helper_control_get_reached_milestone (control) >= 0)
+    {
+      droidian_encryption_helper_scheduling_apply (reencryption_context->pending_scheduling);
+      reencryption_context->pending_scheduling = NULL;
+    }
+
+  /* Handle pause and rate limit at hotzone boundaries */
+  return droidian_encryption_helper_control_checkpoint (control, offset, size) ? 0 : 1;
 }
 
 gboolean
 start_reencryption (struct crypt_device *crypt_device,
                     const char          *name,
                     char                *passphrase,
+                    ReencryptionContext *reencryption_context,
                     GError             **error)
 {
   gint result;
+  struct crypt_params_reencrypt status_params = { 0 };
   struct crypt_params_reencrypt params = {
-    .resilience = "checksum",
+    .resilience = reencryption_context->resilience,
     .hash = "sha256",
     .flags = CRYPT_REENCRYPT_RESUME_ONLY,
   };
@@ -92,7 +133,20 @@ start_reencryption (struct crypt_device *crypt_device,
   if (result < 0)
       goto error;
 
-  result = crypt_reencrypt_run (crypt_device, report_reencryption_status, NULL);
+  /* Older cryptsetup releases keep the mode the reencryption has been initialized with */
+  if (crypt_reencrypt_status (crypt_device, &status_params) != CRYPT_REENCRYPT_NONE &&
+      status_params.resilience)
+      g_strlcpy (session_resilience, status_params.resilience, sizeof (session_resilience));
+  else
+      g_strlcpy (session_resilience, params.resilience, sizeof (session_resilience));
+
+  if (g_strcmp0 (session_resilience, params.resilience) != 0)
+      g_printerr ("Requested resilience %s, using %s\n", params.resilience, session_resilience);
+
+  droidian_encryption_helper_control_set_running (control);
+  droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_STAGE,
+                                                     DROIDIAN_ENCRYPTION_HELPER_STAGE_REENCRYPTING, 0, 0);
+  result = crypt_reencrypt_run (crypt_device, report_reencryption_status, reencryption_context);
   if (result < 0)
       goto error;
 
@@ -124,6 +178,15 @@ needs_reencryption (struct crypt_device *crypt_device,
       should_reencrypt = TRUE;
       break;
 
+    case CRYPT_REENCRYPT_CRASH:
+      /* activate() should have recovered it already */
+      g_set_error (error, DROIDIAN_ENCRYPTION_HELPER_ERROR,
+                   DROIDIAN_ENCRYPTION_HELPER_FAILED_RECOVERY,
+                   "Interrupted reencryption on %s has not been recovered",
+                   crypt_get_device_name (crypt_device));
+      should_reencrypt = TRUE;
+      break;
+
     default:
       g_set_error (error, DROIDIAN_ENCRYPTION_HELPER_ERROR,
                    DROIDIAN_ENCRYPTION_HELPER_FAILED_REENCRYPTION,
@@ -138,31 +201,143 @@ needs_reencryption (struct crypt_device *crypt_device,
 
 
 gboolean
-activate (struct crypt_device *crypt_device,
-          const char          *name,
-          const char          *passphrase,
-          GError             **error)
+recover_reencryption (struct crypt_device *crypt_device,
+                      const char          *passphrase,
+                      GError             **error)
+{
+  gint result;
+  gint64 started_at;
+  struct crypt_params_reencrypt status_params = { 0 };
+  struct crypt_params_reencrypt params = {
+    .flags = CRYPT_REENCRYPT_RECOVERY,
+  };
+
+  if (crypt_reencrypt_status (crypt_device, &status_params) != CRYPT_REENCRYPT_CRASH)
+      return TRUE;
+
+  /* Power was lost mid-hotzone: replay the resilience data before activating */
+  g_printerr ("Reencryption on %s was interrupted, recovering (resilience %s)\n",
+              crypt_get_device_name (crypt_device),
+              status_params.resilience ? status_params.resilience : "unknown");
+
+  started_at = droidian_encryption_helper_clock_get_monotonic_time ();
+  result = crypt_reencrypt_init_by_passphrase (crypt_device, NULL,
+                                               passphrase, strlen (passphrase),
+                                               CRYPT_ANY_SLOT, 0,
+                                               NULL, NULL, &params);
+  if (result < 0)
+    {
+      g_set_error (error, DROIDIAN_ENCRYPTION_HELPER_ERROR,
+                   (result == -EPERM) ?
+                     DROIDIAN_ENCRYPTION_HELPER_WRONG_PASSPHRASE :
+                     DROIDIAN_ENCRYPTION_HELPER_FAILED_RECOVERY,
+                   "Unable to recover interrupted reencryption on %s: %s",
+                   crypt_get_device_name (crypt_device),
+                   g_strerror (-result));
+      return FALSE;
+    }
+
+  recovery_usec = droidian_encryption_helper_clock_get_monotonic_time () - started_at;
+  droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_STAGE,
+                                                     DROIDIAN_ENCRYPTION_HELPER_STAGE_RECOVERED,
+                                                     recovery_usec, 0);
+  g_printerr ("Reencryption recovered in %" G_GINT64_FORMAT " ms\n", recovery_usec / 1000);
+
+  return TRUE;
+}
+
+gboolean
+prepare (struct crypt_device **crypt_device,
+         const char           *header,
+         const char           *device,
+         GError              **error)
 {
+  struct crypt_pbkdf_type pbkdf;
   gint result;
 
-  result = crypt_load (crypt_device, CRYPT_LUKS2, NULL);
+  result = crypt_init_data_device (crypt_device, header, device);
+  if (result < 0)
+    {
+      g_set_error (error, DROIDIAN_ENCRYPTION_HELPER_ERROR,
+                   DROIDIAN_ENCRYPTION_HELPER_FAILED_TO_INIT,
+                   "Unable to init context: %s",
+                   g_strerror (-result));
+      return FALSE;
+    }
+
+  result = crypt_load (*crypt_device, CRYPT_LUKS2, NULL);
   if (result < 0)
     {
       g_set_error (error, DROIDIAN_ENCRYPTION_HELPER_ERROR,
                    DROIDIAN_ENCRYPTION_HELPER_FAILED_TO_LOAD,
                    "Unable to crypto_load() on device %s: %s",
-                   crypt_get_device_name (crypt_device),
+                   crypt_get_device_name (*crypt_device),
                    g_strerror (-result));
       return FALSE;
     }
 
+  /* Only the key derivation is left for when the passphrase arrives */
+  if (crypt_keyslot_get_pbkdf (*crypt_device, 0, &pbkdf) == 0)
+      g_printerr ("Keyslot 0 uses %s, %u iterations, %u KiB, %u threads\n",
+                  pbkdf.type, pbkdf.iterations, pbkdf.max_memory_kb, pbkdf.parallel_threads);
+
+  return TRUE;
+}
+
+static char *
+read_passphrase (gboolean line_mode,
+                 gboolean strip_newlines)
+{
+  g_autofree char *passphrase = g_malloc0 (PASSPHRASE_MAX + 1);
+  gboolean truncated = FALSE;
+  int ch;
+  int i = 0;
+
+  while ((ch = fgetc (stdin)) != EOF)
+    {
+      if (line_mode && ch == '\n')
+          /* One attempt per line */
+          break;
+      else if (strip_newlines && ch == '\n')
+          continue;
+      else if (i < PASSPHRASE_MAX)
+          passphrase[i++] = ch;
+      else if (!truncated)
+        {
+          g_warning ("PASSPHRASE_MAX reached");
+          truncated = TRUE;
+
+          if (!line_mode)
+              break;
+        }
+    }
+
+  if (!i)
+      return NULL;
+
+  return g_steal_pointer (&passphrase);
+}
+
+gboolean
+activate (struct crypt_device *crypt_device,
+          const char          *name,
+          const char          *passphrase,
+          GError             **error)
+{
+  gint result;
+
+  if (!recover_reencryption (crypt_device, passphrase, error))
+      return FALSE;
+
   /* Finally activate */
   result = crypt_activate_by_passphrase (crypt_device, name, CRYPT_ANY_SLOT,
                                          passphrase, strlen (passphrase), 0);
   if (result < 0)
     {
       g_set_error (error, DROIDIAN_ENCRYPTION_HELPER_ERROR,
-                   DROIDIAN_ENCRYPTION_HELPER_FAILED_TO_ACTIVATE,
+                   (result == -EPERM) ?
+                     DROIDIAN_ENCRYPTION_HELPER_WRONG_PASSPHRASE :
+                     DROIDIAN_ENCRYPTION_HELPER_FAILED_TO_ACTIVATE,
                    "Unable to activate device %s: %s",
                    crypt_get_device_name (crypt_device),
                    g_strerror (-result));
@@ -172,14 +347,72 @@ activate (struct crypt_device *crypt_device,
   return TRUE;
 }
 
+static void
+apply_write_budget (struct crypt_device *crypt_device,
+                    guint64              write_budget)
+{
+  g_autoptr(GArray) history = droidian_encryption_history_load (crypt_device);
+  DroidianEncryptionHistorySession *session;
+  gint64 now = droidian_encryption_helper_clock_get_real_time ();
+  gint64 window_end = now + DROIDIAN_ENCRYPTION_HELPER_CONTROL_BUDGET_WINDOW;
+  guint64 used = 0;
+
+  /* Whatever the sessions started in the window wrote counts against it */
+  for (guint index = 0; index < history->len; index++)
+    {
+      session = &g_array_index (history, DroidianEncryptionHistorySession, index);
+
+      if (session->started_at <= now - DROIDIAN_ENCRYPTION_HELPER_CONTROL_BUDGET_WINDOW)
+          continue;
+
+      used += session->written_bytes;
+      window_end = MIN (window_end, session->started_at + DROIDIAN_ENCRYPTION_HELPER_CONTROL_BUDGET_WINDOW);
+    }
+
+  g_printerr ("Write budget: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " bytes used\n", used, write_budget);
+  droidian_encryption_helper_control_set_write_budget (control, write_budget, used, window_end);
+}
+
+static void
+record_session (struct crypt_device              *crypt_device,
+                DroidianEncryptionHistorySession *session)
+{
+  guint64 processed = session->end_offset - session->start_offset;
+  int result;
+
+  g_strlcpy (session->resilience, session_resilience, sizeof (session->resilience));
+
+  if (processed && session->written_bytes)
+      g_printerr ("Wrote %" G_GUINT64_FORMAT " bytes for %" G_GUINT64_FORMAT
+                  " bytes reencrypted (%s), write amplification %.2f\n",
+                  session->written_bytes, processed, session->resilience,
+                  (double) session->written_bytes / processed);
+
+  for (guint pacing = 0; pacing < DROIDIAN_ENCRYPTION_HISTORY_PACING_MODES; pacing++)
+    {
+      if (session->energy[pacing].bytes && session->energy[pacing].usec > 0)
+          g_printerr ("Pacing mode %s: %.1f J/GB, %.2f W average\n",
+                      droidian_encryption_history_get_pacing_name (pacing),
+                      session->energy[pacing].energy_uj / 1000.0 / (session->energy[pacing].bytes / 1000000.0),
+                      (double) session->energy[pacing].energy_uj / session->energy[pacing].usec);
+    }
+
+  result = droidian_encryption_history_append (crypt_device, session);
+  if (result < 0)
+      /* Not fatal, the ETA will be less accurate */
+      g_printerr ("Unable to store the session history: errno %d\n", -result);
+}
+
 static void
 handle_signal (const int signal)
 {
+  droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_SIGNAL, signal, 0, 0);
+
   switch (signal)
     {
     case SIGINT:
     case SIGTERM:
-      teardown = TRUE;
+      droidian_encryption_helper_control_request_stop (control);
       break;
 
     default:
@@ -219,9 +452,10 @@ gint
 main (gint   argc,
       gchar *argv[])
 {
-  gint result;
   gint exit_code = EXIT_SUCCESS;
   struct crypt_device *crypt_device = NULL;
+  g_autoptr(DroidianEncryptionHelperConfig) helper_config = NULL;
+  DroidianEncryptionHistorySession session;
   g_autoptr(GOptionContext) context = NULL;
   g_autoptr(GError) error = NULL;
   g_autofree char *device = NULL;
@@ -229,15 +463,21 @@ main (gint   argc,
   g_autofree char *rootmnt = NULL;
   g_autofree char *target_name = NULL;
   g_autofree char *passphrase = NULL;
-  g_autofree char *pid = NULL;
   gboolean strip_newlines = FALSE;
   gboolean version = FALSE;
   gboolean should_reencrypt;
-  int length;
-  int ch;
-  int i;
+  gint tries = 1;
+  gint attempt;
+  gint64 wait_started_at;
+  const char *counted_devices[3] = { NULL, NULL, NULL };
   int run_fd = -1;
+  int ready_pipe[2] = { -1, -1 };
+  char ready;
   pid_t child = -1;
+  ReencryptionContext reencryption_context = {
+    .progress_fd = -1,
+    .resilience = "checksum",
+  };
 
   GOptionEntry main_entries[] = {
     { "device", 0, 0, G_OPTION_ARG_FILENAME, &device, "Device to open", NULL },
@@ -245,6 +485,8 @@ main (gint   argc,
     { "rootmnt", 0, 0, G_OPTION_ARG_FILENAME, &rootmnt, "Root mountpoint", NULL },
     { "name", 0, 0, G_OPTION_ARG_STRING, &target_name, "Name to use", NULL },
     { "strip-newlines", 0, 0, G_OPTION_ARG_NONE, &strip_newlines, "Strip newlines", NULL },
+    { "tries", 0, 0, G_OPTION_ARG_INT, &tries,
+      "Read one passphrase per line, up to N times (\"" WRONG_PASSPHRASE_NOTICE "\" is printed after a failed attempt)", "N" },
     { "version", 0, 0, G_OPTION_ARG_NONE, &version, "Show program version", NULL },
     { NULL }
   };
@@ -271,47 +513,60 @@ main (gint   argc,
       goto out;
     }
 
-  /* Read passphrase from stdin */
-  passphrase = g_malloc0 (PASSPHRASE_MAX);
-  i = 0;
-  while ((ch = fgetc (stdin)) != EOF)
+  droidian_encryption_helper_flight_recorder_open ();
+  droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_START, 0, getpid (), 0);
+
+  /* Do all the device work while the user is still typing */
+  if (!prepare (&crypt_device, header, device, &error))
+    {
+      if (g_error_matches (error, DROIDIAN_ENCRYPTION_HELPER_ERROR, DROIDIAN_ENCRYPTION_HELPER_FAILED_TO_LOAD))
+          exit_code = EXIT_UNABLE_TO_ACTIVATE; /* Unable to activate */
+      goto out;
+    }
+
+  droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_STAGE,
+                                                     DROIDIAN_ENCRYPTION_HELPER_STAGE_PREPARED, 0, 0);
+
+  for (attempt = 1; attempt <= MAX (tries, 1); attempt++)
     {
-      if (i < PASSPHRASE_MAX && (strip_newlines && ch != '\n'))
+      g_clear_pointer (&passphrase, g_free);
+      g_clear_error (&error);
+
+      /* Read passphrase from stdin */
+      if (!(passphrase = read_passphrase (tries > 1, strip_newlines)))
         {
-          passphrase[i++] = ch;
+          g_set_error (&error, DROIDIAN_ENCRYPTION_HELPER_ERROR,
+                       DROIDIAN_ENCRYPTION_HELPER_FAILED_TO_READ_PASSPHRASE,
+                       "Unable to read passphrase");
+          break;
         }
-      else if (i >= PASSPHRASE_MAX)
-        {
-          g_warning ("PASSPHRASE_MAX reached");
+
+      /* Activate */
+      if (activate (crypt_device, target_name, passphrase, &error) ||
+          !g_error_matches (error, DROIDIAN_ENCRYPTION_HELPER_ERROR,
+                            DROIDIAN_ENCRYPTION_HELPER_WRONG_PASSPHRASE))
           break;
+
+      droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_ERROR,
+                                                         error->code, EPERM, 0);
+
+      if (attempt < tries)
+        {
+          /* Ask the caller for another attempt */
+          g_printerr ("%s\n", error->message);
+          printf (WRONG_PASSPHRASE_NOTICE "\n");
+          fflush (stdout);
         }
     }
 
-  if (!i)
+  if (error != NULL)
     {
-      g_set_error (&error, DROIDIAN_ENCRYPTION_HELPER_ERROR,
-                   DROIDIAN_ENCRYPTION_HELPER_FAILED_TO_READ_PASSPHRASE,
-                   "Unable to read passphrase");
       exit_code = EXIT_UNABLE_TO_ACTIVATE; /* Unable to activate */
       goto out;
     }
 
-  result = crypt_init_data_device (&crypt_device, header, device);
-  if (result < 0)
-    {
-      g_set_error (&error, DROIDIAN_ENCRYPTION_HELPER_ERROR,
-                   DROIDIAN_ENCRYPTION_HELPER_FAILED_TO_INIT,
-                   "Unable to init context: %s",
-                   g_strerror (-result));
-      goto out;
-    }
-
-  /* Activate */
-  error = NULL;
-  if (!activate (crypt_device, target_name, passphrase, &error)) {
-      exit_code = EXIT_UNABLE_TO_ACTIVATE; /* Unable to activate */
-      goto out;
-  }
+  droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_STAGE,
+                                                     DROIDIAN_ENCRYPTION_HELPER_STAGE_ACTIVATED, 0, 0);
 
   /* Should reencryption be started? */
   error = NULL;
@@ -327,6 +582,13 @@ main (gint   argc,
       goto out;
     }
 
+  /* The parent returns only once the child is ready to be controlled */
+  if (pipe2 (ready_pipe, O_CLOEXEC) == -1)
+    {
+      g_printerr ("Unable to create pipe\n");
+      goto out;
+    }
+
   error = NULL;
   child = fork();
   if (child == -1)
@@ -339,21 +601,59 @@ main (gint   argc,
       /* Ensure systemd doesn't kill us before running switch_root: https://systemd.io/ROOT_STORAGE_DAEMONS/ */
       argv[0][0] = '@';
 
+      close (ready_pipe[0]);
+      ready_pipe[0] = -1;
+
+      if (!(control = droidian_encryption_helper_control_new (run_fd)))
+        {
+          g_set_error (&error, DROIDIAN_ENCRYPTION_HELPER_ERROR,
+                       DROIDIAN_ENCRYPTION_HELPER_FAILED_TO_CREATE_CONTROL,
+                       "Unable to create control context");
+          goto out;
+        }
+
+      droidian_encryption_helper_control_set_recovery_time (control, recovery_usec);
+
+      /* The sysfs statistics are opened while /sys is still there */
+      counted_devices[0] = device;
+      counted_devices[1] = header;
+      droidian_encryption_helper_control_set_write_counter (control,
+                                                            droidian_encryption_helper_write_counter_new (counted_devices));
+
+      if (!droidian_encryption_helper_control_listen (control, &error))
+        {
+          /* Not fatal, reencryption is crash safe anyway */
+          g_printerr ("%s\n", error->message);
+          g_clear_error (&error);
+        }
+
       /* Register signals */
       if (!register_signals (&error))
           goto out;
 
+      /* Let the parent go */
+      if (write (ready_pipe[1], "", 1) != 1)
+          g_printerr ("Unable to notify parent process\n");
+      close (ready_pipe[1]);
+      ready_pipe[1] = -1;
+
       /* Wait for the move to happen if rootmnt has been specified */
       if (rootmnt)
         {
-          while (!teardown && faccessat (run_fd, HALIUM_MOUNTED_STAMP_NAME, F_OK, 0) == -1)
+          wait_started_at = droidian_encryption_helper_clock_get_monotonic_time ();
+
+          if (faccessat (run_fd, HALIUM_MOUNTED_STAMP_NAME, F_OK, 0) == -1)
+              g_printerr ("Root move stamp not found, waiting: errno %d\n", errno);
+
+          while (faccessat (run_fd, HALIUM_MOUNTED_STAMP_NAME, F_OK, 0) == -1)
             {
-              g_printerr ("Root move stamp not found, waiting: errno %d, teardown %d\n", errno, teardown);
-              sleep (1);
+              if (!droidian_encryption_helper_control_wait (control, 1000))
+                  goto out;
             }
 
-          if (teardown)
-              goto out;
+          droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_STAGE,
+                                                             DROIDIAN_ENCRYPTION_HELPER_STAGE_ROOT_MOVED,
+                                                             droidian_encryption_helper_clock_get_monotonic_time () - wait_started_at, 0);
 
           /* If we're here, the mounted stamp has been touched - so we can chroot to the new root mountpoint */
           chroot (rootmnt);
@@ -366,25 +666,87 @@ main (gint   argc,
             }
         }
 
-      /* Wait for the boot to complete */
-      while (!teardown && faccessat (run_fd, DROIDIAN_BOOT_DONE_STAMP_NAME, F_OK, 0) == -1)
+      /* The real root is in place, the configuration can be read */
+      helper_config = droidian_encryption_helper_config_load ();
+      droidian_encryption_helper_control_set_background_rate_limit (control,
+                                                                    MAX (helper_config->background_rate_limit, 0));
+      reencryption_context.resilience = helper_config->resilience;
+
+      if (helper_config->daily_write_budget)
+          apply_write_budget (crypt_device, helper_config->daily_write_budget);
+
+      if (*helper_config->power_supply_dir)
+          droidian_encryption_helper_control_set_energy (control,
+                                                         droidian_encryption_helper_energy_new (helper_config->power_supply_dir));
+
+      if (helper_config->early_start)
+        {
+          /* Start right away, slowly, and speed up as the boot goes on */
+          droidian_encryption_helper_control_set_boot_rate_limit (control,
+                                                                  MAX (helper_config->early_rate_limit, 1));
+          droidian_encryption_helper_control_add_milestone (control, DEFAULT_TARGET_STAMP_NAME,
+                                                            MAX (helper_config->startup_rate_limit, 0));
+          droidian_encryption_helper_control_add_milestone (control, DROIDIAN_BOOT_DONE_STAMP_NAME, 0);
+
+          /*
+           * Still right after switch_root: the cgroup placement needs the
+           * hierarchy systemd sets up, and the priorities would only slow the
+           * ramp down further. Both are applied at the first milestone.
+           */
+          reencryption_context.pending_scheduling = helper_config;
+        }
+      else
         {
-          g_printerr ("Boot done stamp not found, waiting: errno %d, teardown %d\n", errno, teardown);
-          sleep (10);
+          /* Wakes us up as soon as the stamp appears */
+          droidian_encryption_helper_control_add_milestone (control, DROIDIAN_BOOT_DONE_STAMP_NAME, 0);
+
+          /* Wait for the boot to complete */
+          wait_started_at = droidian_encryption_helper_clock_get_monotonic_time ();
+
+          if (faccessat (run_fd, DROIDIAN_BOOT_DONE_STAMP_NAME, F_OK, 0) == -1)
+              g_printerr ("Boot done stamp not found, waiting: errno %d\n", errno);
+
+          while (faccessat (run_fd, DROIDIAN_BOOT_DONE_STAMP_NAME, F_OK, 0) == -1)
+            {
+              if (!droidian_encryption_helper_control_wait (control, 10000))
+                  goto out;
+            }
+
+          droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_STAGE,
+                                                             DROIDIAN_ENCRYPTION_HELPER_STAGE_BOOT_DONE,
+                                                             droidian_encryption_helper_clock_get_monotonic_time () - wait_started_at, 0);
+
+          /* The system is up, get out of the way of the foreground */
+          droidian_encryption_helper_scheduling_apply (helper_config);
         }
 
-      if (teardown || !start_reencryption (crypt_device, target_name, passphrase, &error))
+      /* Publish progress for droidian-encryption-service */
+      reencryption_context.progress_fd = openat (run_fd, DROIDIAN_ENCRYPTION_HELPER_PROGRESS_NAME,
+                                                 O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (reencryption_context.progress_fd == -1)
+          /* Not fatal */
+          g_printerr ("Unable to create progress file: errno %d\n", errno);
+
+      if (droidian_encryption_helper_control_should_stop (control) ||
+          !start_reencryption (crypt_device, target_name, passphrase,
+                               &reencryption_context, &error))
           goto out;
 
       g_warning ("Reencrypt finished!");
+      droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_STAGE,
+                                                         DROIDIAN_ENCRYPTION_HELPER_STAGE_FINISHED, 0, 0);
     }
   else
     {
-      /* Write the child pid to the pidfile */
-      length = snprintf ( NULL, 0, "%d", child) + 1;
-      pid = g_malloc (length);
-      snprintf (pid, length, "%d",  child);
-      g_file_set_contents (DROIDIAN_ENCRYPTION_HELPER_PIDFILE, pid, -1, &error);
+      droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_STAGE,
+                                                         DROIDIAN_ENCRYPTION_HELPER_STAGE_FORKED, child, 0);
+
+      /* Wait for the child to set up its control socket */
+      close (ready_pipe[1]);
+      ready_pipe[1] = -1;
+
+      if (read (ready_pipe[0], &ready, 1) != 1)
+          g_printerr ("Reencryption process failed to start\n");
     }
 
 
@@ -392,6 +754,8 @@ out:
   if (error)
     {
       g_printerr ("%s\n", error->message);
+      droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_ERROR,
+                                                         error->code, 0, 0);
 
       if (exit_code == EXIT_SUCCESS)
           exit_code = EXIT_FAILURE;
@@ -401,14 +765,31 @@ out:
           g_file_set_contents (DROIDIAN_ENCRYPTION_HELPER_FAILURE, error->message, -1, &error);
     }
 
-  if (child == 0 && faccessat (run_fd, DROIDIAN_ENCRYPTION_HELPER_PIDFILE_NAME, F_OK, 0) == 0)
+  if (ready_pipe[0] > -1)
+      close (ready_pipe[0]);
+
+  if (ready_pipe[1] > -1)
+      close (ready_pipe[1]);
+
+  if (reencryption_context.progress_fd > -1)
     {
-      /* Unlink pid file */
-      if (unlinkat (run_fd, DROIDIAN_ENCRYPTION_HELPER_PIDFILE_NAME, 0) == -1)
-        {
-            g_printerr ("Unable to unlink pidfile\n");
-            exit_code = EXIT_FAILURE;
-        }
+      close (reencryption_context.progress_fd);
+      unlinkat (run_fd, DROIDIAN_ENCRYPTION_HELPER_PROGRESS_NAME, 0);
+    }
+
+  if (control)
+    {
+      /* Keep track of this session for the ETA estimation, before acknowledging a stop */
+      if (crypt_device && droidian_encryption_helper_control_get_session (control, &session))
+          record_session (crypt_device, &session);
+
+      if (droidian_encryption_helper_control_should_stop (control))
+          droidian_encryption_helper_flight_recorder_record (DROIDIAN_ENCRYPTION_HELPER_EVENT_STAGE,
+                                                             DROIDIAN_ENCRYPTION_HELPER_STAGE_STOPPED, 0, 0);
+
+      /* Acknowledge pending stop requests, then tear the socket down */
+      droidian_encryption_helper_control_stopped (control);
+      droidian_encryption_helper_control_free (control);
     }
 
   if (crypt_device)
@@ -417,5 +798,7 @@ out:
   if (run_fd > -1)
       close (run_fd);
 
+  droidian_encryption_helper_flight_recorder_close ();
+
   return exit_code;
 }
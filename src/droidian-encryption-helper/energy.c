@@ -0,0 +1,212 @@
+/* energy.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "clock.h"
+#include "energy.h"
+
+typedef enum {
+  ENERGY_SOURCE_POWER,   /* power_now, uW */
+  ENERGY_SOURCE_CURRENT, /* current_now, uA, and voltage_now, uV */
+  ENERGY_SOURCE_COUNTER, /* energy_now, uWh */
+} EnergySource;
+
+struct _DroidianEncryptionHelperEnergy
+{
+  char *battery;
+  EnergySource source;
+
+  guint64 consumed;
+  gint64 sampled_at;
+  guint64 last_power;
+  guint64 last_counter;
+};
+
+static char *
+read_attribute (const char *battery,
+                const char *name)
+{
+  g_autofree char *path = g_build_filename (battery, name, NULL);
+  char *contents = NULL;
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+      return NULL;
+
+  return g_strstrip (contents);
+}
+
+static gboolean
+read_value (const char *battery,
+            const char *name,
+            gint64     *value)
+{
+  g_autofree char *contents = read_attribute (battery, name);
+  char *end;
+
+  if (!contents)
+      return FALSE;
+
+  *value = g_ascii_strtoll (contents, &end, 10);
+
+  return end != contents && *end == '\0';
+}
+
+static gboolean
+read_power (DroidianEncryptionHelperEnergy *self,
+            guint64                        *power)
+{
+  gint64 current;
+  gint64 voltage;
+  gint64 value;
+
+  switch (self->source)
+    {
+    case ENERGY_SOURCE_POWER:
+      if (!read_value (self->battery, "power_now", &value))
+          return FALSE;
+
+      /* Some drivers report discharging as negative */
+      *power = ABS (value);
+      return TRUE;
+
+    case ENERGY_SOURCE_CURRENT:
+      if (!read_value (self->battery, "current_now", &current) ||
+          !read_value (self->battery, "voltage_now", &voltage))
+          return FALSE;
+
+      *power = (guint64) ABS (current) * (guint64) ABS (voltage) / 1000000;
+      return TRUE;
+
+    default:
+      return FALSE;
+    }
+}
+
+static gboolean
+is_on_battery (DroidianEncryptionHelperEnergy *self)
+{
+  g_autofree char *status = read_attribute (self->battery, "status");
+
+  /* Drivers without status are assumed to be discharging */
+  return !status || g_strcmp0 (status, "Discharging") == 0 || g_strcmp0 (status, "Unknown") == 0;
+}
+
+gboolean
+droidian_encryption_helper_energy_sample (DroidianEncryptionHelperEnergy *self,
+                                          guint64                        *energy_uj)
+{
+  gint64 now = droidian_encryption_helper_clock_get_monotonic_time ();
+  gint64 counter;
+  guint64 power;
+
+  if (!is_on_battery (self))
+      goto invalidate;
+
+  if (self->source == ENERGY_SOURCE_COUNTER)
+    {
+      if (!read_value (self->battery, "energy_now", &counter) || counter < 0)
+          goto invalidate;
+
+      /* The counter is coarse, but doesn't miss anything between samples */
+      if (self->sampled_at && (guint64) counter <= self->last_counter)
+          self->consumed += (self->last_counter - (guint64) counter) * 3600;
+
+      self->last_counter = counter;
+    }
+  else
+    {
+      if (!read_power (self, &power))
+          goto invalidate;
+
+      /* uW * s = uJ */
+      if (self->sampled_at)
+          self->consumed += (self->last_power + power) / 2 * (now - self->sampled_at) / G_USEC_PER_SEC;
+
+      self->last_power = power;
+    }
+
+  self->sampled_at = now;
+  *energy_uj = self->consumed;
+
+  return TRUE;
+
+invalidate:
+  self->sampled_at = 0;
+  return FALSE;
+}
+
+static char *
+find_battery (const char *power_supply_dir)
+{
+  g_autoptr(GDir) dir = NULL;
+  const char *name;
+
+  if (!(dir = g_dir_open (power_supply_dir, 0, NULL)))
+      return NULL;
+
+  while ((name = g_dir_read_name (dir)))
+    {
+      g_autofree char *supply = g_build_filename (power_supply_dir, name, NULL);
+      g_autofree char *type = read_attribute (supply, "type");
+
+      if (g_strcmp0 (type, "Battery") == 0)
+          return g_steal_pointer (&supply);
+    }
+
+  return NULL;
+}
+
+DroidianEncryptionHelperEnergy *
+droidian_encryption_helper_energy_new (const char *power_supply_dir)
+{
+  DroidianEncryptionHelperEnergy *self;
+  g_autofree char *battery = NULL;
+  gint64 value;
+
+  if (!(battery = find_battery (power_supply_dir)))
+    {
+      g_printerr ("No battery found in %s, energy won't be measured\n", power_supply_dir);
+      return NULL;
+    }
+
+  self = g_new0 (DroidianEncryptionHelperEnergy, 1);
+  self->battery = g_steal_pointer (&battery);
+
+  /* Instant readings are finer grained than the energy counter */
+  if (read_value (self->battery, "power_now", &value))
+      self->source = ENERGY_SOURCE_POWER;
+  else if (read_value (self->battery, "current_now", &value) &&
+           read_value (self->battery, "voltage_now", &value))
+      self->source = ENERGY_SOURCE_CURRENT;
+  else if (read_value (self->battery, "energy_now", &value))
+      self->source = ENERGY_SOURCE_COUNTER;
+  else
+    {
+      g_printerr ("Battery %s reports neither power nor energy, energy won't be measured\n", self->battery);
+      droidian_encryption_helper_energy_free (self);
+      return NULL;
+    }
+
+  return self;
+}
+
+void
+droidian_encryption_helper_energy_free (DroidianEncryptionHelperEnergy *self)
+{
+  g_free (self->battery);
+  g_free (self);
+}
@@ -0,0 +1,45 @@
+/* energy.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONHELPERENERGY_H
+#define DROIDIANENCRYPTIONHELPERENERGY_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Energy drawn from the battery, from the power_supply class. Instant
+ * readings (power_now, or current_now and voltage_now) are integrated
+ * between samples, energy_now is used as is otherwise. Nothing is
+ * accounted while on external power. The directory can be pointed to a
+ * fixture tree for testing.
+ */
+typedef struct _DroidianEncryptionHelperEnergy DroidianEncryptionHelperEnergy;
+
+/* NULL if no usable battery has been found */
+DroidianEncryptionHelperEnergy *droidian_encryption_helper_energy_new (const char *power_supply_dir);
+void droidian_encryption_helper_energy_free (DroidianEncryptionHelperEnergy *self);
+
+/* energy_uj: microjoules drawn since creation. FALSE while not on battery. */
+gboolean droidian_encryption_helper_energy_sample (DroidianEncryptionHelperEnergy *self,
+                                                   guint64                        *energy_uj);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONHELPERENERGY_H */
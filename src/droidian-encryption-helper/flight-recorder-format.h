@@ -0,0 +1,95 @@
+/* flight-recorder-format.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONHELPERFLIGHTRECORDERFORMAT_H
+#define DROIDIANENCRYPTIONHELPERFLIGHTRECORDERFORMAT_H
+
+#include <stdint.h>
+
+/*
+ * The helper records its activity in a fixed size ring buffer, mmap()ed
+ * from a file in /run so that it survives the helper and switch_root.
+ *
+ * Writers reserve a slot by atomically incrementing head, invalidate its
+ * sequence, fill it in and finally store the slot sequence (its index + 1),
+ * with release ordering on both sequence stores. Readers map the file,
+ * load the sequence, copy the slot and load the sequence again after an
+ * acquire fence: slots whose sequence doesn't match the index or changed
+ * during the copy are being overwritten and are skipped.
+ *
+ * Timestamps are CLOCK_MONOTONIC microseconds.
+ */
+
+#define DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_NAME "droidian-encryption-helper.trace"
+#define DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER "/run/" DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_NAME
+#define DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_MAGIC 0x52464544 /* "DEFR" */
+#define DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_VERSION 1
+#define DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_CAPACITY 1024
+
+typedef enum {
+  DROIDIAN_ENCRYPTION_HELPER_EVENT_START = 1,  /* value1: pid */
+  DROIDIAN_ENCRYPTION_HELPER_EVENT_STAGE,      /* code: stage, value1: stage specific */
+  DROIDIAN_ENCRYPTION_HELPER_EVENT_HOTZONE,    /* value1: offset, value2: size */
+  DROIDIAN_ENCRYPTION_HELPER_EVENT_CONTROL,    /* code: request, value1: argument */
+  DROIDIAN_ENCRYPTION_HELPER_EVENT_SIGNAL,     /* code: signal number */
+  DROIDIAN_ENCRYPTION_HELPER_EVENT_ERROR,      /* code: helper error code, value1: errno */
+} DroidianEncryptionHelperEventType;
+
+typedef enum {
+  DROIDIAN_ENCRYPTION_HELPER_STAGE_PREPARED = 1,
+  DROIDIAN_ENCRYPTION_HELPER_STAGE_RECOVERED,   /* value1: recovery time in usec */
+  DROIDIAN_ENCRYPTION_HELPER_STAGE_ACTIVATED,
+  DROIDIAN_ENCRYPTION_HELPER_STAGE_FORKED,      /* value1: child pid */
+  DROIDIAN_ENCRYPTION_HELPER_STAGE_ROOT_MOVED,  /* value1: time waited in usec */
+  DROIDIAN_ENCRYPTION_HELPER_STAGE_BOOT_DONE,   /* value1: time waited in usec */
+  DROIDIAN_ENCRYPTION_HELPER_STAGE_REENCRYPTING,
+  DROIDIAN_ENCRYPTION_HELPER_STAGE_PAUSED,
+  DROIDIAN_ENCRYPTION_HELPER_STAGE_RESUMED,     /* value1: time paused in usec */
+  DROIDIAN_ENCRYPTION_HELPER_STAGE_FINISHED,
+  DROIDIAN_ENCRYPTION_HELPER_STAGE_STOPPED,
+  DROIDIAN_ENCRYPTION_HELPER_STAGE_MILESTONE,    /* value1: milestone index, value2: rate limit */
+  DROIDIAN_ENCRYPTION_HELPER_STAGE_OVER_BUDGET,  /* value1: bytes written, value2: time to wait in usec */
+} DroidianEncryptionHelperStage;
+
+typedef enum {
+  DROIDIAN_ENCRYPTION_HELPER_REQUEST_PAUSE = 1,
+  DROIDIAN_ENCRYPTION_HELPER_REQUEST_RESUME,
+  DROIDIAN_ENCRYPTION_HELPER_REQUEST_RATE_LIMIT, /* value1: bytes per second */
+  DROIDIAN_ENCRYPTION_HELPER_REQUEST_MODE,       /* value1: 0 boost, 1 background */
+  DROIDIAN_ENCRYPTION_HELPER_REQUEST_STOP,
+} DroidianEncryptionHelperRequest;
+
+typedef struct {
+  uint64_t sequence;
+  uint64_t timestamp;
+  uint32_t type;
+  uint32_t code;
+  uint64_t value1;
+  uint64_t value2;
+} DroidianEncryptionHelperEvent;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;
+  uint32_t event_size;
+  uint64_t head;
+  DroidianEncryptionHelperEvent events[DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_CAPACITY];
+} DroidianEncryptionHelperFlightRecord;
+
+#endif /* DROIDIANENCRYPTIONHELPERFLIGHTRECORDERFORMAT_H */
@@ -0,0 +1,119 @@
+/* flight-recorder.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "flight-recorder.h"
+
+static DroidianEncryptionHelperFlightRecord *record = NULL;
+
+void
+droidian_encryption_helper_flight_recorder_open (void)
+{
+  DroidianEncryptionHelperFlightRecord *mapping;
+  int fd;
+
+  if (record)
+      return;
+
+  if ((fd = open (DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 ||
+      ftruncate (fd, sizeof (DroidianEncryptionHelperFlightRecord)) < 0)
+    {
+      /* Not fatal, events are simply dropped */
+      g_printerr ("Unable to create flight recorder: errno %d\n", errno);
+      if (fd > -1)
+          close (fd);
+      return;
+    }
+
+  /* Shared, so that both the parent and the background process record into it */
+  mapping = mmap (NULL, sizeof (DroidianEncryptionHelperFlightRecord),
+                  PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (mapping == MAP_FAILED)
+    {
+      g_printerr ("Unable to map flight recorder: errno %d\n", errno);
+      return;
+    }
+
+  /* Keep the events of a previous run in this boot, if compatible */
+  if (mapping->magic != DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_MAGIC ||
+      mapping->version != DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_VERSION ||
+      mapping->capacity != DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_CAPACITY ||
+      mapping->event_size != sizeof (DroidianEncryptionHelperEvent))
+    {
+      memset (mapping, 0, sizeof (DroidianEncryptionHelperFlightRecord));
+      mapping->version = DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_VERSION;
+      mapping->capacity = DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_CAPACITY;
+      mapping->event_size = sizeof (DroidianEncryptionHelperEvent);
+      __atomic_store_n (&mapping->magic, DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_MAGIC, __ATOMIC_RELEASE);
+    }
+
+  record = mapping;
+}
+
+void
+droidian_encryption_helper_flight_recorder_close (void)
+{
+  if (!record)
+      return;
+
+  munmap (record, sizeof (DroidianEncryptionHelperFlightRecord));
+  record = NULL;
+}
+
+void
+droidian_encryption_helper_flight_recorder_record (DroidianEncryptionHelperEventType type,
+                                                   uint32_t                          code,
+                                                   uint64_t                          value1,
+                                                   uint64_t                          value2)
+{
+  DroidianEncryptionHelperEvent *event;
+  struct timespec now;
+  uint64_t index;
+
+  if (!record)
+      return;
+
+  /* vDSO backed, no actual syscall */
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  index = __atomic_fetch_add (&record->head, 1, __ATOMIC_RELAXED);
+  event = &record->events[index % DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_CAPACITY];
+
+  /* Invalidate the slot while it's being rewritten. The fence keeps the
+   * payload stores below from becoming visible before the invalidation */
+  __atomic_store_n (&event->sequence, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+
+  event->timestamp = (uint64_t) now.tv_sec * G_USEC_PER_SEC + now.tv_nsec / 1000;
+  event->type = type;
+  event->code = code;
+  event->value1 = value1;
+  event->value2 = value2;
+
+  __atomic_store_n (&event->sequence, index + 1, __ATOMIC_RELEASE);
+}
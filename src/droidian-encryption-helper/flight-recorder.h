@@ -0,0 +1,40 @@
+/* flight-recorder.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONHELPERFLIGHTRECORDER_H
+#define DROIDIANENCRYPTIONHELPERFLIGHTRECORDER_H
+
+#include <glib.h>
+#include <stdint.h>
+
+#include "flight-recorder-format.h"
+
+G_BEGIN_DECLS
+
+void droidian_encryption_helper_flight_recorder_open (void);
+void droidian_encryption_helper_flight_recorder_close (void);
+
+/* No allocations nor syscalls, safe to call from a signal handler */
+void droidian_encryption_helper_flight_recorder_record (DroidianEncryptionHelperEventType type,
+                                                        uint32_t                          code,
+                                                        uint64_t                          value1,
+                                                        uint64_t                          value2);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONHELPERFLIGHTRECORDER_H */
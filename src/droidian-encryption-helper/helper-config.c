@@ -0,0 +1,119 @@
+/* helper-config.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "helper-config.h"
+
+/* Shared with droidian-encryption-service, in its own section */
+#define CONFIGURATION_FILE "/etc/droidian-encryption-service.conf"
+#define CONFIGURATION_FILE_SECTION "droidian-encryption-helper"
+
+#define DEFAULT_IOPRIO_CLASS "none"
+#define DEFAULT_IOPRIO_LEVEL 4
+#define DEFAULT_CGROUP ""
+#define DEFAULT_IO_WEIGHT 0
+#define DEFAULT_CPU_WEIGHT 0
+#define DEFAULT_EFFICIENCY_CORES FALSE
+#define DEFAULT_BACKGROUND_RATE_LIMIT 0
+#define DEFAULT_EARLY_START FALSE
+#define DEFAULT_EARLY_RATE_LIMIT 1048576
+#define DEFAULT_STARTUP_RATE_LIMIT 4194304
+#define DEFAULT_RESILIENCE "checksum"
+#define DEFAULT_DAILY_WRITE_BUDGET 0
+#define DEFAULT_POWER_SUPPLY_DIR "/sys/class/power_supply"
+
+static char *
+get_string (GKeyFile   *key_file,
+            const char *key,
+            const char *default_value)
+{
+  char *value = g_key_file_get_string (key_file, CONFIGURATION_FILE_SECTION, key, NULL);
+
+  return value ? value : g_strdup (default_value);
+}
+
+static gint
+get_integer (GKeyFile   *key_file,
+             const char *key,
+             gint        default_value)
+{
+  g_autoptr(GError) error = NULL;
+  gint value = g_key_file_get_integer (key_file, CONFIGURATION_FILE_SECTION, key, &error);
+
+  return error ? default_value : value;
+}
+
+static guint64
+get_uint64 (GKeyFile   *key_file,
+            const char *key,
+            guint64     default_value)
+{
+  g_autoptr(GError) error = NULL;
+  guint64 value = g_key_file_get_uint64 (key_file, CONFIGURATION_FILE_SECTION, key, &error);
+
+  return error ? default_value : value;
+}
+
+static gboolean
+get_boolean (GKeyFile   *key_file,
+             const char *key,
+             gboolean    default_value)
+{
+  g_autoptr(GError) error = NULL;
+  gboolean value = g_key_file_get_boolean (key_file, CONFIGURATION_FILE_SECTION, key, &error);
+
+  return error ? default_value : value;
+}
+
+DroidianEncryptionHelperConfig *
+droidian_encryption_helper_config_load (void)
+{
+  DroidianEncryptionHelperConfig *self = g_new0 (DroidianEncryptionHelperConfig, 1);
+  g_autoptr(GKeyFile) key_file = g_key_file_new ();
+  g_autoptr(GError) error = NULL;
+
+  /* Missing keys (or file) fall back to the defaults */
+  if (!g_key_file_load_from_file (key_file, CONFIGURATION_FILE, G_KEY_FILE_NONE, &error))
+      g_printerr ("Unable to read configuration file %s: %s\n",
+                  CONFIGURATION_FILE, error->message);
+
+  self->ioprio_class = get_string (key_file, "ioprio_class", DEFAULT_IOPRIO_CLASS);
+  self->ioprio_level = get_integer (key_file, "ioprio_level", DEFAULT_IOPRIO_LEVEL);
+  self->cgroup = get_string (key_file, "cgroup", DEFAULT_CGROUP);
+  self->io_weight = get_integer (key_file, "io_weight", DEFAULT_IO_WEIGHT);
+  self->cpu_weight = get_integer (key_file, "cpu_weight", DEFAULT_CPU_WEIGHT);
+  self->efficiency_cores = get_boolean (key_file, "efficiency_cores", DEFAULT_EFFICIENCY_CORES);
+  self->background_rate_limit = get_integer (key_file, "background_rate_limit", DEFAULT_BACKGROUND_RATE_LIMIT);
+  self->early_start = get_boolean (key_file, "early_start", DEFAULT_EARLY_START);
+  self->early_rate_limit = get_integer (key_file, "early_rate_limit", DEFAULT_EARLY_RATE_LIMIT);
+  self->startup_rate_limit = get_integer (key_file, "startup_rate_limit", DEFAULT_STARTUP_RATE_LIMIT);
+  self->resilience = get_string (key_file, "resilience", DEFAULT_RESILIENCE);
+  self->daily_write_budget = get_uint64 (key_file, "daily_write_budget", DEFAULT_DAILY_WRITE_BUDGET);
+  self->power_supply_dir = get_string (key_file, "power_supply_dir", DEFAULT_POWER_SUPPLY_DIR);
+
+  return self;
+}
+
+void
+droidian_encryption_helper_config_free (DroidianEncryptionHelperConfig *self)
+{
+  g_free (self->ioprio_class);
+  g_free (self->cgroup);
+  g_free (self->resilience);
+  g_free (self->power_supply_dir);
+  g_free (self);
+}
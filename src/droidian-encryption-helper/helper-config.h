@@ -0,0 +1,60 @@
+/* helper-config.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONHELPERCONFIG_H
+#define DROIDIANENCRYPTIONHELPERCONFIG_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct {
+  /* Scheduling */
+  char *ioprio_class;
+  gint ioprio_level;
+  char *cgroup;
+  gint io_weight;
+  gint cpu_weight;
+  gboolean efficiency_cores;
+
+  /* Rate limit applied in background mode, 0 disables it */
+  gint background_rate_limit;
+
+  /* Start right after switch_root instead of waiting for boot-done */
+  gboolean early_start;
+  gint early_rate_limit;
+  /* Applied once default.target has been reached, 0 lifts the cap */
+  gint startup_rate_limit;
+
+  /* Resilience mode used when resuming: checksum, journal or none */
+  char *resilience;
+  /* Bytes that can be written to the devices in 24 hours, 0 disables it */
+  guint64 daily_write_budget;
+
+  /* Where to look for the battery, empty disables the energy measurements */
+  char *power_supply_dir;
+} DroidianEncryptionHelperConfig;
+
+DroidianEncryptionHelperConfig *droidian_encryption_helper_config_load (void);
+void droidian_encryption_helper_config_free (DroidianEncryptionHelperConfig *self);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (DroidianEncryptionHelperConfig, droidian_encryption_helper_config_free);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONHELPERCONFIG_H */
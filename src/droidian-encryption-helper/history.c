@@ -0,0 +1,255 @@
+/* history.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <json-c/json.h>
+
+#include "control-protocol.h"
+#include "history.h"
+
+/* LUKS2 supports up to 32 tokens */
+#define LUKS2_TOKENS_MAX 32
+
+/* Fields of a session, in the order they're stored */
+enum {
+  FIELD_STARTED_AT,
+  FIELD_START_OFFSET,
+  FIELD_END_OFFSET,
+  FIELD_ACTIVE_USEC,
+  FIELD_THROTTLED_USEC,
+  FIELD_PAUSED_USEC,
+  FIELD_WRITTEN_BYTES,
+  FIELD_RESILIENCE,
+  FIELD_BOOST_ENERGY_UJ,
+  FIELD_BOOST_USEC,
+  FIELD_BOOST_BYTES,
+  FIELD_BACKGROUND_ENERGY_UJ,
+  FIELD_BACKGROUND_USEC,
+  FIELD_BACKGROUND_BYTES,
+};
+
+/* Sessions recorded by the first release carry up to paused_usec only */
+#define FIELDS_MIN (FIELD_PAUSED_USEC + 1)
+
+static int
+find_token (struct crypt_device *crypt_device)
+{
+  const char *type;
+  int token;
+
+  for (token = 0; token < LUKS2_TOKENS_MAX; token++)
+    {
+      if (crypt_token_status (crypt_device, token, &type) != CRYPT_TOKEN_INACTIVE &&
+          g_strcmp0 (type, DROIDIAN_ENCRYPTION_HISTORY_TOKEN_TYPE) == 0)
+          return token;
+    }
+
+  return -1;
+}
+
+static gboolean
+parse_session (const char                       *value,
+               DroidianEncryptionHistorySession *session)
+{
+  g_auto (GStrv) fields = g_strsplit (value, ":", -1);
+  guint n_fields = g_strv_length (fields);
+
+  /* Missing fields, and empty ones, are reported as 0 and empty strings */
+#define FIELD(index) (((index) < n_fields) ? fields[index] : "")
+
+  if (n_fields < FIELDS_MIN)
+      return FALSE;
+
+  memset (session, 0, sizeof (*session));
+
+  session->started_at = g_ascii_strtoll (FIELD (FIELD_STARTED_AT), NULL, 10);
+  session->start_offset = g_ascii_strtoull (FIELD (FIELD_START_OFFSET), NULL, 10);
+  session->end_offset = g_ascii_strtoull (FIELD (FIELD_END_OFFSET), NULL, 10);
+  session->active_usec = g_ascii_strtoll (FIELD (FIELD_ACTIVE_USEC), NULL, 10);
+  session->throttled_usec = g_ascii_strtoll (FIELD (FIELD_THROTTLED_USEC), NULL, 10);
+  session->paused_usec = g_ascii_strtoll (FIELD (FIELD_PAUSED_USEC), NULL, 10);
+  session->written_bytes = g_ascii_strtoull (FIELD (FIELD_WRITTEN_BYTES), NULL, 10);
+  g_strlcpy (session->resilience, FIELD (FIELD_RESILIENCE), sizeof (session->resilience));
+  session->energy[DROIDIAN_ENCRYPTION_HISTORY_PACING_BOOST].energy_uj =
+    g_ascii_strtoull (FIELD (FIELD_BOOST_ENERGY_UJ), NULL, 10);
+  session->energy[DROIDIAN_ENCRYPTION_HISTORY_PACING_BOOST].usec =
+    g_ascii_strtoll (FIELD (FIELD_BOOST_USEC), NULL, 10);
+  session->energy[DROIDIAN_ENCRYPTION_HISTORY_PACING_BOOST].bytes =
+    g_ascii_strtoull (FIELD (FIELD_BOOST_BYTES), NULL, 10);
+  session->energy[DROIDIAN_ENCRYPTION_HISTORY_PACING_BACKGROUND].energy_uj =
+    g_ascii_strtoull (FIELD (FIELD_BACKGROUND_ENERGY_UJ), NULL, 10);
+  session->energy[DROIDIAN_ENCRYPTION_HISTORY_PACING_BACKGROUND].usec =
+    g_ascii_strtoll (FIELD (FIELD_BACKGROUND_USEC), NULL, 10);
+  session->energy[DROIDIAN_ENCRYPTION_HISTORY_PACING_BACKGROUND].bytes =
+    g_ascii_strtoull (FIELD (FIELD_BACKGROUND_BYTES), NULL, 10);
+
+#undef FIELD
+
+  return TRUE;
+}
+
+static char *
+format_session (const DroidianEncryptionHistorySession *session)
+{
+  return g_strdup_printf ("%" G_GINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT
+                          ":%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT
+                          ":%" G_GUINT64_FORMAT ":%s"
+                          ":%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT ":%" G_GUINT64_FORMAT
+                          ":%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT ":%" G_GUINT64_FORMAT,
+                          session->started_at, session->start_offset, session->end_offset,
+                          session->active_usec, session->throttled_usec, session->paused_usec,
+                          session->written_bytes, session->resilience,
+                          session->energy[DROIDIAN_ENCRYPTION_HISTORY_PACING_BOOST].energy_uj,
+                          session->energy[DROIDIAN_ENCRYPTION_HISTORY_PACING_BOOST].usec,
+                          session->energy[DROIDIAN_ENCRYPTION_HISTORY_PACING_BOOST].bytes,
+                          session->energy[DROIDIAN_ENCRYPTION_HISTORY_PACING_BACKGROUND].energy_uj,
+                          session->energy[DROIDIAN_ENCRYPTION_HISTORY_PACING_BACKGROUND].usec,
+                          session->energy[DROIDIAN_ENCRYPTION_HISTORY_PACING_BACKGROUND].bytes);
+}
+
+void
+droidian_encryption_history_parse (const char *json,
+                                   GArray     *sessions)
+{
+  DroidianEncryptionHistorySession session;
+  struct json_object *token;
+  struct json_object *array;
+  struct json_object *value;
+  size_t i;
+
+  g_return_if_fail (json != NULL);
+
+  if (!(token = json_tokener_parse (json)))
+      return;
+
+  if (json_object_object_get_ex (token, "sessions", &array) &&
+      json_object_is_type (array, json_type_array))
+    {
+      for (i = 0; i < json_object_array_length (array); i++)
+        {
+          value = json_object_array_get_idx (array, i);
+
+          /* Skip what can't be understood, keep the rest */
+          if (json_object_is_type (value, json_type_string) &&
+              parse_session (json_object_get_string (value), &session))
+              g_array_append_val (sessions, session);
+        }
+    }
+
+  json_object_put (token);
+}
+
+char *
+droidian_encryption_history_format (GArray *sessions)
+{
+  g_autoptr (GPtrArray) formatted = g_ptr_array_new_with_free_func (g_free);
+  struct json_object *token;
+  struct json_object *array;
+  char *json;
+  gsize length = 0;
+  guint first;
+  guint i;
+
+  for (i = 0; i < sessions->len; i++)
+      g_ptr_array_add (formatted, format_session (&g_array_index (sessions, DroidianEncryptionHistorySession, i)));
+
+  /*
+   * The token shares the JSON area with the keyslots and the reencryption
+   * segments: keep the most recent sessions that fit in its share, quotes
+   * and separators included.
+   */
+  for (first = formatted->len; first > 0; first--)
+    {
+      length += strlen (g_ptr_array_index (formatted, first - 1)) + 3;
+
+      if (formatted->len - first >= DROIDIAN_ENCRYPTION_HISTORY_MAX_SESSIONS ||
+          length > DROIDIAN_ENCRYPTION_HISTORY_TOKEN_SIZE_MAX - 128)
+          break;
+    }
+
+  token = json_object_new_object ();
+  json_object_object_add (token, "type", json_object_new_string (DROIDIAN_ENCRYPTION_HISTORY_TOKEN_TYPE));
+  json_object_object_add (token, "keyslots", json_object_new_array ());
+
+  array = json_object_new_array ();
+  for (i = first; i < formatted->len; i++)
+      json_object_array_add (array, json_object_new_string (g_ptr_array_index (formatted, i)));
+  json_object_object_add (token, "sessions", array);
+
+  json = g_strdup (json_object_to_json_string_ext (token, JSON_C_TO_STRING_PLAIN));
+  json_object_put (token);
+
+  return json;
+}
+
+const char *
+droidian_encryption_history_get_pacing_name (DroidianEncryptionHistoryPacing pacing)
+{
+  static const char *pacing_names[] = {
+    [DROIDIAN_ENCRYPTION_HISTORY_PACING_BOOST] = DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE_BOOST,
+    [DROIDIAN_ENCRYPTION_HISTORY_PACING_BACKGROUND] = DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE_BACKGROUND,
+  };
+
+  g_return_val_if_fail (pacing < DROIDIAN_ENCRYPTION_HISTORY_PACING_MODES, NULL);
+
+  return pacing_names[pacing];
+}
+
+GArray *
+droidian_encryption_history_load (struct crypt_device *crypt_device)
+{
+  GArray *sessions = g_array_new (FALSE, FALSE, sizeof (DroidianEncryptionHistorySession));
+  const char *json;
+  int token;
+
+  if ((token = find_token (crypt_device)) > -1 &&
+      crypt_token_json_get (crypt_device, token, &json) >= 0)
+      droidian_encryption_history_parse (json, sessions);
+
+  return sessions;
+}
+
+int
+droidian_encryption_history_append (struct crypt_device                    *crypt_device,
+                                    const DroidianEncryptionHistorySession *session)
+{
+  g_autoptr (GArray) sessions = droidian_encryption_history_load (crypt_device);
+  g_autofree char *json = NULL;
+  int token;
+  int result;
+
+  g_array_append_vals (sessions, session, 1);
+
+  json = droidian_encryption_history_format (sessions);
+  token = find_token (crypt_device);
+
+  if ((result = crypt_token_json_set (crypt_device, (token > -1) ? token : CRYPT_ANY_TOKEN, json)) >= 0 ||
+      sessions->len == 1)
+      return result;
+
+  /*
+   * The header is left untouched on failure. The JSON area is probably
+   * full (a migration carries more keyslots and segments): keep the
+   * latest session only rather than losing it.
+   */
+  g_array_remove_range (sessions, 0, sessions->len - 1);
+  g_clear_pointer (&json, g_free);
+  json = droidian_encryption_history_format (sessions);
+
+  return crypt_token_json_set (crypt_device, (token > -1) ? token : CRYPT_ANY_TOKEN, json);
+}
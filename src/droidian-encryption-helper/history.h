@@ -0,0 +1,86 @@
+/* history.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONHISTORY_H
+#define DROIDIANENCRYPTIONHISTORY_H
+
+#include <glib.h>
+#include <libcryptsetup.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Every reencryption session (one per boot, usually) is stored in a LUKS2
+ * token of the header being reencrypted, so that it survives reboots:
+ *
+ * { "type": "droidian-history", "keyslots": [],
+ *   "sessions": [ "<started_at>:<start_offset>:<end_offset>:<active_usec>:<throttled_usec>:<paused_usec>:<written_bytes>:<resilience>"
+ *                 ":<boost_energy_uj>:<boost_usec>:<boost_bytes>:<background_energy_uj>:<background_usec>:<background_bytes>", ... ] }
+ *
+ * started_at is wall clock time in microseconds, offsets are in bytes.
+ * The fields after paused_usec are missing from sessions recorded by
+ * older releases, they're reported as 0 and empty strings, as are empty
+ * fields.
+ *
+ * The token is bounded to DROIDIAN_ENCRYPTION_HISTORY_TOKEN_SIZE_MAX bytes,
+ * the oldest sessions are dropped to fit.
+ *
+ * The energy drawn from the battery is accounted per pacing mode, over
+ * the time it has been measured (on battery, not paused) only.
+ */
+
+#define DROIDIAN_ENCRYPTION_HISTORY_TOKEN_TYPE "droidian-history"
+#define DROIDIAN_ENCRYPTION_HISTORY_MAX_SESSIONS 16
+#define DROIDIAN_ENCRYPTION_HISTORY_TOKEN_SIZE_MAX 4096
+#define DROIDIAN_ENCRYPTION_HISTORY_RESILIENCE_MAX 16
+
+typedef enum {
+  DROIDIAN_ENCRYPTION_HISTORY_PACING_BOOST,
+  DROIDIAN_ENCRYPTION_HISTORY_PACING_BACKGROUND,
+  DROIDIAN_ENCRYPTION_HISTORY_PACING_MODES,
+} DroidianEncryptionHistoryPacing;
+
+typedef struct {
+  guint64 energy_uj;
+  gint64 usec;
+  guint64 bytes;
+} DroidianEncryptionHistoryEnergy;
+
+typedef struct {
+  gint64 started_at;
+  guint64 start_offset;
+  guint64 end_offset;
+  gint64 active_usec;
+  gint64 throttled_usec;
+  gint64 paused_usec;
+  guint64 written_bytes; /* to the data and header devices */
+  char resilience[DROIDIAN_ENCRYPTION_HISTORY_RESILIENCE_MAX];
+  DroidianEncryptionHistoryEnergy energy[DROIDIAN_ENCRYPTION_HISTORY_PACING_MODES];
+} DroidianEncryptionHistorySession;
+
+const char *droidian_encryption_history_get_pacing_name (DroidianEncryptionHistoryPacing pacing);
+void droidian_encryption_history_parse (const char *json,
+                                        GArray     *sessions);
+char *droidian_encryption_history_format (GArray *sessions);
+GArray *droidian_encryption_history_load (struct crypt_device *crypt_device);
+int droidian_encryption_history_append (struct crypt_device                    *crypt_device,
+                                        const DroidianEncryptionHistorySession *session);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONHISTORY_H */
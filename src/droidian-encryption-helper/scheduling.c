@@ -0,0 +1,199 @@
+/* scheduling.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "scheduling.h"
+
+/* From linux/ioprio.h */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_WHO_PROCESS 1
+
+enum {
+  IOPRIO_CLASS_NONE,
+  IOPRIO_CLASS_RT,
+  IOPRIO_CLASS_BE,
+  IOPRIO_CLASS_IDLE,
+};
+
+#define CPU_SYSFS "/sys/devices/system/cpu"
+
+static gboolean
+write_attribute (const char *directory,
+                 const char *name,
+                 const char *value)
+{
+  g_autofree char *path = g_build_filename (directory, name, NULL);
+  ssize_t length = strlen (value);
+  int fd;
+
+  /* cgroupfs doesn't support g_file_set_contents()' atomic replace */
+  if ((fd = open (path, O_WRONLY | O_CLOEXEC)) < 0)
+      goto error;
+
+  if (write (fd, value, length) != length)
+    {
+      close (fd);
+      goto error;
+    }
+
+  close (fd);
+  return TRUE;
+
+error:
+  g_printerr ("Unable to write %s to %s: %s\n", value, path, g_strerror (errno));
+  return FALSE;
+}
+
+static void
+apply_ioprio (DroidianEncryptionHelperConfig *config)
+{
+  int class;
+  int level = CLAMP (config->ioprio_level, 0, 7);
+
+  if (g_strcmp0 (config->ioprio_class, "none") == 0)
+      return;
+  else if (g_strcmp0 (config->ioprio_class, "realtime") == 0)
+      class = IOPRIO_CLASS_RT;
+  else if (g_strcmp0 (config->ioprio_class, "best-effort") == 0)
+      class = IOPRIO_CLASS_BE;
+  else if (g_strcmp0 (config->ioprio_class, "idle") == 0)
+      class = IOPRIO_CLASS_IDLE, level = 0;
+  else
+    {
+      g_printerr ("Unknown ioprio_class %s\n", config->ioprio_class);
+      return;
+    }
+
+  /* Applies to the calling thread, which is the one submitting the I/O */
+  if (syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE (class, level)) < 0)
+      g_printerr ("Unable to set I/O priority: %s\n", g_strerror (errno));
+}
+
+static void
+apply_cgroup (DroidianEncryptionHelperConfig *config)
+{
+  g_autofree char *value = NULL;
+
+  if (!config->cgroup || *config->cgroup == '\0')
+      return;
+
+  if (mkdir (config->cgroup, 0755) < 0 && errno != EEXIST)
+    {
+      g_printerr ("Unable to create cgroup %s: %s\n", config->cgroup, g_strerror (errno));
+      return;
+    }
+
+  /* Weights require the controllers to be enabled in the parent cgroup */
+  if (config->io_weight > 0)
+    {
+      value = g_strdup_printf ("default %d", CLAMP (config->io_weight, 1, 10000));
+      write_attribute (config->cgroup, "io.weight", value);
+      g_clear_pointer (&value, g_free);
+    }
+
+  if (config->cpu_weight > 0)
+    {
+      value = g_strdup_printf ("%d", CLAMP (config->cpu_weight, 1, 10000));
+      write_attribute (config->cgroup, "cpu.weight", value);
+      g_clear_pointer (&value, g_free);
+    }
+
+  value = g_strdup_printf ("%d", getpid ());
+  write_attribute (config->cgroup, "cgroup.procs", value);
+}
+
+static gboolean
+read_cpu_attribute (int         cpu,
+                    const char *attribute,
+                    guint64    *value)
+{
+  g_autofree char *path = g_strdup_printf (CPU_SYSFS "/cpu%d/%s", cpu, attribute);
+  g_autofree char *contents = NULL;
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+      return FALSE;
+
+  *value = g_ascii_strtoull (contents, NULL, 10);
+  return TRUE;
+}
+
+static void
+apply_efficiency_affinity (void)
+{
+  static guint64 capacities[CPU_SETSIZE];
+  const char *attribute = "cpu_capacity";
+  guint64 lowest = G_MAXUINT64;
+  guint64 highest = 0;
+  cpu_set_t set;
+  int cpus = MIN (sysconf (_SC_NPROCESSORS_CONF), CPU_SETSIZE);
+  int cpu;
+
+  /* Prefer the capacity reported by the scheduler, fall back to the maximum frequency */
+  if (!read_cpu_attribute (0, attribute, &capacities[0]))
+      attribute = "cpufreq/cpuinfo_max_freq";
+
+  for (cpu = 0; cpu < cpus; cpu++)
+    {
+      if (!read_cpu_attribute (cpu, attribute, &capacities[cpu]) || !capacities[cpu])
+        {
+          /* Offline or unknown */
+          capacities[cpu] = 0;
+          continue;
+        }
+
+      lowest = MIN (lowest, capacities[cpu]);
+      highest = MAX (highest, capacities[cpu]);
+    }
+
+  if (!highest || lowest == highest)
+    {
+      g_printerr ("No efficiency cluster found, leaving CPU affinity alone\n");
+      return;
+    }
+
+  CPU_ZERO (&set);
+  for (cpu = 0; cpu < cpus; cpu++)
+    {
+      if (capacities[cpu] == lowest)
+          CPU_SET (cpu, &set);
+    }
+
+  /* As with ioprio, only the reencryption thread is affected */
+  if (sched_setaffinity (0, sizeof (set), &set) < 0)
+      g_printerr ("Unable to set CPU affinity: %s\n", g_strerror (errno));
+}
+
+void
+droidian_encryption_helper_scheduling_apply (DroidianEncryptionHelperConfig *config)
+{
+  apply_ioprio (config);
+  apply_cgroup (config);
+
+  if (config->efficiency_cores)
+      apply_efficiency_affinity ();
+}
@@ -0,0 +1,163 @@
+/* write-counter.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "write-counter.h"
+
+/* The stat file always counts 512 bytes sectors */
+#define SECTOR_SIZE 512
+/* Sectors written, see Documentation/block/stat.rst */
+#define STAT_WRITE_SECTORS_FIELD 6
+
+typedef struct {
+  dev_t device;
+  int stat_fd;
+  guint64 baseline;
+} WriteCounterDevice;
+
+struct _DroidianEncryptionHelperWriteCounter
+{
+  GArray *devices;
+};
+
+static gboolean
+read_written_sectors (int      stat_fd,
+                      guint64 *sectors)
+{
+  char buffer[256];
+  g_auto(GStrv) fields = NULL;
+  ssize_t length;
+
+  /* Kept open, so that it can be read after the chroot as well */
+  if ((length = pread (stat_fd, buffer, sizeof (buffer) - 1, 0)) <= 0)
+      return FALSE;
+
+  buffer[length] = '\0';
+  fields = g_strsplit_set (g_strstrip (buffer), " ", -1);
+
+  /* Fields are padded with a variable number of spaces */
+  for (guint index = 0, field = 0; fields[index] != NULL; index++)
+    {
+      if (*fields[index] == '\0')
+          continue;
+
+      if (field++ == STAT_WRITE_SECTORS_FIELD)
+        {
+          *sectors = g_ascii_strtoull (fields[index], NULL, 10);
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+static gboolean
+add_device (DroidianEncryptionHelperWriteCounter *self,
+            const char                           *path)
+{
+  g_autofree char *stat_path = NULL;
+  WriteCounterDevice device = { 0 };
+  struct stat path_stat;
+
+  if (stat (path, &path_stat) < 0)
+    {
+      g_printerr ("Unable to stat %s: errno %d\n", path, errno);
+      return FALSE;
+    }
+
+  /* A header stored in a file is written through its filesystem */
+  device.device = S_ISBLK (path_stat.st_mode) ? path_stat.st_rdev : path_stat.st_dev;
+
+  /* Attached headers live on the data device */
+  for (guint index = 0; index < self->devices->len; index++)
+    {
+      if (g_array_index (self->devices, WriteCounterDevice, index).device == device.device)
+          return TRUE;
+    }
+
+  stat_path = g_strdup_printf ("/sys/dev/block/%u:%u/stat", major (device.device), minor (device.device));
+  if ((device.stat_fd = open (stat_path, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+      g_printerr ("Unable to open %s: errno %d\n", stat_path, errno);
+      return FALSE;
+    }
+
+  if (!read_written_sectors (device.stat_fd, &device.baseline))
+    {
+      g_printerr ("Unable to parse %s\n", stat_path);
+      close (device.stat_fd);
+      return FALSE;
+    }
+
+  g_array_append_val (self->devices, device);
+
+  return TRUE;
+}
+
+guint64
+droidian_encryption_helper_write_counter_get (DroidianEncryptionHelperWriteCounter *self)
+{
+  WriteCounterDevice *device;
+  guint64 written = 0;
+  guint64 sectors;
+
+  for (guint index = 0; index < self->devices->len; index++)
+    {
+      device = &g_array_index (self->devices, WriteCounterDevice, index);
+
+      if (read_written_sectors (device->stat_fd, &sectors) && sectors > device->baseline)
+          written += (sectors - device->baseline) * SECTOR_SIZE;
+    }
+
+  return written;
+}
+
+DroidianEncryptionHelperWriteCounter *
+droidian_encryption_helper_write_counter_new (const char * const *paths)
+{
+  DroidianEncryptionHelperWriteCounter *self = g_new0 (DroidianEncryptionHelperWriteCounter, 1);
+
+  self->devices = g_array_new (FALSE, FALSE, sizeof (WriteCounterDevice));
+
+  for (const char * const *path = paths; *path != NULL; path++)
+    {
+      if (!add_device (self, *path))
+        {
+          /* Partial figures would be misleading */
+          droidian_encryption_helper_write_counter_free (self);
+          return NULL;
+        }
+    }
+
+  return self;
+}
+
+void
+droidian_encryption_helper_write_counter_free (DroidianEncryptionHelperWriteCounter *self)
+{
+  for (guint index = 0; index < self->devices->len; index++)
+      close (g_array_index (self->devices, WriteCounterDevice, index).stat_fd);
+
+  g_array_unref (self->devices);
+  g_free (self);
+}
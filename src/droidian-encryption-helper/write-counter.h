@@ -0,0 +1,41 @@
+/* write-counter.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONHELPERWRITECOUNTER_H
+#define DROIDIANENCRYPTIONHELPERWRITECOUNTER_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Bytes written to the block devices backing the reencryption (data and
+ * header), from their /sys/dev/block/<major>:<minor>/stat. The counters
+ * cover every writer of the devices, foreground writes included.
+ */
+typedef struct _DroidianEncryptionHelperWriteCounter DroidianEncryptionHelperWriteCounter;
+
+DroidianEncryptionHelperWriteCounter *droidian_encryption_helper_write_counter_new (const char * const *paths);
+void droidian_encryption_helper_write_counter_free (DroidianEncryptionHelperWriteCounter *self);
+
+/* Bytes written since the counter has been created */
+guint64 droidian_encryption_helper_write_counter_get (DroidianEncryptionHelperWriteCounter *self);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONHELPERWRITECOUNTER_H */
@@ -44,14 +44,44 @@ handle_timeout_reached (DroidianEncryptionServiceDbus *dbus)
 
   g_debug ("Idle timeout reached");
 
-  /* Safety check for CONFIGURING / CONFIGURED status (where the service must not exit) */
+  /*
+   * The CONFIGURED status is journaled and restored on the next activation.
+   * The service stays around during a configuration, while a discard pass
+   * runs and while it holds something on behalf of the helper (a sleep
+   * inhibitor, a pause for sleep or a boost), never just because logind is
+   * there.
+   */
   encryption = droidian_encryption_service_encryption_get_default ();
 
   switch (droidian_encryption_service_encryption_get_last_status (encryption))
     {
     case DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_CONFIGURING:
-    case DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_CONFIGURED:
-      g_warning ("Service will remain in background due to configuring/configured status");
+      g_warning ("Service will remain in background due to configuring status");
+      droidian_encryption_service_dbus_register_timestamp (dbus);
+      break;
+
+    case DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_ENCRYPTING:
+      if (droidian_encryption_service_encryption_is_scheduling_helper (encryption))
+        {
+          g_warning ("Service will remain in background while holding the helper scheduling");
+          droidian_encryption_service_dbus_register_timestamp (dbus);
+          break;
+        }
+
+      should_quit = TRUE;
+      g_main_context_wakeup (NULL);
+      break;
+
+    case DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_ENCRYPTED:
+      if (droidian_encryption_service_encryption_is_trimming (encryption))
+        {
+          g_warning ("Service will remain in background to discard the free space");
+          droidian_encryption_service_dbus_register_timestamp (dbus);
+          break;
+        }
+
+      should_quit = TRUE;
+      g_main_context_wakeup (NULL);
       break;
 
     default:
@@ -18,6 +18,16 @@
 
 #define G_LOG_DOMAIN "droidian-encryption-service-encryption"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
 #include <libcryptsetup.h>
 #include <libdevmapper.h>
 #include <polkit/polkit.h>
@@ -25,15 +35,56 @@
 #include "encryption.h"
 #include "config.h"
 #include "dbus.h"
-
-#define DROIDIAN_ENCRYPTION_HELPER_PIDFILE "/run/droidian-encryption-helper.pid"
+#include "helper.h"
+#include "job.h"
+#include "logind.h"
+#include "control-protocol.h"
+#include "history.h"
+#include "progress.h"
+#include "trim.h"
+
+/* Overridden by the service build the tests run */
+#ifndef DROIDIAN_ENCRYPTION_HELPER_FAILURE
 #define DROIDIAN_ENCRYPTION_HELPER_FAILURE "/run/droidian-encryption-helper-failed"
+#endif
+#ifndef DROIDIAN_ENCRYPTION_HELPER_PROGRESS
+#define DROIDIAN_ENCRYPTION_HELPER_PROGRESS "/run/droidian-encryption-helper.progress"
+#endif
+#ifndef DROIDIAN_ENCRYPTION_SUPPORTED_STAMP
 #define DROIDIAN_ENCRYPTION_SUPPORTED_STAMP "/usr/lib/droidian/device/encryption-supported"
+#endif
+/* In /run: CONFIGURED lasts until the next reboot */
+#ifndef DROIDIAN_ENCRYPTION_SERVICE_JOURNAL
+#define DROIDIAN_ENCRYPTION_SERVICE_JOURNAL "/run/droidian-encryption-service.state"
+#endif
+#define JOURNAL_SECTION "encryption"
+
+/* Smallest LUKS2 metadata area, see cryptsetup's luks2.h */
+#define LUKS2_MIN_METADATA_SIZE (16 * 1024)
+#define LUKS2_KEYSLOTS_ALIGNMENT 4096
+/* Keyslots area used when it's not configured, see set_metadata_size() */
+#define DEFAULT_KEYSLOTS_AREA_SIZE (4 * 1024 * 1024)
+
+/* Below this the passphrase KDF is too cheap to brute force */
+#define MIN_KEYSLOT_ITERATION_TIME 1000
+
+#define DM_CRYPT_MAX_SECTOR_SIZE 4096
+#define VOLUME_KEY_SIZE (512 / 8)
+#define EXT4_SUPERBLOCK_OFFSET 1024
+#define EXT4_SUPERBLOCK_LOG_BLOCK_SIZE 0x18
+#define EXT4_SUPERBLOCK_MAGIC 0x38
+#define EXT4_SUPER_MAGIC 0xEF53
+
+#define TRIM_CHUNK_SIZE (64 * 1024 * 1024)
+/* The header is rewritten on every checkpoint, don't do it for every chunk */
+#define TRIM_CHECKPOINT_CHUNKS 16
 
 enum {
   DM_CRYPT_SECTOR_SIZE = 1 << 0,
 };
 
+typedef struct _HeaderInfo HeaderInfo;
+
 struct _DroidianEncryptionServiceEncryption
 {
   DroidianEncryptionServiceDbusEncryptionSkeleton parent_instance;
@@ -41,12 +92,51 @@ struct _DroidianEncryptionServiceEncryption
   /* instance members */
   DroidianEncryptionServiceDbus *dbus;
   DroidianEncryptionServiceConfig *config;
+  DroidianEncryptionServiceHelper *helper;
+  DroidianEncryptionServiceLogind *logind;
   gboolean interface_exported;
   PolkitAuthority *authority;
   GMutex encryption_process_mutex;
   GThread *encryption_process_thread;
+  GCancellable *cancellable;
   struct crypt_device *crypt_device;
   char *passphrase;
+  DroidianEncryptionServiceJob *job;
+  GFileMonitor *progress_monitor;
+  GArray *history;
+
+  /* Status snapshot, might be read and swapped from any thread */
+  gint status;
+  GPtrArray *pending_refreshes;
+
+  /* Suspend handling */
+  gboolean sleeping;
+  gboolean paused_for_sleep;
+  gint64 sleep_requested_at;
+  gint64 woken_up_at;
+  guint sleep_resume_source_id;
+
+  /* Cached for GetDetailedStatus */
+  HeaderInfo *header_info;
+  char *failure_message;
+  double progress;
+  guint64 throughput;
+  guint64 last_progress_offset;
+  gint64 last_progress_at;
+
+  /* Progress read from the LUKS2 segments, valid while the mapping keeps this layout */
+  char *segments_layout;
+  guint64 segments_offset;
+
+  /* Progress derived by the last status probe, when the helper doesn't publish it */
+  gboolean have_derived_progress;
+  guint64 derived_offset;
+  guint64 derived_size;
+
+  /* Discard pass, once encrypted */
+  GThread *trim_thread;
+  GCancellable *trim_cancellable;
+  gint trimming;
 };
 
 static void droidian_encryption_service_dbus_encryption_interface_init (DroidianEncryptionServiceDbusEncryptionIface *iface);
@@ -106,108 +196,652 @@ out:
   return flags;
 }
 
-static gpointer
-start_encryption (DroidianEncryptionServiceEncryption *self)
+static guint64
+get_device_size (const char *path)
+{
+  struct stat st;
+  guint64 size = 0;
+  int fd;
+
+  if ((fd = open (path, O_RDONLY | O_CLOEXEC)) < 0)
+      return 0;
+
+  if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode))
+      size = st.st_size;
+  else if (ioctl (fd, BLKGETSIZE64, &size) < 0)
+      size = 0;
+
+  close (fd);
+
+  return size;
+}
+
+static int
+set_metadata_size (DroidianEncryptionServiceEncryption *self,
+                   const char                          *header_device)
+{
+  guint64 metadata_size = MAX (droidian_encryption_service_config_get_metadata_size (self->config), 0);
+  guint64 keyslots_size = MAX (droidian_encryption_service_config_get_keyslots_size (self->config), 0);
+  guint64 device_size;
+
+  /*
+   * Both copies are rewritten at every checkpoint, so keep the smallest
+   * area (12 KiB of JSON). It can't grow after the format, but the
+   * largest JSON Migrate produces (two keyslots, three segments, the
+   * reencryption keyslot, a full history and the discard token) is
+   * about 7.2 KiB.
+   */
+  if (!metadata_size)
+      metadata_size = LUKS2_MIN_METADATA_SIZE;
+
+  if (!keyslots_size)
+    {
+      device_size = get_device_size (header_device);
+      if (device_size <= 2 * metadata_size + LUKS2_KEYSLOTS_ALIGNMENT)
+        {
+          g_warning ("Unable to get the size of %s, using the default keyslots area size", header_device);
+          return crypt_set_metadata_size (self->crypt_device, metadata_size, 0);
+        }
+
+      /*
+       * The reencryption keyslot is wiped several times over when the
+       * reencryption ends, about 40 times the area size: taking the
+       * whole reserved LV costs 1.2 GiB of header writes at the end
+       * for hotzones that are larger than crash recovery wants. 4 MiB
+       * still allows 60 MiB hotzones with 512 bytes sectors.
+       */
+      keyslots_size = MIN (device_size - 2 * metadata_size, DEFAULT_KEYSLOTS_AREA_SIZE);
+      keyslots_size -= keyslots_size % LUKS2_KEYSLOTS_ALIGNMENT;
+    }
+
+  g_debug ("Using %" G_GUINT64_FORMAT " bytes of metadata and %" G_GUINT64_FORMAT " bytes of keyslots",
+           metadata_size, keyslots_size);
+
+  return crypt_set_metadata_size (self->crypt_device, metadata_size, keyslots_size);
+}
+
+static guint64
+read_block_attribute (dev_t       device,
+                      const char *attribute)
+{
+  g_autofree char *path = g_strdup_printf ("/sys/dev/block/%u:%u/%s",
+                                           major (device), minor (device), attribute);
+  g_autofree char *contents = NULL;
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+      return 0;
+
+  return g_ascii_strtoull (contents, NULL, 10);
+}
+
+static guint
+get_ext4_block_size (int fd)
+{
+  guint8 superblock[1024];
+  guint16 magic;
+  guint32 log_block_size;
+
+  if (pread (fd, superblock, sizeof (superblock), EXT4_SUPERBLOCK_OFFSET) != sizeof (superblock))
+      return 0;
+
+  memcpy (&magic, superblock + EXT4_SUPERBLOCK_MAGIC, sizeof (magic));
+  memcpy (&log_block_size, superblock + EXT4_SUPERBLOCK_LOG_BLOCK_SIZE, sizeof (log_block_size));
+
+  if (GUINT16_FROM_LE (magic) != EXT4_SUPER_MAGIC || GUINT32_FROM_LE (log_block_size) > 6)
+      return 0;
+
+  return 1024 << GUINT32_FROM_LE (log_block_size);
+}
+
+static guint32
+detect_sector_size (const char  *data_device,
+                    char       **reason)
+{
+  g_autoptr (GString) description = g_string_new (NULL);
+  struct stat st;
+  int logical = 512;
+  unsigned int physical = 512;
+  guint64 device_size = 0;
+  guint64 minimum_io, optimal_io, discard_granularity, alignment_offset;
+  guint fs_block_size;
+  guint32 sector_size;
+  int fd;
+
+  if ((fd = open (data_device, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+      *reason = g_strdup_printf ("Unable to open %s, using 512 bytes", data_device);
+      return 512;
+    }
+
+  if (fstat (fd, &st) < 0 || !S_ISBLK (st.st_mode) ||
+      ioctl (fd, BLKSSZGET, &logical) < 0 ||
+      ioctl (fd, BLKGETSIZE64, &device_size) < 0)
+    {
+      close (fd);
+      *reason = g_strdup_printf ("Unable to probe %s, using 512 bytes", data_device);
+      return 512;
+    }
+
+  if (ioctl (fd, BLKPBSZGET, &physical) < 0)
+      physical = logical;
+
+  fs_block_size = get_ext4_block_size (fd);
+  close (fd);
+
+  minimum_io = read_block_attribute (st.st_rdev, "queue/minimum_io_size");
+  optimal_io = read_block_attribute (st.st_rdev, "queue/optimal_io_size");
+  discard_granularity = read_block_attribute (st.st_rdev, "queue/discard_granularity");
+  alignment_offset = read_block_attribute (st.st_rdev, "alignment_offset");
+
+  if (fs_block_size)
+    {
+      /* The filesystem never issues I/O smaller than its block size */
+      sector_size = MIN (fs_block_size, DM_CRYPT_MAX_SECTOR_SIZE);
+      g_string_append_printf (description, "ext4 block size %u", fs_block_size);
+    }
+  else
+    {
+      /* Anything larger might break whatever is on the device */
+      sector_size = logical;
+      g_string_append (description, "no ext4 filesystem found");
+    }
+
+  /* Never go below what the device can address... */
+  sector_size = MAX (sector_size, (guint32) logical);
+
+  /* ...and cover the whole device */
+  while (sector_size > (guint32) logical && device_size % sector_size)
+      sector_size /= 2;
+
+  g_string_append_printf (description,
+                          ", logical %d, physical %u, minimum I/O %" G_GUINT64_FORMAT
+                          ", optimal I/O %" G_GUINT64_FORMAT ", discard granularity %" G_GUINT64_FORMAT,
+                          logical, physical, minimum_io, optimal_io, discard_granularity);
+
+  /* The data segment starts at offset 0, so it's aligned as much as the device is */
+  if (alignment_offset)
+    {
+      g_string_append_printf (description, "; data segment misaligned by %" G_GUINT64_FORMAT " bytes",
+                              alignment_offset);
+      g_warning ("%s is misaligned by %" G_GUINT64_FORMAT " bytes", data_device, alignment_offset);
+    }
+
+  if (sector_size < physical)
+      g_warning ("Sector size %u is smaller than the physical block size %u", sector_size, physical);
+
+  *reason = g_string_free (g_steal_pointer (&description), FALSE);
+
+  return sector_size;
+}
+
+static void
+save_journal (DroidianEncryptionServiceEncryption *self)
 {
   DroidianEncryptionServiceDbusEncryption *dbus_encryption = DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self);
-  g_autofree char* header_device = NULL;
-  g_autofree char* data_device = NULL;
-  g_autofree char* cipher = NULL;
-  g_autofree char* cipher_mode = NULL;
-  DroidianEncryptionServiceEncryptionStatus encryption_status;
-  struct crypt_params_luks2 luks2_params;
-  struct crypt_params_reencrypt params;
-  int result;
+  g_autoptr (GKeyFile) journal = g_key_file_new ();
+  g_autoptr (GError) error = NULL;
 
-  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self), NULL);
-  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_DBUS_IS_ENCRYPTION (dbus_encryption), NULL);
+  g_key_file_set_integer (journal, JOURNAL_SECTION, "status", g_atomic_int_get (&self->status));
+  g_key_file_set_uint64 (journal, JOURNAL_SECTION, "sector_size",
+                         droidian_encryption_service_dbus_encryption_get_sector_size (dbus_encryption));
+  g_key_file_set_string (journal, JOURNAL_SECTION, "sector_size_reason",
+                         droidian_encryption_service_dbus_encryption_get_sector_size_reason (dbus_encryption));
 
-  g_mutex_lock (&self->encryption_process_mutex);
+  if (!g_key_file_save_to_file (journal, DROIDIAN_ENCRYPTION_SERVICE_JOURNAL, &error))
+      g_warning ("Unable to save the state journal: %s", error->message);
+}
 
-  header_device = droidian_encryption_service_config_get_header_device (self->config);
-  data_device = droidian_encryption_service_config_get_data_device (self->config);
-  cipher = droidian_encryption_service_config_get_cipher (self->config);
-  cipher_mode = droidian_encryption_service_config_get_cipher_mode (self->config);
+static void
+load_journal (DroidianEncryptionServiceEncryption *self)
+{
+  DroidianEncryptionServiceDbusEncryption *dbus_encryption = DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self);
+  g_autoptr (GKeyFile) journal = g_key_file_new ();
+  g_autofree char *sector_size_reason = NULL;
+  gint status;
+
+  if (!g_key_file_load_from_file (journal, DROIDIAN_ENCRYPTION_SERVICE_JOURNAL, G_KEY_FILE_NONE, NULL))
+      return;
+
+  sector_size_reason = g_key_file_get_string (journal, JOURNAL_SECTION, "sector_size_reason", NULL);
+  droidian_encryption_service_dbus_encryption_set_sector_size (dbus_encryption,
+                                                               g_key_file_get_uint64 (journal, JOURNAL_SECTION,
+                                                                                      "sector_size", NULL));
+  droidian_encryption_service_dbus_encryption_set_sector_size_reason (dbus_encryption,
+                                                                      sector_size_reason ? sector_size_reason : "");
+
+  /*
+   * A configured header looks unconfigured until the next boot, that's the
+   * only status that can't be probed again. A configuration interrupted by
+   * a crash is probed as usual.
+   */
+  status = g_key_file_get_integer (journal, JOURNAL_SECTION, "status", NULL);
+  if (status == DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_CONFIGURED)
+    {
+      g_debug ("Restoring the configured status from the journal");
+      g_atomic_int_set (&self->status, status);
+      droidian_encryption_service_dbus_encryption_set_status (dbus_encryption, status);
+    }
+}
 
-  luks2_params = (struct crypt_params_luks2) {
-    .data_device = data_device,
-  };
+static gboolean
+apply_status (DroidianEncryptionServiceEncryption *self)
+{
+  gint status = g_atomic_int_get (&self->status);
 
-  params = (struct crypt_params_reencrypt) {
-    .resilience = "checksum",
-    .hash = "sha256",
-    .direction = CRYPT_REENCRYPT_FORWARD,
-    .mode = CRYPT_REENCRYPT_ENCRYPT,
-    .flags = CRYPT_REENCRYPT_INITIALIZE_ONLY,
-    .luks2 = &luks2_params,
-  };
+  droidian_encryption_service_dbus_encryption_set_status (DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self), status);
+  save_journal (self);
 
-  if (!self->crypt_device && (result = open_device (self, header_device)) < 0)
-      goto out;
+  /* The job has been failed before the status got published */
+  if (status == DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_FAILED && self->job)
+    {
+      g_free (self->failure_message);
+      self->failure_message =
+        g_strdup (droidian_encryption_service_dbus_job_get_error (DROIDIAN_ENCRYPTION_SERVICE_DBUS_JOB (self->job)));
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+publish_status (DroidianEncryptionServiceEncryption       *self,
+                DroidianEncryptionServiceEncryptionStatus  encryption_status)
+{
+  /* The snapshot is read without locks, the property follows from the main context */
+  g_atomic_int_set (&self->status, encryption_status);
+  g_main_context_invoke_full (NULL, G_PRIORITY_DEFAULT,
+                              (GSourceFunc) apply_status, g_object_ref (self),
+                              g_object_unref);
+}
+
+struct _HeaderInfo {
+  char *cipher;
+  char *cipher_mode;
+  char *pbkdf_type;
+  guint32 pbkdf_iterations;
+  guint32 pbkdf_max_memory_kb;
+  guint32 pbkdf_parallel_threads;
+};
+
+static void
+header_info_free (HeaderInfo *info)
+{
+  g_free (info->cipher);
+  g_free (info->cipher_mode);
+  g_free (info->pbkdf_type);
+  g_free (info);
+}
+
+static HeaderInfo *
+header_info_new (struct crypt_device *crypt_device)
+{
+  struct crypt_pbkdf_type pbkdf;
+  HeaderInfo *info;
+  int keyslot;
+
+  if (!crypt_get_type (crypt_device))
+      return NULL;
+
+  info = g_new0 (HeaderInfo, 1);
+  info->cipher = g_strdup (crypt_get_cipher (crypt_device));
+  info->cipher_mode = g_strdup (crypt_get_cipher_mode (crypt_device));
+
+  /* Report the KDF of the first keyslot in use */
+  for (keyslot = 0; keyslot < crypt_keyslot_max (CRYPT_LUKS2); keyslot++)
+    {
+      if (crypt_keyslot_status (crypt_device, keyslot) < CRYPT_SLOT_ACTIVE ||
+          crypt_keyslot_get_pbkdf (crypt_device, keyslot, &pbkdf) < 0)
+          continue;
+
+      info->pbkdf_type = g_strdup (pbkdf.type);
+      info->pbkdf_iterations = pbkdf.iterations;
+      info->pbkdf_max_memory_kb = pbkdf.max_memory_kb;
+      info->pbkdf_parallel_threads = pbkdf.parallel_threads;
+      break;
+    }
+
+  return info;
+}
+
+typedef struct {
+  DroidianEncryptionServiceEncryption *self;
+  HeaderInfo *info;
+} HeaderInfoUpdate;
+
+static void
+header_info_update_free (HeaderInfoUpdate *update)
+{
+  g_object_unref (update->self);
+  g_clear_pointer (&update->info, header_info_free);
+  g_free (update);
+}
+
+static gboolean
+apply_header_info (HeaderInfoUpdate *update)
+{
+  g_clear_pointer (&update->self->header_info, header_info_free);
+  update->self->header_info = g_steal_pointer (&update->info);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+publish_header_info (DroidianEncryptionServiceEncryption *self,
+                     HeaderInfo                          *info)
+{
+  HeaderInfoUpdate *update;
+
+  if (!info)
+      return;
+
+  update = g_new0 (HeaderInfoUpdate, 1);
+  update->self = g_object_ref (self);
+  update->info = info;
+
+  /* Cached for GetDetailedStatus, which is served from the main context */
+  g_main_context_invoke_full (NULL, G_PRIORITY_DEFAULT,
+                              (GSourceFunc) apply_header_info, update,
+                              (GDestroyNotify) header_info_update_free);
+}
+
+typedef struct {
+  DroidianEncryptionServiceEncryption *self;
+  char *header_device;
+  char *data_device;
+  char *cipher;
+  char *cipher_mode;
+  char *sector_size_reason;
+  struct crypt_params_luks2 luks2_params;
+  struct crypt_params_reencrypt params;
+  char volume_key[VOLUME_KEY_SIZE];
+  int keyslot;
+  gboolean formatted;
+} ConfigureContext;
+
+typedef int (*ConfigureStageFunc) (ConfigureContext *context);
+
+static int
+configure_probe (ConfigureContext *context)
+{
+  DroidianEncryptionServiceEncryption *self = context->self;
+  DroidianEncryptionServiceDbusEncryption *dbus_encryption = DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self);
+  gint sector_size;
+  int result;
+
+  if (!self->crypt_device && (result = open_device (self, context->header_device)) < 0)
+      return result;
 
   /* Set offset */
   if ((result = crypt_set_data_offset (self->crypt_device, 0)) < 0)
-      goto out;
+      return result;
+
+  /* Fit the header to the reserved LV */
+  if ((result = set_metadata_size (self, context->header_device)) < 0)
+      return result;
 
   /* Set sector_size, ensure we keep supporting older kernels */
   if (droidian_encryption_service_config_get_sector_size_force (self->config) ||
       get_supported_features () & DM_CRYPT_SECTOR_SIZE)
     {
-      /* Use the user specified sector_size (default is 4096) */
-      luks2_params.sector_size = droidian_encryption_service_config_get_sector_size (self->config);
+      sector_size = droidian_encryption_service_config_get_sector_size (self->config);
+
+      if (sector_size > 0)
+        {
+          /* Use the user specified sector_size */
+          context->luks2_params.sector_size = sector_size;
+          context->sector_size_reason = g_strdup ("Set in the configuration file");
+        }
+      else
+        {
+          /* Pick the largest one the data device topology allows */
+          context->luks2_params.sector_size = detect_sector_size (context->data_device,
+                                                                  &context->sector_size_reason);
+        }
     }
   else
     {
       /* Unable to get flags, or sector_size not supported */
       g_warning ("Sector size is not supported by the running kernel, fallbacking to 512");
-      luks2_params.sector_size = 512;
+      context->luks2_params.sector_size = 512;
+      context->sector_size_reason = g_strdup ("Not supported by the running kernel");
     }
 
+  g_debug ("Using sector size %u: %s", context->luks2_params.sector_size, context->sector_size_reason);
+  droidian_encryption_service_dbus_encryption_set_sector_size (dbus_encryption, context->luks2_params.sector_size);
+  droidian_encryption_service_dbus_encryption_set_sector_size_reason (dbus_encryption, context->sector_size_reason);
 
-  /* Format header */
-  if ((result = crypt_format (self->crypt_device, CRYPT_LUKS2, cipher,
-                             cipher_mode, NULL, NULL, 512 / 8, &luks2_params)) < 0)
-      goto out;
+  return 0;
+}
+
+static int
+configure_format (ConfigureContext *context)
+{
+  int result;
+
+  /* Generate the volume key here, so that it can be reused for reencrypt-init */
+  if (getrandom (context->volume_key, sizeof (context->volume_key), 0) != sizeof (context->volume_key))
+      return -errno;
+
+  if ((result = crypt_format (context->self->crypt_device, CRYPT_LUKS2, context->cipher,
+                              context->cipher_mode, NULL, context->volume_key,
+                              sizeof (context->volume_key), &context->luks2_params)) < 0)
+      return result;
+
+  context->formatted = TRUE;
+
+  return 0;
+}
+
+static int
+configure_flags (ConfigureContext *context)
+{
+  int result;
 
   /* Set persistent activation flags */
-  if ((result = crypt_persistent_flags_set (self->crypt_device, CRYPT_FLAGS_ACTIVATION,
+  if ((result = crypt_persistent_flags_set (context->self->crypt_device, CRYPT_FLAGS_ACTIVATION,
                                             CRYPT_ACTIVATE_ALLOW_DISCARDS)) < 0)
       /* Not fatal */
       g_printerr ("Unable to set ALLOW_DISCARDS activation flag: %s\n", g_strerror (-result));
 
-  /* Create volume key */
-  if ((result = crypt_keyslot_add_by_volume_key (self->crypt_device, CRYPT_ANY_SLOT, NULL,
-                                                0, self->passphrase, strlen (self->passphrase))) < 0)
-      goto out;
+  return 0;
+}
 
-  if ((result = crypt_reencrypt_init_by_passphrase (self->crypt_device, NULL,
-                                                   self->passphrase, strlen (self->passphrase),
-                                                   CRYPT_ANY_SLOT, 0,
-                                                   cipher, cipher_mode,
-                                                   &params)) < 0)
-      goto out;
+static int
+set_keyslot_pbkdf (DroidianEncryptionServiceEncryption *self)
+{
+  struct crypt_pbkdf_type pbkdf;
+  const struct crypt_pbkdf_type *pbkdf_default;
+  int iteration_time = droidian_encryption_service_config_get_keyslot_iteration_time (self->config);
 
-  g_debug ("Encryption finished");
+  if (!(pbkdf_default = crypt_get_pbkdf_default (CRYPT_LUKS2)))
+      return -EINVAL;
 
-out:
-  if (result < 0)
+  /* Bound the time spent in crypt_keyslot_add_*(), which can't be cancelled */
+  pbkdf = *pbkdf_default;
+  if (iteration_time >= MIN_KEYSLOT_ITERATION_TIME)
+      pbkdf.time_ms = iteration_time;
+  else
+      g_warning ("keyslot_iteration_time %d is below %d ms, using the libcryptsetup default of %u ms",
+                 iteration_time, MIN_KEYSLOT_ITERATION_TIME, pbkdf.time_ms);
+
+  return crypt_set_pbkdf_type (self->crypt_device, &pbkdf);
+}
+
+static int
+configure_keyslot (ConfigureContext *context)
+{
+  DroidianEncryptionServiceEncryption *self = context->self;
+  int result;
+
+  if ((result = set_keyslot_pbkdf (self)) < 0)
+      return result;
+
+  /* The only KDF run we can't avoid */
+  context->keyslot = crypt_keyslot_add_by_volume_key (self->crypt_device, CRYPT_ANY_SLOT,
+                                                      context->volume_key, sizeof (context->volume_key),
+                                                      self->passphrase, strlen (self->passphrase));
+
+  return MIN (context->keyslot, 0);
+}
+
+static int
+configure_reencrypt_init (ConfigureContext *context)
+{
+  DroidianEncryptionServiceEncryption *self = context->self;
+  int result;
+
+#ifdef HAVE_CRYPT_REENCRYPT_INIT_BY_KEYSLOT_CONTEXT
+  struct crypt_keyslot_context *keyslot_context = NULL;
+
+  /* Unlock with the volume key we already have rather than deriving it again */
+  if ((result = crypt_keyslot_context_init_by_volume_key (self->crypt_device, context->volume_key,
+                                                          sizeof (context->volume_key),
+                                                          &keyslot_context)) < 0)
+      return result;
+
+  result = crypt_reencrypt_init_by_keyslot_context (self->crypt_device, NULL,
+                                                    NULL, keyslot_context,
+                                                    CRYPT_ANY_SLOT, context->keyslot,
+                                                    context->cipher, context->cipher_mode,
+                                                    &context->params);
+  crypt_keyslot_context_free (keyslot_context);
+#else
+  result = crypt_reencrypt_init_by_passphrase (self->crypt_device, NULL,
+                                               self->passphrase, strlen (self->passphrase),
+                                               CRYPT_ANY_SLOT, context->keyslot,
+                                               context->cipher, context->cipher_mode,
+                                               &context->params);
+#endif
+
+  return MIN (result, 0);
+}
+
+static const struct {
+  const char *name;
+  double progress;
+  ConfigureStageFunc func;
+} configure_stages[] = {
+  { "probe", 0.0, configure_probe },
+  { "format", 0.1, configure_format },
+  { "flags", 0.15, configure_flags },
+  { "keyslot", 0.2, configure_keyslot },
+  { "reencrypt-init", 0.6, configure_reencrypt_init },
+};
+
+static void
+wipe_header (ConfigureContext *context)
+{
+  struct crypt_device *crypt_device = context->self->crypt_device;
+  uint64_t metadata_size, keyslots_size;
+  int result;
+
+  /* Invalidate both header copies, the device is then unconfigured again */
+  if ((result = crypt_get_metadata_size (crypt_device, &metadata_size, &keyslots_size)) < 0 ||
+      (result = crypt_wipe (crypt_device, context->header_device, CRYPT_WIPE_ZERO,
+                            0, 2 * metadata_size, 0, 0, NULL, NULL)) < 0)
+      g_warning ("Unable to wipe the LUKS2 header: %s", g_strerror (-result));
+}
+
+static gpointer
+start_encryption (DroidianEncryptionServiceEncryption *self)
+{
+  DroidianEncryptionServiceEncryptionStatus encryption_status;
+  g_autofree char *message = NULL;
+  ConfigureContext context;
+  gint64 started_at;
+  gboolean cancelled = FALSE;
+  guint stage;
+  int result = 0;
+
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self), NULL);
+
+  g_mutex_lock (&self->encryption_process_mutex);
+
+  context = (ConfigureContext) {
+    .self = self,
+    .header_device = droidian_encryption_service_config_get_header_device (self->config),
+    .data_device = droidian_encryption_service_config_get_data_device (self->config),
+    .cipher = droidian_encryption_service_config_get_cipher (self->config),
+    .cipher_mode = droidian_encryption_service_config_get_cipher_mode (self->config),
+    .keyslot = CRYPT_ANY_SLOT,
+  };
+
+  context.luks2_params = (struct crypt_params_luks2) {
+    .data_device = context.data_device,
+  };
+
+  context.params = (struct crypt_params_reencrypt) {
+    .resilience = "checksum",
+    .hash = "sha256",
+    .direction = CRYPT_REENCRYPT_FORWARD,
+    .mode = CRYPT_REENCRYPT_ENCRYPT,
+    .flags = CRYPT_REENCRYPT_INITIALIZE_ONLY,
+    .luks2 = &context.luks2_params,
+  };
+
+  for (stage = 0; stage < G_N_ELEMENTS (configure_stages); stage++)
+    {
+      if (g_cancellable_is_cancelled (self->cancellable))
+        {
+          cancelled = TRUE;
+          break;
+        }
+
+      droidian_encryption_service_job_set_stage (self->job, configure_stages[stage].name,
+                                                 configure_stages[stage].progress);
+
+      started_at = g_get_monotonic_time ();
+      result = configure_stages[stage].func (&context);
+      droidian_encryption_service_job_add_stage_timing (self->job, configure_stages[stage].name,
+                                                        g_get_monotonic_time () - started_at);
+
+      if (result < 0)
+          break;
+    }
+
+  /* A Cancel received while the last stage ran: nothing has touched the data yet */
+  if (!cancelled && result >= 0 && g_cancellable_is_cancelled (self->cancellable))
+      cancelled = TRUE;
+
+  if (cancelled)
+    {
+      g_debug ("Encryption cancelled");
+
+      if (context.formatted)
+          wipe_header (&context);
+
+      encryption_status = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_UNCONFIGURED;
+      droidian_encryption_service_job_fail (self->job, "Encryption cancelled");
+    }
+  else if (result < 0)
     {
-      g_warning ("Unable to start encryption: %s", g_strerror (-result));
+      message = g_strdup_printf ("Unable to start encryption: %s", g_strerror (-result));
+
+      g_warning ("%s", message);
       encryption_status = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_FAILED;
+      droidian_encryption_service_job_fail (self->job, message);
     }
   else
     {
+      g_debug ("Encryption finished");
       encryption_status = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_CONFIGURED;
+      publish_header_info (self, header_info_new (self->crypt_device));
+      droidian_encryption_service_job_complete (self->job);
     }
 
-  droidian_encryption_service_dbus_encryption_set_status (dbus_encryption,
-                                                          (int) encryption_status);
+  publish_status (self, encryption_status);
 
   if (self->crypt_device) {
       crypt_free (self->crypt_device);
       self->crypt_device = NULL;
   }
 
+  explicit_bzero (context.volume_key, sizeof (context.volume_key));
+  g_free (context.header_device);
+  g_free (context.data_device);
+  g_free (context.cipher);
+  g_free (context.cipher_mode);
+  g_free (context.sector_size_reason);
+
   g_free (self->passphrase);
   self->passphrase = NULL;
   g_mutex_unlock (&self->encryption_process_mutex);
@@ -215,61 +849,1070 @@ out:
   return NULL;
 }
 
-static gboolean
-handle_start (DroidianEncryptionServiceDbusEncryption *dbus_encryption,
-              GDBusMethodInvocation                   *invocation,
-              const char                              *passphrase)
+typedef struct {
+  DroidianEncryptionServiceEncryption *self;
+  char *cipher;
+  char *cipher_mode;
+  guint32 sector_size;
+} MigrationRequest;
+
+static void
+migration_request_free (MigrationRequest *request)
 {
-  DroidianEncryptionServiceEncryption *self = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION (dbus_encryption);
+  g_free (request->cipher);
+  g_free (request->cipher_mode);
+  g_free (request);
+}
+
+static gpointer
+start_migration (MigrationRequest *request)
+{
+  DroidianEncryptionServiceEncryption *self = request->self;
+  DroidianEncryptionServiceDbusEncryption *dbus_encryption = DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self);
+  g_autofree char* header_device = NULL;
+  g_autofree char* mapped_name = NULL;
+  g_autofree char* mapped_device = NULL;
+  g_autofree char* sector_size_reason = NULL;
+  g_autofree char* message = NULL;
+  const char *cipher;
+  const char *cipher_mode;
   DroidianEncryptionServiceEncryptionStatus encryption_status;
+  struct crypt_params_luks2 luks2_params = { 0 };
+  struct crypt_params_reencrypt params;
+  size_t volume_key_size;
+  int keyslot = -1;
+  int result;
+
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self), NULL);
+
+  g_mutex_lock (&self->encryption_process_mutex);
+
+  droidian_encryption_service_job_set_stage (self->job, "probe", 0.0);
+
+  header_device = droidian_encryption_service_config_get_header_device (self->config);
+  mapped_name = droidian_encryption_service_config_get_mapped_name (self->config);
+  mapped_device = g_build_filename (crypt_get_dir (), mapped_name, NULL);
+
+  if (self->crypt_device)
+    {
+      /* Reload the header, it might be stale */
+      crypt_free (self->crypt_device);
+      self->crypt_device = NULL;
+    }
+
+  if ((result = open_device (self, header_device)) < 0 ||
+      (result = crypt_load (self->crypt_device, CRYPT_LUKS2, NULL)) < 0)
+    {
+      message = g_strdup_printf ("Unable to load header: %s", g_strerror (-result));
+      goto out;
+    }
+
+  /* Empty values keep the current settings */
+  cipher = *request->cipher ? request->cipher : crypt_get_cipher (self->crypt_device);
+  cipher_mode = *request->cipher_mode ? request->cipher_mode : crypt_get_cipher_mode (self->crypt_device);
+
+  if (request->sector_size)
+    {
+      luks2_params.sector_size = request->sector_size;
+      sector_size_reason = g_strdup ("Requested by the caller");
+    }
+  else if (get_supported_features () & DM_CRYPT_SECTOR_SIZE)
+    {
+      /* The filesystem is visible through the active mapping only */
+      luks2_params.sector_size = detect_sector_size (mapped_device, &sector_size_reason);
+    }
+  else
+    {
+      luks2_params.sector_size = crypt_get_sector_size (self->crypt_device);
+      sector_size_reason = g_strdup ("Not supported by the running kernel, unchanged");
+    }
+
+  if (g_strcmp0 (cipher, crypt_get_cipher (self->crypt_device)) == 0 &&
+      g_strcmp0 (cipher_mode, crypt_get_cipher_mode (self->crypt_device)) == 0 &&
+      luks2_params.sector_size == (guint32) crypt_get_sector_size (self->crypt_device))
+    {
+      result = -EINVAL;
+      message = g_strdup_printf ("Already using %s-%s with %u bytes sectors, nothing to migrate",
+                                 cipher, cipher_mode, luks2_params.sector_size);
+      goto out;
+    }
+
+  /* libcryptsetup can't tell the key size a cipher needs, keep the current one unless configured */
+  volume_key_size = MAX (droidian_encryption_service_config_get_migration_key_size (self->config), 0) / 8;
+  if (!volume_key_size)
+      volume_key_size = (size_t) crypt_get_volume_key_size (self->crypt_device);
+
+  g_debug ("Migrating to %s-%s, %u bytes sectors: %s",
+           cipher, cipher_mode, luks2_params.sector_size, sector_size_reason);
+
+  /* New volume key, not bound to any segment until the reencryption starts */
+  droidian_encryption_service_job_set_stage (self->job, "keyslot", 0.2);
+  if ((result = set_keyslot_pbkdf (self)) < 0)
+    {
+      message = g_strdup_printf ("Unable to set the keyslot KDF: %s", g_strerror (-result));
+      goto out;
+    }
+
+  if ((result = crypt_keyslot_add_by_key (self->crypt_device, CRYPT_ANY_SLOT, NULL, volume_key_size,
+                                          self->passphrase, strlen (self->passphrase),
+                                          CRYPT_VOLUME_KEY_NO_SEGMENT)) < 0)
+    {
+      message = g_strdup_printf ("Unable to add the new keyslot: %s", g_strerror (-result));
+      goto out;
+    }
+
+  keyslot = result;
+
+  params = (struct crypt_params_reencrypt) {
+    .resilience = "checksum",
+    .hash = "sha256",
+    .direction = CRYPT_REENCRYPT_FORWARD,
+    .mode = CRYPT_REENCRYPT_REENCRYPT,
+    .flags = CRYPT_REENCRYPT_INITIALIZE_ONLY,
+    .luks2 = &luks2_params,
+  };
+
+  /* The helper resumes the reencryption on the next boot */
+  droidian_encryption_service_job_set_stage (self->job, "reencrypt-init", 0.6);
+  if ((result = crypt_reencrypt_init_by_passphrase (self->crypt_device, NULL,
+                                                   self->passphrase, strlen (self->passphrase),
+                                                   CRYPT_ANY_SLOT, keyslot,
+                                                   cipher, cipher_mode,
+                                                   &params)) < 0)
+    {
+      message = g_strdup_printf ("Unable to initialize reencryption: %s", g_strerror (-result));
+      goto out;
+    }
+
+  droidian_encryption_service_dbus_encryption_set_sector_size (dbus_encryption, luks2_params.sector_size);
+  droidian_encryption_service_dbus_encryption_set_sector_size_reason (dbus_encryption, sector_size_reason);
+
+  /* Every block is going to be written again, so is the free space to be discarded */
+  if (droidian_encryption_service_trim_reset_state (self->crypt_device) < 0)
+      g_warning ("Unable to reset the discard pass state");
+
+  g_debug ("Migration configured");
+
+out:
+  if (result < 0)
+    {
+      g_warning ("Unable to start migration: %s", message);
+
+      /* Don't leave an unused keyslot behind */
+      if (keyslot >= 0 && crypt_keyslot_destroy (self->crypt_device, keyslot) < 0)
+          g_warning ("Unable to remove keyslot %d", keyslot);
+
+      /* The device is still encrypted with the old settings */
+      encryption_status = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_ENCRYPTED;
+      droidian_encryption_service_job_fail (self->job, message);
+    }
+  else
+    {
+      encryption_status = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_CONFIGURED;
+      publish_header_info (self, header_info_new (self->crypt_device));
+      droidian_encryption_service_job_complete (self->job);
+    }
+
+  publish_status (self, encryption_status);
+
+  if (self->crypt_device) {
+      crypt_free (self->crypt_device);
+      self->crypt_device = NULL;
+  }
+
+  g_free (self->passphrase);
+  self->passphrase = NULL;
+  g_mutex_unlock (&self->encryption_process_mutex);
+
+  migration_request_free (request);
+
+  return NULL;
+}
+
+static void
+set_job (DroidianEncryptionServiceEncryption *self,
+         DroidianEncryptionServiceJob        *job)
+{
+  DroidianEncryptionServiceDbusEncryption *dbus_encryption = DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self);
+
+  g_set_object (&self->job, job);
+
+  droidian_encryption_service_dbus_encryption_set_job (dbus_encryption,
+                                                       job ? droidian_encryption_service_job_get_object_path (job) : "/");
+}
+
+static gboolean
+has_running_job (DroidianEncryptionServiceEncryption *self)
+{
+  return self->job &&
+    droidian_encryption_service_dbus_job_get_state (DROIDIAN_ENCRYPTION_SERVICE_DBUS_JOB (self->job)) ==
+      DROIDIAN_ENCRYPTION_SERVICE_JOB_STATE_RUNNING;
+}
+
+static GArray *
+load_history (DroidianEncryptionServiceEncryption *self,
+              GError                             **error)
+{
+  g_autofree char *header_name = droidian_encryption_service_config_get_header_device (self->config);
+  struct crypt_device *crypt_device = NULL;
+  GArray *history = NULL;
+  int result;
+
+  /* Use a private context, the encryption thread might own self->crypt_device */
+  if ((result = crypt_init (&crypt_device, header_name)) < 0 ||
+      (result = crypt_load (crypt_device, CRYPT_LUKS2, NULL)) < 0)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (-result),
+                   "Unable to load the LUKS2 header: %s", g_strerror (-result));
+      goto out;
+    }
+
+  history = droidian_encryption_history_load (crypt_device);
+
+out:
+  if (crypt_device)
+      crypt_free (crypt_device);
+
+  return history;
+}
+
+static void
+load_history_thread (GTask                               *task,
+                     DroidianEncryptionServiceEncryption *self,
+                     gpointer                             task_data,
+                     GCancellable                        *cancellable)
+{
+  GError *error = NULL;
+  GArray *history;
+
+  if ((history = load_history (self, &error)))
+      g_task_return_pointer (task, history, (GDestroyNotify) g_array_unref);
+  else
+      g_task_return_error (task, error);
+}
+
+/* The header device might be slow, never read it on the main loop */
+static void
+load_history_async (DroidianEncryptionServiceEncryption *self,
+                    GAsyncReadyCallback                  callback,
+                    gpointer                             user_data)
+{
+  g_autoptr (GTask) task = NULL;
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, load_history_async);
+  g_task_run_in_thread (task, (GTaskThreadFunc) load_history_thread);
+}
+
+static GArray *
+load_history_finish (DroidianEncryptionServiceEncryption *self,
+                     GAsyncResult                        *result,
+                     GError                             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static gboolean
+read_helper_progress (DroidianEncryptionServiceEncryption *self,
+                      guint64                             *offset,
+                      guint64                             *size)
+{
+  g_autofree char *contents = NULL;
+
+  /* A crashed helper leaves its last position behind */
+  if (!g_file_get_contents (DROIDIAN_ENCRYPTION_HELPER_PROGRESS, &contents, NULL, NULL) ||
+      !droidian_encryption_service_helper_is_running (self->helper))
+      return FALSE;
+
+  /* The helper writes "<offset> <size>" once per hotzone */
+  return sscanf (contents, "%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT, offset, size) == 2;
+}
+
+static gboolean
+derive_progress (DroidianEncryptionServiceEncryption *self,
+                 guint64                             *offset,
+                 guint64                             *size)
+{
+  /* The table and the header are read by the status probe, off the main loop */
+  if (!self->have_derived_progress)
+      return FALSE;
+
+  *offset = self->derived_offset;
+  *size = self->derived_size;
+  return TRUE;
+}
+
+static void
+refresh_helper_progress (DroidianEncryptionServiceEncryption *self)
+{
+  guint64 offset, size, sample, eta;
+  gint64 now;
+
+  if (!has_running_job (self))
+      return;
+
+  /* Nothing published by an older or crashed helper, or not yet */
+  if ((read_helper_progress (self, &offset, &size) ||
+       derive_progress (self, &offset, &size)) && size > 0)
+    {
+      now = g_get_monotonic_time ();
+
+      /* Smooth the throughput over the last few hotzones */
+      if (self->last_progress_at && now > self->last_progress_at && offset > self->last_progress_offset)
+        {
+          sample = (offset - self->last_progress_offset) * G_USEC_PER_SEC / (now - self->last_progress_at);
+          self->throughput = self->throughput ? (3 * self->throughput + sample) / 4 : sample;
+        }
+
+      self->last_progress_offset = offset;
+      self->last_progress_at = now;
+      self->progress = (double) offset / size;
+
+      eta = droidian_encryption_service_progress_estimate_remaining_time (self->history,
+                                                                          size - MIN (offset, size));
+
+      droidian_encryption_service_job_set_progress (self->job, self->progress);
+      droidian_encryption_service_dbus_encryption_set_eta (DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self), eta);
+    }
+}
+
+static void
+on_helper_progress_changed (DroidianEncryptionServiceEncryption *self,
+                            GFile                               *file,
+                            GFile                               *other_file,
+                            GFileMonitorEvent                    event_type,
+                            GFileMonitor                        *monitor)
+{
+  g_return_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self));
+
+  if (event_type == G_FILE_MONITOR_EVENT_CHANGED ||
+      event_type == G_FILE_MONITOR_EVENT_CREATED)
+      refresh_helper_progress (self);
+}
+
+static void
+on_helper_status_done (DroidianEncryptionServiceHelper     *helper,
+                       GAsyncResult                        *result,
+                       DroidianEncryptionServiceEncryption *self)
+{
+  DroidianEncryptionServiceDbusEncryption *dbus_encryption = DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self);
+  g_autoptr (GHashTable) values = NULL;
+  g_autofree char *reply = NULL;
+  const char *value;
+
+  if ((reply = droidian_encryption_service_helper_request_finish (helper, result, NULL)))
+    {
+      values = droidian_encryption_service_helper_parse_reply (reply);
+
+      if ((value = g_hash_table_lookup (values, "paused")))
+          droidian_encryption_service_dbus_encryption_set_paused (dbus_encryption,
+                                                                  g_ascii_strtoull (value, NULL, 10) != 0);
+
+      if ((value = g_hash_table_lookup (values, "rate_limit")))
+          droidian_encryption_service_dbus_encryption_set_rate_limit (dbus_encryption,
+                                                                      g_ascii_strtoull (value, NULL, 10));
+
+      if ((value = g_hash_table_lookup (values, "mode")))
+          droidian_encryption_service_dbus_encryption_set_scheduling_mode (dbus_encryption, value);
+    }
+
+  g_object_unref (self);
+}
+
+static void
+on_helper_mode_done (DroidianEncryptionServiceHelper     *helper,
+                     GAsyncResult                        *result,
+                     DroidianEncryptionServiceEncryption *self)
+{
+  DroidianEncryptionServiceDbusEncryption *dbus_encryption = DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self);
+  g_autoptr (GHashTable) values = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autofree char *reply = NULL;
+  const char *value;
+
+  if (!(reply = droidian_encryption_service_helper_request_finish (helper, result, &error)))
+    {
+      g_warning ("Unable to switch the helper scheduling mode: %s", error->message);
+    }
+  else
+    {
+      values = droidian_encryption_service_helper_parse_reply (reply);
+
+      if ((value = g_hash_table_lookup (values, "mode")))
+          droidian_encryption_service_dbus_encryption_set_scheduling_mode (dbus_encryption, value);
+    }
+
+  g_object_unref (self);
+}
+
+static void
+send_scheduling_mode (DroidianEncryptionServiceEncryption *self)
+{
+  g_autofree char *request = NULL;
+  const char *mode;
+
+  if (!self->logind ||
+      !droidian_encryption_service_config_get_opportunistic_scheduling (self->config) ||
+      g_atomic_int_get (&self->status) != DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_ENCRYPTING)
+      return;
+
+  /* Full speed while nobody is looking, stay out of the way otherwise */
+  mode = droidian_encryption_service_logind_get_idle (self->logind) ?
+    DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE_BOOST :
+    DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE_BACKGROUND;
+
+  request = g_strdup_printf (DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE " %s", mode);
+  droidian_encryption_service_helper_request_async (self->helper, request, NULL,
+                                                    (GAsyncReadyCallback) on_helper_mode_done,
+                                                    g_object_ref (self));
+}
+
+static void
+on_logind_idle_changed (DroidianEncryptionServiceEncryption *self,
+                        GParamSpec                          *pspec,
+                        DroidianEncryptionServiceLogind     *logind)
+{
+  g_return_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self));
+
+  send_scheduling_mode (self);
+}
+
+static void
+update_sleep_inhibitor (DroidianEncryptionServiceEncryption *self)
+{
+  if (!self->logind)
+      return;
+
+  /* Only worth delaying suspend while the helper is reencrypting */
+  droidian_encryption_service_logind_inhibit_sleep (self->logind,
+                                                    droidian_encryption_service_config_get_pause_on_sleep (self->config) &&
+                                                    g_atomic_int_get (&self->status) == DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_ENCRYPTING);
+}
+
+static void
+on_helper_sleep_resume_done (DroidianEncryptionServiceHelper     *helper,
+                             GAsyncResult                        *result,
+                             DroidianEncryptionServiceEncryption *self)
+{
+  g_autoptr (GError) error = NULL;
+  g_autofree char *reply = NULL;
+
+  if (!(reply = droidian_encryption_service_helper_request_finish (helper, result, &error)))
+    {
+      g_warning ("Unable to resume the helper after sleep: %s", error->message);
+    }
+  else
+    {
+      g_debug ("Helper resumed %" G_GINT64_FORMAT " ms after wake up",
+               (g_get_monotonic_time () - self->woken_up_at) / 1000);
+      droidian_encryption_service_dbus_encryption_set_paused (DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self), FALSE);
+    }
+
+  g_object_unref (self);
+}
+
+static gboolean
+on_sleep_resume_timeout (DroidianEncryptionServiceEncryption *self)
+{
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self), G_SOURCE_REMOVE);
+
+  self->sleep_resume_source_id = 0;
+  self->paused_for_sleep = FALSE;
+
+  droidian_encryption_service_helper_request_async (self->helper,
+                                                    DROIDIAN_ENCRYPTION_HELPER_CONTROL_RESUME,
+                                                    NULL,
+                                                    (GAsyncReadyCallback) on_helper_sleep_resume_done,
+                                                    g_object_ref (self));
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+schedule_sleep_resume (DroidianEncryptionServiceEncryption *self)
+{
+  gint delay = MAX (droidian_encryption_service_config_get_sleep_resume_delay (self->config), 0);
+
+  /* Leave the resume path alone for a while */
+  g_clear_handle_id (&self->sleep_resume_source_id, g_source_remove);
+  self->sleep_resume_source_id = g_timeout_add_seconds (delay, G_SOURCE_FUNC (on_sleep_resume_timeout), self);
+}
+
+static void
+on_helper_sleep_pause_done (DroidianEncryptionServiceHelper     *helper,
+                            GAsyncResult                        *result,
+                            DroidianEncryptionServiceEncryption *self)
+{
+  g_autoptr (GError) error = NULL;
+  g_autofree char *reply = NULL;
+
+  if (!(reply = droidian_encryption_service_helper_request_finish (helper, result, &error)))
+    {
+      g_warning ("Unable to pause the helper before sleep: %s", error->message);
+    }
+  else
+    {
+      g_debug ("Sleep delayed by %" G_GINT64_FORMAT " ms to pause the helper",
+               (g_get_monotonic_time () - self->sleep_requested_at) / 1000);
+      droidian_encryption_service_dbus_encryption_set_paused (DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self), TRUE);
+      self->paused_for_sleep = TRUE;
+
+      /* Woken up while waiting for the hotzone to complete */
+      if (!self->sleeping)
+          schedule_sleep_resume (self);
+    }
+
+  /* The hotzone is complete, the system can go to sleep */
+  if (self->sleeping && self->logind)
+      droidian_encryption_service_logind_inhibit_sleep (self->logind, FALSE);
+
+  g_object_unref (self);
+}
+
+static void
+on_logind_prepare_for_sleep (DroidianEncryptionServiceEncryption *self,
+                             gboolean                             start,
+                             DroidianEncryptionServiceLogind     *logind)
+{
+  DroidianEncryptionServiceDbusEncryption *dbus_encryption = DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self);
+
+  g_return_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self));
+
+  self->sleeping = start;
+
+  if (g_atomic_int_get (&self->status) != DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_ENCRYPTING)
+      return;
+
+  if (start)
+    {
+      g_clear_handle_id (&self->sleep_resume_source_id, g_source_remove);
+
+      if (droidian_encryption_service_dbus_encryption_get_paused (dbus_encryption))
+        {
+          /* Already paused, by the user or by a previous sleep */
+          droidian_encryption_service_logind_inhibit_sleep (logind, FALSE);
+          return;
+        }
+
+      /*
+       * The PAUSE reply comes once the current hotzone is complete. logind
+       * won't wait for longer than its InhibitDelayMaxSec anyway.
+       */
+      self->sleep_requested_at = g_get_monotonic_time ();
+      droidian_encryption_service_helper_request_async (self->helper,
+                                                        DROIDIAN_ENCRYPTION_HELPER_CONTROL_PAUSE,
+                                                        NULL,
+                                                        (GAsyncReadyCallback) on_helper_sleep_pause_done,
+                                                        g_object_ref (self));
+    }
+  else
+    {
+      self->woken_up_at = g_get_monotonic_time ();
+      update_sleep_inhibitor (self);
+
+      if (self->paused_for_sleep)
+          schedule_sleep_resume (self);
+    }
+}
+
+typedef struct {
+  DroidianEncryptionServiceEncryption *self;
+  DroidianEncryptionServiceJob *job;
+  struct crypt_device *crypt_device;
+  DroidianEncryptionServiceTrimState state;
+  guint64 size;
+  int root_fd;
+} TrimRequest;
+
+static void
+trim_request_free (TrimRequest *request)
+{
+  g_clear_object (&request->job);
+
+  if (request->crypt_device)
+      crypt_free (request->crypt_device);
+
+  if (request->root_fd > -1)
+      close (request->root_fd);
+
+  g_free (request);
+}
+
+static void
+save_trim_state (TrimRequest *request)
+{
+  int result;
+
+  if ((result = droidian_encryption_service_trim_save_state (request->crypt_device, &request->state)) < 0)
+      /* Not fatal, the pass would start over from the previous checkpoint */
+      g_warning ("Unable to save the discard pass state: %s", g_strerror (-result));
+}
+
+static gpointer
+run_trim (TrimRequest *request)
+{
+  DroidianEncryptionServiceEncryption *self = request->self;
+  guint64 rate_limit = MAX (droidian_encryption_service_config_get_trim_rate_limit (self->config), 0);
+  guint64 start_offset = request->state.offset;
+  gint64 started_at = g_get_monotonic_time ();
+  g_autofree char *message = NULL;
+  guint64 discarded = 0;
+  guint64 trimmed;
+  guint64 length;
+  guint chunks = 0;
+  gint64 delay;
+  GPollFD cancel_fd;
+  gboolean can_wait;
+  int result = 0;
+
+  can_wait = g_cancellable_make_pollfd (self->trim_cancellable, &cancel_fd);
+
+  while (request->state.offset < request->size && !g_cancellable_is_cancelled (self->trim_cancellable))
+    {
+      length = MIN (TRIM_CHUNK_SIZE, request->size - request->state.offset);
+
+      result = droidian_encryption_service_trim_range (request->root_fd, request->state.offset, length, &trimmed);
+      if (result == -EINVAL && request->state.offset > 0)
+        {
+          /* Past the end of the filesystem, which might be slightly smaller than the device */
+          request->state.offset = request->size;
+          result = 0;
+          break;
+        }
+      else if (result < 0)
+        {
+          break;
+        }
+
+      request->state.offset += length;
+      discarded += trimmed;
+      droidian_encryption_service_job_set_progress (request->job, (double) request->state.offset / request->size);
+
+      if (++chunks % TRIM_CHECKPOINT_CHUNKS == 0)
+          save_trim_state (request);
+
+      if (!rate_limit)
+          continue;
+
+      /* Discards are cheap per byte, but they can stall the flash controller for the foreground */
+      delay = started_at + (gint64) ((request->state.offset - start_offset) * G_USEC_PER_SEC / rate_limit) -
+        g_get_monotonic_time ();
+
+      if (delay > 0 && can_wait)
+          g_poll (&cancel_fd, 1, (gint) MIN (delay / 1000, G_MAXINT));
+      else if (delay > 0)
+          g_usleep (delay);
+    }
+
+  if (can_wait)
+      g_cancellable_release_fd (self->trim_cancellable);
+
+  if (result == -EOPNOTSUPP)
+    {
+      /* Discards aren't allowed on the mapping, retrying on every boot won't help */
+      g_warning ("Discards are not supported by %s", crypt_get_device_name (request->crypt_device));
+      request->state.done = TRUE;
+      message = g_strdup ("Discards are not supported");
+    }
+  else if (result < 0)
+    {
+      message = g_strdup_printf ("Unable to discard the free space: %s", g_strerror (-result));
+    }
+  else if (request->state.offset < request->size)
+    {
+      message = g_strdup ("Cancelled");
+    }
+  else
+    {
+      request->state.done = TRUE;
+    }
+
+  save_trim_state (request);
+
+  g_debug ("Discard pass %s at %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT " bytes discarded",
+           message ? "stopped" : "completed", request->state.offset, request->size, discarded);
+
+  if (message)
+      droidian_encryption_service_job_fail (request->job, message);
+  else
+      droidian_encryption_service_job_complete (request->job);
+
+  trim_request_free (request);
+  g_atomic_int_set (&self->trimming, FALSE);
+
+  return NULL;
+}
+
+static void
+trim_probe_thread (GTask                               *task,
+                   DroidianEncryptionServiceEncryption *self,
+                   TrimRequest                         *request,
+                   GCancellable                        *cancellable)
+{
+  g_autofree char *header_name = droidian_encryption_service_config_get_header_device (self->config);
+  g_autofree char *mapped_name = droidian_encryption_service_config_get_mapped_name (self->config);
+  g_autofree char *mapped_device = g_build_filename (crypt_get_dir (), mapped_name, NULL);
+  struct stat root_stat;
+  struct stat mapped_stat;
+  int result;
+
+  /* Use a private context, the header is only needed for the state token */
+  if ((result = crypt_init (&request->crypt_device, header_name)) < 0 ||
+      (result = crypt_load (request->crypt_device, CRYPT_LUKS2, NULL)) < 0)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, g_io_error_from_errno (-result),
+                               "Unable to load the LUKS2 header: %s", g_strerror (-result));
+      return;
+    }
+
+  droidian_encryption_service_trim_load_state (request->crypt_device, &request->state);
+  if (request->state.done)
+    {
+      g_task_return_boolean (task, FALSE);
+      return;
+    }
+
+  /* Free space is known to the filesystem only, it must be the one on the mapped device */
+  if (stat (mapped_device, &mapped_stat) < 0 || stat ("/", &root_stat) < 0 ||
+      root_stat.st_dev != mapped_stat.st_rdev)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                               "The root filesystem is not on %s", mapped_device);
+      return;
+    }
+
+  if (!(request->size = get_device_size (mapped_device)) ||
+      (request->root_fd = open ("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                               "Unable to open the root filesystem on %s", mapped_device);
+      return;
+    }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+on_trim_probe_done (DroidianEncryptionServiceEncryption *self,
+                    GAsyncResult                        *result,
+                    TrimRequest                         *request)
+{
+  g_autoptr (GError) error = NULL;
+
+  g_return_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self));
+
+  if (!g_task_propagate_boolean (G_TASK (result), &error) ||
+      /* Migrate might have been called in the meantime */
+      g_atomic_int_get (&self->status) != DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_ENCRYPTED ||
+      has_running_job (self))
+    {
+      if (error && !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+          g_warning ("Not discarding the free space: %s", error->message);
+
+      trim_request_free (request);
+      g_atomic_int_set (&self->trimming, FALSE);
+      return;
+    }
+
+  request->job = droidian_encryption_service_job_new ();
+  droidian_encryption_service_job_set_stage (request->job, "trim", (double) request->state.offset / request->size);
+  set_job (self, request->job);
+
+  self->trim_thread = g_thread_new ("trim_thread", (GThreadFunc) run_trim, request);
+}
+
+static void
+start_trim (DroidianEncryptionServiceEncryption *self)
+{
+  g_autoptr (GTask) task = NULL;
+  TrimRequest *request;
+
+  if (!droidian_encryption_service_config_get_trim_after_encryption (self->config) ||
+      !g_atomic_int_compare_and_exchange (&self->trimming, FALSE, TRUE))
+      return;
+
+  /* Reap the previous pass */
+  if (self->trim_thread)
+      g_thread_join (g_steal_pointer (&self->trim_thread));
+
+  g_clear_object (&self->trim_cancellable);
+  self->trim_cancellable = g_cancellable_new ();
+
+  request = g_new0 (TrimRequest, 1);
+  request->self = self;
+  request->root_fd = -1;
+
+  /* Owned by on_trim_probe_done, then by the trim thread */
+  task = g_task_new (self, self->trim_cancellable, (GAsyncReadyCallback) on_trim_probe_done, request);
+  g_task_set_source_tag (task, start_trim);
+  g_task_set_task_data (task, request, NULL);
+  g_task_run_in_thread (task, (GTaskThreadFunc) trim_probe_thread);
+}
+
+static void
+stop_trim (DroidianEncryptionServiceEncryption *self)
+{
+  if (self->trim_cancellable)
+      g_cancellable_cancel (self->trim_cancellable);
+
+  /* Bounded by a single chunk */
+  if (self->trim_thread)
+      g_thread_join (g_steal_pointer (&self->trim_thread));
+}
+
+static void
+on_eta_history_loaded (DroidianEncryptionServiceEncryption *self,
+                       GAsyncResult                        *result,
+                       gpointer                             user_data)
+{
+  g_autoptr (GError) error = NULL;
+
+  g_clear_pointer (&self->history, g_array_unref);
+  if (!(self->history = load_history_finish (self, result, &error)))
+      g_warning ("Unable to load the encryption history: %s", error->message);
+
+  /* The ETA published meanwhile didn't account for it */
+  refresh_helper_progress (self);
+}
+
+static void
+sync_job_with_status (DroidianEncryptionServiceEncryption       *self,
+                      DroidianEncryptionServiceEncryptionStatus  encryption_status)
+{
+  g_autoptr (DroidianEncryptionServiceJob) job = NULL;
+  g_autofree char *failure = NULL;
+
+  switch (encryption_status)
+    {
+    case DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_ENCRYPTING:
+      /* Pick up pause and rate limit set by a previous instance */
+      droidian_encryption_service_helper_request_async (self->helper,
+                                                        DROIDIAN_ENCRYPTION_HELPER_CONTROL_STATUS,
+                                                        NULL,
+                                                        (GAsyncReadyCallback) on_helper_status_done,
+                                                        g_object_ref (self));
+      send_scheduling_mode (self);
+      update_sleep_inhibitor (self);
+
+      if (has_running_job (self))
+          break;
+
+      /* Sessions of previous boots, for the ETA */
+      load_history_async (self, (GAsyncReadyCallback) on_eta_history_loaded, NULL);
+
+      /* Encryption is running in the helper, track it with a new job */
+      job = droidian_encryption_service_job_new ();
+      droidian_encryption_service_job_set_stage (job, "encrypt", 0.0);
+      set_job (self, job);
+      refresh_helper_progress (self);
+      break;
+
+    case DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_ENCRYPTED:
+      if (has_running_job (self))
+          droidian_encryption_service_job_complete (self->job);
+
+      self->progress = 1.0;
+      self->throughput = 0;
+      droidian_encryption_service_dbus_encryption_set_eta (DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self), 0);
+      update_sleep_inhibitor (self);
+
+      /* The flash controller still considers the whole device in use */
+      start_trim (self);
+      break;
+
+    case DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_FAILED:
+      if (g_file_get_contents (DROIDIAN_ENCRYPTION_HELPER_FAILURE, &failure, NULL, NULL))
+        {
+          g_free (self->failure_message);
+          self->failure_message = g_strdup (g_strstrip (failure));
+        }
+
+      if (has_running_job (self))
+          droidian_encryption_service_job_fail (self->job,
+                                                self->failure_message ? self->failure_message : "Encryption failed");
+
+      update_sleep_inhibitor (self);
+      break;
+
+    default:
+      break;
+    }
+}
+
+static gboolean
+handle_start (DroidianEncryptionServiceDbusEncryption *dbus_encryption,
+              GDBusMethodInvocation                   *invocation,
+              const char                              *passphrase)
+{
+  DroidianEncryptionServiceEncryption *self = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION (dbus_encryption);
+  g_autoptr (DroidianEncryptionServiceJob) job = NULL;
+
+  if (!g_atomic_int_compare_and_exchange (&self->status,
+                                          DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_UNCONFIGURED,
+                                          DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_CONFIGURING))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                             "Encryption can't be started from status %d",
+                                             g_atomic_int_get (&self->status));
+      return TRUE;
+    }
+
+  droidian_encryption_service_dbus_encryption_set_status (dbus_encryption,
+                                                          (int) DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_CONFIGURING);
+
+  /* A previous encryption thread has already published its status, reap it */
+  if (self->encryption_process_thread)
+      g_thread_join (g_steal_pointer (&self->encryption_process_thread));
+
+  g_mutex_lock (&self->encryption_process_mutex);
+
+  /* Create the job tracking the configuration */
+  job = droidian_encryption_service_job_new ();
+  set_job (self, job);
+
+  /* Store passphrase */
+  self->passphrase = g_strdup (passphrase);
+
+  g_clear_object (&self->cancellable);
+  self->cancellable = g_cancellable_new ();
+
+  /* Prepare thread */
+  self->encryption_process_thread = g_thread_new ("encryption_thread", (GThreadFunc) start_encryption, self);
+
+  g_mutex_unlock (&self->encryption_process_mutex);
+  droidian_encryption_service_dbus_encryption_complete_start (dbus_encryption, invocation,
+                                                              droidian_encryption_service_job_get_object_path (job));
+
+  return TRUE;
+}
+
+static gboolean
+handle_cancel (DroidianEncryptionServiceDbusEncryption *dbus_encryption,
+               GDBusMethodInvocation                   *invocation)
+{
+  DroidianEncryptionServiceEncryption *self = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION (dbus_encryption);
+
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self), FALSE);
+
+  if (g_atomic_int_get (&self->status) != DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_CONFIGURING ||
+      !self->cancellable)
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                             "No encryption is being configured");
+      return TRUE;
+    }
+
+  /* Honoured at the next stage boundary, a running stage (the keyslot KDF
+   * above all, up to keyslot_iteration_time) always completes first */
+  g_cancellable_cancel (self->cancellable);
+  droidian_encryption_service_dbus_encryption_complete_cancel (dbus_encryption, invocation);
+
+  return TRUE;
+}
+
+static gboolean
+handle_migrate (DroidianEncryptionServiceDbusEncryption *dbus_encryption,
+                GDBusMethodInvocation                   *invocation,
+                const char                              *passphrase,
+                const char                              *cipher,
+                const char                              *cipher_mode,
+                guint                                    sector_size)
+{
+  DroidianEncryptionServiceEncryption *self = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION (dbus_encryption);
+  g_autoptr (DroidianEncryptionServiceJob) job = NULL;
+  MigrationRequest *request;
+
+  if (sector_size && (sector_size < 512 || sector_size > DM_CRYPT_MAX_SECTOR_SIZE ||
+                      (sector_size & (sector_size - 1))))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                             "Invalid sector size %u", sector_size);
+      return TRUE;
+    }
+
+  if (!g_atomic_int_compare_and_exchange (&self->status,
+                                          DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_ENCRYPTED,
+                                          DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_CONFIGURING))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                             "Only fully encrypted devices can be migrated, status is %d",
+                                             g_atomic_int_get (&self->status));
+      return TRUE;
+    }
+
+  droidian_encryption_service_dbus_encryption_set_status (dbus_encryption,
+                                                          (int) DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_CONFIGURING);
+
+  /* A previous encryption thread has already published its status, reap it */
+  if (self->encryption_process_thread)
+      g_thread_join (g_steal_pointer (&self->encryption_process_thread));
+
+  /* The discard pass is resumed once the migration is over */
+  stop_trim (self);
 
   g_mutex_lock (&self->encryption_process_mutex);
 
-  encryption_status = droidian_encryption_service_dbus_encryption_get_status (dbus_encryption);
-  if (encryption_status != DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_UNCONFIGURED)
-    /* TODO: return a GError instead */
-    goto out;
+  job = droidian_encryption_service_job_new ();
+  set_job (self, job);
 
-  droidian_encryption_service_dbus_encryption_set_status (dbus_encryption,
-                                                          (int) DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_CONFIGURING);
-
-  /* Store passphrase */
   self->passphrase = g_strdup (passphrase);
 
-  /* Prepare thread */
-  self->encryption_process_thread = g_thread_new ("encryption_thread", (GThreadFunc) start_encryption, self);
+  /* Migration can't be cancelled */
+  g_clear_object (&self->cancellable);
+
+  request = g_new0 (MigrationRequest, 1);
+  request->self = self;
+  request->cipher = g_strdup (cipher);
+  request->cipher_mode = g_strdup (cipher_mode);
+  request->sector_size = sector_size;
+
+  self->encryption_process_thread = g_thread_new ("migration_thread", (GThreadFunc) start_migration, request);
 
-out:
   g_mutex_unlock (&self->encryption_process_mutex);
-  g_dbus_method_invocation_return_value (invocation, NULL);
+  droidian_encryption_service_dbus_encryption_complete_migrate (dbus_encryption, invocation,
+                                                                droidian_encryption_service_job_get_object_path (job));
 
   return TRUE;
 }
 
-static gboolean
-handle_refresh_status (DroidianEncryptionServiceDbusEncryption *dbus_encryption,
-                       GDBusMethodInvocation                   *invocation)
+typedef struct {
+  DroidianEncryptionServiceEncryptionStatus previous_status;
+  DroidianEncryptionServiceEncryptionStatus status;
+  guint32 header_sector_size;
+  gboolean want_header_info;
+  HeaderInfo *header_info;
+  gboolean table_split;
+  guint64 table_offset;
+  guint64 table_size;
+  char *table_layout;    /* NULL if the table couldn't be read */
+  char *segments_layout; /* NULL if the segments haven't been read */
+  guint64 segments_offset;
+} RefreshResult;
+
+static void
+refresh_result_free (RefreshResult *result)
 {
-  DroidianEncryptionServiceEncryption *self = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION (dbus_encryption);
-  DroidianEncryptionServiceEncryptionStatus encryption_status;
+  g_clear_pointer (&result->header_info, header_info_free);
+  g_free (result->table_layout);
+  g_free (result->segments_layout);
+  g_free (result);
+}
+
+static DroidianEncryptionServiceEncryptionStatus
+probe_status (DroidianEncryptionServiceEncryption *self,
+              RefreshResult                       *result)
+{
+  struct crypt_device *crypt_device = NULL;
+  DroidianEncryptionServiceEncryptionStatus encryption_status = result->previous_status;
   crypt_status_info cryptsetup_crypt_status;
   crypt_reencrypt_info cryptsetup_reencrypt_status;
+  crypt_reencrypt_info reencrypt_status;
   g_autofree char *header_name = NULL;
   g_autofree char *data_name = NULL;
   g_autofree char *mapped_name = NULL;
-
-  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self), FALSE);
-
-  /* Set default encryption status to the last one */
-  encryption_status = droidian_encryption_service_dbus_encryption_get_status (dbus_encryption);
-
-  if (!g_mutex_trylock (&self->encryption_process_mutex))
-      /* Operation ongoing or configuring/configured, return last cached status */
-      goto out;
-
-  /* Set default encryption status to the last one */
-  encryption_status = (DroidianEncryptionServiceEncryptionStatus)
-    droidian_encryption_service_dbus_encryption_get_status (dbus_encryption);
+  gboolean helper_running;
 
   if (encryption_status == DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_CONFIGURING ||
       encryption_status == DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_CONFIGURED ||
@@ -277,46 +1920,64 @@ handle_refresh_status (DroidianEncryptionServiceDbusEncryption *dbus_encryption,
       encryption_status == DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_FAILED)
 
       /* Configuring/configured/unsupported/failed, return last cached status */
-      goto cleanup;
+      return encryption_status;
 
-  if (access (DROIDIAN_ENCRYPTION_HELPER_PIDFILE, F_OK) == 0)
+  if ((helper_running = droidian_encryption_service_helper_is_running (self->helper)))
     {
-      /* Helper pidfile exists, assume we're in the configuring state */
+      /* Helper is running, assume we're in the encrypting state */
       encryption_status = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_ENCRYPTING;
-      goto save;
-    }
 
-  if (access (DROIDIAN_ENCRYPTION_HELPER_FAILURE, F_OK) == 0)
-    {
-      /* Failure flag found, signal that */
-      encryption_status = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_FAILED;
-      goto save;
+      /* Still read the header once, for the details */
+      if (!result->want_header_info)
+          return encryption_status;
     }
+  else if (access (DROIDIAN_ENCRYPTION_HELPER_FAILURE, F_OK) == 0)
+      /* Failure flag found, signal that */
+      return DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_FAILED;
 
   header_name = droidian_encryption_service_config_get_header_device (self->config);
   data_name = droidian_encryption_service_config_get_data_device (self->config);
   mapped_name = droidian_encryption_service_config_get_mapped_name (self->config);
 
-  if (access (header_name, F_OK) != 0 ||
-      access (data_name, F_OK) != 0 ||
-      access (DROIDIAN_ENCRYPTION_SUPPORTED_STAMP, F_OK) != 0)
-    {
-      encryption_status = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_UNSUPPORTED;
-      goto save;
-    }
+  if (!helper_running &&
+      (access (header_name, F_OK) != 0 ||
+       access (data_name, F_OK) != 0 ||
+       access (DROIDIAN_ENCRYPTION_SUPPORTED_STAMP, F_OK) != 0))
+      return DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_UNSUPPORTED;
+
+  /* Before the header: a hotzone completed in between changes the layout, and the cache won't be used */
+  result->table_split = droidian_encryption_service_progress_from_table (mapped_name,
+                                                                         &result->table_offset,
+                                                                         &result->table_size,
+                                                                         &result->table_layout);
+
+  /* Use a private context, the encryption thread might own self->crypt_device */
+  if (crypt_init (&crypt_device, header_name) < 0)
+      /* Don't nag as encryption might be unconfigured */
+      goto out;
 
-  if (!self->crypt_device)
-    {
-      if (open_device (self, header_name) < 0)
-        /* Don't nag as encryption might be unconfigured */
-        goto cleanup;
+  if (crypt_load (crypt_device, CRYPT_LUKS2, NULL) < 0)
+      /* Just warn */
+      g_warning ("Unable to crypt_load() header");
 
-      if (crypt_load (self->crypt_device, CRYPT_LUKS2, NULL) < 0)
-        /* Just warn */
-        g_warning ("Unable to crypt_load() header");
-    }
+  if (crypt_get_type (crypt_device))
+      result->header_sector_size = crypt_get_sector_size (crypt_device);
+
+  if (result->want_header_info)
+      result->header_info = header_info_new (crypt_device);
 
-  cryptsetup_crypt_status = crypt_status (self->crypt_device, mapped_name);
+  /* The header is loaded anyway, keep the position for when the table can't tell.
+   * After a crash, the hotzone left behind doesn't count until recovered. */
+  if (crypt_get_type (crypt_device) &&
+      (reencrypt_status = crypt_reencrypt_status (crypt_device, NULL)) != CRYPT_REENCRYPT_NONE &&
+      reencrypt_status != CRYPT_REENCRYPT_INVALID &&
+      droidian_encryption_service_progress_from_segments (crypt_device, &result->segments_offset))
+      result->segments_layout = g_strdup (result->table_layout);
+
+  if (helper_running)
+      goto out;
+
+  cryptsetup_crypt_status = crypt_status (crypt_device, mapped_name);
 
   switch (cryptsetup_crypt_status)
     {
@@ -324,7 +1985,7 @@ handle_refresh_status (DroidianEncryptionServiceDbusEncryption *dbus_encryption,
     case CRYPT_INACTIVE:
       /* Unconfigured */
       encryption_status = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_UNCONFIGURED;
-      goto save;
+      goto out;
 
     case CRYPT_ACTIVE:
     case CRYPT_BUSY:
@@ -334,12 +1995,12 @@ handle_refresh_status (DroidianEncryptionServiceDbusEncryption *dbus_encryption,
 
     default:
       g_warning ("Unknown status %d returned by libcryptsetup", cryptsetup_crypt_status);
-      goto cleanup;
+      goto out;
     }
 
   /* If we are here, continue checking for clues... */
 
-  cryptsetup_reencrypt_status = crypt_reencrypt_status (self->crypt_device, NULL);
+  cryptsetup_reencrypt_status = crypt_reencrypt_status (crypt_device, NULL);
 
   switch (cryptsetup_reencrypt_status)
     {
@@ -359,15 +2020,406 @@ handle_refresh_status (DroidianEncryptionServiceDbusEncryption *dbus_encryption,
       break;
     }
 
-save:
-  droidian_encryption_service_dbus_encryption_set_status (dbus_encryption,
-                                                          (int) encryption_status);
+out:
+  if (crypt_device)
+      crypt_free (crypt_device);
 
-cleanup:
-  g_mutex_unlock (&self->encryption_process_mutex);
+  return encryption_status;
+}
 
-out:
-  g_dbus_method_invocation_return_value (invocation, NULL);
+static void
+refresh_status_thread (GTask                               *task,
+                       DroidianEncryptionServiceEncryption *self,
+                       RefreshResult                       *result,
+                       GCancellable                        *cancellable)
+{
+  /* Might block for a long time on a slow device, never run it on the main loop */
+  result->status = probe_status (self, result);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+on_refresh_status_done (DroidianEncryptionServiceEncryption *self,
+                        GAsyncResult                        *task,
+                        gpointer                             user_data)
+{
+  DroidianEncryptionServiceDbusEncryption *dbus_encryption = DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self);
+  RefreshResult *result = g_task_get_task_data (G_TASK (task));
+  g_autoptr (GPtrArray) invocations = g_steal_pointer (&self->pending_refreshes);
+  guint i;
+
+  if (result->header_sector_size &&
+      !droidian_encryption_service_dbus_encryption_get_sector_size (dbus_encryption))
+    {
+      /* Configured by a previous instance */
+      droidian_encryption_service_dbus_encryption_set_sector_size (dbus_encryption, result->header_sector_size);
+      droidian_encryption_service_dbus_encryption_set_sector_size_reason (dbus_encryption,
+                                                                          "Read from the LUKS2 header");
+    }
+
+  if (result->header_info)
+    {
+      g_clear_pointer (&self->header_info, header_info_free);
+      self->header_info = g_steal_pointer (&result->header_info);
+    }
+
+  if (result->segments_layout)
+    {
+      g_free (self->segments_layout);
+      self->segments_layout = g_steal_pointer (&result->segments_layout);
+      self->segments_offset = result->segments_offset;
+    }
+
+  /* The table tells when split, the header as long as the mapping didn't change since */
+  self->have_derived_progress = FALSE;
+  if (result->table_layout && result->table_size)
+    {
+      self->derived_size = result->table_size;
+
+      if (result->table_split)
+        {
+          self->derived_offset = result->table_offset;
+          self->have_derived_progress = TRUE;
+        }
+      else if (g_strcmp0 (result->table_layout, self->segments_layout) == 0)
+        {
+          self->derived_offset = self->segments_offset;
+          self->have_derived_progress = TRUE;
+        }
+    }
+
+  /* Start or Migrate might have been called in the meantime, they win */
+  if (g_atomic_int_compare_and_exchange (&self->status, result->previous_status, result->status))
+    {
+      droidian_encryption_service_dbus_encryption_set_status (dbus_encryption, (int) result->status);
+      sync_job_with_status (self, result->status);
+
+      if (result->status != result->previous_status)
+          save_journal (self);
+    }
+
+  for (i = 0; i < invocations->len; i++)
+      droidian_encryption_service_dbus_encryption_complete_refresh_status (dbus_encryption,
+                                                                           invocations->pdata[i]);
+}
+
+static gboolean
+handle_refresh_status (DroidianEncryptionServiceDbusEncryption *dbus_encryption,
+                       GDBusMethodInvocation                   *invocation)
+{
+  DroidianEncryptionServiceEncryption *self = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION (dbus_encryption);
+  g_autoptr (GTask) task = NULL;
+  RefreshResult *result;
+
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self), FALSE);
+
+  if (self->pending_refreshes)
+    {
+      /* A probe is already running, share its result */
+      g_ptr_array_add (self->pending_refreshes, invocation);
+      return TRUE;
+    }
+
+  self->pending_refreshes = g_ptr_array_new ();
+  g_ptr_array_add (self->pending_refreshes, invocation);
+
+  result = g_new0 (RefreshResult, 1);
+  result->previous_status = g_atomic_int_get (&self->status);
+  result->status = result->previous_status;
+  result->want_header_info = (self->header_info == NULL);
+
+  task = g_task_new (self, NULL, (GAsyncReadyCallback) on_refresh_status_done, NULL);
+  g_task_set_source_tag (task, handle_refresh_status);
+  g_task_set_task_data (task, result, (GDestroyNotify) refresh_result_free);
+  g_task_run_in_thread (task, (GTaskThreadFunc) refresh_status_thread);
+
+  return TRUE;
+}
+
+static gboolean
+handle_get_detailed_status (DroidianEncryptionServiceDbusEncryption *dbus_encryption,
+                            GDBusMethodInvocation                   *invocation)
+{
+  DroidianEncryptionServiceEncryption *self = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION (dbus_encryption);
+  GVariantDict dict;
+
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self), FALSE);
+
+  /* Cached state only, never touch the device here: the progress derived
+   * from the mapping is refreshed by the status probe */
+  g_variant_dict_init (&dict, NULL);
+  g_variant_dict_insert (&dict, "status", "i", g_atomic_int_get (&self->status));
+  g_variant_dict_insert (&dict, "paused", "b", droidian_encryption_service_dbus_encryption_get_paused (dbus_encryption));
+  g_variant_dict_insert (&dict, "progress", "d", self->progress);
+  g_variant_dict_insert (&dict, "throughput", "t", self->throughput);
+  g_variant_dict_insert (&dict, "eta", "t", droidian_encryption_service_dbus_encryption_get_eta (dbus_encryption));
+
+  if (self->failure_message)
+      g_variant_dict_insert (&dict, "failure", "s", self->failure_message);
+
+  if (droidian_encryption_service_dbus_encryption_get_sector_size (dbus_encryption))
+      g_variant_dict_insert (&dict, "sector-size", "u",
+                             droidian_encryption_service_dbus_encryption_get_sector_size (dbus_encryption));
+
+  if (self->header_info)
+    {
+      g_variant_dict_insert (&dict, "cipher", "s", self->header_info->cipher ? self->header_info->cipher : "");
+      g_variant_dict_insert (&dict, "cipher-mode", "s", self->header_info->cipher_mode ? self->header_info->cipher_mode : "");
+
+      if (self->header_info->pbkdf_type)
+        {
+          g_variant_dict_insert (&dict, "pbkdf", "s", self->header_info->pbkdf_type);
+          g_variant_dict_insert (&dict, "pbkdf-iterations", "u", self->header_info->pbkdf_iterations);
+          g_variant_dict_insert (&dict, "pbkdf-memory", "u", self->header_info->pbkdf_max_memory_kb);
+          g_variant_dict_insert (&dict, "pbkdf-parallel", "u", self->header_info->pbkdf_parallel_threads);
+        }
+    }
+
+  droidian_encryption_service_dbus_encryption_complete_get_detailed_status (dbus_encryption, invocation,
+                                                                            g_variant_dict_end (&dict));
+
+  return TRUE;
+}
+
+static gboolean
+handle_get_flight_record (DroidianEncryptionServiceDbusEncryption *dbus_encryption,
+                          GDBusMethodInvocation                   *invocation)
+{
+  DroidianEncryptionServiceEncryption *self = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION (dbus_encryption);
+  g_autoptr (GError) error = NULL;
+  GVariant *events;
+
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self), FALSE);
+
+  if (!(events = droidian_encryption_service_helper_read_flight_record (self->helper, &error)))
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return TRUE;
+    }
+
+  droidian_encryption_service_dbus_encryption_complete_get_flight_record (dbus_encryption, invocation, events);
+
+  return TRUE;
+}
+
+static void
+on_get_history_done (DroidianEncryptionServiceEncryption *self,
+                     GAsyncResult                        *result,
+                     GDBusMethodInvocation               *invocation)
+{
+  DroidianEncryptionServiceDbusEncryption *dbus_encryption = DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self);
+  g_autoptr (GArray) history = NULL;
+  g_autoptr (GError) error = NULL;
+  DroidianEncryptionHistorySession *session;
+  GVariantBuilder builder;
+  guint i;
+
+  if (!(history = load_history_finish (self, result, &error)))
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return;
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(xttxxxts)"));
+
+  for (i = 0; i < history->len; i++)
+    {
+      session = &g_array_index (history, DroidianEncryptionHistorySession, i);
+      g_variant_builder_add (&builder, "(xttxxxts)",
+                             session->started_at, session->start_offset, session->end_offset,
+                             session->active_usec, session->throttled_usec, session->paused_usec,
+                             session->written_bytes, session->resilience);
+    }
+
+  droidian_encryption_service_dbus_encryption_complete_get_history (dbus_encryption, invocation,
+                                                                    g_variant_builder_end (&builder));
+}
+
+static gboolean
+handle_get_history (DroidianEncryptionServiceDbusEncryption *dbus_encryption,
+                    GDBusMethodInvocation                   *invocation)
+{
+  DroidianEncryptionServiceEncryption *self = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION (dbus_encryption);
+
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self), FALSE);
+
+  load_history_async (self, (GAsyncReadyCallback) on_get_history_done, invocation);
+
+  return TRUE;
+}
+
+static void
+on_get_energy_stats_done (DroidianEncryptionServiceEncryption *self,
+                          GAsyncResult                        *result,
+                          GDBusMethodInvocation               *invocation)
+{
+  DroidianEncryptionServiceDbusEncryption *dbus_encryption = DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self);
+  DroidianEncryptionHistoryEnergy totals[DROIDIAN_ENCRYPTION_HISTORY_PACING_MODES] = { 0 };
+  g_autoptr (GArray) history = NULL;
+  g_autoptr (GError) error = NULL;
+  DroidianEncryptionHistorySession *session;
+  GVariantBuilder builder;
+  GVariantDict dict;
+  guint pacing;
+  guint i;
+
+  if (!(history = load_history_finish (self, result, &error)))
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return;
+    }
+
+  for (i = 0; i < history->len; i++)
+    {
+      session = &g_array_index (history, DroidianEncryptionHistorySession, i);
+
+      for (pacing = 0; pacing < DROIDIAN_ENCRYPTION_HISTORY_PACING_MODES; pacing++)
+        {
+          totals[pacing].energy_uj += session->energy[pacing].energy_uj;
+          totals[pacing].usec += session->energy[pacing].usec;
+          totals[pacing].bytes += session->energy[pacing].bytes;
+        }
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sa{sv}}"));
+
+  for (pacing = 0; pacing < DROIDIAN_ENCRYPTION_HISTORY_PACING_MODES; pacing++)
+    {
+      /* Never measured in this mode */
+      if (!totals[pacing].bytes || totals[pacing].usec <= 0)
+          continue;
+
+      g_variant_dict_init (&dict, NULL);
+      g_variant_dict_insert (&dict, "energy", "t", totals[pacing].energy_uj);
+      g_variant_dict_insert (&dict, "time", "t", (guint64) totals[pacing].usec);
+      g_variant_dict_insert (&dict, "bytes", "t", totals[pacing].bytes);
+      /* 1 uJ per byte is 1000 J per GB */
+      g_variant_dict_insert (&dict, "joules-per-gb", "d",
+                             (double) totals[pacing].energy_uj * 1000 / totals[pacing].bytes);
+      g_variant_dict_insert (&dict, "average-power", "d",
+                             (double) totals[pacing].energy_uj / totals[pacing].usec);
+
+      g_variant_builder_add (&builder, "{s@a{sv}}",
+                             droidian_encryption_history_get_pacing_name (pacing),
+                             g_variant_dict_end (&dict));
+    }
+
+  droidian_encryption_service_dbus_encryption_complete_get_energy_stats (dbus_encryption, invocation,
+                                                                         g_variant_builder_end (&builder));
+}
+
+static gboolean
+handle_get_energy_stats (DroidianEncryptionServiceDbusEncryption *dbus_encryption,
+                         GDBusMethodInvocation                   *invocation)
+{
+  DroidianEncryptionServiceEncryption *self = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION (dbus_encryption);
+
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self), FALSE);
+
+  load_history_async (self, (GAsyncReadyCallback) on_get_energy_stats_done, invocation);
+
+  return TRUE;
+}
+
+typedef struct {
+  DroidianEncryptionServiceEncryption *self;
+  GDBusMethodInvocation *invocation;
+  guint64 rate_limit;
+} HelperCall;
+
+static void
+on_helper_control_done (DroidianEncryptionServiceHelper *helper,
+                        GAsyncResult                    *result,
+                        HelperCall                      *call)
+{
+  DroidianEncryptionServiceDbusEncryption *dbus_encryption = DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (call->self);
+  g_autoptr (GError) error = NULL;
+  g_autofree char *reply = NULL;
+  const char *method_name = g_dbus_method_invocation_get_method_name (call->invocation);
+
+  reply = droidian_encryption_service_helper_request_finish (helper, result, &error);
+  if (!reply)
+    {
+      g_dbus_method_invocation_return_gerror (call->invocation, error);
+    }
+  else if (g_strcmp0 (method_name, "Pause") == 0)
+    {
+      droidian_encryption_service_dbus_encryption_set_paused (dbus_encryption, TRUE);
+      droidian_encryption_service_dbus_encryption_complete_pause (dbus_encryption, call->invocation);
+    }
+  else if (g_strcmp0 (method_name, "Resume") == 0)
+    {
+      droidian_encryption_service_dbus_encryption_set_paused (dbus_encryption, FALSE);
+      droidian_encryption_service_dbus_encryption_complete_resume (dbus_encryption, call->invocation);
+    }
+  else
+    {
+      droidian_encryption_service_dbus_encryption_set_rate_limit (dbus_encryption, call->rate_limit);
+      droidian_encryption_service_dbus_encryption_complete_set_rate_limit (dbus_encryption, call->invocation);
+    }
+
+  g_object_unref (call->self);
+  g_free (call);
+}
+
+static void
+send_helper_control (DroidianEncryptionServiceEncryption *self,
+                     GDBusMethodInvocation               *invocation,
+                     const char                          *request,
+                     guint64                              rate_limit)
+{
+  HelperCall *call = g_new0 (HelperCall, 1);
+
+  call->self = g_object_ref (self);
+  call->invocation = invocation;
+  call->rate_limit = rate_limit;
+
+  droidian_encryption_service_helper_request_async (self->helper, request, NULL,
+                                                    (GAsyncReadyCallback) on_helper_control_done,
+                                                    call);
+}
+
+static gboolean
+handle_pause (DroidianEncryptionServiceDbusEncryption *dbus_encryption,
+              GDBusMethodInvocation                   *invocation)
+{
+  DroidianEncryptionServiceEncryption *self = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION (dbus_encryption);
+
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self), FALSE);
+
+  /* Replied to once the helper has completed its current hotzone */
+  send_helper_control (self, invocation, DROIDIAN_ENCRYPTION_HELPER_CONTROL_PAUSE, 0);
+
+  return TRUE;
+}
+
+static gboolean
+handle_resume (DroidianEncryptionServiceDbusEncryption *dbus_encryption,
+               GDBusMethodInvocation                   *invocation)
+{
+  DroidianEncryptionServiceEncryption *self = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION (dbus_encryption);
+
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self), FALSE);
+
+  send_helper_control (self, invocation, DROIDIAN_ENCRYPTION_HELPER_CONTROL_RESUME, 0);
+
+  return TRUE;
+}
+
+static gboolean
+handle_set_rate_limit (DroidianEncryptionServiceDbusEncryption *dbus_encryption,
+                       GDBusMethodInvocation                   *invocation,
+                       guint64                                  bytes_per_second)
+{
+  DroidianEncryptionServiceEncryption *self = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION (dbus_encryption);
+  g_autofree char *request = NULL;
+
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self), FALSE);
+
+  request = g_strdup_printf (DROIDIAN_ENCRYPTION_HELPER_CONTROL_RATE_LIMIT " %" G_GUINT64_FORMAT,
+                             bytes_per_second);
+  send_helper_control (self, invocation, request, bytes_per_second);
 
   return TRUE;
 }
@@ -397,14 +2449,31 @@ on_authorize_method (GDBusInterfaceSkeleton *skeleton,
   method_name = g_dbus_method_invocation_get_method_name (invocation); /* owned by the invocation */
   subject = polkit_system_bus_name_new (sender);
 
-  if (g_strcmp0 (method_name, "Start") == 0)
+  if (g_strcmp0 (method_name, "Start") == 0 ||
+      g_strcmp0 (method_name, "Cancel") == 0)
     {
-      /* Start encryption */
+      /* Start or cancel encryption */
       action = "org.droidian.EncryptionService.EncryptionStart";
     }
-  else if (g_strcmp0 (method_name, "RefreshStatus") == 0)
+  else if (g_strcmp0 (method_name, "Migrate") == 0)
+    {
+      /* Reencrypt with new settings */
+      action = "org.droidian.EncryptionService.EncryptionMigrate";
+    }
+  else if (g_strcmp0 (method_name, "Pause") == 0 ||
+           g_strcmp0 (method_name, "Resume") == 0 ||
+           g_strcmp0 (method_name, "SetRateLimit") == 0)
+    {
+      /* Drive the running helper */
+      action = "org.droidian.EncryptionService.EncryptionControl";
+    }
+  else if (g_strcmp0 (method_name, "RefreshStatus") == 0 ||
+           g_strcmp0 (method_name, "GetDetailedStatus") == 0 ||
+           g_strcmp0 (method_name, "GetFlightRecord") == 0 ||
+           g_strcmp0 (method_name, "GetHistory") == 0 ||
+           g_strcmp0 (method_name, "GetEnergyStats") == 0)
     {
-      /* Refresh status, no authorization required */
+      /* Refresh status and diagnostics, no authorization required */
       authorized = TRUE;
     }
   else
@@ -470,6 +2539,35 @@ on_dbus_bus_acquired (DroidianEncryptionServiceEncryption *self,
     }
 }
 
+gboolean
+droidian_encryption_service_encryption_is_scheduling_helper (DroidianEncryptionServiceEncryption *self)
+{
+  DroidianEncryptionServiceDbusEncryption *dbus_encryption = DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self);
+
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self), FALSE);
+
+  if (!self->logind)
+      return FALSE;
+
+  /*
+   * Only what would be left behind matters: a held sleep inhibitor, a helper
+   * paused for sleep that must be resumed, or a boost that must be revoked
+   * once the user is back. A helper in background mode runs fine alone.
+   */
+  return droidian_encryption_service_logind_is_inhibiting_sleep (self->logind) ||
+         self->paused_for_sleep ||
+         g_strcmp0 (droidian_encryption_service_dbus_encryption_get_scheduling_mode (dbus_encryption),
+                    DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE_BOOST) == 0;
+}
+
+gboolean
+droidian_encryption_service_encryption_is_trimming (DroidianEncryptionServiceEncryption *self)
+{
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self), FALSE);
+
+  return g_atomic_int_get (&self->trimming);
+}
+
 DroidianEncryptionServiceEncryptionStatus
 droidian_encryption_service_encryption_get_last_status (DroidianEncryptionServiceEncryption *self)
 {
@@ -478,28 +2576,97 @@ droidian_encryption_service_encryption_get_last_status (DroidianEncryptionServic
   g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_ENCRYPTION (self), DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_FAILED);
   g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_DBUS_IS_ENCRYPTION (dbus_encryption), DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_FAILED);
 
-  return (DroidianEncryptionServiceEncryptionStatus)
-    droidian_encryption_service_dbus_encryption_get_status (dbus_encryption);
+  return (DroidianEncryptionServiceEncryptionStatus) g_atomic_int_get (&self->status);
 }
 
 static void
 droidian_encryption_service_encryption_constructed (GObject *obj)
 {
   DroidianEncryptionServiceEncryption *self = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION (obj);
+  g_autoptr (GFile) progress_file = NULL;
   g_autoptr (GError) error = NULL;
 
   G_OBJECT_CLASS (droidian_encryption_service_encryption_parent_class)->constructed (obj);
 
   self->dbus = droidian_encryption_service_dbus_get_default ();
   self->config = droidian_encryption_service_config_get_default ();
+  self->helper = droidian_encryption_service_helper_get_default ();
+  self->logind = NULL;
   self->interface_exported = FALSE;
   self->authority = NULL;
   self->encryption_process_thread = NULL;
+  self->cancellable = NULL;
   self->crypt_device = NULL;
   self->passphrase = NULL;
+  self->job = NULL;
+  self->progress_monitor = NULL;
+  self->history = NULL;
+  self->status = DROIDIAN_ENCRYPTION_SERVICE_ENCRYPTION_STATUS_UNKNOWN;
+  self->pending_refreshes = NULL;
+  self->sleeping = FALSE;
+  self->paused_for_sleep = FALSE;
+  self->sleep_requested_at = 0;
+  self->woken_up_at = 0;
+  self->sleep_resume_source_id = 0;
+  self->header_info = NULL;
+  self->failure_message = NULL;
+  self->progress = 0.0;
+  self->throughput = 0;
+  self->last_progress_offset = 0;
+  self->last_progress_at = 0;
+  self->segments_layout = NULL;
+  self->segments_offset = 0;
+  self->have_derived_progress = FALSE;
+  self->derived_offset = 0;
+  self->derived_size = 0;
+  self->trim_thread = NULL;
+  self->trim_cancellable = NULL;
+  self->trimming = FALSE;
 
   g_mutex_init (&self->encryption_process_mutex);
 
+  droidian_encryption_service_dbus_encryption_set_job (DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self), "/");
+  droidian_encryption_service_dbus_encryption_set_paused (DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self), FALSE);
+  droidian_encryption_service_dbus_encryption_set_rate_limit (DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self), 0);
+  droidian_encryption_service_dbus_encryption_set_scheduling_mode (DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self), "");
+  droidian_encryption_service_dbus_encryption_set_sector_size (DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self), 0);
+  droidian_encryption_service_dbus_encryption_set_sector_size_reason (DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self), "");
+  droidian_encryption_service_dbus_encryption_set_eta (DROIDIAN_ENCRYPTION_SERVICE_DBUS_ENCRYPTION (self), 0);
+
+  /* Pick up where the previous instance left */
+  load_journal (self);
+
+  if (droidian_encryption_service_config_get_opportunistic_scheduling (self->config) ||
+      droidian_encryption_service_config_get_pause_on_sleep (self->config))
+      self->logind = droidian_encryption_service_logind_get_default ();
+
+  /* Boost the helper while the user is idle */
+  if (droidian_encryption_service_config_get_opportunistic_scheduling (self->config))
+      g_signal_connect_object (self->logind, "notify::idle",
+                               G_CALLBACK (on_logind_idle_changed),
+                               self, G_CONNECT_SWAPPED);
+
+  /* Don't let suspend freeze the helper in the middle of a hotzone */
+  if (droidian_encryption_service_config_get_pause_on_sleep (self->config))
+      g_signal_connect_object (self->logind, "prepare-for-sleep",
+                               G_CALLBACK (on_logind_prepare_for_sleep),
+                               self, G_CONNECT_SWAPPED);
+
+  /* Follow the progress published by the helper, if any */
+  progress_file = g_file_new_for_path (DROIDIAN_ENCRYPTION_HELPER_PROGRESS);
+  self->progress_monitor = g_file_monitor_file (progress_file, G_FILE_MONITOR_NONE, NULL, &error);
+  if (error != NULL)
+    {
+      g_printerr ("Unable to monitor helper progress: %s\n", error->message);
+      g_clear_error (&error);
+    }
+  else
+    {
+      g_signal_connect_object (self->progress_monitor, "changed",
+                               G_CALLBACK (on_helper_progress_changed),
+                               self, G_CONNECT_SWAPPED);
+    }
+
   /* Get polkit authority */
   self->authority = polkit_authority_get_sync (NULL, &error);
   if (error != NULL)
@@ -523,6 +2690,8 @@ droidian_encryption_service_encryption_dispose (GObject *obj)
   if (self->encryption_process_thread)
     g_thread_join (self->encryption_process_thread);
 
+  stop_trim (self);
+
   if (g_dbus_interface_skeleton_get_object_path (G_DBUS_INTERFACE_SKELETON (self)))
       g_dbus_interface_skeleton_unexport (G_DBUS_INTERFACE_SKELETON (self));
 
@@ -534,9 +2703,21 @@ droidian_encryption_service_encryption_dispose (GObject *obj)
   g_free (self->passphrase);
   self->passphrase = NULL;
 
+  g_clear_handle_id (&self->sleep_resume_source_id, g_source_remove);
+  g_clear_pointer (&self->header_info, header_info_free);
+  g_clear_pointer (&self->failure_message, g_free);
+  g_clear_pointer (&self->segments_layout, g_free);
+  g_clear_object (&self->cancellable);
+  g_clear_object (&self->trim_cancellable);
+  g_clear_object (&self->progress_monitor);
+  g_clear_pointer (&self->history, g_array_unref);
+  g_clear_object (&self->job);
+  g_clear_object (&self->logind);
+
   g_object_unref (self->authority);
   g_object_unref (self->dbus);
   g_object_unref (self->config);
+  g_object_unref (self->helper);
 
   G_OBJECT_CLASS (droidian_encryption_service_encryption_parent_class)->dispose (obj);
 }
@@ -554,7 +2735,16 @@ static void
 droidian_encryption_service_dbus_encryption_interface_init (DroidianEncryptionServiceDbusEncryptionIface *iface)
 {
   iface->handle_start  = handle_start;
+  iface->handle_migrate = handle_migrate;
+  iface->handle_cancel = handle_cancel;
   iface->handle_refresh_status = handle_refresh_status;
+  iface->handle_get_detailed_status = handle_get_detailed_status;
+  iface->handle_get_flight_record = handle_get_flight_record;
+  iface->handle_get_history = handle_get_history;
+  iface->handle_get_energy_stats = handle_get_energy_stats;
+  iface->handle_pause = handle_pause;
+  iface->handle_resume = handle_resume;
+  iface->handle_set_rate_limit = handle_set_rate_limit;
 }
 
 static void
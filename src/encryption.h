@@ -24,7 +24,7 @@
 #include <gio/gio.h>
 #include <polkit/polkittypes.h>
 
-#include "dbus-encryption.h"
+#include "droidian-encryption-dbus.h"
 
 G_BEGIN_DECLS
 
@@ -44,6 +44,8 @@ G_DECLARE_FINAL_TYPE (DroidianEncryptionServiceEncryption, droidian_encryption_s
                       DROIDIAN_ENCRYPTION_SERVICE, ENCRYPTION, DroidianEncryptionServiceDbusEncryptionSkeleton)
 
 DroidianEncryptionServiceEncryption *droidian_encryption_service_encryption_get_default (void);
+gboolean droidian_encryption_service_encryption_is_scheduling_helper (DroidianEncryptionServiceEncryption *self);
+gboolean droidian_encryption_service_encryption_is_trimming (DroidianEncryptionServiceEncryption *self);
 DroidianEncryptionServiceEncryptionStatus droidian_encryption_service_encryption_get_last_status (DroidianEncryptionServiceEncryption *self);
 
 G_END_DECLS
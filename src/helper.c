@@ -0,0 +1,366 @@
+/* helper.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define G_LOG_DOMAIN "droidian-encryption-service-helper"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "helper.h"
+#include "control-protocol.h"
+#include "flight-recorder-format.h"
+
+static const char *event_names[] = {
+  [DROIDIAN_ENCRYPTION_HELPER_EVENT_START] = "start",
+  [DROIDIAN_ENCRYPTION_HELPER_EVENT_STAGE] = "stage",
+  [DROIDIAN_ENCRYPTION_HELPER_EVENT_HOTZONE] = "hotzone",
+  [DROIDIAN_ENCRYPTION_HELPER_EVENT_CONTROL] = "control",
+  [DROIDIAN_ENCRYPTION_HELPER_EVENT_SIGNAL] = "signal",
+  [DROIDIAN_ENCRYPTION_HELPER_EVENT_ERROR] = "error",
+};
+
+static const char *stage_names[] = {
+  [DROIDIAN_ENCRYPTION_HELPER_STAGE_PREPARED] = "prepared",
+  [DROIDIAN_ENCRYPTION_HELPER_STAGE_RECOVERED] = "recovered",
+  [DROIDIAN_ENCRYPTION_HELPER_STAGE_ACTIVATED] = "activated",
+  [DROIDIAN_ENCRYPTION_HELPER_STAGE_FORKED] = "forked",
+  [DROIDIAN_ENCRYPTION_HELPER_STAGE_ROOT_MOVED] = "root-moved",
+  [DROIDIAN_ENCRYPTION_HELPER_STAGE_BOOT_DONE] = "boot-done",
+  [DROIDIAN_ENCRYPTION_HELPER_STAGE_REENCRYPTING] = "reencrypting",
+  [DROIDIAN_ENCRYPTION_HELPER_STAGE_PAUSED] = "paused",
+  [DROIDIAN_ENCRYPTION_HELPER_STAGE_RESUMED] = "resumed",
+  [DROIDIAN_ENCRYPTION_HELPER_STAGE_FINISHED] = "finished",
+  [DROIDIAN_ENCRYPTION_HELPER_STAGE_STOPPED] = "stopped",
+  [DROIDIAN_ENCRYPTION_HELPER_STAGE_MILESTONE] = "milestone",
+  [DROIDIAN_ENCRYPTION_HELPER_STAGE_OVER_BUDGET] = "over-budget",
+};
+
+static const char *request_names[] = {
+  [DROIDIAN_ENCRYPTION_HELPER_REQUEST_PAUSE] = "pause",
+  [DROIDIAN_ENCRYPTION_HELPER_REQUEST_RESUME] = "resume",
+  [DROIDIAN_ENCRYPTION_HELPER_REQUEST_RATE_LIMIT] = "rate-limit",
+  [DROIDIAN_ENCRYPTION_HELPER_REQUEST_MODE] = "mode",
+  [DROIDIAN_ENCRYPTION_HELPER_REQUEST_STOP] = "stop",
+};
+
+struct _DroidianEncryptionServiceHelper
+{
+  GObject parent_instance;
+};
+
+G_DEFINE_TYPE (DroidianEncryptionServiceHelper, droidian_encryption_service_helper, G_TYPE_OBJECT)
+
+static int
+connect_to_helper (GError **error)
+{
+  struct sockaddr_un address = {
+    .sun_family = AF_UNIX,
+  };
+  int fd;
+
+  g_strlcpy (address.sun_path, DROIDIAN_ENCRYPTION_HELPER_CONTROL_SOCKET, sizeof (address.sun_path));
+
+  if ((fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "Unable to create socket: %s", g_strerror (errno));
+      return -1;
+    }
+
+  if (connect (fd, (struct sockaddr *) &address, sizeof (address)) < 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_CONNECTED,
+                   "The encryption helper is not running");
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+static void
+request_thread (GTask        *task,
+                gpointer      source_object,
+                const char   *request,
+                GCancellable *cancellable)
+{
+  char reply[DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX];
+  g_autoptr(GError) error = NULL;
+  ssize_t length;
+  int fd;
+
+  if ((fd = connect_to_helper (&error)) < 0)
+    {
+      g_task_return_error (task, g_steal_pointer (&error));
+      return;
+    }
+
+  if (send (fd, request, strlen (request), MSG_NOSIGNAL) < 0)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, g_io_error_from_errno (errno),
+                               "Unable to send request to the encryption helper: %s",
+                               g_strerror (errno));
+      close (fd);
+      return;
+    }
+
+  /* Some requests are answered only once the helper reaches a hotzone boundary */
+  do
+      length = recv (fd, reply, sizeof (reply) - 1, 0);
+  while (length < 0 && errno == EINTR);
+
+  close (fd);
+
+  if (length <= 0)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED,
+                               "No reply from the encryption helper");
+      return;
+    }
+
+  reply[length] = '\0';
+
+  if (!g_str_has_prefix (reply, DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_OK))
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                               "The encryption helper refused the request: %s", reply);
+      return;
+    }
+
+  g_task_return_pointer (task,
+                         g_strdup (g_strstrip (reply + strlen (DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_OK))),
+                         g_free);
+}
+
+GHashTable *
+droidian_encryption_service_helper_parse_reply (const char *reply)
+{
+  GHashTable *values = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_auto(GStrv) tokens = g_strsplit (reply, " ", -1);
+  char *separator;
+
+  for (char **token = tokens; *token != NULL; token++)
+    {
+      if (!(separator = strchr (*token, '=')))
+          continue;
+
+      g_hash_table_insert (values, g_strndup (*token, separator - *token), g_strdup (separator + 1));
+    }
+
+  return values;
+}
+
+static char *
+describe_event (const DroidianEncryptionHelperEvent *event)
+{
+  const char *name = NULL;
+  const char *detail = NULL;
+
+  if (event->type < G_N_ELEMENTS (event_names))
+      name = event_names[event->type];
+
+  if (event->type == DROIDIAN_ENCRYPTION_HELPER_EVENT_STAGE && event->code < G_N_ELEMENTS (stage_names))
+      detail = stage_names[event->code];
+  else if (event->type == DROIDIAN_ENCRYPTION_HELPER_EVENT_CONTROL && event->code < G_N_ELEMENTS (request_names))
+      detail = request_names[event->code];
+
+  if (!name)
+      return g_strdup_printf ("unknown-%u", event->type);
+
+  return detail ? g_strdup_printf ("%s:%s", name, detail) : g_strdup (name);
+}
+
+GVariant *
+droidian_encryption_service_helper_read_flight_record (DroidianEncryptionServiceHelper  *self,
+                                                       GError                          **error)
+{
+  const DroidianEncryptionHelperFlightRecord *record = NULL;
+  const DroidianEncryptionHelperEvent *slot;
+  DroidianEncryptionHelperEvent event;
+  GVariantBuilder builder;
+  GVariant *result = NULL;
+  gint64 monotonic_offset;
+  struct stat st;
+  guint64 sequence;
+  guint64 head;
+  guint64 index;
+  int fd;
+
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_HELPER (self), NULL);
+
+  /* Map the record rather than copying it, so that every slot can be
+   * validated against concurrent writes from the helper */
+  if ((fd = open (DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "Unable to open flight record: %s", g_strerror (errno));
+      return NULL;
+    }
+
+  if (fstat (fd, &st) < 0 || st.st_size != sizeof (DroidianEncryptionHelperFlightRecord))
+    {
+      close (fd);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Unsupported flight record format");
+      return NULL;
+    }
+
+  record = mmap (NULL, sizeof (DroidianEncryptionHelperFlightRecord), PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (record == MAP_FAILED)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "Unable to map flight record: %s", g_strerror (errno));
+      return NULL;
+    }
+
+  if (__atomic_load_n (&record->magic, __ATOMIC_ACQUIRE) != DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_MAGIC ||
+      record->version != DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_VERSION ||
+      record->capacity != DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_CAPACITY ||
+      record->event_size != sizeof (DroidianEncryptionHelperEvent))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Unsupported flight record format");
+      goto out;
+    }
+
+  /* Events carry monotonic timestamps, report them as wall clock time */
+  monotonic_offset = g_get_real_time () - g_get_monotonic_time ();
+  head = __atomic_load_n (&record->head, __ATOMIC_RELAXED);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(tsutt)"));
+
+  for (index = (head > DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_CAPACITY) ?
+               head - DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_CAPACITY : 0;
+       index < head; index++)
+    {
+      g_autofree char *name = NULL;
+
+      slot = &record->events[index % DROIDIAN_ENCRYPTION_HELPER_FLIGHT_RECORDER_CAPACITY];
+
+      if ((sequence = __atomic_load_n (&slot->sequence, __ATOMIC_ACQUIRE)) != index + 1)
+          continue;
+
+      event.timestamp = slot->timestamp;
+      event.type = slot->type;
+      event.code = slot->code;
+      event.value1 = slot->value1;
+      event.value2 = slot->value2;
+
+      /* Overwritten while we were reading */
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      if (__atomic_load_n (&slot->sequence, __ATOMIC_RELAXED) != sequence)
+          continue;
+
+      name = describe_event (&event);
+      g_variant_builder_add (&builder, "(tsutt)",
+                             (guint64) (event.timestamp + monotonic_offset),
+                             name, event.code, event.value1, event.value2);
+    }
+
+  result = g_variant_builder_end (&builder);
+
+out:
+  munmap ((gpointer) record, sizeof (DroidianEncryptionHelperFlightRecord));
+
+  return result;
+}
+
+gboolean
+droidian_encryption_service_helper_is_running (DroidianEncryptionServiceHelper *self)
+{
+  int fd;
+
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_HELPER (self), FALSE);
+
+  /* A socket left behind by a crashed helper refuses connections */
+  if ((fd = connect_to_helper (NULL)) < 0)
+      return FALSE;
+
+  close (fd);
+  return TRUE;
+}
+
+void
+droidian_encryption_service_helper_request_async (DroidianEncryptionServiceHelper *self,
+                                                  const char                      *request,
+                                                  GCancellable                    *cancellable,
+                                                  GAsyncReadyCallback              callback,
+                                                  gpointer                         user_data)
+{
+  g_autoptr(GTask) task = NULL;
+
+  g_return_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_HELPER (self));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, droidian_encryption_service_helper_request_async);
+  g_task_set_task_data (task, g_strdup (request), g_free);
+  g_task_run_in_thread (task, (GTaskThreadFunc) request_thread);
+}
+
+char *
+droidian_encryption_service_helper_request_finish (DroidianEncryptionServiceHelper *self,
+                                                   GAsyncResult                    *result,
+                                                   GError                         **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+droidian_encryption_service_helper_class_init (DroidianEncryptionServiceHelperClass *klass)
+{
+  (void) klass;
+}
+
+static void
+droidian_encryption_service_helper_init (DroidianEncryptionServiceHelper *self)
+{
+  (void) self;
+}
+
+DroidianEncryptionServiceHelper *
+droidian_encryption_service_helper_get_default (void)
+{
+  static DroidianEncryptionServiceHelper *instance = NULL;
+  static GMutex mutex;
+
+  g_mutex_lock (&mutex);
+
+  if (instance == NULL)
+    {
+      instance = g_object_new (DROIDIAN_ENCRYPTION_SERVICE_TYPE_HELPER, NULL);
+      g_object_add_weak_pointer (G_OBJECT (instance), (gpointer) &instance);
+    }
+  else
+    {
+      g_object_ref (instance);
+    }
+
+  g_mutex_unlock (&mutex);
+
+  return instance;
+}
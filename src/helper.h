@@ -0,0 +1,48 @@
+/* helper.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONSERVICEHELPER_H
+#define DROIDIANENCRYPTIONSERVICEHELPER_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define DROIDIAN_ENCRYPTION_SERVICE_TYPE_HELPER droidian_encryption_service_helper_get_type ()
+G_DECLARE_FINAL_TYPE (DroidianEncryptionServiceHelper, droidian_encryption_service_helper,
+                      DROIDIAN_ENCRYPTION_SERVICE, HELPER, GObject)
+
+DroidianEncryptionServiceHelper *droidian_encryption_service_helper_get_default (void);
+GHashTable *droidian_encryption_service_helper_parse_reply (const char *reply);
+gboolean droidian_encryption_service_helper_is_running (DroidianEncryptionServiceHelper *self);
+GVariant *droidian_encryption_service_helper_read_flight_record (DroidianEncryptionServiceHelper  *self,
+                                                                GError                          **error);
+void droidian_encryption_service_helper_request_async (DroidianEncryptionServiceHelper *self,
+                                                       const char                      *request,
+                                                       GCancellable                    *cancellable,
+                                                       GAsyncReadyCallback              callback,
+                                                       gpointer                         user_data);
+char *droidian_encryption_service_helper_request_finish (DroidianEncryptionServiceHelper *self,
+                                                         GAsyncResult                    *result,
+                                                         GError                         **error);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONSERVICEHELPER_H */
@@ -0,0 +1,345 @@
+/* job.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define G_LOG_DOMAIN "droidian-encryption-service-job"
+
+#define JOB_OBJECT_PATH_PREFIX "/Encryption/Job/"
+
+#include "job.h"
+#include "config.h"
+#include "dbus.h"
+
+struct _DroidianEncryptionServiceJob
+{
+  DroidianEncryptionServiceDbusJobSkeleton parent_instance;
+
+  /* instance members */
+  DroidianEncryptionServiceDbus *dbus;
+  char *object_path;
+
+  /* ProgressChanged coalescing */
+  gint64 min_interval;
+  gint64 last_emission;
+  guint pending_source_id;
+  double pending_progress;
+};
+
+typedef struct {
+  DroidianEncryptionServiceJob *job;
+  gint state;      /* -1 if unchanged */
+  char *stage;     /* NULL if unchanged */
+  double progress; /* < 0 if unchanged */
+  char *error;     /* NULL if unchanged */
+  char *timing_stage; /* NULL if no timing to add */
+  gint64 timing_usec;
+} JobUpdate;
+
+G_DEFINE_TYPE (DroidianEncryptionServiceJob, droidian_encryption_service_job,
+               DROIDIAN_ENCRYPTION_SERVICE_DBUS_TYPE_JOB_SKELETON);
+
+static void
+job_update_free (JobUpdate *update)
+{
+  g_object_unref (update->job);
+  g_free (update->stage);
+  g_free (update->error);
+  g_free (update->timing_stage);
+  g_free (update);
+}
+
+static void
+emit_progress (DroidianEncryptionServiceJob *self)
+{
+  DroidianEncryptionServiceDbusJob *dbus_job = DROIDIAN_ENCRYPTION_SERVICE_DBUS_JOB (self);
+
+  g_clear_handle_id (&self->pending_source_id, g_source_remove);
+  self->last_emission = g_get_monotonic_time ();
+
+  droidian_encryption_service_dbus_job_set_progress (dbus_job, self->pending_progress);
+  droidian_encryption_service_dbus_job_emit_progress_changed (dbus_job,
+                                                              droidian_encryption_service_dbus_job_get_stage (dbus_job),
+                                                              self->pending_progress);
+}
+
+static gboolean
+on_pending_progress_timeout (DroidianEncryptionServiceJob *self)
+{
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_JOB (self), G_SOURCE_REMOVE);
+
+  self->pending_source_id = 0;
+  emit_progress (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+queue_progress (DroidianEncryptionServiceJob *self,
+                double                        progress,
+                gboolean                      flush)
+{
+  gint64 elapsed;
+
+  self->pending_progress = progress;
+  elapsed = g_get_monotonic_time () - self->last_emission;
+
+  if (flush || elapsed >= self->min_interval)
+    {
+      emit_progress (self);
+    }
+  else if (!self->pending_source_id)
+    {
+      /* Rate limit reached, emit the latest value once the interval elapses */
+      self->pending_source_id =
+        g_timeout_add ((self->min_interval - elapsed) / 1000,
+                       G_SOURCE_FUNC (on_pending_progress_timeout), self);
+    }
+}
+
+static void
+add_stage_timing (DroidianEncryptionServiceJob *self,
+                  const char                   *stage,
+                  gint64                        usec)
+{
+  DroidianEncryptionServiceDbusJob *dbus_job = DROIDIAN_ENCRYPTION_SERVICE_DBUS_JOB (self);
+  GVariant *timings = droidian_encryption_service_dbus_job_get_stage_timings (dbus_job);
+  GVariantBuilder builder;
+  GVariantIter iter;
+  const char *name;
+  guint64 value;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{st}"));
+
+  if (timings)
+    {
+      g_variant_iter_init (&iter, timings);
+      while (g_variant_iter_next (&iter, "{&st}", &name, &value))
+        {
+          if (g_strcmp0 (name, stage) != 0)
+              g_variant_builder_add (&builder, "{st}", name, value);
+        }
+    }
+
+  g_variant_builder_add (&builder, "{st}", stage, (guint64) MAX (usec, 0));
+  droidian_encryption_service_dbus_job_set_stage_timings (dbus_job, g_variant_builder_end (&builder));
+}
+
+static gboolean
+apply_update (JobUpdate *update)
+{
+  DroidianEncryptionServiceJob *self = update->job;
+  DroidianEncryptionServiceDbusJob *dbus_job = DROIDIAN_ENCRYPTION_SERVICE_DBUS_JOB (self);
+  gboolean flush = FALSE;
+
+  if (droidian_encryption_service_dbus_job_get_state (dbus_job) != DROIDIAN_ENCRYPTION_SERVICE_JOB_STATE_RUNNING)
+    /* Job already finished, ignore stale updates */
+    return G_SOURCE_REMOVE;
+
+  if (update->error)
+      droidian_encryption_service_dbus_job_set_error (dbus_job, update->error);
+
+  if (update->timing_stage)
+      add_stage_timing (self, update->timing_stage, update->timing_usec);
+
+  if (update->stage &&
+      g_strcmp0 (update->stage, droidian_encryption_service_dbus_job_get_stage (dbus_job)) != 0)
+    {
+      droidian_encryption_service_dbus_job_set_stage (dbus_job, update->stage);
+      /* Stage transitions are always signalled right away */
+      flush = TRUE;
+    }
+
+  if (update->state > -1)
+    {
+      droidian_encryption_service_dbus_job_set_state (dbus_job, update->state);
+      flush = TRUE;
+    }
+
+  if (update->progress >= 0)
+      queue_progress (self, update->progress, flush);
+  else if (flush)
+      queue_progress (self, self->pending_progress, flush);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+queue_update (JobUpdate *update)
+{
+  /* Updates might come from the encryption thread, always apply them in the main context */
+  g_main_context_invoke_full (NULL, G_PRIORITY_DEFAULT,
+                              (GSourceFunc) apply_update, update,
+                              (GDestroyNotify) job_update_free);
+}
+
+static void
+push_update (DroidianEncryptionServiceJob *self,
+             gint                          state,
+             const char                   *stage,
+             double                        progress,
+             const char                   *error)
+{
+  JobUpdate *update;
+
+  g_return_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_JOB (self));
+
+  update = g_new0 (JobUpdate, 1);
+  update->job = g_object_ref (self);
+  update->state = state;
+  update->stage = g_strdup (stage);
+  update->progress = progress;
+  update->error = g_strdup (error);
+
+  queue_update (update);
+}
+
+const char *
+droidian_encryption_service_job_get_object_path (DroidianEncryptionServiceJob *self)
+{
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_JOB (self), NULL);
+
+  return self->object_path;
+}
+
+void
+droidian_encryption_service_job_set_stage (DroidianEncryptionServiceJob *self,
+                                           const char                   *stage,
+                                           double                        progress)
+{
+  push_update (self, -1, stage, progress, NULL);
+}
+
+void
+droidian_encryption_service_job_set_progress (DroidianEncryptionServiceJob *self,
+                                              double                        progress)
+{
+  push_update (self, -1, NULL, progress, NULL);
+}
+
+void
+droidian_encryption_service_job_add_stage_timing (DroidianEncryptionServiceJob *self,
+                                                  const char                   *stage,
+                                                  gint64                        usec)
+{
+  JobUpdate *update;
+
+  g_return_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_JOB (self));
+
+  update = g_new0 (JobUpdate, 1);
+  update->job = g_object_ref (self);
+  update->state = -1;
+  update->progress = -1;
+  update->timing_stage = g_strdup (stage);
+  update->timing_usec = usec;
+
+  queue_update (update);
+}
+
+void
+droidian_encryption_service_job_complete (DroidianEncryptionServiceJob *self)
+{
+  push_update (self, DROIDIAN_ENCRYPTION_SERVICE_JOB_STATE_COMPLETED, NULL, 1.0, NULL);
+}
+
+void
+droidian_encryption_service_job_fail (DroidianEncryptionServiceJob *self,
+                                      const char                   *message)
+{
+  push_update (self, DROIDIAN_ENCRYPTION_SERVICE_JOB_STATE_FAILED, NULL, -1, message);
+}
+
+static void
+droidian_encryption_service_job_constructed (GObject *obj)
+{
+  DroidianEncryptionServiceJob *self = DROIDIAN_ENCRYPTION_SERVICE_JOB (obj);
+  DroidianEncryptionServiceDbusJob *dbus_job = DROIDIAN_ENCRYPTION_SERVICE_DBUS_JOB (self);
+  g_autoptr (DroidianEncryptionServiceConfig) config = NULL;
+  g_autoptr (GError) error = NULL;
+  static guint job_serial = 0;
+  GDBusConnection *connection;
+  gint max_rate;
+
+  G_OBJECT_CLASS (droidian_encryption_service_job_parent_class)->constructed (obj);
+
+  self->dbus = droidian_encryption_service_dbus_get_default ();
+  self->object_path = g_strdup_printf (JOB_OBJECT_PATH_PREFIX "%u", ++job_serial);
+  self->last_emission = 0;
+  self->pending_source_id = 0;
+  self->pending_progress = 0.0;
+
+  config = droidian_encryption_service_config_get_default ();
+  max_rate = droidian_encryption_service_config_get_progress_signal_max_rate (config);
+  self->min_interval = (max_rate > 0) ? G_USEC_PER_SEC / max_rate : 0;
+
+  droidian_encryption_service_dbus_job_set_state (dbus_job, DROIDIAN_ENCRYPTION_SERVICE_JOB_STATE_RUNNING);
+  droidian_encryption_service_dbus_job_set_stage (dbus_job, "");
+  droidian_encryption_service_dbus_job_set_progress (dbus_job, 0.0);
+  droidian_encryption_service_dbus_job_set_error (dbus_job, "");
+  droidian_encryption_service_dbus_job_set_stage_timings (dbus_job, g_variant_new ("a{st}", NULL));
+
+  connection = droidian_encryption_service_dbus_get_connection (self->dbus);
+  if (!connection)
+    {
+      g_warning ("No bus connection available, job %s won't be exported", self->object_path);
+    }
+  else if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (self),
+                                              connection,
+                                              self->object_path,
+                                              &error))
+    {
+      g_warning ("Unable to export Job DBus interface: %s", error->message);
+    }
+}
+
+static void
+droidian_encryption_service_job_dispose (GObject *obj)
+{
+  DroidianEncryptionServiceJob *self = DROIDIAN_ENCRYPTION_SERVICE_JOB (obj);
+
+  g_debug ("Job dispose");
+
+  g_clear_handle_id (&self->pending_source_id, g_source_remove);
+
+  if (g_dbus_interface_skeleton_get_object_path (G_DBUS_INTERFACE_SKELETON (self)))
+      g_dbus_interface_skeleton_unexport (G_DBUS_INTERFACE_SKELETON (self));
+
+  g_clear_object (&self->dbus);
+  g_clear_pointer (&self->object_path, g_free);
+
+  G_OBJECT_CLASS (droidian_encryption_service_job_parent_class)->dispose (obj);
+}
+
+static void
+droidian_encryption_service_job_class_init (DroidianEncryptionServiceJobClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->constructed = droidian_encryption_service_job_constructed;
+  object_class->dispose = droidian_encryption_service_job_dispose;
+}
+
+static void
+droidian_encryption_service_job_init (DroidianEncryptionServiceJob *self)
+{
+  (void) self;
+}
+
+DroidianEncryptionServiceJob *
+droidian_encryption_service_job_new (void)
+{
+  return g_object_new (DROIDIAN_ENCRYPTION_SERVICE_TYPE_JOB, NULL);
+}
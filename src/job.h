@@ -0,0 +1,56 @@
+/* job.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONSERVICEJOB_H
+#define DROIDIANENCRYPTIONSERVICEJOB_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <gio/gio.h>
+
+#include "droidian-encryption-dbus.h"
+
+G_BEGIN_DECLS
+
+typedef enum {
+  DROIDIAN_ENCRYPTION_SERVICE_JOB_STATE_RUNNING = 0,
+  DROIDIAN_ENCRYPTION_SERVICE_JOB_STATE_COMPLETED,
+  DROIDIAN_ENCRYPTION_SERVICE_JOB_STATE_FAILED,
+} DroidianEncryptionServiceJobState;
+
+#define DROIDIAN_ENCRYPTION_SERVICE_TYPE_JOB droidian_encryption_service_job_get_type ()
+G_DECLARE_FINAL_TYPE (DroidianEncryptionServiceJob, droidian_encryption_service_job,
+                      DROIDIAN_ENCRYPTION_SERVICE, JOB, DroidianEncryptionServiceDbusJobSkeleton)
+
+DroidianEncryptionServiceJob *droidian_encryption_service_job_new (void);
+const char *droidian_encryption_service_job_get_object_path (DroidianEncryptionServiceJob *self);
+void droidian_encryption_service_job_set_stage (DroidianEncryptionServiceJob *self,
+                                                const char                   *stage,
+                                                double                        progress);
+void droidian_encryption_service_job_set_progress (DroidianEncryptionServiceJob *self,
+                                                   double                        progress);
+void droidian_encryption_service_job_add_stage_timing (DroidianEncryptionServiceJob *self,
+                                                       const char                   *stage,
+                                                       gint64                        usec);
+void droidian_encryption_service_job_complete (DroidianEncryptionServiceJob *self);
+void droidian_encryption_service_job_fail (DroidianEncryptionServiceJob *self,
+                                           const char                   *message);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONSERVICEJOB_H */
@@ -0,0 +1,422 @@
+/* logind.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define G_LOG_DOMAIN "droidian-encryption-service-logind"
+
+#define LOGIND_BUS_NAME "org.freedesktop.login1"
+#define LOGIND_OBJECT_PATH "/org/freedesktop/login1"
+#define LOGIND_MANAGER_INTERFACE "org.freedesktop.login1.Manager"
+
+#include <unistd.h>
+#include <gio/gunixfdlist.h>
+
+#include "logind.h"
+#include "config.h"
+
+struct _DroidianEncryptionServiceLogind
+{
+  GObject parent_instance;
+
+  GCancellable *cancellable;
+  GDBusProxy *manager;
+  gboolean idle;
+
+  /* Delay sleep inhibitor */
+  gboolean want_sleep_inhibitor;
+  gboolean sleep_inhibitor_pending;
+  int sleep_inhibitor_fd;
+};
+
+enum {
+  PROP_0,
+  PROP_IDLE,
+  N_PROPS
+};
+static GParamSpec *props[N_PROPS] = { NULL };
+
+enum {
+  PREPARE_FOR_SLEEP,
+  N_SIGNALS
+};
+static guint signals[N_SIGNALS] = { 0 };
+
+G_DEFINE_TYPE (DroidianEncryptionServiceLogind, droidian_encryption_service_logind, G_TYPE_OBJECT)
+
+static void
+update_idle (DroidianEncryptionServiceLogind *self)
+{
+  g_autoptr (GVariant) idle_hint = NULL;
+  gboolean idle = FALSE;
+
+  /* The manager IdleHint is set once every session is idle */
+  idle_hint = g_dbus_proxy_get_cached_property (self->manager, "IdleHint");
+  if (idle_hint && g_variant_is_of_type (idle_hint, G_VARIANT_TYPE_BOOLEAN))
+      idle = g_variant_get_boolean (idle_hint);
+
+  if (idle == self->idle)
+      return;
+
+  g_debug ("Sessions are now %s", idle ? "idle" : "active");
+
+  self->idle = idle;
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_IDLE]);
+}
+
+static void
+on_manager_properties_changed (DroidianEncryptionServiceLogind *self,
+                               GVariant                        *changed_properties,
+                               GStrv                            invalidated_properties,
+                               GDBusProxy                      *proxy)
+{
+  g_return_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_LOGIND (self));
+
+  update_idle (self);
+}
+
+static void
+on_manager_signal (DroidianEncryptionServiceLogind *self,
+                   const char                      *sender_name,
+                   const char                      *signal_name,
+                   GVariant                        *parameters,
+                   GDBusProxy                      *proxy)
+{
+  gboolean start;
+
+  g_return_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_LOGIND (self));
+
+  if (g_strcmp0 (signal_name, "PrepareForSleep") != 0 ||
+      !g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(b)")))
+      return;
+
+  g_variant_get (parameters, "(b)", &start);
+  g_debug ("%s", start ? "Going to sleep" : "Woken up");
+
+  g_signal_emit (self, signals[PREPARE_FOR_SLEEP], 0, start);
+}
+
+static void take_sleep_inhibitor (DroidianEncryptionServiceLogind *self);
+
+static void
+on_manager_proxy_ready (GObject                         *source_object,
+                        GAsyncResult                    *result,
+                        DroidianEncryptionServiceLogind *self)
+{
+  g_autoptr (GError) error = NULL;
+  GDBusProxy *proxy;
+
+  proxy = g_dbus_proxy_new_finish (result, &error);
+  if (!proxy)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+          g_warning ("Unable to watch logind, assuming the user is active: %s", error->message);
+      return;
+    }
+
+  self->manager = proxy;
+  g_signal_connect_object (self->manager, "g-properties-changed",
+                           G_CALLBACK (on_manager_properties_changed),
+                           self, G_CONNECT_SWAPPED);
+  g_signal_connect_object (self->manager, "g-signal",
+                           G_CALLBACK (on_manager_signal),
+                           self, G_CONNECT_SWAPPED);
+
+  update_idle (self);
+
+  /* Requested before logind was reachable */
+  if (self->want_sleep_inhibitor)
+      take_sleep_inhibitor (self);
+}
+
+static void
+on_inhibit_done (GDBusProxy                      *proxy,
+                 GAsyncResult                    *result,
+                 DroidianEncryptionServiceLogind *self)
+{
+  g_autoptr (GUnixFDList) fd_list = NULL;
+  g_autoptr (GVariant) reply = NULL;
+  g_autoptr (GError) error = NULL;
+  gint32 index;
+  int fd;
+
+  reply = g_dbus_proxy_call_with_unix_fd_list_finish (proxy, &fd_list, result, &error);
+  if (!reply)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_warning ("Unable to take the sleep inhibitor: %s", error->message);
+          self->sleep_inhibitor_pending = FALSE;
+        }
+      return;
+    }
+
+  self->sleep_inhibitor_pending = FALSE;
+
+  g_variant_get (reply, "(h)", &index);
+  if (!fd_list || (fd = g_unix_fd_list_get (fd_list, index, &error)) < 0)
+    {
+      g_warning ("No sleep inhibitor returned by logind");
+      return;
+    }
+
+  if (!self->want_sleep_inhibitor)
+    {
+      /* Released while the call was in flight */
+      close (fd);
+      return;
+    }
+
+  g_debug ("Took the sleep inhibitor");
+  self->sleep_inhibitor_fd = fd;
+}
+
+static void
+take_sleep_inhibitor (DroidianEncryptionServiceLogind *self)
+{
+  if (!self->manager || self->sleep_inhibitor_pending || self->sleep_inhibitor_fd > -1)
+      return;
+
+  self->sleep_inhibitor_pending = TRUE;
+  g_dbus_proxy_call_with_unix_fd_list (self->manager,
+                                       "Inhibit",
+                                       g_variant_new ("(ssss)", "sleep",
+                                                      "Droidian Encryption Service",
+                                                      "Finishing the current encryption step",
+                                                      "delay"),
+                                       G_DBUS_CALL_FLAGS_NONE,
+                                       -1,
+                                       NULL,
+                                       self->cancellable,
+                                       (GAsyncReadyCallback) on_inhibit_done,
+                                       self);
+}
+
+static void
+watch_manager (DroidianEncryptionServiceLogind *self,
+               GDBusConnection                 *connection,
+               GError                          *error)
+{
+  if (!connection)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+          g_warning ("Unable to connect to the logind bus, assuming the user is active: %s", error->message);
+      return;
+    }
+
+  g_dbus_proxy_new (connection,
+                    G_DBUS_PROXY_FLAGS_NONE,
+                    NULL,
+                    LOGIND_BUS_NAME,
+                    LOGIND_OBJECT_PATH,
+                    LOGIND_MANAGER_INTERFACE,
+                    self->cancellable,
+                    (GAsyncReadyCallback) on_manager_proxy_ready,
+                    self);
+}
+
+static void
+on_system_bus_ready (GObject                         *source_object,
+                     GAsyncResult                    *result,
+                     DroidianEncryptionServiceLogind *self)
+{
+  g_autoptr (GDBusConnection) connection = NULL;
+  g_autoptr (GError) error = NULL;
+
+  connection = g_bus_get_finish (result, &error);
+  watch_manager (self, connection, error);
+}
+
+static void
+on_private_bus_ready (GObject                         *source_object,
+                      GAsyncResult                    *result,
+                      DroidianEncryptionServiceLogind *self)
+{
+  g_autoptr (GDBusConnection) connection = NULL;
+  g_autoptr (GError) error = NULL;
+
+  connection = g_dbus_connection_new_for_address_finish (result, &error);
+  watch_manager (self, connection, error);
+}
+
+gboolean
+droidian_encryption_service_logind_get_idle (DroidianEncryptionServiceLogind *self)
+{
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_LOGIND (self), FALSE);
+
+  return self->idle;
+}
+
+void
+droidian_encryption_service_logind_inhibit_sleep (DroidianEncryptionServiceLogind *self,
+                                                  gboolean                         inhibit)
+{
+  g_return_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_LOGIND (self));
+
+  self->want_sleep_inhibitor = inhibit;
+
+  if (inhibit)
+    {
+      take_sleep_inhibitor (self);
+    }
+  else if (self->sleep_inhibitor_fd > -1)
+    {
+      /* Let the system go to sleep */
+      g_debug ("Releasing the sleep inhibitor");
+      close (self->sleep_inhibitor_fd);
+      self->sleep_inhibitor_fd = -1;
+    }
+}
+
+gboolean
+droidian_encryption_service_logind_is_inhibiting_sleep (DroidianEncryptionServiceLogind *self)
+{
+  g_return_val_if_fail (DROIDIAN_ENCRYPTION_SERVICE_IS_LOGIND (self), FALSE);
+
+  /* Wanted is not enough, logind might not be there at all */
+  return self->sleep_inhibitor_fd > -1 || self->sleep_inhibitor_pending;
+}
+
+static void
+droidian_encryption_service_logind_get_property (GObject    *object,
+                                                 guint       prop_id,
+                                                 GValue     *value,
+                                                 GParamSpec *pspec)
+{
+  DroidianEncryptionServiceLogind *self = DROIDIAN_ENCRYPTION_SERVICE_LOGIND (object);
+
+  switch (prop_id)
+    {
+    case PROP_IDLE:
+      g_value_set_boolean (value, self->idle);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
+static void
+droidian_encryption_service_logind_constructed (GObject *obj)
+{
+  DroidianEncryptionServiceLogind *self = DROIDIAN_ENCRYPTION_SERVICE_LOGIND (obj);
+  g_autoptr (DroidianEncryptionServiceConfig) config = NULL;
+  g_autofree char *bus_address = NULL;
+
+  G_OBJECT_CLASS (droidian_encryption_service_logind_parent_class)->constructed (obj);
+
+  self->cancellable = g_cancellable_new ();
+  self->manager = NULL;
+  self->idle = FALSE;
+  self->want_sleep_inhibitor = FALSE;
+  self->sleep_inhibitor_pending = FALSE;
+  self->sleep_inhibitor_fd = -1;
+
+  config = droidian_encryption_service_config_get_default ();
+  bus_address = droidian_encryption_service_config_get_logind_bus_address (config);
+
+  if (bus_address && *bus_address != '\0')
+    {
+      /* Talk to a logind implementation on a private bus */
+      g_dbus_connection_new_for_address (bus_address,
+                                         G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                         G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                         NULL,
+                                         self->cancellable,
+                                         (GAsyncReadyCallback) on_private_bus_ready,
+                                         self);
+    }
+  else
+    {
+      g_bus_get (G_BUS_TYPE_SYSTEM, self->cancellable,
+                 (GAsyncReadyCallback) on_system_bus_ready, self);
+    }
+}
+
+static void
+droidian_encryption_service_logind_dispose (GObject *obj)
+{
+  DroidianEncryptionServiceLogind *self = DROIDIAN_ENCRYPTION_SERVICE_LOGIND (obj);
+
+  g_debug ("Logind dispose");
+
+  if (self->cancellable)
+      g_cancellable_cancel (self->cancellable);
+
+  if (self->sleep_inhibitor_fd > -1)
+    {
+      close (self->sleep_inhibitor_fd);
+      self->sleep_inhibitor_fd = -1;
+    }
+
+  g_clear_object (&self->cancellable);
+  g_clear_object (&self->manager);
+
+  G_OBJECT_CLASS (droidian_encryption_service_logind_parent_class)->dispose (obj);
+}
+
+static void
+droidian_encryption_service_logind_class_init (DroidianEncryptionServiceLogindClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->constructed  = droidian_encryption_service_logind_constructed;
+  object_class->dispose      = droidian_encryption_service_logind_dispose;
+  object_class->get_property = droidian_encryption_service_logind_get_property;
+
+  props[PROP_IDLE] =
+    g_param_spec_boolean ("idle", "Idle", "Whether every session is idle",
+                          FALSE,
+                          G_PARAM_READABLE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class, N_PROPS, props);
+
+  signals[PREPARE_FOR_SLEEP] =
+    g_signal_new ("prepare-for-sleep",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE, 1, G_TYPE_BOOLEAN);
+}
+
+static void
+droidian_encryption_service_logind_init (DroidianEncryptionServiceLogind *self)
+{
+  (void) self;
+}
+
+DroidianEncryptionServiceLogind *
+droidian_encryption_service_logind_get_default (void)
+{
+  static DroidianEncryptionServiceLogind *instance = NULL;
+  static GMutex mutex;
+
+  g_mutex_lock (&mutex);
+
+  if (instance == NULL)
+    {
+      instance = g_object_new (DROIDIAN_ENCRYPTION_SERVICE_TYPE_LOGIND, NULL);
+      g_object_add_weak_pointer (G_OBJECT (instance), (gpointer) &instance);
+    }
+  else
+    {
+      g_object_ref (instance);
+    }
+
+  g_mutex_unlock (&mutex);
+
+  return instance;
+}
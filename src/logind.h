@@ -0,0 +1,40 @@
+/* logind.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONSERVICELOGIND_H
+#define DROIDIANENCRYPTIONSERVICELOGIND_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define DROIDIAN_ENCRYPTION_SERVICE_TYPE_LOGIND droidian_encryption_service_logind_get_type ()
+G_DECLARE_FINAL_TYPE (DroidianEncryptionServiceLogind, droidian_encryption_service_logind,
+                      DROIDIAN_ENCRYPTION_SERVICE, LOGIND, GObject)
+
+DroidianEncryptionServiceLogind *droidian_encryption_service_logind_get_default (void);
+gboolean droidian_encryption_service_logind_get_idle (DroidianEncryptionServiceLogind *self);
+void droidian_encryption_service_logind_inhibit_sleep (DroidianEncryptionServiceLogind *self,
+                                                       gboolean                         inhibit);
+gboolean droidian_encryption_service_logind_is_inhibiting_sleep (DroidianEncryptionServiceLogind *self);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONSERVICELOGIND_H */
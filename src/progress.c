@@ -0,0 +1,338 @@
+/* progress.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <json-c/json.h>
+#include <libdevmapper.h>
+
+#include "progress.h"
+
+#define SECTOR_SIZE 512
+
+static struct dm_task *
+get_table (const char *mapped_name,
+           guint       major,
+           guint       minor)
+{
+  struct dm_task *dmt;
+  struct dm_info info;
+
+  if (!(dmt = dm_task_create (DM_DEVICE_TABLE)))
+      return NULL;
+
+  if ((mapped_name ? !dm_task_set_name (dmt, mapped_name) :
+                     !dm_task_set_major_minor (dmt, major, minor, 0)) ||
+      !dm_task_run (dmt) ||
+      !dm_task_get_info (dmt, &info) ||
+      !info.exists)
+    {
+      dm_task_destroy (dmt);
+      return NULL;
+    }
+
+  return dmt;
+}
+
+static struct dm_task *
+follow_linear (struct dm_task *dmt)
+{
+  struct dm_task *lower;
+  uint64_t start, length;
+  char *type, *params;
+  guint major, minor;
+  void *next;
+
+  /* A mapping replaced by a single linear target on top of the real table */
+  type = params = NULL;
+  next = dm_get_next_target (dmt, NULL, &start, &length, &type, &params);
+  if (next || g_strcmp0 (type, "linear") != 0 ||
+      !params || sscanf (params, "%u:%u", &major, &minor) != 2 ||
+      !(lower = get_table (NULL, major, minor)))
+      return dmt;
+
+  dm_task_destroy (dmt);
+  return lower;
+}
+
+gboolean
+droidian_encryption_service_progress_from_table (const char  *mapped_name,
+                                                 guint64     *offset,
+                                                 guint64     *size,
+                                                 char       **layout)
+{
+  g_autoptr (GString) description = g_string_new (NULL);
+  struct dm_task *dmt;
+  uint64_t start, length;
+  char *type, *params;
+  guint64 first_end = 0;
+  gboolean first_is_crypt = FALSE;
+  guint targets = 0;
+  void *next = NULL;
+
+  *layout = NULL;
+
+  if (!(dmt = get_table (mapped_name, 0, 0)))
+      return FALSE;
+
+  dmt = follow_linear (dmt);
+
+  do
+    {
+      type = NULL;
+      next = dm_get_next_target (dmt, next, &start, &length, &type, &params);
+      if (!type)
+          break;
+
+      /* The parameters carry the key, never keep them */
+      g_string_append_printf (description, "%" G_GUINT64_FORMAT "+%" G_GUINT64_FORMAT ":%s;",
+                              (guint64) start, (guint64) length, type);
+
+      if (targets++ == 0)
+        {
+          first_is_crypt = g_strcmp0 (type, "crypt") == 0;
+          first_end = start + length;
+        }
+
+      *size = (start + length) * SECTOR_SIZE;
+    }
+  while (next);
+
+  dm_task_destroy (dmt);
+
+  *layout = g_string_free (g_steal_pointer (&description), FALSE);
+
+  /* Not started yet, over, or something else entirely */
+  if (targets < 2)
+      return FALSE;
+
+  /* A hotzone (or the old segment) first means nothing has been written yet */
+  *offset = first_is_crypt ? first_end * SECTOR_SIZE : 0;
+
+  return TRUE;
+}
+
+#ifdef HAVE_CRYPT_DUMP_JSON
+typedef struct {
+  guint index;
+  guint64 offset;
+  const char *type;
+  const char *encryption;
+  gint64 sector_size;
+  gboolean in_reencryption;
+} Segment;
+
+static gboolean
+has_flag (struct json_object *segment,
+          const char         *prefix)
+{
+  struct json_object *flags;
+  size_t i;
+
+  if (!json_object_object_get_ex (segment, "flags", &flags) ||
+      !json_object_is_type (flags, json_type_array))
+      return FALSE;
+
+  for (i = 0; i < json_object_array_length (flags); i++)
+    {
+      if (g_str_has_prefix (json_object_get_string (json_object_array_get_idx (flags, i)), prefix))
+          return TRUE;
+    }
+
+  return FALSE;
+}
+
+static const char *
+get_string (struct json_object *object,
+            const char         *key)
+{
+  struct json_object *value;
+
+  if (!json_object_object_get_ex (object, key, &value))
+      return NULL;
+
+  return json_object_get_string (value);
+}
+
+static gboolean
+parse_segment (const char         *key,
+               struct json_object *object,
+               Segment            *segment)
+{
+  const char *value;
+  char *end;
+
+  segment->index = (guint) g_ascii_strtoull (key, &end, 10);
+  if (end == key || *end != '\0')
+      return FALSE;
+
+  /* 64 bit values are strings in LUKS2 */
+  if (!(value = get_string (object, "offset")))
+      return FALSE;
+  segment->offset = g_ascii_strtoull (value, &end, 10);
+  if (end == value || *end != '\0')
+      return FALSE;
+
+  segment->type = get_string (object, "type");
+  segment->encryption = get_string (object, "encryption");
+  segment->sector_size = (value = get_string (object, "sector_size")) ? g_ascii_strtoll (value, NULL, 10) : 0;
+  segment->in_reencryption = has_flag (object, "in-reencryption");
+
+  return TRUE;
+}
+
+static gboolean
+is_same_segment_kind (const Segment *segment,
+                      const Segment *other)
+{
+  return g_strcmp0 (segment->type, other->type) == 0 &&
+         g_strcmp0 (segment->encryption, other->encryption) == 0 &&
+         segment->sector_size == other->sector_size;
+}
+
+static gint
+compare_segments (const Segment *a,
+                  const Segment *b)
+{
+  return (a->index > b->index) - (a->index < b->index);
+}
+#endif
+
+gboolean
+droidian_encryption_service_progress_from_segments (struct crypt_device *crypt_device,
+                                                    guint64             *offset)
+{
+#ifdef HAVE_CRYPT_DUMP_JSON
+  g_autoptr (GArray) segments = g_array_new (FALSE, FALSE, sizeof (Segment));
+  struct json_object *metadata = NULL;
+  struct json_object *object;
+  const Segment *first;
+  const Segment *segment;
+  Segment final = { 0 };
+  Segment parsed;
+  gboolean have_final = FALSE;
+  gboolean result = FALSE;
+  const char *json = NULL;
+  guint i;
+
+  if (crypt_dump_json (crypt_device, &json, 0) < 0 || !json ||
+      !(metadata = json_tokener_parse (json)) ||
+      !json_object_object_get_ex (metadata, "segments", &object) ||
+      !json_object_is_type (object, json_type_object))
+      goto out;
+
+  json_object_object_foreach (object, key, value)
+    {
+      if (!parse_segment (key, value, &parsed))
+          goto out;
+
+      /* The backups are kept around for recovery, they don't map anything.
+       * backup-final describes the new segment. */
+      if (has_flag (value, "backup-final"))
+        {
+          final = parsed;
+          have_final = TRUE;
+        }
+      else if (!has_flag (value, "backup-"))
+        {
+          g_array_append_val (segments, parsed);
+        }
+    }
+
+  if (!segments->len)
+      goto out;
+
+  /* Segments are mapped in the order of their keys */
+  g_array_sort (segments, (GCompareFunc) compare_segments);
+  first = &g_array_index (segments, Segment, 0);
+
+  /*
+   * Forward reencryption: the new segment, possibly the hotzone being
+   * rewritten (flagged in-reencryption, after a crash), then the old one.
+   * Progress ends where the first segment not in the new format starts.
+   * Without a backup-final segment, only the first one can be the new one.
+   */
+  for (i = 0; i < segments->len; i++)
+    {
+      segment = &g_array_index (segments, Segment, i);
+
+      if (segment->in_reencryption ||
+          (have_final ? !is_same_segment_kind (segment, &final) : (i > 0 || segments->len == 1)))
+        {
+          *offset = segment->offset - MIN (first->offset, segment->offset);
+          result = TRUE;
+          break;
+        }
+    }
+
+  /* Otherwise everything is in the new format already: the size can't be
+   * told from here, the caller knows the reencryption is about to end */
+
+out:
+  if (metadata)
+      json_object_put (metadata);
+
+  return result;
+#else
+  (void) crypt_device;
+  (void) offset;
+
+  /* crypt_dump_json() needs cryptsetup >= 2.6 */
+  return FALSE;
+#endif
+}
+
+guint64
+droidian_encryption_service_progress_estimate_remaining_time (GArray  *history,
+                                                              guint64  remaining)
+{
+  DroidianEncryptionHistorySession *first, *last, *session;
+  double bytes = 0, active_usec = 0;
+  double needed_usec, days;
+  gint64 span;
+  guint i;
+
+  if (!history || !history->len)
+      return 0;
+
+  for (i = 0; i < history->len; i++)
+    {
+      session = &g_array_index (history, DroidianEncryptionHistorySession, i);
+      bytes += session->end_offset - session->start_offset;
+      active_usec += session->active_usec;
+    }
+
+  if (bytes <= 0 || active_usec <= 0)
+      return 0;
+
+  needed_usec = remaining * (active_usec / bytes);
+
+  /*
+   * The helper only runs while the device is on: spread the remaining
+   * active time over the days according to the observed usage.
+   */
+  first = &g_array_index (history, DroidianEncryptionHistorySession, 0);
+  last = &g_array_index (history, DroidianEncryptionHistorySession, history->len - 1);
+  span = last->started_at + last->active_usec + last->paused_usec - first->started_at;
+  days = (double) span / (G_USEC_PER_SEC * 86400.0);
+
+  if (days >= 1 && active_usec / days < G_USEC_PER_SEC * 86400.0)
+      needed_usec *= (G_USEC_PER_SEC * 86400.0) / (active_usec / days);
+
+  return (guint64) (needed_usec / G_USEC_PER_SEC);
+}
@@ -0,0 +1,65 @@
+/* progress.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONSERVICEPROGRESS_H
+#define DROIDIANENCRYPTIONSERVICEPROGRESS_H
+
+#include <glib.h>
+#include <libcryptsetup.h>
+
+#include "history.h"
+
+G_BEGIN_DECLS
+
+/*
+ * Reencryption progress without the helper. LUKS2 reencrypts forward, and
+ * while it's running the mapping is split in the new segment, up to the
+ * current offset, the hotzone and the old segment (or a linear target,
+ * when encrypting). Between hotzones the split is also in the segments of
+ * the LUKS2 header, which are the only source when the table can't tell
+ * (a single target, before the first hotzone or with a different layout).
+ *
+ * The table layout (targets and their extents, never their parameters) is
+ * returned so that what has been derived from the header can be cached
+ * until the mapping changes.
+ */
+
+/* TRUE if the table is split. layout and size are set whenever the table could be read. */
+gboolean droidian_encryption_service_progress_from_table (const char  *mapped_name,
+                                                          guint64     *offset,
+                                                          guint64     *size,
+                                                          char       **layout);
+
+/*
+ * crypt_device must be loaded and in reencryption. The offset is where the
+ * old segment, or a hotzone left behind by a crash, starts.
+ */
+gboolean droidian_encryption_service_progress_from_segments (struct crypt_device *crypt_device,
+                                                             guint64             *offset);
+
+/*
+ * Seconds needed to reencrypt the remaining bytes, from the throughput of
+ * the recorded sessions, spread over the days according to how long the
+ * device has been running each day. 0 if there's nothing to go by.
+ */
+guint64 droidian_encryption_service_progress_estimate_remaining_time (GArray  *history,
+                                                                      guint64  remaining);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONSERVICEPROGRESS_H */
@@ -0,0 +1,147 @@
+/* trim.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <json-c/json.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "trim.h"
+
+/* LUKS2 supports up to 32 tokens */
+#define LUKS2_TOKENS_MAX 32
+
+static int
+find_token (struct crypt_device *crypt_device)
+{
+  const char *type;
+  int token;
+
+  for (token = 0; token < LUKS2_TOKENS_MAX; token++)
+    {
+      if (crypt_token_status (crypt_device, token, &type) != CRYPT_TOKEN_INACTIVE &&
+          g_strcmp0 (type, DROIDIAN_ENCRYPTION_SERVICE_TRIM_TOKEN_TYPE) == 0)
+          return token;
+    }
+
+  return -1;
+}
+
+/* Numbers are stored as strings, as LUKS2 does for 64 bits values */
+static gboolean
+parse_value (struct json_object *token,
+             const char         *key,
+             guint64            *value)
+{
+  struct json_object *object;
+  const char *string;
+  char *end;
+
+  if (!json_object_object_get_ex (token, key, &object) ||
+      !json_object_is_type (object, json_type_string))
+      return FALSE;
+
+  string = json_object_get_string (object);
+  *value = g_ascii_strtoull (string, &end, 10);
+
+  return end != string && *end == '\0';
+}
+
+void
+droidian_encryption_service_trim_load_state (struct crypt_device                *crypt_device,
+                                             DroidianEncryptionServiceTrimState *state)
+{
+  struct json_object *object;
+  const char *json;
+  guint64 offset = 0;
+  guint64 done = 0;
+  int token;
+
+  state->offset = 0;
+  state->done = FALSE;
+
+  if ((token = find_token (crypt_device)) < 0 ||
+      crypt_token_json_get (crypt_device, token, &json) < 0 ||
+      !(object = json_tokener_parse (json)))
+      return;
+
+  if (parse_value (object, "offset", &offset))
+      state->offset = offset;
+
+  if (parse_value (object, "done", &done))
+      state->done = done != 0;
+
+  json_object_put (object);
+}
+
+int
+droidian_encryption_service_trim_save_state (struct crypt_device                      *crypt_device,
+                                             const DroidianEncryptionServiceTrimState *state)
+{
+  g_autofree char *offset = g_strdup_printf ("%" G_GUINT64_FORMAT, state->offset);
+  struct json_object *object;
+  int token;
+  int result;
+
+  object = json_object_new_object ();
+  json_object_object_add (object, "type", json_object_new_string (DROIDIAN_ENCRYPTION_SERVICE_TRIM_TOKEN_TYPE));
+  json_object_object_add (object, "keyslots", json_object_new_array ());
+  json_object_object_add (object, "offset", json_object_new_string (offset));
+  json_object_object_add (object, "done", json_object_new_string (state->done ? "1" : "0"));
+
+  token = find_token (crypt_device);
+  result = crypt_token_json_set (crypt_device, (token > -1) ? token : CRYPT_ANY_TOKEN,
+                                 json_object_to_json_string_ext (object, JSON_C_TO_STRING_PLAIN));
+  json_object_put (object);
+
+  return result;
+}
+
+int
+droidian_encryption_service_trim_reset_state (struct crypt_device *crypt_device)
+{
+  int token;
+
+  if ((token = find_token (crypt_device)) < 0)
+      return 0;
+
+  /* A NULL JSON removes the token */
+  return crypt_token_json_set (crypt_device, token, NULL);
+}
+
+int
+droidian_encryption_service_trim_range (int      fd,
+                                        guint64  start,
+                                        guint64  length,
+                                        guint64 *trimmed)
+{
+  struct fstrim_range range = {
+    .start = start,
+    .len = length,
+    .minlen = 0,
+  };
+
+  if (ioctl (fd, FITRIM, &range) < 0)
+      return -errno;
+
+  /* The kernel reports how much has actually been discarded */
+  if (trimmed)
+      *trimmed = range.len;
+
+  return 0;
+}
@@ -0,0 +1,56 @@
+/* trim.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONSERVICETRIM_H
+#define DROIDIANENCRYPTIONSERVICETRIM_H
+
+#include <glib.h>
+#include <libcryptsetup.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Reencryption writes every block of the data device, so once it's over
+ * the flash controller considers all of it in use. The free space of the
+ * root filesystem is then discarded through the mapped device, one chunk
+ * at a time, and the position is kept in a LUKS2 token so that the pass
+ * resumes where it stopped:
+ *
+ * { "type": "droidian-trim", "keyslots": [], "offset": "<bytes>", "done": "<0|1>" }
+ */
+
+#define DROIDIAN_ENCRYPTION_SERVICE_TRIM_TOKEN_TYPE "droidian-trim"
+
+typedef struct {
+  guint64 offset;
+  gboolean done;
+} DroidianEncryptionServiceTrimState;
+
+void droidian_encryption_service_trim_load_state (struct crypt_device                *crypt_device,
+                                                  DroidianEncryptionServiceTrimState *state);
+int droidian_encryption_service_trim_save_state (struct crypt_device                      *crypt_device,
+                                                 const DroidianEncryptionServiceTrimState *state);
+int droidian_encryption_service_trim_reset_state (struct crypt_device *crypt_device);
+int droidian_encryption_service_trim_range (int      fd,
+                                            guint64  start,
+                                            guint64  length,
+                                            guint64 *trimmed);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONSERVICETRIM_H */
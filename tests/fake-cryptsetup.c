@@ -0,0 +1,399 @@
+/* fake-cryptsetup.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <json-c/json.h>
+
+#include "fake-cryptsetup.h"
+#include "virtual-clock.h"
+
+/* LUKS2 supports up to 32 tokens */
+#define LUKS2_TOKENS_MAX 32
+
+typedef struct {
+  char *path;
+  FakeCryptModel model;
+  guint64 offset;
+  gint64 busy_usec;
+  char *metadata;
+  char *tokens[LUKS2_TOKENS_MAX];
+  char *token_types[LUKS2_TOKENS_MAX];
+} FakeDevice;
+
+struct crypt_device
+{
+  FakeDevice *device;
+  gboolean reencrypt_initialized;
+};
+
+static GHashTable *devices = NULL;
+
+static void
+fake_device_free (FakeDevice *device)
+{
+  for (guint token = 0; token < LUKS2_TOKENS_MAX; token++)
+    {
+      g_free (device->tokens[token]);
+      g_free (device->token_types[token]);
+    }
+
+  g_free (device->metadata);
+  g_free (device->path);
+  g_free (device);
+}
+
+static FakeDevice *
+lookup_device (const char *path)
+{
+  if (!devices || !path)
+      return NULL;
+
+  return g_hash_table_lookup (devices, path);
+}
+
+void
+fake_crypt_add_device (const char           *path,
+                       const FakeCryptModel *model)
+{
+  FakeDevice *device;
+
+  g_return_if_fail (model->hotzone_size > 0 && model->bytes_per_second > 0);
+
+  if (!devices)
+      devices = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) fake_device_free);
+
+  device = g_new0 (FakeDevice, 1);
+  device->path = g_strdup (path);
+  device->model = *model;
+
+  g_hash_table_replace (devices, device->path, device);
+}
+
+void
+fake_crypt_remove_device (const char *path)
+{
+  if (devices)
+      g_hash_table_remove (devices, path);
+}
+
+guint64
+fake_crypt_get_offset (const char *path)
+{
+  FakeDevice *device = lookup_device (path);
+
+  g_return_val_if_fail (device != NULL, 0);
+
+  return device->offset;
+}
+
+void
+fake_crypt_set_offset (const char *path,
+                       guint64     offset)
+{
+  FakeDevice *device = lookup_device (path);
+
+  g_return_if_fail (device != NULL);
+
+  device->offset = MIN (offset, device->model.size);
+}
+
+gint64
+fake_crypt_get_busy_usec (const char *path)
+{
+  FakeDevice *device = lookup_device (path);
+
+  g_return_val_if_fail (device != NULL, 0);
+
+  return device->busy_usec;
+}
+
+void
+fake_crypt_set_metadata (const char *path,
+                         const char *json)
+{
+  FakeDevice *device = lookup_device (path);
+
+  g_return_if_fail (device != NULL);
+
+  g_free (device->metadata);
+  device->metadata = g_strdup (json);
+}
+
+int
+crypt_init (struct crypt_device **cd,
+            const char           *device)
+{
+  return crypt_init_data_device (cd, device, NULL);
+}
+
+int
+crypt_init_data_device (struct crypt_device **cd,
+                        const char           *device,
+                        const char           *data_device)
+{
+  FakeDevice *fake_device = lookup_device (device);
+
+  (void) data_device;
+
+  if (!fake_device)
+      return -ENOENT;
+
+  *cd = g_new0 (struct crypt_device, 1);
+  (*cd)->device = fake_device;
+
+  return 0;
+}
+
+int
+crypt_load (struct crypt_device *cd,
+            const char          *requested_type,
+            void                *params)
+{
+  (void) params;
+
+  /* Only LUKS2 headers exist here */
+  if (requested_type && g_strcmp0 (requested_type, CRYPT_LUKS2) != 0)
+      return -EINVAL;
+
+  return lookup_device (cd->device->path) ? 0 : -ENODEV;
+}
+
+void
+crypt_free (struct crypt_device *cd)
+{
+  g_free (cd);
+}
+
+const char *
+crypt_get_device_name (struct crypt_device *cd)
+{
+  return cd->device->path;
+}
+
+crypt_status_info
+crypt_status (struct crypt_device *cd,
+              const char          *name)
+{
+  (void) name;
+
+  /* Devices are always active while reencrypting online */
+  return (cd && lookup_device (cd->device->path)) ? CRYPT_ACTIVE : CRYPT_INACTIVE;
+}
+
+crypt_reencrypt_info
+crypt_reencrypt_status (struct crypt_device            *cd,
+                        struct crypt_params_reencrypt *params)
+{
+  FakeDevice *device = cd->device;
+
+  if (params)
+    {
+      memset (params, 0, sizeof (*params));
+      params->mode = CRYPT_REENCRYPT_REENCRYPT;
+      params->direction = CRYPT_REENCRYPT_FORWARD;
+      params->resilience = "checksum";
+      params->hash = "sha256";
+    }
+
+  return (device->offset < device->model.size) ? CRYPT_REENCRYPT_CLEAN : CRYPT_REENCRYPT_NONE;
+}
+
+int
+crypt_reencrypt_init_by_passphrase (struct crypt_device                 *cd,
+                                    const char                          *name,
+                                    const char                          *passphrase,
+                                    size_t                               passphrase_size,
+                                    int                                  keyslot_old,
+                                    int                                  keyslot_new,
+                                    const char                          *cipher,
+                                    const char                          *cipher_mode,
+                                    const struct crypt_params_reencrypt *params)
+{
+  (void) name;
+  (void) keyslot_old;
+  (void) cipher;
+  (void) cipher_mode;
+  (void) params;
+
+  if (!passphrase || !passphrase_size)
+      return -EPERM;
+
+  if (crypt_reencrypt_status (cd, NULL) != CRYPT_REENCRYPT_CLEAN)
+      return -EINVAL;
+
+  cd->reencrypt_initialized = TRUE;
+
+  return MAX (keyslot_new, 0);
+}
+
+int
+crypt_reencrypt_run (struct crypt_device *cd,
+                     int                (*progress) (uint64_t size, uint64_t offset, void *usrptr),
+                     void                *usrptr)
+{
+  FakeDevice *device = cd->device;
+  guint64 length;
+  gint64 usec;
+
+  if (!cd->reencrypt_initialized)
+      return -EINVAL;
+
+  cd->reencrypt_initialized = FALSE;
+
+  while (device->offset < device->model.size)
+    {
+      length = MIN (device->model.hotzone_size, device->model.size - device->offset);
+      usec = (gint64) (length * G_USEC_PER_SEC / device->model.bytes_per_second) + device->model.checkpoint_usec;
+
+      virtual_clock_advance (usec);
+      device->busy_usec += usec;
+      device->offset += length;
+
+      /* The checkpoint is written before the callback, stopping here loses nothing */
+      if (progress && progress (device->model.size, device->offset, usrptr))
+          break;
+    }
+
+  return 0;
+}
+
+static gsize
+get_tokens_size (FakeDevice *device)
+{
+  gsize size = 0;
+
+  for (guint token = 0; token < LUKS2_TOKENS_MAX; token++)
+      size += device->tokens[token] ? strlen (device->tokens[token]) : 0;
+
+  return size;
+}
+
+crypt_token_info
+crypt_token_status (struct crypt_device  *cd,
+                    int                   token,
+                    const char          **type)
+{
+  FakeDevice *device = cd->device;
+
+  if (token < 0 || token >= LUKS2_TOKENS_MAX)
+      return CRYPT_TOKEN_INVALID;
+
+  if (!device->tokens[token])
+      return CRYPT_TOKEN_INACTIVE;
+
+  if (type)
+      *type = device->token_types[token];
+
+  /* No token handler is ever loaded here */
+  return CRYPT_TOKEN_EXTERNAL_UNKNOWN;
+}
+
+int
+crypt_token_json_get (struct crypt_device  *cd,
+                      int                   token,
+                      const char          **json)
+{
+  FakeDevice *device = cd->device;
+
+  if (token < 0 || token >= LUKS2_TOKENS_MAX)
+      return -EINVAL;
+
+  if (!device->tokens[token])
+      return -ENOENT;
+
+  *json = device->tokens[token];
+
+  return token;
+}
+
+int
+crypt_token_json_set (struct crypt_device *cd,
+                      int                  token,
+                      const char          *json)
+{
+  FakeDevice *device = cd->device;
+  struct json_object *object;
+  struct json_object *value;
+  g_autofree char *type = NULL;
+  gsize replaced;
+
+  if (token == CRYPT_ANY_TOKEN)
+    {
+      if (!json)
+          return -EINVAL;
+
+      for (token = 0; token < LUKS2_TOKENS_MAX && device->tokens[token]; token++)
+          ;
+    }
+
+  if (token < 0 || token >= LUKS2_TOKENS_MAX)
+      return -EINVAL;
+
+  /* Removal */
+  if (!json)
+    {
+      g_clear_pointer (&device->tokens[token], g_free);
+      g_clear_pointer (&device->token_types[token], g_free);
+      return token;
+    }
+
+  /* The same checks as LUKS2: an object with a type and keyslots */
+  if (!(object = json_tokener_parse (json)))
+      return -EINVAL;
+
+  if (json_object_object_get_ex (object, "type", &value) &&
+      json_object_is_type (value, json_type_string) &&
+      json_object_object_get_ex (object, "keyslots", NULL))
+      type = g_strdup (json_object_get_string (value));
+
+  json_object_put (object);
+
+  if (!type)
+      return -EINVAL;
+
+  /* The header is left untouched when the JSON area is full */
+  replaced = device->tokens[token] ? strlen (device->tokens[token]) : 0;
+  if (device->model.json_area_size &&
+      get_tokens_size (device) - replaced + strlen (json) > device->model.json_area_size)
+      return -ENOSPC;
+
+  g_free (device->tokens[token]);
+  g_free (device->token_types[token]);
+  device->tokens[token] = g_strdup (json);
+  device->token_types[token] = g_steal_pointer (&type);
+
+  return token;
+}
+
+#ifdef HAVE_CRYPT_DUMP_JSON
+int
+crypt_dump_json (struct crypt_device  *cd,
+                 const char          **json,
+                 uint32_t              flags)
+{
+  (void) flags;
+
+  if (!cd->device->metadata)
+      return -EINVAL;
+
+  *json = cd->device->metadata;
+
+  return 0;
+}
+#endif
@@ -0,0 +1,59 @@
+/* fake-cryptsetup.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONTESTSFAKECRYPTSETUP_H
+#define DROIDIANENCRYPTIONTESTSFAKECRYPTSETUP_H
+
+#include <glib.h>
+#include <libcryptsetup.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Just enough of libcryptsetup to run a LUKS2 reencryption and keep
+ * tokens, on devices that only exist in memory. A device is registered by
+ * the path of its header and outlives the contexts opened on it, like a
+ * header on disk would. The reencryption moves forward one hotzone at a
+ * time, each one taking the time the speed model gives on the virtual
+ * clock, and is resumable from where the last run stopped.
+ */
+
+typedef struct {
+  guint64 size;             /* bytes to reencrypt */
+  guint64 hotzone_size;
+  guint64 bytes_per_second; /* reencryption throughput of the device */
+  gint64 checkpoint_usec;   /* header update at the end of a hotzone */
+  gsize json_area_size;     /* room for the tokens, 0 for no limit */
+} FakeCryptModel;
+
+void fake_crypt_add_device (const char           *path,
+                            const FakeCryptModel *model);
+void fake_crypt_remove_device (const char *path);
+
+guint64 fake_crypt_get_offset (const char *path);
+void fake_crypt_set_offset (const char *path,
+                            guint64     offset);
+/* Time spent reencrypting so far, the device can't serve anything else meanwhile */
+gint64 fake_crypt_get_busy_usec (const char *path);
+/* What crypt_dump_json() returns, NULL makes it fail */
+void fake_crypt_set_metadata (const char *path,
+                              const char *json);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONTESTSFAKECRYPTSETUP_H */
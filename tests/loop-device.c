@@ -0,0 +1,151 @@
+/* loop-device.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <linux/loop.h>
+#include <sys/ioctl.h>
+#include <glib/gstdio.h>
+
+#include "loop-device.h"
+
+gboolean
+loop_device_available (void)
+{
+  return geteuid () == 0 && access ("/dev/loop-control", R_OK | W_OK) == 0;
+}
+
+char *
+loop_device_create_file (const char *directory,
+                         const char *name,
+                         guint64     size)
+{
+  g_autofree char *path = g_build_filename (directory, name, NULL);
+  int fd;
+
+  fd = open (path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  g_assert_cmpint (fd, >, -1);
+  g_assert_cmpint (ftruncate (fd, (off_t) size), ==, 0);
+  close (fd);
+
+  return g_steal_pointer (&path);
+}
+
+char *
+loop_device_attach (const char *backing_file)
+{
+  struct loop_info64 info = { 0 };
+  g_autofree char *device = NULL;
+  int control, backing, loop = -1;
+  int number;
+  int attempt;
+
+  control = open ("/dev/loop-control", O_RDWR | O_CLOEXEC);
+  g_assert_cmpint (control, >, -1);
+  backing = open (backing_file, O_RDWR | O_CLOEXEC);
+  g_assert_cmpint (backing, >, -1);
+
+  /* Someone else might grab the free device in the meantime */
+  for (attempt = 0; attempt < 10; attempt++)
+    {
+      number = ioctl (control, LOOP_CTL_GET_FREE);
+      g_assert_cmpint (number, >, -1);
+
+      g_free (device);
+      device = g_strdup_printf ("/dev/loop%d", number);
+      loop = open (device, O_RDWR | O_CLOEXEC);
+      g_assert_cmpint (loop, >, -1);
+
+      if (ioctl (loop, LOOP_SET_FD, backing) == 0)
+          break;
+
+      g_assert_cmpint (errno, ==, EBUSY);
+      close (loop);
+      loop = -1;
+    }
+
+  g_assert_cmpint (loop, >, -1);
+
+  g_strlcpy ((char *) info.lo_file_name, backing_file, LO_NAME_SIZE);
+  g_assert_cmpint (ioctl (loop, LOOP_SET_STATUS64, &info), ==, 0);
+
+  close (loop);
+  close (backing);
+  close (control);
+
+  return g_steal_pointer (&device);
+}
+
+void
+loop_device_detach (const char *device)
+{
+  int loop;
+
+  loop = open (device, O_RDWR | O_CLOEXEC);
+  g_assert_cmpint (loop, >, -1);
+
+  if (ioctl (loop, LOOP_CLR_FD, 0) == -1)
+      g_printerr ("Unable to detach %s: %s\n", device, g_strerror (errno));
+
+  close (loop);
+}
+
+guint64
+loop_device_get_size (const char *device)
+{
+  guint64 size = 0;
+  int fd;
+
+  fd = open (device, O_RDONLY | O_CLOEXEC);
+  g_assert_cmpint (fd, >, -1);
+  g_assert_cmpint (ioctl (fd, BLKGETSIZE64, &size), ==, 0);
+  close (fd);
+
+  return size;
+}
+
+void
+loop_fixture_set_up (LoopFixture *fixture,
+                     guint64      header_size,
+                     guint64      data_size)
+{
+  fixture->directory = g_dir_make_tmp ("droidian-encryption-loop-XXXXXX", NULL);
+  g_assert_nonnull (fixture->directory);
+
+  fixture->header = loop_device_create_file (fixture->directory, "header", header_size);
+  fixture->data_file = loop_device_create_file (fixture->directory, "data", data_size);
+  fixture->data_device = loop_device_attach (fixture->data_file);
+}
+
+void
+loop_fixture_tear_down (LoopFixture *fixture)
+{
+  loop_device_detach (fixture->data_device);
+
+  g_unlink (fixture->data_file);
+  g_unlink (fixture->header);
+  g_rmdir (fixture->directory);
+
+  g_clear_pointer (&fixture->data_device, g_free);
+  g_clear_pointer (&fixture->data_file, g_free);
+  g_clear_pointer (&fixture->header, g_free);
+  g_clear_pointer (&fixture->directory, g_free);
+}
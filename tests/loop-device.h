@@ -0,0 +1,62 @@
+/* loop-device.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONTESTSLOOPDEVICE_H
+#define DROIDIANENCRYPTIONTESTSLOOPDEVICE_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Loop devices over sparse files, for the tests that need real block
+ * devices. They need root: the tests exit with 77 (skipped) when
+ * loop_device_available() says otherwise.
+ */
+#define LOOP_DEVICE_SKIP 77
+
+gboolean loop_device_available (void);
+
+char *loop_device_create_file (const char *directory,
+                               const char *name,
+                               guint64     size);
+char *loop_device_attach (const char *backing_file);
+void loop_device_detach (const char *device);
+
+/* Size of the device, in bytes */
+guint64 loop_device_get_size (const char *device);
+
+/*
+ * A temporary directory holding a detached header file and a data file,
+ * the latter attached to a loop device. Embedded in the test fixtures.
+ */
+typedef struct {
+  char *directory;
+  char *header;
+  char *data_file;
+  char *data_device;
+} LoopFixture;
+
+void loop_fixture_set_up (LoopFixture *fixture,
+                          guint64      header_size,
+                          guint64      data_size);
+void loop_fixture_tear_down (LoopFixture *fixture);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONTESTSLOOPDEVICE_H */
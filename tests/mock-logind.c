@@ -0,0 +1,266 @@
+/* mock-logind.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib-unix.h>
+#include <gio/gunixfdlist.h>
+
+#include "mock-logind.h"
+
+#define LOGIND_BUS_NAME "org.freedesktop.login1"
+#define LOGIND_OBJECT_PATH "/org/freedesktop/login1"
+#define LOGIND_MANAGER_INTERFACE "org.freedesktop.login1.Manager"
+
+static const char introspection_xml[] =
+  "<node>"
+  "  <interface name='" LOGIND_MANAGER_INTERFACE "'>"
+  "    <property name='IdleHint' type='b' access='read'/>"
+  "    <method name='Inhibit'>"
+  "      <arg name='what' type='s' direction='in'/>"
+  "      <arg name='who' type='s' direction='in'/>"
+  "      <arg name='why' type='s' direction='in'/>"
+  "      <arg name='mode' type='s' direction='in'/>"
+  "      <arg name='fd' type='h' direction='out'/>"
+  "    </method>"
+  "    <signal name='PrepareForSleep'>"
+  "      <arg name='start' type='b'/>"
+  "    </signal>"
+  "  </interface>"
+  "</node>";
+
+struct _MockLogind
+{
+  GDBusConnection *connection;
+  guint registration_id;
+
+  gboolean idle_hint;
+  guint inhibit_calls;
+  GPtrArray *inhibitors;
+};
+
+typedef struct {
+  MockLogind *mock;
+  char *what;
+  char *mode;
+  int fd;
+  guint source_id;
+} MockLogindInhibitor;
+
+static void
+mock_logind_inhibitor_free (MockLogindInhibitor *inhibitor)
+{
+  if (inhibitor->source_id)
+      g_source_remove (inhibitor->source_id);
+
+  close (inhibitor->fd);
+  g_free (inhibitor->what);
+  g_free (inhibitor->mode);
+  g_free (inhibitor);
+}
+
+static gboolean
+on_inhibitor_released (int                  fd,
+                       GIOCondition         condition,
+                       MockLogindInhibitor *inhibitor)
+{
+  /* The caller closed its end, like logind checks */
+  inhibitor->source_id = 0;
+  g_ptr_array_remove (inhibitor->mock->inhibitors, inhibitor);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+handle_inhibit (MockLogind            *self,
+                GVariant              *parameters,
+                GDBusMethodInvocation *invocation)
+{
+  g_autoptr (GUnixFDList) fd_list = NULL;
+  MockLogindInhibitor *inhibitor;
+  int fds[2];
+
+  self->inhibit_calls++;
+
+  if (pipe2 (fds, O_CLOEXEC) == -1)
+    {
+      g_dbus_method_invocation_return_error (invocation, G_IO_ERROR, g_io_error_from_errno (errno),
+                                             "Unable to create the inhibitor pipe: %s", g_strerror (errno));
+      return;
+    }
+
+  inhibitor = g_new0 (MockLogindInhibitor, 1);
+  inhibitor->mock = self;
+  inhibitor->fd = fds[0];
+  g_variant_get (parameters, "(ssss)", &inhibitor->what, NULL, NULL, &inhibitor->mode);
+  inhibitor->source_id = g_unix_fd_add (fds[0], G_IO_HUP | G_IO_ERR,
+                                        (GUnixFDSourceFunc) on_inhibitor_released, inhibitor);
+  g_ptr_array_add (self->inhibitors, inhibitor);
+
+  /* Only the caller keeps the write end */
+  fd_list = g_unix_fd_list_new_from_array (&fds[1], 1);
+  g_dbus_method_invocation_return_value_with_unix_fd_list (invocation, g_variant_new ("(h)", 0), fd_list);
+}
+
+static void
+handle_method_call (GDBusConnection       *connection,
+                    const char            *sender,
+                    const char            *object_path,
+                    const char            *interface_name,
+                    const char            *method_name,
+                    GVariant              *parameters,
+                    GDBusMethodInvocation *invocation,
+                    MockLogind            *self)
+{
+  if (g_strcmp0 (method_name, "Inhibit") == 0)
+      handle_inhibit (self, parameters, invocation);
+  else
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD,
+                                             "No method %s", method_name);
+}
+
+static GVariant *
+handle_get_property (GDBusConnection  *connection,
+                     const char       *sender,
+                     const char       *object_path,
+                     const char       *interface_name,
+                     const char       *property_name,
+                     GError          **error,
+                     MockLogind       *self)
+{
+  if (g_strcmp0 (property_name, "IdleHint") == 0)
+      return g_variant_new_boolean (self->idle_hint);
+
+  g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_PROPERTY, "No property %s", property_name);
+  return NULL;
+}
+
+static const GDBusInterfaceVTable interface_vtable = {
+  .method_call = (GDBusInterfaceMethodCallFunc) handle_method_call,
+  .get_property = (GDBusInterfaceGetPropertyFunc) handle_get_property,
+};
+
+MockLogind *
+mock_logind_new (GDBusConnection *connection)
+{
+  g_autoptr (GDBusNodeInfo) node_info = NULL;
+  g_autoptr (GVariant) reply = NULL;
+  g_autoptr (GError) error = NULL;
+  MockLogind *self;
+  guint32 result;
+
+  self = g_new0 (MockLogind, 1);
+  self->connection = g_object_ref (connection);
+  self->inhibitors = g_ptr_array_new_with_free_func ((GDestroyNotify) mock_logind_inhibitor_free);
+
+  node_info = g_dbus_node_info_new_for_xml (introspection_xml, &error);
+  g_assert_no_error (error);
+
+  self->registration_id = g_dbus_connection_register_object (connection, LOGIND_OBJECT_PATH,
+                                                             node_info->interfaces[0], &interface_vtable,
+                                                             self, NULL, &error);
+  g_assert_no_error (error);
+
+  /* Owned before returning, so that the service finds it right away */
+  reply = g_dbus_connection_call_sync (connection, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                                       "org.freedesktop.DBus", "RequestName",
+                                       g_variant_new ("(su)", LOGIND_BUS_NAME, 0x4 /* DO_NOT_QUEUE */),
+                                       G_VARIANT_TYPE ("(u)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+  g_assert_no_error (error);
+
+  g_variant_get (reply, "(u)", &result);
+  g_assert_cmpuint (result, ==, 1 /* PRIMARY_OWNER */);
+
+  return self;
+}
+
+void
+mock_logind_free (MockLogind *self)
+{
+  g_autoptr (GVariant) reply = NULL;
+
+  reply = g_dbus_connection_call_sync (self->connection, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                                       "org.freedesktop.DBus", "ReleaseName",
+                                       g_variant_new ("(s)", LOGIND_BUS_NAME),
+                                       NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+
+  g_dbus_connection_unregister_object (self->connection, self->registration_id);
+  g_ptr_array_unref (self->inhibitors);
+  g_object_unref (self->connection);
+  g_free (self);
+}
+
+void
+mock_logind_set_idle_hint (MockLogind *self,
+                           gboolean    idle_hint)
+{
+  GVariantBuilder changed;
+  g_autoptr (GError) error = NULL;
+
+  self->idle_hint = idle_hint;
+
+  g_variant_builder_init (&changed, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&changed, "{sv}", "IdleHint", g_variant_new_boolean (idle_hint));
+
+  g_dbus_connection_emit_signal (self->connection, NULL, LOGIND_OBJECT_PATH,
+                                 "org.freedesktop.DBus.Properties", "PropertiesChanged",
+                                 g_variant_new ("(sa{sv}@as)", LOGIND_MANAGER_INTERFACE, &changed,
+                                                g_variant_new_strv (NULL, 0)),
+                                 &error);
+  g_assert_no_error (error);
+}
+
+void
+mock_logind_prepare_for_sleep (MockLogind *self,
+                               gboolean    start)
+{
+  g_autoptr (GError) error = NULL;
+
+  g_dbus_connection_emit_signal (self->connection, NULL, LOGIND_OBJECT_PATH,
+                                 LOGIND_MANAGER_INTERFACE, "PrepareForSleep",
+                                 g_variant_new ("(b)", start), &error);
+  g_assert_no_error (error);
+}
+
+guint
+mock_logind_get_inhibit_calls (MockLogind *self)
+{
+  return self->inhibit_calls;
+}
+
+guint
+mock_logind_get_inhibitors (MockLogind *self,
+                            const char *what,
+                            const char *mode)
+{
+  MockLogindInhibitor *inhibitor;
+  guint count = 0;
+
+  for (guint i = 0; i < self->inhibitors->len; i++)
+    {
+      inhibitor = g_ptr_array_index (self->inhibitors, i);
+
+      if (g_strcmp0 (inhibitor->what, what) == 0 && g_strcmp0 (inhibitor->mode, mode) == 0)
+          count++;
+    }
+
+  return count;
+}
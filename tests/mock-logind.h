@@ -0,0 +1,52 @@
+/* mock-logind.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONTESTSMOCKLOGIND_H
+#define DROIDIANENCRYPTIONTESTSMOCKLOGIND_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/*
+ * The part of the logind Manager the service relies on, served on the
+ * given connection as org.freedesktop.login1. Meant for a private bus set
+ * up with GTestDBus.
+ */
+typedef struct _MockLogind MockLogind;
+
+MockLogind *mock_logind_new (GDBusConnection *connection);
+void mock_logind_free (MockLogind *self);
+
+/* Emits PropertiesChanged, like logind does */
+void mock_logind_set_idle_hint (MockLogind *self,
+                                gboolean    idle_hint);
+
+void mock_logind_prepare_for_sleep (MockLogind *self,
+                                    gboolean    start);
+
+/* Inhibit() calls so far, and the inhibitors their callers still hold */
+guint mock_logind_get_inhibit_calls (MockLogind *self);
+guint mock_logind_get_inhibitors (MockLogind *self,
+                                  const char *what,
+                                  const char *mode);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONTESTSMOCKLOGIND_H */
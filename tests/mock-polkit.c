@@ -0,0 +1,153 @@
+/* mock-polkit.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mock-polkit.h"
+
+#define POLKIT_BUS_NAME "org.freedesktop.PolicyKit1"
+#define POLKIT_OBJECT_PATH "/org/freedesktop/PolicyKit1/Authority"
+#define POLKIT_AUTHORITY_INTERFACE "org.freedesktop.PolicyKit1.Authority"
+
+static const char introspection_xml[] =
+  "<node>"
+  "  <interface name='" POLKIT_AUTHORITY_INTERFACE "'>"
+  "    <property name='BackendName' type='s' access='read'/>"
+  "    <property name='BackendVersion' type='s' access='read'/>"
+  "    <property name='BackendFeatures' type='u' access='read'/>"
+  "    <method name='CheckAuthorization'>"
+  "      <arg name='subject' type='(sa{sv})' direction='in'/>"
+  "      <arg name='action_id' type='s' direction='in'/>"
+  "      <arg name='details' type='a{ss}' direction='in'/>"
+  "      <arg name='flags' type='u' direction='in'/>"
+  "      <arg name='cancellation_id' type='s' direction='in'/>"
+  "      <arg name='result' type='(bba{ss})' direction='out'/>"
+  "    </method>"
+  "  </interface>"
+  "</node>";
+
+struct _MockPolkit
+{
+  GDBusConnection *connection;
+  guint registration_id;
+
+  guint check_calls;
+};
+
+static void
+handle_method_call (GDBusConnection       *connection,
+                    const char            *sender,
+                    const char            *object_path,
+                    const char            *interface_name,
+                    const char            *method_name,
+                    GVariant              *parameters,
+                    GDBusMethodInvocation *invocation,
+                    MockPolkit            *self)
+{
+  if (g_strcmp0 (method_name, "CheckAuthorization") == 0)
+    {
+      self->check_calls++;
+      /* is_authorized, is_challenge, details */
+      g_dbus_method_invocation_return_value (invocation,
+                                             g_variant_new ("((bb@a{ss}))", TRUE, FALSE,
+                                                            g_variant_new_array (G_VARIANT_TYPE ("{ss}"),
+                                                                                 NULL, 0)));
+    }
+  else
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD,
+                                             "No method %s", method_name);
+    }
+}
+
+static GVariant *
+handle_get_property (GDBusConnection  *connection,
+                     const char       *sender,
+                     const char       *object_path,
+                     const char       *interface_name,
+                     const char       *property_name,
+                     GError          **error,
+                     MockPolkit       *self)
+{
+  if (g_strcmp0 (property_name, "BackendName") == 0)
+      return g_variant_new_string ("mock");
+  else if (g_strcmp0 (property_name, "BackendVersion") == 0)
+      return g_variant_new_string ("0");
+  else if (g_strcmp0 (property_name, "BackendFeatures") == 0)
+      return g_variant_new_uint32 (0);
+
+  g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_PROPERTY, "No property %s", property_name);
+  return NULL;
+}
+
+static const GDBusInterfaceVTable interface_vtable = {
+  .method_call = (GDBusInterfaceMethodCallFunc) handle_method_call,
+  .get_property = (GDBusInterfaceGetPropertyFunc) handle_get_property,
+};
+
+MockPolkit *
+mock_polkit_new (GDBusConnection *connection)
+{
+  g_autoptr (GDBusNodeInfo) node_info = NULL;
+  g_autoptr (GVariant) reply = NULL;
+  g_autoptr (GError) error = NULL;
+  MockPolkit *self;
+  guint32 result;
+
+  self = g_new0 (MockPolkit, 1);
+  self->connection = g_object_ref (connection);
+
+  node_info = g_dbus_node_info_new_for_xml (introspection_xml, &error);
+  g_assert_no_error (error);
+
+  self->registration_id = g_dbus_connection_register_object (connection, POLKIT_OBJECT_PATH,
+                                                             node_info->interfaces[0], &interface_vtable,
+                                                             self, NULL, &error);
+  g_assert_no_error (error);
+
+  /* polkit_authority_get_sync() runs when the service starts */
+  reply = g_dbus_connection_call_sync (connection, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                                       "org.freedesktop.DBus", "RequestName",
+                                       g_variant_new ("(su)", POLKIT_BUS_NAME, 0x4 /* DO_NOT_QUEUE */),
+                                       G_VARIANT_TYPE ("(u)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+  g_assert_no_error (error);
+
+  g_variant_get (reply, "(u)", &result);
+  g_assert_cmpuint (result, ==, 1 /* PRIMARY_OWNER */);
+
+  return self;
+}
+
+void
+mock_polkit_free (MockPolkit *self)
+{
+  g_autoptr (GVariant) reply = NULL;
+
+  reply = g_dbus_connection_call_sync (self->connection, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                                       "org.freedesktop.DBus", "ReleaseName",
+                                       g_variant_new ("(s)", POLKIT_BUS_NAME),
+                                       NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+
+  g_dbus_connection_unregister_object (self->connection, self->registration_id);
+  g_object_unref (self->connection);
+  g_free (self);
+}
+
+guint
+mock_polkit_get_check_calls (MockPolkit *self)
+{
+  return self->check_calls;
+}
@@ -0,0 +1,40 @@
+/* mock-polkit.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONTESTSMOCKPOLKIT_H
+#define DROIDIANENCRYPTIONTESTSMOCKPOLKIT_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/*
+ * A polkit authority that authorizes every action, served on the given
+ * connection as org.freedesktop.PolicyKit1.
+ */
+typedef struct _MockPolkit MockPolkit;
+
+MockPolkit *mock_polkit_new (GDBusConnection *connection);
+void mock_polkit_free (MockPolkit *self);
+
+guint mock_polkit_get_check_calls (MockPolkit *self);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONTESTSMOCKPOLKIT_H */
@@ -0,0 +1,130 @@
+/* reencryption.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "reencryption.h"
+
+#define VOLUME_KEY_SIZE 64
+
+void
+reencryption_initialize (const char *header,
+                         const char *data_device,
+                         const char *resilience)
+{
+  struct crypt_device *crypt_device = NULL;
+  char volume_key[VOLUME_KEY_SIZE];
+  int keyslot;
+  struct crypt_pbkdf_type pbkdf = {
+    .type = CRYPT_KDF_PBKDF2,
+    .hash = "sha256",
+    .iterations = 1000,
+    .flags = CRYPT_PBKDF_NO_BENCHMARK,
+  };
+  struct crypt_params_luks2 luks2_params = {
+    .data_device = data_device,
+    .sector_size = 512,
+  };
+  struct crypt_params_reencrypt params = {
+    .mode = CRYPT_REENCRYPT_ENCRYPT,
+    .direction = CRYPT_REENCRYPT_FORWARD,
+    .resilience = resilience,
+    .hash = "sha256",
+    .flags = CRYPT_REENCRYPT_INITIALIZE_ONLY,
+    .luks2 = &luks2_params,
+  };
+
+  for (gsize i = 0; i < sizeof (volume_key); i++)
+      volume_key[i] = (char) g_random_int ();
+
+  /* Same sequence as the service configure stages */
+  g_assert_cmpint (crypt_init (&crypt_device, header), ==, 0);
+  g_assert_cmpint (crypt_set_data_offset (crypt_device, 0), ==, 0);
+  g_assert_cmpint (crypt_format (crypt_device, CRYPT_LUKS2, "aes", "xts-plain64", NULL,
+                                 volume_key, sizeof (volume_key), &luks2_params), ==, 0);
+
+  /* Nothing to protect here, don't spend the test time in the KDF */
+  g_assert_cmpint (crypt_set_pbkdf_type (crypt_device, &pbkdf), ==, 0);
+  keyslot = crypt_keyslot_add_by_volume_key (crypt_device, CRYPT_ANY_SLOT, volume_key, sizeof (volume_key),
+                                             REENCRYPTION_PASSPHRASE, strlen (REENCRYPTION_PASSPHRASE));
+  g_assert_cmpint (keyslot, >=, 0);
+
+  g_assert_cmpint (crypt_reencrypt_init_by_passphrase (crypt_device, NULL,
+                                                       REENCRYPTION_PASSPHRASE,
+                                                       strlen (REENCRYPTION_PASSPHRASE),
+                                                       CRYPT_ANY_SLOT, keyslot, "aes", "xts-plain64",
+                                                       &params), >=, 0);
+
+  crypt_free (crypt_device);
+}
+
+struct crypt_device *
+reencryption_load (const char *header,
+                   const char *data_device)
+{
+  struct crypt_device *crypt_device = NULL;
+
+  g_assert_cmpint (crypt_init_data_device (&crypt_device, header, data_device), ==, 0);
+  g_assert_cmpint (crypt_load (crypt_device, CRYPT_LUKS2, NULL), ==, 0);
+
+  return crypt_device;
+}
+
+gint64
+reencryption_recover (struct crypt_device *crypt_device)
+{
+  struct crypt_params_reencrypt params = {
+    .flags = CRYPT_REENCRYPT_RECOVERY,
+  };
+  gint64 started_at;
+
+  if (crypt_reencrypt_status (crypt_device, NULL) != CRYPT_REENCRYPT_CRASH)
+      return 0;
+
+  started_at = g_get_monotonic_time ();
+  g_assert_cmpint (crypt_reencrypt_init_by_passphrase (crypt_device, NULL,
+                                                       REENCRYPTION_PASSPHRASE,
+                                                       strlen (REENCRYPTION_PASSPHRASE),
+                                                       CRYPT_ANY_SLOT, 0, NULL, NULL, &params), >=, 0);
+
+  return MAX (g_get_monotonic_time () - started_at, 1);
+}
+
+int
+reencryption_resume (struct crypt_device *crypt_device,
+                     const char          *resilience,
+                     guint64              hotzone_size,
+                     int                (*progress) (uint64_t size, uint64_t offset, void *usrptr),
+                     void                *data)
+{
+  struct crypt_params_reencrypt params = {
+    .resilience = resilience,
+    .hash = "sha256",
+    .max_hotzone_size = hotzone_size / 512,
+    .flags = CRYPT_REENCRYPT_RESUME_ONLY,
+  };
+  int result;
+
+  result = crypt_reencrypt_init_by_passphrase (crypt_device, NULL,
+                                               REENCRYPTION_PASSPHRASE, strlen (REENCRYPTION_PASSPHRASE),
+                                               CRYPT_ANY_SLOT, 0, NULL, NULL, &params);
+  if (result < 0)
+      return result;
+
+  return crypt_reencrypt_run (crypt_device, progress, data);
+}
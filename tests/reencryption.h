@@ -0,0 +1,56 @@
+/* reencryption.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONTESTSREENCRYPTION_H
+#define DROIDIANENCRYPTIONTESTSREENCRYPTION_H
+
+#include <glib.h>
+#include <libcryptsetup.h>
+
+G_BEGIN_DECLS
+
+/*
+ * The libcryptsetup calls the service and the helper make, against real
+ * devices: a detached header and an in-place encryption of the data
+ * device, initialized by the service and resumed by the helper.
+ */
+#define REENCRYPTION_PASSPHRASE "passphrase"
+#define REENCRYPTION_HEADER_SIZE (32 * 1024 * 1024)
+
+/* Formats header for data_device and initializes the reencryption */
+void reencryption_initialize (const char *header,
+                              const char *data_device,
+                              const char *resilience);
+
+struct crypt_device *reencryption_load (const char *header,
+                                        const char *data_device);
+
+/* Replays the resilience data of an interrupted hotzone, if any. Returns
+ * the time it took, 0 if there was nothing to recover. */
+gint64 reencryption_recover (struct crypt_device *crypt_device);
+
+/* As the helper does. hotzone_size is in bytes, 0 for the default. */
+int reencryption_resume (struct crypt_device *crypt_device,
+                         const char          *resilience,
+                         guint64              hotzone_size,
+                         int                (*progress) (uint64_t size, uint64_t offset, void *usrptr),
+                         void                *data);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONTESTSREENCRYPTION_H */
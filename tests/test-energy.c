@@ -0,0 +1,373 @@
+/* test-energy.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#include "control.h"
+#include "energy.h"
+#include "virtual-clock.h"
+
+#define MIB (G_GUINT64_CONSTANT (1024) * 1024)
+#define HOTZONE_SIZE (32 * MIB)
+#define SECONDS(seconds) ((seconds) * G_USEC_PER_SEC)
+#define JOULES(joules) (G_GUINT64_CONSTANT (joules) * 1000000)
+
+typedef struct {
+  char *power_supply_dir;
+  char *battery;
+} Fixture;
+
+static void
+write_attribute (const char *supply,
+                 const char *name,
+                 const char *value)
+{
+  g_autofree char *path = g_build_filename (supply, name, NULL);
+  g_autofree char *contents = g_strconcat (value, "\n", NULL);
+
+  g_assert_true (g_file_set_contents (path, contents, -1, NULL));
+}
+
+static void
+remove_tree (const char *path)
+{
+  g_autoptr (GDir) dir = g_dir_open (path, 0, NULL);
+  const char *name;
+
+  while (dir && (name = g_dir_read_name (dir)))
+    {
+      g_autofree char *child = g_build_filename (path, name, NULL);
+
+      if (g_file_test (child, G_FILE_TEST_IS_DIR))
+          remove_tree (child);
+      else
+          g_assert_cmpint (g_unlink (child), ==, 0);
+    }
+
+  g_assert_cmpint (g_rmdir (path), ==, 0);
+}
+
+/* A charger and a discharging battery, like a phone unplugged */
+static void
+fixture_set_up (Fixture       *fixture,
+                gconstpointer  data)
+{
+  g_autofree char *charger = NULL;
+
+  (void) data;
+
+  fixture->power_supply_dir = g_dir_make_tmp ("droidian-encryption-power-supply-XXXXXX", NULL);
+  g_assert_nonnull (fixture->power_supply_dir);
+
+  charger = g_build_filename (fixture->power_supply_dir, "charger", NULL);
+  g_assert_cmpint (g_mkdir (charger, 0755), ==, 0);
+  write_attribute (charger, "type", "Mains");
+  write_attribute (charger, "online", "0");
+
+  fixture->battery = g_build_filename (fixture->power_supply_dir, "battery", NULL);
+  g_assert_cmpint (g_mkdir (fixture->battery, 0755), ==, 0);
+  write_attribute (fixture->battery, "type", "Battery");
+  write_attribute (fixture->battery, "status", "Discharging");
+}
+
+static void
+fixture_tear_down (Fixture       *fixture,
+                   gconstpointer  data)
+{
+  (void) data;
+
+  remove_tree (fixture->power_supply_dir);
+  g_free (fixture->power_supply_dir);
+  g_free (fixture->battery);
+}
+
+static guint64
+sample (DroidianEncryptionHelperEnergy *energy)
+{
+  guint64 energy_uj = G_MAXUINT64;
+
+  g_assert_true (droidian_encryption_helper_energy_sample (energy, &energy_uj));
+
+  return energy_uj;
+}
+
+static void
+test_no_battery (Fixture       *fixture,
+                 gconstpointer  data)
+{
+  g_autofree char *missing = g_build_filename (fixture->power_supply_dir, "missing", NULL);
+
+  (void) data;
+
+  g_assert_null (droidian_encryption_helper_energy_new (missing));
+
+  /* A battery that reports neither power nor energy */
+  g_assert_null (droidian_encryption_helper_energy_new (fixture->power_supply_dir));
+
+  write_attribute (fixture->battery, "type", "UPS");
+  write_attribute (fixture->battery, "power_now", "2000000");
+  g_assert_null (droidian_encryption_helper_energy_new (fixture->power_supply_dir));
+}
+
+static void
+test_power (Fixture       *fixture,
+            gconstpointer  data)
+{
+  DroidianEncryptionHelperEnergy *energy;
+
+  (void) data;
+
+  write_attribute (fixture->battery, "power_now", "2000000");
+  write_attribute (fixture->battery, "energy_now", "10000000");
+
+  /* Instant readings win over the counter */
+  energy = droidian_encryption_helper_energy_new (fixture->power_supply_dir);
+  g_assert_nonnull (energy);
+  g_assert_cmpuint (sample (energy), ==, 0);
+
+  /* Integrated between samples, 2 then 4 W over 10 s */
+  virtual_clock_advance (SECONDS (10));
+  write_attribute (fixture->battery, "power_now", "4000000");
+  write_attribute (fixture->battery, "energy_now", "0");
+  g_assert_cmpuint (sample (energy), ==, JOULES (30));
+
+  /* Discharging reported as negative */
+  virtual_clock_advance (SECONDS (10));
+  write_attribute (fixture->battery, "power_now", "-4000000");
+  g_assert_cmpuint (sample (energy), ==, JOULES (70));
+
+  droidian_encryption_helper_energy_free (energy);
+}
+
+static void
+test_current (Fixture       *fixture,
+              gconstpointer  data)
+{
+  DroidianEncryptionHelperEnergy *energy;
+  g_autofree char *voltage_now = g_build_filename (fixture->battery, "voltage_now", NULL);
+  guint64 energy_uj = 0;
+
+  (void) data;
+
+  /* 0.5 A at 4 V */
+  write_attribute (fixture->battery, "current_now", "-500000");
+  write_attribute (fixture->battery, "voltage_now", "4000000");
+
+  energy = droidian_encryption_helper_energy_new (fixture->power_supply_dir);
+  g_assert_nonnull (energy);
+  g_assert_cmpuint (sample (energy), ==, 0);
+
+  virtual_clock_advance (SECONDS (5));
+  g_assert_cmpuint (sample (energy), ==, JOULES (10));
+
+  /* Not integrated over a gap in the readings */
+  g_assert_cmpint (g_unlink (voltage_now), ==, 0);
+  virtual_clock_advance (SECONDS (5));
+  g_assert_false (droidian_encryption_helper_energy_sample (energy, &energy_uj));
+
+  write_attribute (fixture->battery, "voltage_now", "4000000");
+  virtual_clock_advance (SECONDS (5));
+  g_assert_cmpuint (sample (energy), ==, JOULES (10));
+  virtual_clock_advance (SECONDS (5));
+  g_assert_cmpuint (sample (energy), ==, JOULES (20));
+
+  droidian_encryption_helper_energy_free (energy);
+}
+
+static void
+test_counter (Fixture       *fixture,
+              gconstpointer  data)
+{
+  DroidianEncryptionHelperEnergy *energy;
+
+  (void) data;
+
+  /* uWh */
+  write_attribute (fixture->battery, "energy_now", "10000000");
+
+  energy = droidian_encryption_helper_energy_new (fixture->power_supply_dir);
+  g_assert_nonnull (energy);
+  g_assert_cmpuint (sample (energy), ==, 0);
+
+  /* 1 Wh */
+  virtual_clock_advance (SECONDS (10));
+  write_attribute (fixture->battery, "energy_now", "9000000");
+  g_assert_cmpuint (sample (energy), ==, JOULES (3600));
+
+  /* A counter going up is not drawn energy */
+  virtual_clock_advance (SECONDS (10));
+  write_attribute (fixture->battery, "energy_now", "9500000");
+  g_assert_cmpuint (sample (energy), ==, JOULES (3600));
+
+  virtual_clock_advance (SECONDS (10));
+  write_attribute (fixture->battery, "energy_now", "9000000");
+  g_assert_cmpuint (sample (energy), ==, JOULES (5400));
+
+  droidian_encryption_helper_energy_free (energy);
+}
+
+static void
+test_charging (Fixture       *fixture,
+               gconstpointer  data)
+{
+  DroidianEncryptionHelperEnergy *energy;
+  guint64 energy_uj = 0;
+
+  (void) data;
+
+  write_attribute (fixture->battery, "power_now", "2000000");
+
+  energy = droidian_encryption_helper_energy_new (fixture->power_supply_dir);
+  g_assert_nonnull (energy);
+  g_assert_cmpuint (sample (energy), ==, 0);
+
+  virtual_clock_advance (SECONDS (10));
+  g_assert_cmpuint (sample (energy), ==, JOULES (20));
+
+  write_attribute (fixture->battery, "status", "Charging");
+  virtual_clock_advance (SECONDS (10));
+  g_assert_false (droidian_encryption_helper_energy_sample (energy, &energy_uj));
+
+  write_attribute (fixture->battery, "status", "Full");
+  virtual_clock_advance (SECONDS (10));
+  g_assert_false (droidian_encryption_helper_energy_sample (energy, &energy_uj));
+
+  /* Unplugged: nothing is accounted for the time on the charger */
+  write_attribute (fixture->battery, "status", "Discharging");
+  virtual_clock_advance (SECONDS (10));
+  g_assert_cmpuint (sample (energy), ==, JOULES (20));
+
+  virtual_clock_advance (SECONDS (10));
+  g_assert_cmpuint (sample (energy), ==, JOULES (40));
+
+  droidian_encryption_helper_energy_free (energy);
+}
+
+static void
+checkpoint (DroidianEncryptionHelperControl *control,
+            guint                            hotzone)
+{
+  g_assert_true (droidian_encryption_helper_control_checkpoint (control, hotzone * HOTZONE_SIZE,
+                                                                100 * HOTZONE_SIZE));
+}
+
+static void
+request (DroidianEncryptionHelperControl *control,
+         const char                      *request,
+         char                            *reply)
+{
+  char buffer[DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX];
+
+  g_strlcpy (buffer, request, sizeof (buffer));
+  droidian_encryption_helper_control_handle_request (control, buffer, reply,
+                                                     DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX);
+
+  g_assert_true (g_str_has_prefix (reply, DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_OK));
+}
+
+static void
+test_pacing_modes (Fixture       *fixture,
+                   gconstpointer  data)
+{
+  DroidianEncryptionHelperControl *control;
+  DroidianEncryptionHistorySession session;
+  char reply[DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX];
+  g_autofree char *expected = NULL;
+  int run_fd;
+
+  (void) data;
+
+  write_attribute (fixture->battery, "power_now", "2000000");
+
+  /* Nothing is created in there */
+  run_fd = open (fixture->power_supply_dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  g_assert_cmpint (run_fd, >, -1);
+
+  control = droidian_encryption_helper_control_new (run_fd);
+  g_assert_nonnull (control);
+  droidian_encryption_helper_control_set_energy (control,
+                                                 droidian_encryption_helper_energy_new (fixture->power_supply_dir));
+  droidian_encryption_helper_control_set_running (control);
+
+  /* Boosting at 2 W */
+  checkpoint (control, 1);
+  virtual_clock_advance (SECONDS (10));
+  checkpoint (control, 2);
+
+  /* Every interval goes to the mode it started in */
+  request (control, DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE " " DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE_BACKGROUND,
+           reply);
+  write_attribute (fixture->battery, "power_now", "1000000");
+  virtual_clock_advance (SECONDS (10));
+  checkpoint (control, 3);
+
+  /* In the background at 1 W */
+  virtual_clock_advance (SECONDS (10));
+  checkpoint (control, 4);
+
+  /* Charging, then unplugged */
+  write_attribute (fixture->battery, "status", "Charging");
+  virtual_clock_advance (SECONDS (10));
+  checkpoint (control, 5);
+  write_attribute (fixture->battery, "status", "Discharging");
+  virtual_clock_advance (SECONDS (10));
+  checkpoint (control, 6);
+  virtual_clock_advance (SECONDS (10));
+  checkpoint (control, 7);
+
+  request (control, DROIDIAN_ENCRYPTION_HELPER_CONTROL_STATS, reply);
+  expected = g_strdup_printf (" boost_energy_uj=%" G_GUINT64_FORMAT " boost_energy_usec=%" G_GINT64_FORMAT
+                              " boost_energy_bytes=%" G_GUINT64_FORMAT
+                              " background_energy_uj=%" G_GUINT64_FORMAT " background_energy_usec=%" G_GINT64_FORMAT
+                              " background_energy_bytes=%" G_GUINT64_FORMAT,
+                              JOULES (35), SECONDS (20), 2 * HOTZONE_SIZE,
+                              JOULES (20), SECONDS (20), 2 * HOTZONE_SIZE);
+  g_assert_true (g_str_has_suffix (reply, expected));
+
+  /* And recorded with the session */
+  g_assert_true (droidian_encryption_helper_control_get_session (control, &session));
+  g_assert_cmpuint (session.energy[DROIDIAN_ENCRYPTION_HISTORY_PACING_BOOST].energy_uj, ==, JOULES (35));
+  g_assert_cmpuint (session.energy[DROIDIAN_ENCRYPTION_HISTORY_PACING_BACKGROUND].energy_uj, ==, JOULES (20));
+
+  droidian_encryption_helper_control_stopped (control);
+  droidian_encryption_helper_control_free (control);
+  close (run_fd);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  virtual_clock_install ();
+
+  g_test_add ("/energy/no-battery", Fixture, NULL, fixture_set_up, test_no_battery, fixture_tear_down);
+  g_test_add ("/energy/power", Fixture, NULL, fixture_set_up, test_power, fixture_tear_down);
+  g_test_add ("/energy/current", Fixture, NULL, fixture_set_up, test_current, fixture_tear_down);
+  g_test_add ("/energy/counter", Fixture, NULL, fixture_set_up, test_counter, fixture_tear_down);
+  g_test_add ("/energy/charging", Fixture, NULL, fixture_set_up, test_charging, fixture_tear_down);
+  g_test_add ("/energy/pacing-modes", Fixture, NULL, fixture_set_up, test_pacing_modes, fixture_tear_down);
+
+  return g_test_run ();
+}
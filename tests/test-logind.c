@@ -0,0 +1,329 @@
+/* test-logind.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The service side of logind, against a mock on a private bus. The
+ * service is pointed to it with logind_bus_address, in a configuration
+ * file written by the test at the path it has been built with.
+ */
+
+#include "logind.h"
+#include "mock-logind.h"
+
+#define WAIT_TIMEOUT (5 * G_USEC_PER_SEC)
+
+static GDBusConnection *connection = NULL;
+
+typedef struct {
+  MockLogind *mock;
+  DroidianEncryptionServiceLogind *logind;
+  guint idle_changes;
+
+  GArray *prepare_for_sleep;
+  guint emitted;
+  gint64 emitted_at;
+  gint64 delivered_at;
+} Fixture;
+
+static gboolean
+wait_for (gboolean (*condition) (Fixture *fixture),
+          Fixture   *fixture)
+{
+  gint64 deadline = g_get_monotonic_time () + WAIT_TIMEOUT;
+
+  while (!condition (fixture))
+    {
+      if (g_get_monotonic_time () > deadline)
+          return FALSE;
+
+      if (!g_main_context_iteration (NULL, FALSE))
+          g_usleep (1000);
+    }
+
+  return TRUE;
+}
+
+static void
+on_idle_changed (Fixture *fixture)
+{
+  fixture->idle_changes++;
+}
+
+static void
+on_prepare_for_sleep (DroidianEncryptionServiceLogind *logind,
+                      gboolean                         start,
+                      Fixture                         *fixture)
+{
+  fixture->delivered_at = g_get_monotonic_time ();
+  g_array_append_val (fixture->prepare_for_sleep, start);
+}
+
+static void
+fixture_set_up (Fixture       *fixture,
+                gconstpointer  data)
+{
+  (void) data;
+
+  fixture->mock = mock_logind_new (connection);
+  fixture->idle_changes = 0;
+  fixture->prepare_for_sleep = g_array_new (FALSE, FALSE, sizeof (gboolean));
+}
+
+static void
+fixture_start_logind (Fixture *fixture)
+{
+  fixture->logind = droidian_encryption_service_logind_get_default ();
+  g_signal_connect_swapped (fixture->logind, "notify::idle", G_CALLBACK (on_idle_changed), fixture);
+  g_signal_connect (fixture->logind, "prepare-for-sleep", G_CALLBACK (on_prepare_for_sleep), fixture);
+}
+
+static gboolean is_idle (Fixture *fixture);
+
+/* Once the service is subscribed to the manager */
+static void
+fixture_start_logind_and_wait (Fixture *fixture)
+{
+  mock_logind_set_idle_hint (fixture->mock, TRUE);
+  fixture_start_logind (fixture);
+  g_assert_true (wait_for (is_idle, fixture));
+}
+
+static void
+fixture_tear_down (Fixture       *fixture,
+                   gconstpointer  data)
+{
+  (void) data;
+
+  g_clear_object (&fixture->logind);
+  mock_logind_free (fixture->mock);
+  g_array_unref (fixture->prepare_for_sleep);
+
+  /* Let the cancelled calls complete */
+  while (g_main_context_iteration (NULL, FALSE));
+}
+
+static gboolean
+is_idle (Fixture *fixture)
+{
+  return droidian_encryption_service_logind_get_idle (fixture->logind);
+}
+
+static gboolean
+is_active (Fixture *fixture)
+{
+  return !droidian_encryption_service_logind_get_idle (fixture->logind);
+}
+
+static void
+test_idle_hint (Fixture       *fixture,
+                gconstpointer  data)
+{
+  (void) data;
+
+  /* Picked up when the service starts */
+  mock_logind_set_idle_hint (fixture->mock, TRUE);
+  fixture_start_logind (fixture);
+  g_assert_true (wait_for (is_idle, fixture));
+  g_assert_cmpuint (fixture->idle_changes, ==, 1);
+
+  /* And followed */
+  mock_logind_set_idle_hint (fixture->mock, FALSE);
+  g_assert_true (wait_for (is_active, fixture));
+  g_assert_cmpuint (fixture->idle_changes, ==, 2);
+
+  mock_logind_set_idle_hint (fixture->mock, TRUE);
+  g_assert_true (wait_for (is_idle, fixture));
+  g_assert_cmpuint (fixture->idle_changes, ==, 3);
+}
+
+static void
+test_idle_hint_unchanged (Fixture       *fixture,
+                          gconstpointer  data)
+{
+  (void) data;
+
+  fixture_start_logind (fixture);
+  mock_logind_set_idle_hint (fixture->mock, TRUE);
+  g_assert_true (wait_for (is_idle, fixture));
+
+  /* Only changes are notified */
+  mock_logind_set_idle_hint (fixture->mock, TRUE);
+  mock_logind_set_idle_hint (fixture->mock, FALSE);
+  g_assert_true (wait_for (is_active, fixture));
+  g_assert_cmpuint (fixture->idle_changes, ==, 2);
+}
+
+static gboolean
+is_inhibiting (Fixture *fixture)
+{
+  return droidian_encryption_service_logind_is_inhibiting_sleep (fixture->logind) &&
+         mock_logind_get_inhibitors (fixture->mock, "sleep", "delay") == 1;
+}
+
+static gboolean
+is_released (Fixture *fixture)
+{
+  return (!fixture->logind || !droidian_encryption_service_logind_is_inhibiting_sleep (fixture->logind)) &&
+         mock_logind_get_inhibitors (fixture->mock, "sleep", "delay") == 0;
+}
+
+static gboolean
+has_inhibit_call (Fixture *fixture)
+{
+  return mock_logind_get_inhibit_calls (fixture->mock) > 0;
+}
+
+static void
+test_sleep_inhibitor (Fixture       *fixture,
+                      gconstpointer  data)
+{
+  (void) data;
+
+  fixture_start_logind_and_wait (fixture);
+
+  droidian_encryption_service_logind_inhibit_sleep (fixture->logind, TRUE);
+  g_assert_true (wait_for (is_inhibiting, fixture));
+
+  /* Taken once */
+  droidian_encryption_service_logind_inhibit_sleep (fixture->logind, TRUE);
+  g_assert_true (wait_for (is_inhibiting, fixture));
+  g_assert_cmpuint (mock_logind_get_inhibit_calls (fixture->mock), ==, 1);
+
+  droidian_encryption_service_logind_inhibit_sleep (fixture->logind, FALSE);
+  g_assert_false (droidian_encryption_service_logind_is_inhibiting_sleep (fixture->logind));
+  g_assert_true (wait_for (is_released, fixture));
+
+  /* And again, for the next run */
+  droidian_encryption_service_logind_inhibit_sleep (fixture->logind, TRUE);
+  g_assert_true (wait_for (is_inhibiting, fixture));
+  g_assert_cmpuint (mock_logind_get_inhibit_calls (fixture->mock), ==, 2);
+
+  /* Released with the service */
+  g_clear_object (&fixture->logind);
+  g_assert_true (wait_for (is_released, fixture));
+}
+
+static void
+test_sleep_inhibitor_early (Fixture       *fixture,
+                            gconstpointer  data)
+{
+  (void) data;
+
+  /* Requested before logind is reachable */
+  fixture_start_logind (fixture);
+  droidian_encryption_service_logind_inhibit_sleep (fixture->logind, TRUE);
+  g_assert_true (wait_for (is_inhibiting, fixture));
+  g_assert_cmpuint (mock_logind_get_inhibit_calls (fixture->mock), ==, 1);
+}
+
+static void
+test_sleep_inhibitor_in_flight (Fixture       *fixture,
+                                gconstpointer  data)
+{
+  (void) data;
+
+  fixture_start_logind_and_wait (fixture);
+
+  /* Released before logind answers */
+  droidian_encryption_service_logind_inhibit_sleep (fixture->logind, TRUE);
+  droidian_encryption_service_logind_inhibit_sleep (fixture->logind, FALSE);
+  g_assert_true (droidian_encryption_service_logind_is_inhibiting_sleep (fixture->logind));
+
+  g_assert_true (wait_for (has_inhibit_call, fixture));
+  g_assert_true (wait_for (is_released, fixture));
+}
+
+static gboolean
+has_prepare_for_sleep (Fixture *fixture)
+{
+  return fixture->prepare_for_sleep->len == fixture->emitted;
+}
+
+static void
+test_prepare_for_sleep (Fixture       *fixture,
+                        gconstpointer  data)
+{
+  const gboolean starts[] = { TRUE, FALSE, TRUE, FALSE };
+  gint64 latency;
+
+  (void) data;
+
+  fixture_start_logind_and_wait (fixture);
+
+  for (guint i = 0; i < G_N_ELEMENTS (starts); i++)
+    {
+      fixture->emitted++;
+      fixture->emitted_at = g_get_monotonic_time ();
+      mock_logind_prepare_for_sleep (fixture->mock, starts[i]);
+      g_assert_true (wait_for (has_prepare_for_sleep, fixture));
+
+      /* What the pause on suspend, and the resume after wake-up, start from */
+      latency = fixture->delivered_at - fixture->emitted_at;
+      g_test_message ("PrepareForSleep(%s) delivered after %" G_GINT64_FORMAT " us",
+                      starts[i] ? "true" : "false", latency);
+      g_assert_cmpint (latency, <, WAIT_TIMEOUT);
+    }
+
+  g_assert_cmpuint (fixture->prepare_for_sleep->len, ==, G_N_ELEMENTS (starts));
+  for (guint i = 0; i < G_N_ELEMENTS (starts); i++)
+      g_assert_cmpint (g_array_index (fixture->prepare_for_sleep, gboolean, i), ==, starts[i]);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr (GTestDBus) bus = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autofree char *contents = NULL;
+  int result;
+
+  g_test_init (&argc, &argv, NULL);
+
+  bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (bus);
+
+  connection = g_dbus_connection_new_for_address_sync (g_test_dbus_get_bus_address (bus),
+                                                       G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                       G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                       NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  /* Read once, by the first user of the configuration */
+  contents = g_strdup_printf ("[droidian-encryption-service]\nlogind_bus_address = %s\n",
+                              g_test_dbus_get_bus_address (bus));
+  g_assert_true (g_file_set_contents (CONFIGURATION_FILE, contents, -1, NULL));
+
+  g_test_add ("/logind/idle-hint", Fixture, NULL, fixture_set_up, test_idle_hint, fixture_tear_down);
+  g_test_add ("/logind/idle-hint-unchanged", Fixture, NULL,
+              fixture_set_up, test_idle_hint_unchanged, fixture_tear_down);
+  g_test_add ("/logind/sleep-inhibitor", Fixture, NULL, fixture_set_up, test_sleep_inhibitor, fixture_tear_down);
+  g_test_add ("/logind/sleep-inhibitor-early", Fixture, NULL,
+              fixture_set_up, test_sleep_inhibitor_early, fixture_tear_down);
+  g_test_add ("/logind/sleep-inhibitor-in-flight", Fixture, NULL,
+              fixture_set_up, test_sleep_inhibitor_in_flight, fixture_tear_down);
+  g_test_add ("/logind/prepare-for-sleep", Fixture, NULL,
+              fixture_set_up, test_prepare_for_sleep, fixture_tear_down);
+
+  result = g_test_run ();
+
+  g_clear_object (&connection);
+  g_test_dbus_down (bus);
+
+  return result;
+}
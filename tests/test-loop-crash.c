@@ -0,0 +1,318 @@
+/* test-loop-crash.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+/*
+ * Power loss during the reencryption of a loop device: a child resumes
+ * the reencryption as the helper does and gets SIGKILLed at a random
+ * point, a few times in a row. Every restart recovers the interrupted
+ * hotzone first, and the data must come out intact once the
+ * reencryption completes. Every resilience mode runs with several
+ * hotzone sizes, the time the recovery takes grows with it.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "loop-device.h"
+#include "reencryption.h"
+
+#define MIB (G_GUINT64_CONSTANT (1024) * 1024)
+
+/* Leaves room for a few kills with the largest hotzones */
+#define DATA_SIZE (128 * MIB)
+#define SECTOR_SIZE 512
+#define KILLS 4
+
+/* Bounds the wait for a child that stopped making progress */
+#define PROGRESS_TIMEOUT_MSEC (60 * 1000)
+
+typedef struct {
+  LoopFixture loop;
+} Fixture;
+
+typedef struct {
+  const char *path;
+  const char *resilience;
+  guint64     hotzone_size;
+} TestCase;
+
+/* Journal hotzones are capped to the keyslots area, a bit less than 16 MiB */
+static const TestCase test_cases[] = {
+  { "/loop/crash/checksum/1MiB", "checksum", MIB },
+  { "/loop/crash/checksum/4MiB", "checksum", 4 * MIB },
+  { "/loop/crash/checksum/16MiB", "checksum", 16 * MIB },
+  { "/loop/crash/journal/1MiB", "journal", MIB },
+  { "/loop/crash/journal/4MiB", "journal", 4 * MIB },
+  { "/loop/crash/journal/16MiB", "journal", 16 * MIB },
+};
+
+static void
+fixture_set_up (Fixture       *fixture,
+                gconstpointer  user_data)
+{
+  loop_fixture_set_up (&fixture->loop, REENCRYPTION_HEADER_SIZE, DATA_SIZE);
+}
+
+static void
+fixture_tear_down (Fixture       *fixture,
+                   gconstpointer  user_data)
+{
+  loop_fixture_tear_down (&fixture->loop);
+}
+
+static void
+fill_sector (guint64  sector,
+             guint64 *buffer)
+{
+  /* Tells apart a sector left unencrypted, encrypted twice or moved */
+  for (gsize i = 0; i < SECTOR_SIZE / sizeof (guint64); i++)
+      buffer[i] = (sector << 16) | i;
+}
+
+static void
+write_pattern (const char *device)
+{
+  guint64 buffer[SECTOR_SIZE / sizeof (guint64)];
+  int fd;
+
+  fd = open (device, O_WRONLY | O_CLOEXEC);
+  g_assert_cmpint (fd, >, -1);
+
+  for (guint64 sector = 0; sector < DATA_SIZE / SECTOR_SIZE; sector++)
+    {
+      fill_sector (sector, buffer);
+      g_assert_cmpint (pwrite (fd, buffer, sizeof (buffer), sector * SECTOR_SIZE), ==, sizeof (buffer));
+    }
+
+  g_assert_cmpint (fsync (fd), ==, 0);
+  close (fd);
+}
+
+static void
+check_pattern (const char *device)
+{
+  guint64 expected[SECTOR_SIZE / sizeof (guint64)];
+  guint64 buffer[SECTOR_SIZE / sizeof (guint64)];
+  int fd;
+
+  fd = open (device, O_RDONLY | O_CLOEXEC);
+  g_assert_cmpint (fd, >, -1);
+
+  for (guint64 sector = 0; sector < DATA_SIZE / SECTOR_SIZE; sector++)
+    {
+      fill_sector (sector, expected);
+      g_assert_cmpint (pread (fd, buffer, sizeof (buffer), sector * SECTOR_SIZE), ==, sizeof (buffer));
+
+      if (memcmp (buffer, expected, sizeof (buffer)) != 0)
+          g_error ("Sector %" G_GUINT64_FORMAT " is corrupted", sector);
+    }
+
+  close (fd);
+}
+
+static int
+report_progress (uint64_t  size,
+                 uint64_t  offset,
+                 void     *data)
+{
+  int *progress_fd = data;
+
+  /* What the helper publishes after every hotzone */
+  if (write (*progress_fd, &offset, sizeof (offset)) != sizeof (offset))
+      return 1;
+
+  return 0;
+}
+
+static pid_t
+spawn_reencryption (Fixture        *fixture,
+                    const TestCase *test_case,
+                    int            *progress_fd)
+{
+  struct crypt_device *crypt_device;
+  int fds[2];
+  pid_t pid;
+  int result;
+
+  g_assert_cmpint (pipe2 (fds, O_CLOEXEC), ==, 0);
+
+  pid = fork ();
+  g_assert_cmpint (pid, >, -1);
+
+  if (pid == 0)
+    {
+      close (fds[0]);
+
+      crypt_device = reencryption_load (fixture->loop.header, fixture->loop.data_device);
+      result = reencryption_resume (crypt_device, test_case->resilience, test_case->hotzone_size,
+                                    report_progress, &fds[1]);
+      crypt_free (crypt_device);
+
+      _exit (result < 0 ? 1 : 0);
+    }
+
+  close (fds[1]);
+  *progress_fd = fds[0];
+
+  return pid;
+}
+
+/* FALSE on end of file, that is the child is done */
+static gboolean
+read_progress (int       progress_fd,
+               guint64  *offset)
+{
+  struct pollfd pollfd = { .fd = progress_fd, .events = POLLIN };
+  gssize length;
+
+  g_assert_cmpint (poll (&pollfd, 1, PROGRESS_TIMEOUT_MSEC), ==, 1);
+
+  length = read (progress_fd, offset, sizeof (*offset));
+  g_assert_cmpint (length, >=, 0);
+
+  return length == sizeof (*offset);
+}
+
+static void
+test_crash (Fixture       *fixture,
+            gconstpointer  user_data)
+{
+  const TestCase *test_case = user_data;
+  g_autofree char *name = g_strdup_printf ("droidian-encryption-test-%d", getpid ());
+  g_autofree char *mapped_device = NULL;
+  struct crypt_device *crypt_device;
+  gint64 killed_at = 0;
+  gint64 hotzone_usec;
+  gint64 recovery_usec;
+  gint64 recovery_max_usec = 0;
+  gint64 recovery_total_usec = 0;
+  guint recoveries = 0;
+  gint64 resume_usec;
+  gint64 now;
+  gboolean done = FALSE;
+  guint64 offset = 0;
+  int progress_fd;
+  int status;
+  pid_t pid;
+
+  write_pattern (fixture->loop.data_device);
+  reencryption_initialize (fixture->loop.header, fixture->loop.data_device, test_case->resilience);
+
+  for (guint kill_count = 0; !done; kill_count++)
+    {
+      /* What the helper does on boot before resuming */
+      crypt_device = reencryption_load (fixture->loop.header, fixture->loop.data_device);
+      recovery_usec = reencryption_recover (crypt_device);
+      crypt_free (crypt_device);
+
+      if (recovery_usec)
+        {
+          recoveries++;
+          recovery_total_usec += recovery_usec;
+          recovery_max_usec = MAX (recovery_max_usec, recovery_usec);
+        }
+
+      pid = spawn_reencryption (fixture, test_case, &progress_fd);
+
+      if (read_progress (progress_fd, &offset) && killed_at)
+        {
+          resume_usec = g_get_monotonic_time () - killed_at;
+          g_test_message ("Killed at %" G_GUINT64_FORMAT " MiB, recovered in %" G_GINT64_FORMAT " ms, "
+                          "resumed in %" G_GINT64_FORMAT " ms", offset / MIB,
+                          recovery_usec / 1000, resume_usec / 1000);
+          g_assert_cmpint (resume_usec, <, 10 * G_USEC_PER_SEC);
+        }
+
+      if (kill_count < KILLS)
+        {
+          /* Somewhere in the middle of a hotzone, however long they take */
+          hotzone_usec = 20 * 1000;
+          now = g_get_monotonic_time ();
+          for (gint hotzones = g_test_rand_int_range (1, 4); hotzones > 0; hotzones--)
+            {
+              if (!read_progress (progress_fd, &offset))
+                  break;
+
+              hotzone_usec = MAX (g_get_monotonic_time () - now, 1);
+              now += hotzone_usec;
+            }
+
+          g_usleep (g_test_rand_int_range (0, MIN (hotzone_usec, G_MAXINT32)));
+          kill (pid, SIGKILL);
+          killed_at = g_get_monotonic_time ();
+        }
+      else
+        {
+          while (read_progress (progress_fd, &offset))
+              continue;
+        }
+
+      g_assert_cmpint (waitpid (pid, &status, 0), ==, pid);
+      close (progress_fd);
+
+      /* It might have completed before the signal got to it */
+      done = WIFEXITED (status);
+      if (done)
+          g_assert_cmpint (WEXITSTATUS (status), ==, 0);
+      else
+          g_assert_cmpint (WTERMSIG (status), ==, SIGKILL);
+    }
+
+  crypt_device = reencryption_load (fixture->loop.header, fixture->loop.data_device);
+  g_assert_cmpint (crypt_reencrypt_status (crypt_device, NULL), ==, CRYPT_REENCRYPT_NONE);
+
+  if (recoveries)
+      g_test_message ("%s resilience, %" G_GUINT64_FORMAT " MiB hotzones: %u recoveries, "
+                      "%" G_GINT64_FORMAT " ms on average, %" G_GINT64_FORMAT " ms at most",
+                      test_case->resilience, test_case->hotzone_size / MIB, recoveries,
+                      recovery_total_usec / recoveries / 1000, recovery_max_usec / 1000);
+
+  g_assert_cmpint (crypt_activate_by_passphrase (crypt_device, name, CRYPT_ANY_SLOT,
+                                                 REENCRYPTION_PASSPHRASE, strlen (REENCRYPTION_PASSPHRASE),
+                                                 CRYPT_ACTIVATE_READONLY), >=, 0);
+
+  mapped_device = g_build_filename (crypt_get_dir (), name, NULL);
+  check_pattern (mapped_device);
+
+  g_assert_cmpint (crypt_deactivate (crypt_device, name), ==, 0);
+  crypt_free (crypt_device);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  if (!loop_device_available ())
+    {
+      g_printerr ("Loop devices need root\n");
+      return LOOP_DEVICE_SKIP;
+    }
+
+  g_test_init (&argc, &argv, NULL);
+
+  for (gsize i = 0; i < G_N_ELEMENTS (test_cases); i++)
+      g_test_add (test_cases[i].path, Fixture, &test_cases[i], fixture_set_up, test_crash, fixture_tear_down);
+
+  return g_test_run ();
+}
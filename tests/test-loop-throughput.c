@@ -0,0 +1,156 @@
+/* test-loop-throughput.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+/*
+ * The rate limit of the helper, against a real reencryption of a loop
+ * device: the hotzones are paced by the control checkpoint, as in the
+ * helper progress callback.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "loop-device.h"
+#include "reencryption.h"
+
+#define MIB (G_GUINT64_CONSTANT (1024) * 1024)
+
+#define DATA_SIZE (64 * MIB)
+#define HOTZONE_SIZE MIB
+#define UNTHROTTLED_SIZE (8 * MIB)
+#define RATE_LIMIT (8 * MIB)
+
+typedef struct {
+  LoopFixture loop;
+  int run_fd;
+} Fixture;
+
+typedef struct {
+  DroidianEncryptionHelperControl *control;
+  gint64 started_at;
+  gdouble unthrottled_rate;
+  gint64 throttled_from;
+  guint64 throttled_offset;
+} Throughput;
+
+static void
+fixture_set_up (Fixture       *fixture,
+                gconstpointer  user_data)
+{
+  loop_fixture_set_up (&fixture->loop, REENCRYPTION_HEADER_SIZE, DATA_SIZE);
+
+  fixture->run_fd = open (fixture->loop.directory, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  g_assert_cmpint (fixture->run_fd, >, -1);
+}
+
+static void
+fixture_tear_down (Fixture       *fixture,
+                   gconstpointer  user_data)
+{
+  close (fixture->run_fd);
+  loop_fixture_tear_down (&fixture->loop);
+}
+
+static int
+on_progress (uint64_t  size,
+             uint64_t  offset,
+             void     *data)
+{
+  Throughput *throughput = data;
+  char request[DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX];
+  char reply[DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX];
+  gint64 now = g_get_monotonic_time ();
+
+  if (!throughput->throttled_from && offset >= UNTHROTTLED_SIZE)
+    {
+      throughput->unthrottled_rate = (gdouble) offset * G_USEC_PER_SEC / MAX (now - throughput->started_at, 1);
+
+      /* As the service would send it: the window opens at the checkpoint below */
+      g_snprintf (request, sizeof (request), "%s %" G_GUINT64_FORMAT,
+                  DROIDIAN_ENCRYPTION_HELPER_CONTROL_RATE_LIMIT, RATE_LIMIT);
+      droidian_encryption_helper_control_handle_request (throughput->control, request, reply, sizeof (reply));
+      g_assert_cmpstr (reply, ==, DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_OK);
+
+      throughput->throttled_from = now;
+      throughput->throttled_offset = offset;
+    }
+
+  return droidian_encryption_helper_control_checkpoint (throughput->control, offset, size) ? 0 : 1;
+}
+
+static void
+test_rate_limit (Fixture       *fixture,
+                 gconstpointer  user_data)
+{
+  Throughput throughput = { 0 };
+  struct crypt_device *crypt_device;
+  gdouble throttled_rate;
+  gint64 elapsed;
+
+  reencryption_initialize (fixture->loop.header, fixture->loop.data_device, "checksum");
+  crypt_device = reencryption_load (fixture->loop.header, fixture->loop.data_device);
+
+  throughput.control = droidian_encryption_helper_control_new (fixture->run_fd);
+  g_assert_nonnull (throughput.control);
+  droidian_encryption_helper_control_set_running (throughput.control);
+
+  throughput.started_at = g_get_monotonic_time ();
+  g_assert_cmpint (reencryption_resume (crypt_device, "checksum", HOTZONE_SIZE, on_progress, &throughput), ==, 0);
+  elapsed = g_get_monotonic_time () - throughput.throttled_from;
+
+  droidian_encryption_helper_control_stopped (throughput.control);
+  droidian_encryption_helper_control_free (throughput.control);
+  g_assert_cmpint (crypt_reencrypt_status (crypt_device, NULL), ==, CRYPT_REENCRYPT_NONE);
+  crypt_free (crypt_device);
+
+  g_assert_cmpint (throughput.throttled_from, >, 0);
+  throttled_rate = (gdouble) (DATA_SIZE - throughput.throttled_offset) * G_USEC_PER_SEC / elapsed;
+
+  g_test_message ("Unthrottled: %.1f MiB/s, limited to %" G_GUINT64_FORMAT " MiB/s: %.1f MiB/s",
+                  throughput.unthrottled_rate / MIB, RATE_LIMIT / MIB, throttled_rate / MIB);
+
+  /* Nothing to cap when the device can't go much faster than the limit */
+  if (throughput.unthrottled_rate < 2 * RATE_LIMIT)
+    {
+      g_test_skip ("The loop device is too slow to tell the rate limit apart");
+      return;
+    }
+
+  g_assert_cmpfloat (throttled_rate, <=, RATE_LIMIT * 1.05);
+  g_assert_cmpfloat (throttled_rate, >=, RATE_LIMIT * 0.5);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  if (!loop_device_available ())
+    {
+      g_printerr ("Loop devices need root\n");
+      return LOOP_DEVICE_SKIP;
+    }
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/loop/rate-limit", Fixture, NULL, fixture_set_up, test_rate_limit, fixture_tear_down);
+
+  return g_test_run ();
+}
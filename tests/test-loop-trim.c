@@ -0,0 +1,199 @@
+/* test-loop-trim.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The discard pass, through a filesystem on an encrypted loop device: the
+ * free space trimmed on the mapped device must reach the backing file as
+ * holes, as it would reach the flash controller.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <glib/gstdio.h>
+
+#include "loop-device.h"
+#include "reencryption.h"
+#include "trim.h"
+
+#define MIB (G_GUINT64_CONSTANT (1024) * 1024)
+
+#define DATA_SIZE (64 * MIB)
+#define FILE_SIZE (32 * MIB)
+
+typedef struct {
+  LoopFixture loop;
+  char *name;
+  char *mapped_device;
+  char *mount_point;
+  gboolean mounted;
+} Fixture;
+
+static void
+fixture_set_up (Fixture       *fixture,
+                gconstpointer  user_data)
+{
+  loop_fixture_set_up (&fixture->loop, REENCRYPTION_HEADER_SIZE, DATA_SIZE);
+
+  fixture->name = g_strdup_printf ("droidian-encryption-test-%d", getpid ());
+  fixture->mapped_device = g_build_filename (crypt_get_dir (), fixture->name, NULL);
+  fixture->mount_point = g_build_filename (fixture->loop.directory, "mnt", NULL);
+  g_assert_cmpint (g_mkdir (fixture->mount_point, 0700), ==, 0);
+}
+
+static void
+fixture_tear_down (Fixture       *fixture,
+                   gconstpointer  user_data)
+{
+  struct crypt_device *crypt_device = NULL;
+
+  if (fixture->mounted)
+      g_assert_cmpint (umount (fixture->mount_point), ==, 0);
+
+  if (crypt_init_by_name (&crypt_device, fixture->name) == 0)
+    {
+      crypt_deactivate (crypt_device, fixture->name);
+      crypt_free (crypt_device);
+    }
+
+  g_rmdir (fixture->mount_point);
+  loop_fixture_tear_down (&fixture->loop);
+
+  g_free (fixture->mount_point);
+  g_free (fixture->mapped_device);
+  g_free (fixture->name);
+}
+
+static gboolean
+make_filesystem (const char *device)
+{
+  /* The discards must come from the pass, not from mkfs */
+  const char *argv[] = { "mkfs.ext4", "-q", "-F", "-E", "nodiscard", device, NULL };
+  int wait_status;
+
+  if (!g_spawn_sync (NULL, (char **) argv, NULL, G_SPAWN_SEARCH_PATH,
+                     NULL, NULL, NULL, NULL, &wait_status, NULL))
+      return FALSE;
+
+  return WIFEXITED (wait_status) && WEXITSTATUS (wait_status) == 0;
+}
+
+static void
+fill_and_delete (const char *directory)
+{
+  g_autofree char *path = g_build_filename (directory, "fill", NULL);
+  g_autofree char *buffer = g_malloc (MIB);
+  int fd;
+
+  memset (buffer, 0xa5, MIB);
+
+  fd = open (path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+  g_assert_cmpint (fd, >, -1);
+
+  for (guint i = 0; i < FILE_SIZE / MIB; i++)
+      g_assert_cmpint (write (fd, buffer, MIB), ==, MIB);
+
+  g_assert_cmpint (fsync (fd), ==, 0);
+  close (fd);
+
+  /* Free space again, but still allocated in the backing file */
+  g_assert_cmpint (g_unlink (path), ==, 0);
+  sync ();
+}
+
+static guint64
+get_allocated (const char *path)
+{
+  struct stat st;
+
+  g_assert_cmpint (stat (path, &st), ==, 0);
+
+  return (guint64) st.st_blocks * 512;
+}
+
+static void
+test_discard (Fixture       *fixture,
+              gconstpointer  user_data)
+{
+  struct crypt_device *crypt_device;
+  guint64 allocated_before;
+  guint64 allocated_after;
+  guint64 trimmed = 0;
+  int root_fd;
+
+  /* The reencryption writes every block: the backing file is fully allocated */
+  reencryption_initialize (fixture->loop.header, fixture->loop.data_device, "checksum");
+  crypt_device = reencryption_load (fixture->loop.header, fixture->loop.data_device);
+  g_assert_cmpint (reencryption_resume (crypt_device, "checksum", 0, NULL, NULL), ==, 0);
+
+  /* The flag the service persists at configuration */
+  g_assert_cmpint (crypt_activate_by_passphrase (crypt_device, fixture->name, CRYPT_ANY_SLOT,
+                                                 REENCRYPTION_PASSPHRASE, strlen (REENCRYPTION_PASSPHRASE),
+                                                 CRYPT_ACTIVATE_ALLOW_DISCARDS), >=, 0);
+  crypt_free (crypt_device);
+
+  if (!make_filesystem (fixture->mapped_device))
+    {
+      g_test_skip ("Unable to create an ext4 filesystem, is mkfs.ext4 there?");
+      return;
+    }
+
+  g_assert_cmpint (mount (fixture->mapped_device, fixture->mount_point, "ext4", 0, NULL), ==, 0);
+  fixture->mounted = TRUE;
+
+  fill_and_delete (fixture->mount_point);
+  allocated_before = get_allocated (fixture->loop.data_file);
+
+  /* As the service does, on the root directory of the filesystem */
+  root_fd = open (fixture->mount_point, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  g_assert_cmpint (root_fd, >, -1);
+  g_assert_cmpint (droidian_encryption_service_trim_range (root_fd, 0, DATA_SIZE, &trimmed), ==, 0);
+  close (root_fd);
+  sync ();
+
+  allocated_after = get_allocated (fixture->loop.data_file);
+
+  g_test_message ("Trimmed %" G_GUINT64_FORMAT " MiB, backing file %" G_GUINT64_FORMAT
+                  " MiB -> %" G_GUINT64_FORMAT " MiB", trimmed / MIB, allocated_before / MIB,
+                  allocated_after / MIB);
+
+  g_assert_cmpuint (allocated_before, >=, DATA_SIZE);
+  g_assert_cmpuint (trimmed, >=, FILE_SIZE);
+  /* At least the deleted file is punched out of the backing file */
+  g_assert_cmpuint (allocated_after, <=, allocated_before - FILE_SIZE);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  if (!loop_device_available ())
+    {
+      g_printerr ("Loop devices need root\n");
+      return LOOP_DEVICE_SKIP;
+    }
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/loop/discard", Fixture, NULL, fixture_set_up, test_discard, fixture_tear_down);
+
+  return g_test_run ();
+}
@@ -0,0 +1,194 @@
+/* test-progress.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "fake-cryptsetup.h"
+#include "history.h"
+#include "progress.h"
+
+#define DEVICE_PATH "/fake/droidian-reserved"
+
+#define MB (G_GUINT64_CONSTANT (1000) * 1000)
+#define GB (G_GUINT64_CONSTANT (1000) * MB)
+#define HOUR G_TIME_SPAN_HOUR
+#define DAY G_TIME_SPAN_DAY
+
+static void
+add_session (GArray  *history,
+             gint64   started_at,
+             guint64  start_offset,
+             guint64  end_offset,
+             gint64   active_usec)
+{
+  DroidianEncryptionHistorySession session = {
+    .started_at = started_at,
+    .start_offset = start_offset,
+    .end_offset = end_offset,
+    .active_usec = active_usec,
+  };
+
+  g_array_append_val (history, session);
+}
+
+static void
+test_estimate_nothing (void)
+{
+  g_autoptr (GArray) history = g_array_new (FALSE, TRUE, sizeof (DroidianEncryptionHistorySession));
+
+  g_assert_cmpuint (droidian_encryption_service_progress_estimate_remaining_time (NULL, GB), ==, 0);
+  g_assert_cmpuint (droidian_encryption_service_progress_estimate_remaining_time (history, GB), ==, 0);
+
+  /* Interrupted before the first hotzone */
+  add_session (history, DAY, GB, GB, HOUR);
+  g_assert_cmpuint (droidian_encryption_service_progress_estimate_remaining_time (history, GB), ==, 0);
+}
+
+static void
+test_estimate_single_session (void)
+{
+  g_autoptr (GArray) history = g_array_new (FALSE, TRUE, sizeof (DroidianEncryptionHistorySession));
+
+  /* 1 MB/s, less than a day to go by: nothing to spread */
+  add_session (history, DAY, 0, 3600 * MB, HOUR);
+  g_assert_cmpuint (droidian_encryption_service_progress_estimate_remaining_time (history, 7200 * MB), ==, 7200);
+}
+
+static void
+test_estimate_spread (void)
+{
+  g_autoptr (GArray) history = g_array_new (FALSE, TRUE, sizeof (DroidianEncryptionHistorySession));
+
+  /* 1 MB/s, 24 hours of work over a day and a half: 16 hours a day */
+  add_session (history, DAY, 0, 43200 * MB, 12 * HOUR);
+  add_session (history, 2 * DAY, 43200 * MB, 86400 * MB, 12 * HOUR);
+
+  g_assert_cmpuint (droidian_encryption_service_progress_estimate_remaining_time (history, 43200 * MB), ==,
+                    12 * 3600 * 3 / 2);
+}
+
+#ifdef HAVE_CRYPT_DUMP_JSON
+/* Reencrypting from aes-cbc-essiv to aes-xts, past the 16 MiB header */
+#define SEGMENT(offset, size, encryption, flags)                        \
+  "{ \"type\": \"crypt\", \"offset\": \"" offset "\", \"size\": \"" size "\", " \
+  "\"iv_tweak\": \"0\", \"encryption\": \"" encryption "\", \"sector_size\": 512" \
+  flags " }"
+#define NEW "aes-xts-plain64"
+#define OLD "aes-cbc-essiv:sha256"
+#define FLAGS(flag) ", \"flags\": [ \"" flag "\" ]"
+#define BACKUPS                                                         \
+  "\"3\": " SEGMENT ("16777216", "dynamic", OLD, FLAGS ("backup-previous")) ", " \
+  "\"4\": " SEGMENT ("16777216", "dynamic", NEW, FLAGS ("backup-final"))
+
+typedef struct {
+  const char *metadata;
+  gboolean result;
+  guint64 offset;
+} SegmentsTest;
+
+static const SegmentsTest segments_tests[] = {
+  /* Between two hotzones */
+  { "{ \"segments\": { "
+    "\"0\": " SEGMENT ("16777216", "1073741824", NEW, "") ", "
+    "\"1\": " SEGMENT ("1090519040", "dynamic", OLD, "") ", "
+    BACKUPS " } }",
+    TRUE, 1073741824 },
+  /* Stopped by a crash while rewriting a hotzone */
+  { "{ \"segments\": { "
+    "\"0\": " SEGMENT ("16777216", "1073741824", NEW, "") ", "
+    "\"1\": " SEGMENT ("1090519040", "33554432", NEW, FLAGS ("in-reencryption")) ", "
+    "\"2\": " SEGMENT ("1124073472", "dynamic", OLD, "") ", "
+    BACKUPS " } }",
+    TRUE, 1073741824 },
+  /* Before the first hotzone */
+  { "{ \"segments\": { "
+    "\"0\": " SEGMENT ("16777216", "dynamic", OLD, "") ", "
+    BACKUPS " } }",
+    TRUE, 0 },
+  /* Without backup-final, only the first segment can be the new one */
+  { "{ \"segments\": { "
+    "\"0\": " SEGMENT ("16777216", "1073741824", NEW, "") ", "
+    "\"1\": " SEGMENT ("1090519040", "dynamic", NEW, "") " } }",
+    TRUE, 1073741824 },
+  /* Keys are numbers, not positions */
+  { "{ \"segments\": { "
+    "\"1\": " SEGMENT ("1090519040", "dynamic", OLD, "") ", "
+    "\"0\": " SEGMENT ("16777216", "1073741824", NEW, "") ", "
+    BACKUPS " } }",
+    TRUE, 1073741824 },
+  /* Everything is in the new format, the offset is the size */
+  { "{ \"segments\": { "
+    "\"0\": " SEGMENT ("16777216", "dynamic", NEW, "") ", "
+    BACKUPS " } }",
+    FALSE, 0 },
+  /* Not something to go by */
+  { "{ \"segments\": { \"0\": { \"type\": \"crypt\" } } }", FALSE, 0 },
+  { "{ \"segments\": { \"first\": " SEGMENT ("16777216", "dynamic", NEW, "") " } }", FALSE, 0 },
+  { "{ \"segments\": [] }", FALSE, 0 },
+  { "{ \"segments\": ", FALSE, 0 },
+  { NULL, FALSE, 0 },
+};
+
+static void
+test_segments (gconstpointer data)
+{
+  const SegmentsTest *test = data;
+  struct crypt_device *crypt_device = NULL;
+  FakeCryptModel model = {
+    .size = 64 * GB,
+    .hotzone_size = 32 * 1024 * 1024,
+    .bytes_per_second = 100 * MB,
+  };
+  guint64 offset = G_MAXUINT64;
+
+  fake_crypt_add_device (DEVICE_PATH, &model);
+  fake_crypt_set_metadata (DEVICE_PATH, test->metadata);
+
+  g_assert_cmpint (crypt_init_data_device (&crypt_device, DEVICE_PATH, NULL), ==, 0);
+  g_assert_cmpint (crypt_load (crypt_device, CRYPT_LUKS2, NULL), ==, 0);
+
+  g_assert_cmpint (droidian_encryption_service_progress_from_segments (crypt_device, &offset), ==, test->result);
+  if (test->result)
+      g_assert_cmpuint (offset, ==, test->offset);
+
+  crypt_free (crypt_device);
+  fake_crypt_remove_device (DEVICE_PATH);
+}
+#endif
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/progress/estimate/nothing", test_estimate_nothing);
+  g_test_add_func ("/progress/estimate/single-session", test_estimate_single_session);
+  g_test_add_func ("/progress/estimate/spread", test_estimate_spread);
+
+#ifdef HAVE_CRYPT_DUMP_JSON
+  for (guint i = 0; i < G_N_ELEMENTS (segments_tests); i++)
+    {
+      g_autofree char *path = g_strdup_printf ("/progress/segments/%u", i);
+
+      g_test_add_data_func (path, &segments_tests[i], test_segments);
+    }
+#endif
+
+  return g_test_run ();
+}
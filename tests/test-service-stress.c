@@ -0,0 +1,436 @@
+/* test-service-stress.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The service, spawned on a private bus, must keep answering while it
+ * probes a slow header. The header sits on a dm-delay device, so that
+ * every read of the probe stalls, and RefreshStatus is called by many
+ * clients at once while the device is unconfigured, a status that is
+ * probed from the header every time. Meanwhile, the calls that only
+ * read the cached state must not wait for any probe, and the
+ * RefreshStatus calls must share probes rather than queue one each.
+ */
+
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <glib/gstdio.h>
+
+#include "loop-device.h"
+#include "mock-polkit.h"
+
+#define SERVICE_NAME "org.droidian.EncryptionService"
+#define SERVICE_OBJECT_PATH "/Encryption"
+#define SERVICE_INTERFACE "org.droidian.EncryptionService.Encryption"
+
+/* DroidianEncryptionServiceEncryptionStatus */
+#define STATUS_UNKNOWN 0
+#define STATUS_UNCONFIGURED 2
+
+#define MIB (G_GUINT64_CONSTANT (1024) * 1024)
+
+#define HEADER_SIZE (32 * MIB)
+#define DATA_SIZE (64 * MIB)
+#define DELAY_MSEC 100
+#define CLIENTS 100
+
+#define WAIT_TIMEOUT (30 * G_USEC_PER_SEC)
+
+typedef struct {
+  GTestDBus *bus;
+  GDBusConnection *connection;
+  MockPolkit *polkit;
+
+  char *directory;
+  char *header_file;
+  char *data_file;
+  char *header_loop;
+  char *data_device;
+  char *delay_name;
+  char *header_device;
+
+  GSubprocess *service;
+} Fixture;
+
+typedef struct {
+  gint64 sent_at;
+  gint64 latency;
+  GVariant *reply;
+  GError *error;
+  gboolean done;
+} Call;
+
+static gboolean
+run_dmsetup (const char * const *arguments)
+{
+  g_autoptr (GPtrArray) argv = g_ptr_array_new ();
+  g_autoptr (GError) error = NULL;
+  int wait_status;
+
+  g_ptr_array_add (argv, "dmsetup");
+  for (; *arguments; arguments++)
+      g_ptr_array_add (argv, (char *) *arguments);
+  g_ptr_array_add (argv, NULL);
+
+  if (!g_spawn_sync (NULL, (char **) argv->pdata, NULL, G_SPAWN_SEARCH_PATH,
+                     NULL, NULL, NULL, NULL, &wait_status, &error))
+    {
+      g_printerr ("Unable to run dmsetup: %s\n", error->message);
+      return FALSE;
+    }
+
+  return WIFEXITED (wait_status) && WEXITSTATUS (wait_status) == 0;
+}
+
+static void
+on_call_done (GDBusConnection *connection,
+              GAsyncResult    *result,
+              Call            *call)
+{
+  call->reply = g_dbus_connection_call_finish (connection, result, &call->error);
+  call->latency = g_get_monotonic_time () - call->sent_at;
+  call->done = TRUE;
+}
+
+static void
+call_async (GDBusConnection *connection,
+            const char      *interface_name,
+            const char      *method_name,
+            GVariant        *parameters,
+            Call            *call)
+{
+  call->sent_at = g_get_monotonic_time ();
+  g_dbus_connection_call (connection, SERVICE_NAME, SERVICE_OBJECT_PATH, interface_name, method_name,
+                          parameters, NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+                          (GAsyncReadyCallback) on_call_done, call);
+}
+
+/* The mock polkit answers from this thread: never block it on the service */
+static GVariant *
+call (GDBusConnection *connection,
+      const char      *interface_name,
+      const char      *method_name,
+      GVariant        *parameters)
+{
+  Call pending = { 0 };
+
+  call_async (connection, interface_name, method_name, parameters, &pending);
+
+  while (!pending.done)
+      g_main_context_iteration (NULL, TRUE);
+
+  g_assert_no_error (pending.error);
+
+  return pending.reply;
+}
+
+static int
+get_status (Fixture *fixture)
+{
+  g_autoptr (GVariant) reply = NULL;
+  g_autoptr (GVariant) value = NULL;
+
+  reply = call (fixture->connection, "org.freedesktop.DBus.Properties", "Get",
+                g_variant_new ("(ss)", SERVICE_INTERFACE, "Status"));
+  g_variant_get (reply, "(v)", &value);
+
+  return g_variant_get_int32 (value);
+}
+
+static int
+refresh_status (Fixture *fixture)
+{
+  g_autoptr (GVariant) reply = NULL;
+
+  reply = call (fixture->connection, SERVICE_INTERFACE, "RefreshStatus", NULL);
+
+  return get_status (fixture);
+}
+
+static gboolean
+wait_for_service (Fixture *fixture)
+{
+  gint64 deadline = g_get_monotonic_time () + WAIT_TIMEOUT;
+  g_autoptr (GVariant) reply = NULL;
+  gboolean has_owner = FALSE;
+
+  while (!has_owner)
+    {
+      if (g_get_monotonic_time () > deadline)
+          return FALSE;
+
+      g_clear_pointer (&reply, g_variant_unref);
+      reply = g_dbus_connection_call_sync (fixture->connection, "org.freedesktop.DBus",
+                                           "/org/freedesktop/DBus", "org.freedesktop.DBus", "NameHasOwner",
+                                           g_variant_new ("(s)", SERVICE_NAME), G_VARIANT_TYPE ("(b)"),
+                                           G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+      g_assert_nonnull (reply);
+      g_variant_get (reply, "(b)", &has_owner);
+
+      if (!has_owner)
+          g_usleep (10 * 1000);
+    }
+
+  return TRUE;
+}
+
+static int
+wait_for_status_change (Fixture *fixture,
+                        int      status,
+                        gint64   timeout)
+{
+  gint64 deadline = g_get_monotonic_time () + timeout;
+  int current;
+
+  while ((current = refresh_status (fixture)) == status && g_get_monotonic_time () < deadline)
+      g_usleep (100 * 1000);
+
+  return current;
+}
+
+static void
+fixture_set_up (Fixture       *fixture,
+                gconstpointer  user_data)
+{
+  g_autofree char *sectors = NULL;
+  g_autofree char *table = NULL;
+  g_autofree char *configuration = NULL;
+  g_autoptr (GError) error = NULL;
+
+  fixture->bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (fixture->bus);
+
+  fixture->connection = g_dbus_connection_new_for_address_sync (g_test_dbus_get_bus_address (fixture->bus),
+                                                                G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                                G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                                NULL, NULL, &error);
+  g_assert_no_error (error);
+  fixture->polkit = mock_polkit_new (fixture->connection);
+
+  fixture->directory = g_dir_make_tmp ("droidian-encryption-service-XXXXXX", NULL);
+  g_assert_nonnull (fixture->directory);
+
+  fixture->header_file = loop_device_create_file (fixture->directory, "header", HEADER_SIZE);
+  fixture->data_file = loop_device_create_file (fixture->directory, "data", DATA_SIZE);
+  fixture->header_loop = loop_device_attach (fixture->header_file);
+  fixture->data_device = loop_device_attach (fixture->data_file);
+
+  /* Every read and write of the header stalls */
+  fixture->delay_name = g_strdup_printf ("droidian-encryption-test-delay-%d", getpid ());
+  fixture->header_device = g_strdup_printf ("/dev/mapper/%s", fixture->delay_name);
+  table = g_strdup_printf ("0 %" G_GUINT64_FORMAT " delay %s 0 %d",
+                           HEADER_SIZE / 512, fixture->header_loop, DELAY_MSEC);
+  if (!run_dmsetup ((const char *[]) { "create", fixture->delay_name, "--table", table, NULL }))
+      g_clear_pointer (&fixture->delay_name, g_free);
+
+  configuration = g_strdup_printf ("[droidian-encryption-service]\n"
+                                   "header_device = %s\n"
+                                   "data_device = %s\n"
+                                   "mapped_name = droidian-encryption-test-%d\n"
+                                   "keyslot_iteration_time = 1000\n"
+                                   "trim_after_encryption = false\n",
+                                   fixture->header_device, fixture->data_device, getpid ());
+  g_assert_true (g_file_set_contents (CONFIGURATION_FILE, configuration, -1, NULL));
+  g_assert_true (g_file_set_contents (DROIDIAN_ENCRYPTION_SUPPORTED_STAMP, "", -1, NULL));
+  g_unlink (DROIDIAN_ENCRYPTION_HELPER_FAILURE);
+  g_unlink (DROIDIAN_ENCRYPTION_HELPER_PROGRESS);
+  g_unlink (DROIDIAN_ENCRYPTION_SERVICE_JOURNAL);
+}
+
+static void
+fixture_start_service (Fixture *fixture)
+{
+  g_autoptr (GSubprocessLauncher) launcher = NULL;
+  g_autoptr (GError) error = NULL;
+
+  g_assert_nonnull (g_getenv ("DROIDIAN_ENCRYPTION_SERVICE"));
+
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_NONE);
+  g_subprocess_launcher_setenv (launcher, "DBUS_SYSTEM_BUS_ADDRESS",
+                                g_test_dbus_get_bus_address (fixture->bus), TRUE);
+
+  fixture->service = g_subprocess_launcher_spawn (launcher, &error, g_getenv ("DROIDIAN_ENCRYPTION_SERVICE"), NULL);
+  g_assert_no_error (error);
+
+  g_assert_true (wait_for_service (fixture));
+}
+
+static void
+fixture_tear_down (Fixture       *fixture,
+                   gconstpointer  user_data)
+{
+  if (fixture->service)
+    {
+      g_subprocess_send_signal (fixture->service, SIGTERM);
+      g_subprocess_wait (fixture->service, NULL, NULL);
+      g_clear_object (&fixture->service);
+    }
+
+  if (fixture->delay_name &&
+      !run_dmsetup ((const char *[]) { "remove", "--retry", fixture->delay_name, NULL }))
+      g_printerr ("Unable to remove %s\n", fixture->delay_name);
+
+  loop_device_detach (fixture->data_device);
+  loop_device_detach (fixture->header_loop);
+
+  g_unlink (CONFIGURATION_FILE);
+  g_unlink (DROIDIAN_ENCRYPTION_SUPPORTED_STAMP);
+  g_unlink (DROIDIAN_ENCRYPTION_SERVICE_JOURNAL);
+  g_unlink (fixture->data_file);
+  g_unlink (fixture->header_file);
+  g_rmdir (fixture->directory);
+
+  g_free (fixture->header_device);
+  g_free (fixture->delay_name);
+  g_free (fixture->data_device);
+  g_free (fixture->header_loop);
+  g_free (fixture->data_file);
+  g_free (fixture->header_file);
+  g_free (fixture->directory);
+
+  mock_polkit_free (fixture->polkit);
+  g_object_unref (fixture->connection);
+  g_test_dbus_down (fixture->bus);
+  g_object_unref (fixture->bus);
+}
+
+static int
+compare_latency (gconstpointer a,
+                 gconstpointer b)
+{
+  gint64 latency_a = ((const Call *) a)->latency;
+  gint64 latency_b = ((const Call *) b)->latency;
+
+  return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+static void
+test_refresh_while_probing (Fixture       *fixture,
+                            gconstpointer  user_data)
+{
+  GDBusConnection *clients[CLIENTS];
+  Call calls[CLIENTS] = { 0 };
+  g_autoptr (GArray) cached_calls = g_array_new (FALSE, TRUE, sizeof (Call));
+  g_autoptr (GError) error = NULL;
+  Call *cached_call = NULL;
+  gint64 probe_usec;
+  gint64 started_at;
+  gint64 deadline;
+  guint completed;
+
+  if (!fixture->delay_name)
+    {
+      g_test_skip ("Unable to set up the dm-delay device");
+      return;
+    }
+
+  fixture_start_service (fixture);
+  g_assert_cmpint (wait_for_status_change (fixture, STATUS_UNKNOWN, WAIT_TIMEOUT), ==, STATUS_UNCONFIGURED);
+
+  /* Nothing is cached while unconfigured: every RefreshStatus reads the header */
+  started_at = g_get_monotonic_time ();
+  g_assert_cmpint (refresh_status (fixture), ==, STATUS_UNCONFIGURED);
+  probe_usec = g_get_monotonic_time () - started_at;
+  g_test_message ("A probe takes %" G_GINT64_FORMAT " us", probe_usec);
+
+  if (probe_usec < 2 * DELAY_MSEC * 1000)
+    {
+      g_test_incomplete ("The probe doesn't read the delayed header");
+      return;
+    }
+
+  /* Connected beforehand, so that the calls go out together */
+  for (guint i = 0; i < CLIENTS; i++)
+    {
+      clients[i] = g_dbus_connection_new_for_address_sync (g_test_dbus_get_bus_address (fixture->bus),
+                                                           G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                           G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                           NULL, NULL, &error);
+      g_assert_no_error (error);
+    }
+
+  for (guint i = 0; i < CLIENTS; i++)
+      call_async (clients[i], SERVICE_INTERFACE, "RefreshStatus", NULL, &calls[i]);
+
+  /* Back to back, only the cached state: it must never wait for the probes */
+  deadline = g_get_monotonic_time () + CLIENTS * probe_usec;
+  do
+    {
+      if (!cached_call || cached_call->done)
+        {
+          /* Never reallocated while a call is pending */
+          g_array_set_size (cached_calls, cached_calls->len + 1);
+          cached_call = &g_array_index (cached_calls, Call, cached_calls->len - 1);
+          call_async (fixture->connection, SERVICE_INTERFACE, "GetDetailedStatus", NULL, cached_call);
+        }
+
+      g_main_context_iteration (NULL, TRUE);
+
+      completed = 0;
+      while (completed < CLIENTS && calls[completed].done)
+          completed++;
+    }
+  while ((completed < CLIENTS || !cached_call->done) && g_get_monotonic_time () < deadline);
+
+  for (guint i = 0; i < CLIENTS; i++)
+    {
+      g_assert_true (calls[i].done);
+      g_assert_no_error (calls[i].error);
+      g_clear_pointer (&calls[i].reply, g_variant_unref);
+      g_object_unref (clients[i]);
+    }
+
+  for (guint i = 0; i < cached_calls->len; i++)
+    {
+      g_assert_no_error (g_array_index (cached_calls, Call, i).error);
+      g_clear_pointer (&g_array_index (cached_calls, Call, i).reply, g_variant_unref);
+    }
+
+  qsort (calls, CLIENTS, sizeof (Call), compare_latency);
+  g_array_sort (cached_calls, compare_latency);
+  g_test_message ("%d RefreshStatus calls: p50 %" G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT " us",
+                  CLIENTS, calls[CLIENTS / 2].latency, calls[CLIENTS - 1].latency);
+  g_test_message ("%u GetDetailedStatus calls meanwhile: p50 %" G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT " us",
+                  cached_calls->len, g_array_index (cached_calls, Call, cached_calls->len / 2).latency,
+                  g_array_index (cached_calls, Call, cached_calls->len - 1).latency);
+
+  /* Probing on the main loop would hold it for one probe per call */
+  g_assert_cmpint (g_array_index (cached_calls, Call, cached_calls->len - 1).latency, <, probe_usec / 2);
+
+  /* The calls arriving during a probe wait for the next one at worst */
+  g_assert_cmpint (calls[CLIENTS - 1].latency, <, 3 * probe_usec);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  if (!loop_device_available ())
+    {
+      g_printerr ("Loop devices need root\n");
+      return LOOP_DEVICE_SKIP;
+    }
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/service/refresh-while-probing", Fixture, NULL,
+              fixture_set_up, test_refresh_while_probing, fixture_tear_down);
+
+  return g_test_run ();
+}
@@ -0,0 +1,496 @@
+/* test-simulation.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+/*
+ * The helper pacing, and the service estimates built on what it records,
+ * run against a fake libcryptsetup on a virtual clock: days of
+ * reencryption take a fraction of a second, and the outcome of a policy
+ * can be compared by total time and foreground impact.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#include "control.h"
+#include "fake-cryptsetup.h"
+#include "history.h"
+#include "progress.h"
+#include "virtual-clock.h"
+
+#define DEVICE_PATH "/fake/droidian-reserved"
+#define PASSPHRASE "passphrase"
+
+#define MB (G_GUINT64_CONSTANT (1000) * 1000)
+#define MIB (G_GUINT64_CONSTANT (1024) * 1024)
+#define GB (G_GUINT64_CONSTANT (1000) * MB)
+#define HOUR G_TIME_SPAN_HOUR
+#define DAY G_TIME_SPAN_DAY
+
+/* A day of the simulated user: busy, then idle overnight while charging, then switched off */
+#define IDLE_FROM (12 * HOUR)
+#define SWITCHED_OFF_FROM (18 * HOUR)
+
+static int run_fd = -1;
+
+typedef struct {
+  const char *name;
+  guint64 background_rate_limit;
+  gboolean opportunistic; /* boost while the user is idle, as the service does */
+} Policy;
+
+typedef struct {
+  const Policy *policy;
+  DroidianEncryptionHelperControl *control;
+  gint64 origin;
+  gboolean mode_set;
+  gboolean idle;
+
+  /* Foreground impact: how busy the device has been while the user was active */
+  gint64 sampled_at;
+  gint64 sampled_busy_usec;
+  gint64 active_usec;
+  gint64 active_busy_usec;
+
+  /* Pause test */
+  guint hotzones;
+  GThread *pause_thread;
+  gint64 pause_latency;
+  char pause_reply[DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX];
+} Simulation;
+
+static void
+request (DroidianEncryptionHelperControl *control,
+         const char                      *request,
+         char                            *reply)
+{
+  char buffer[DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX];
+
+  g_strlcpy (buffer, request, sizeof (buffer));
+  droidian_encryption_helper_control_handle_request (control, buffer, reply,
+                                                     DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX);
+
+  g_assert_true (g_str_has_prefix (reply, DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_OK));
+}
+
+static gint64
+get_reply_value (const char *reply,
+                 const char *key)
+{
+  g_autofree char *needle = g_strdup_printf (" %s=", key);
+  const char *value = strstr (reply, needle);
+
+  g_assert_nonnull (value);
+
+  return g_ascii_strtoll (value + strlen (needle), NULL, 10);
+}
+
+static void
+add_device (guint64 size,
+            guint64 bytes_per_second)
+{
+  FakeCryptModel model = {
+    .size = size,
+    .hotzone_size = 32 * MIB,
+    .bytes_per_second = bytes_per_second,
+    .checkpoint_usec = 20 * 1000,
+    /* What's left of a 32 KiB metadata area with a keyslot and the segments */
+    .json_area_size = 24 * 1024,
+  };
+
+  fake_crypt_add_device (DEVICE_PATH, &model);
+}
+
+static struct crypt_device *
+start (Simulation *simulation)
+{
+  struct crypt_device *crypt_device = NULL;
+  struct crypt_params_reencrypt params = {
+    .resilience = "checksum",
+    .hash = "sha256",
+    .flags = CRYPT_REENCRYPT_RESUME_ONLY,
+  };
+
+  simulation->control = droidian_encryption_helper_control_new (run_fd);
+  g_assert_nonnull (simulation->control);
+
+  g_assert_cmpint (crypt_init_data_device (&crypt_device, DEVICE_PATH, NULL), ==, 0);
+  g_assert_cmpint (crypt_load (crypt_device, CRYPT_LUKS2, NULL), ==, 0);
+  g_assert_cmpint (crypt_reencrypt_init_by_passphrase (crypt_device, NULL, PASSPHRASE, strlen (PASSPHRASE),
+                                                       CRYPT_ANY_SLOT, 0, NULL, NULL, &params), >=, 0);
+
+  return crypt_device;
+}
+
+static void
+finish (Simulation          *simulation,
+        struct crypt_device *crypt_device,
+        char                *stats)
+{
+  DroidianEncryptionHistorySession session;
+
+  request (simulation->control, DROIDIAN_ENCRYPTION_HELPER_CONTROL_STATS, stats);
+
+  /* What the helper does on exit */
+  if (droidian_encryption_helper_control_get_session (simulation->control, &session))
+    {
+      g_strlcpy (session.resilience, "checksum", sizeof (session.resilience));
+      g_assert_cmpint (droidian_encryption_history_append (crypt_device, &session), >=, 0);
+    }
+
+  droidian_encryption_helper_control_stopped (simulation->control);
+  g_clear_pointer (&simulation->control, droidian_encryption_helper_control_free);
+}
+
+static int
+on_progress (uint64_t  size,
+             uint64_t  offset,
+             void     *data)
+{
+  Simulation *simulation = data;
+
+  return droidian_encryption_helper_control_checkpoint (simulation->control, offset, size) ? 0 : 1;
+}
+
+static void
+test_rate_limit (void)
+{
+  Simulation simulation = { 0 };
+  struct crypt_device *crypt_device;
+  char reply[DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX];
+  guint64 size = 1024 * MIB;
+  guint64 rate_limit = 10 * MB;
+  gint64 started_at;
+  gint64 elapsed;
+
+  add_device (size, 200 * MB);
+  crypt_device = start (&simulation);
+
+  request (simulation.control, DROIDIAN_ENCRYPTION_HELPER_CONTROL_RATE_LIMIT " 10000000", reply);
+
+  started_at = virtual_clock_get_time ();
+  droidian_encryption_helper_control_set_running (simulation.control);
+  g_assert_cmpint (crypt_reencrypt_run (crypt_device, on_progress, &simulation), ==, 0);
+  elapsed = virtual_clock_get_time () - started_at;
+
+  g_assert_cmpuint (fake_crypt_get_offset (DEVICE_PATH), ==, size);
+
+  /* The first hotzone opens the throttling window, the others are paced */
+  g_test_message ("1 GiB at %" G_GUINT64_FORMAT " B/s: %.1f s", rate_limit, (double) elapsed / G_USEC_PER_SEC);
+  g_assert_cmpint (elapsed, >=, (gint64) ((size - 32 * MIB) * G_USEC_PER_SEC / rate_limit));
+  g_assert_cmpint (elapsed, <=, (gint64) (size * G_USEC_PER_SEC / rate_limit) + G_USEC_PER_SEC);
+
+  finish (&simulation, crypt_device, reply);
+  g_assert_cmpint (get_reply_value (reply, "throttled_usec"), >=,
+                   elapsed - fake_crypt_get_busy_usec (DEVICE_PATH) - G_USEC_PER_SEC);
+  g_assert_cmpint (get_reply_value (reply, "bytes"), ==, (gint64) (size - 32 * MIB));
+
+  crypt_free (crypt_device);
+  fake_crypt_remove_device (DEVICE_PATH);
+}
+
+static gpointer
+pause_thread (Simulation *simulation)
+{
+  char reply[DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX];
+  gint64 requested_at = virtual_clock_get_time ();
+
+  /* Answered once the running hotzone has been completed */
+  request (simulation->control, DROIDIAN_ENCRYPTION_HELPER_CONTROL_PAUSE, simulation->pause_reply);
+  simulation->pause_latency = virtual_clock_get_time () - requested_at;
+
+  /* Suspended for an hour */
+  virtual_clock_advance (HOUR);
+  request (simulation->control, DROIDIAN_ENCRYPTION_HELPER_CONTROL_RESUME, reply);
+
+  return NULL;
+}
+
+static int
+on_progress_pause (uint64_t  size,
+                   uint64_t  offset,
+                   void     *data)
+{
+  Simulation *simulation = data;
+  char reply[DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX];
+
+  if (++simulation->hotzones == 4)
+    {
+      simulation->pause_thread = g_thread_new ("pause", (GThreadFunc) pause_thread, simulation);
+
+      /* Make sure this very checkpoint sees the request */
+      do
+        {
+          g_usleep (1000);
+          request (simulation->control, DROIDIAN_ENCRYPTION_HELPER_CONTROL_STATUS, reply);
+        }
+      while (!strstr (reply, " paused=1"));
+    }
+
+  return on_progress (size, offset, data);
+}
+
+static void
+test_pause (void)
+{
+  Simulation simulation = { 0 };
+  struct crypt_device *crypt_device;
+  char reply[DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX];
+  guint64 size = 1024 * MIB;
+  gint64 started_at;
+  gint64 elapsed;
+
+  add_device (size, 100 * MB);
+  crypt_device = start (&simulation);
+
+  request (simulation.control, DROIDIAN_ENCRYPTION_HELPER_CONTROL_RATE_LIMIT " 10000000", reply);
+
+  started_at = virtual_clock_get_time ();
+  droidian_encryption_helper_control_set_running (simulation.control);
+  g_assert_cmpint (crypt_reencrypt_run (crypt_device, on_progress_pause, &simulation), ==, 0);
+  elapsed = virtual_clock_get_time () - started_at;
+
+  g_assert_nonnull (simulation.pause_thread);
+  g_thread_join (simulation.pause_thread);
+
+  g_assert_cmpstr (simulation.pause_reply, ==, DROIDIAN_ENCRYPTION_HELPER_CONTROL_REPLY_OK " state=paused");
+  g_test_message ("Pause acknowledged after %" G_GINT64_FORMAT " us", simulation.pause_latency);
+  g_assert_cmpint (simulation.pause_latency, <=, (gint64) (32 * MIB * G_USEC_PER_SEC / (100 * MB)) + 20 * 1000);
+
+  g_assert_cmpuint (fake_crypt_get_offset (DEVICE_PATH), ==, size);
+
+  finish (&simulation, crypt_device, reply);
+  g_assert_cmpint (get_reply_value (reply, "paused_usec"), >=, HOUR);
+  g_assert_cmpint (get_reply_value (reply, "paused_usec"), <=, elapsed);
+
+  /* The pacing starts over after the pause rather than catching up */
+  g_assert_cmpint (elapsed - get_reply_value (reply, "paused_usec"), >=,
+                   (gint64) ((size - 3 * 32 * MIB) * G_USEC_PER_SEC / (10 * MB)));
+
+  crypt_free (crypt_device);
+  fake_crypt_remove_device (DEVICE_PATH);
+}
+
+static void
+update_mode (Simulation *simulation,
+             gboolean    idle)
+{
+  char reply[DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX];
+  gboolean boost;
+
+  if (simulation->mode_set && idle == simulation->idle)
+      return;
+
+  simulation->mode_set = TRUE;
+  simulation->idle = idle;
+
+  boost = idle && simulation->policy->opportunistic;
+  request (simulation->control,
+           boost ? DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE " " DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE_BOOST :
+                   DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE " " DROIDIAN_ENCRYPTION_HELPER_CONTROL_MODE_BACKGROUND,
+           reply);
+}
+
+static void
+sample_foreground (Simulation *simulation)
+{
+  gint64 now = virtual_clock_get_time ();
+  gint64 busy_usec = fake_crypt_get_busy_usec (DEVICE_PATH);
+
+  /* The last hotzone and the throttling before it ran in the previous user state */
+  if (simulation->mode_set && !simulation->idle)
+    {
+      simulation->active_usec += now - simulation->sampled_at;
+      simulation->active_busy_usec += busy_usec - simulation->sampled_busy_usec;
+    }
+
+  simulation->sampled_at = now;
+  simulation->sampled_busy_usec = busy_usec;
+}
+
+static int
+on_progress_day (uint64_t  size,
+                 uint64_t  offset,
+                 void     *data)
+{
+  Simulation *simulation = data;
+  gint64 time_of_day = (virtual_clock_get_time () - simulation->origin) % DAY;
+
+  sample_foreground (simulation);
+
+  if (time_of_day >= SWITCHED_OFF_FROM)
+      droidian_encryption_helper_control_request_stop (simulation->control);
+  else
+      update_mode (simulation, time_of_day >= IDLE_FROM);
+
+  return on_progress (size, offset, data);
+}
+
+typedef struct {
+  gint64 elapsed;
+  double foreground_impact;
+  guint sessions;
+  double eta_accuracy; /* estimated over actual time left, after two days */
+} SimulationResult;
+
+static void
+simulate (const Policy     *policy,
+          SimulationResult *result)
+{
+  Simulation simulation = {
+    .policy = policy,
+    .origin = virtual_clock_get_time (),
+  };
+  struct crypt_device *crypt_device;
+  g_autoptr (GArray) history = NULL;
+  char reply[DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX];
+  guint64 size = 256 * GB;
+  guint64 estimate = 0;
+  gint64 estimated_at = 0;
+  guint64 bytes = 0;
+  gboolean complete = FALSE;
+  guint day;
+
+  memset (result, 0, sizeof (*result));
+  add_device (size, 60 * MB);
+
+  for (day = 0; !complete; day++)
+    {
+      g_assert_cmpuint (day, <, 30);
+
+      /* Booted at the start of the day */
+      virtual_clock_advance (simulation.origin + day * DAY - virtual_clock_get_time ());
+
+      crypt_device = start (&simulation);
+      droidian_encryption_helper_control_set_background_rate_limit (simulation.control, policy->background_rate_limit);
+
+      /* Switched off since the last session */
+      simulation.mode_set = FALSE;
+      sample_foreground (&simulation);
+      update_mode (&simulation, FALSE);
+
+      droidian_encryption_helper_control_set_running (simulation.control);
+      g_assert_cmpint (crypt_reencrypt_run (crypt_device, on_progress_day, &simulation), ==, 0);
+      sample_foreground (&simulation);
+
+      finish (&simulation, crypt_device, reply);
+      result->sessions++;
+
+      complete = crypt_reencrypt_status (crypt_device, NULL) == CRYPT_REENCRYPT_NONE;
+
+      /* What the service would report the next morning */
+      if (day == 1 && !complete)
+        {
+          history = droidian_encryption_history_load (crypt_device);
+          estimate = droidian_encryption_service_progress_estimate_remaining_time (history,
+                                                                                   size - fake_crypt_get_offset (DEVICE_PATH));
+          estimated_at = virtual_clock_get_time ();
+          g_clear_pointer (&history, g_array_unref);
+        }
+
+      crypt_free (crypt_device);
+    }
+
+  result->elapsed = virtual_clock_get_time () - simulation.origin;
+  result->foreground_impact = simulation.active_usec ?
+    (double) simulation.active_busy_usec / simulation.active_usec : 0;
+
+  if (estimated_at)
+      result->eta_accuracy = (double) estimate * G_USEC_PER_SEC / (virtual_clock_get_time () - estimated_at);
+
+  /* Every session made it to the history */
+  g_assert_cmpint (crypt_init_data_device (&crypt_device, DEVICE_PATH, NULL), ==, 0);
+  history = droidian_encryption_history_load (crypt_device);
+  g_assert_cmpuint (history->len, ==, MIN (result->sessions, DROIDIAN_ENCRYPTION_HISTORY_MAX_SESSIONS));
+
+  for (guint i = 0; i < history->len; i++)
+      bytes += g_array_index (history, DroidianEncryptionHistorySession, i).end_offset -
+               g_array_index (history, DroidianEncryptionHistorySession, i).start_offset;
+
+  /* Only the first hotzone of every session goes unrecorded */
+  g_assert_cmpuint (bytes + result->sessions * 32 * MIB, >=, size);
+
+  crypt_free (crypt_device);
+  fake_crypt_remove_device (DEVICE_PATH);
+
+  g_test_message ("%s: %u sessions, %.2f days, %.2f%% of the device while the user is active",
+                  policy->name, result->sessions, (double) result->elapsed / DAY,
+                  result->foreground_impact * 100);
+}
+
+static void
+test_policies (void)
+{
+  static const Policy unthrottled = { "unthrottled", 0, FALSE };
+  static const Policy background = { "background", 1 * MB, FALSE };
+  static const Policy opportunistic = { "opportunistic", 1 * MB, TRUE };
+  SimulationResult result;
+
+  /* 256 GB at 60 MB/s: a bit more than an hour, using the whole device */
+  simulate (&unthrottled, &result);
+  g_assert_cmpint (result.elapsed, <, 2 * HOUR);
+  g_assert_cmpfloat (result.foreground_impact, >, 0.9);
+
+  /* 18 hours a day at 1 MB/s: four days, barely noticeable */
+  simulate (&background, &result);
+  g_assert_cmpint (result.elapsed, >, 3 * DAY + 12 * HOUR);
+  g_assert_cmpint (result.elapsed, <, 4 * DAY);
+  g_assert_cmpfloat (result.foreground_impact, <, 0.025);
+
+  /* The switched off hours aren't spread evenly over the days left */
+  g_test_message ("ETA after two days: %.0f%% of the actual time", result.eta_accuracy * 100);
+  g_assert_cmpfloat (result.eta_accuracy, >, 0.75);
+  g_assert_cmpfloat (result.eta_accuracy, <, 1.25);
+
+  /* Boosting overnight finishes on the first night, just as unnoticeable */
+  simulate (&opportunistic, &result);
+  g_assert_cmpint (result.elapsed, <, DAY);
+  g_assert_cmpfloat (result.foreground_impact, <, 0.025);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autofree char *run_dir = NULL;
+  int result;
+
+  g_test_init (&argc, &argv, NULL);
+
+  /* Milestones are never added, nothing is created in there */
+  run_dir = g_dir_make_tmp ("droidian-encryption-simulation-XXXXXX", NULL);
+  g_assert_nonnull (run_dir);
+  run_fd = open (run_dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  g_assert_cmpint (run_fd, >, -1);
+
+  virtual_clock_install ();
+
+  g_test_add_func ("/simulation/rate-limit", test_rate_limit);
+  g_test_add_func ("/simulation/pause", test_pause);
+  g_test_add_func ("/simulation/policies", test_policies);
+
+  result = g_test_run ();
+
+  close (run_fd);
+  g_rmdir (run_dir);
+
+  return result;
+}
@@ -0,0 +1,92 @@
+/* virtual-clock.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <poll.h>
+
+#include "clock.h"
+#include "virtual-clock.h"
+
+#define VIRTUAL_CLOCK_EPOCH (G_GINT64_CONSTANT (1700000000) * G_USEC_PER_SEC)
+
+/* Read by every thread of the helper */
+static gint64 now = G_USEC_PER_SEC;
+
+static gint64
+get_monotonic_time (void)
+{
+  return __atomic_load_n (&now, __ATOMIC_SEQ_CST);
+}
+
+static gint64
+get_real_time (void)
+{
+  return VIRTUAL_CLOCK_EPOCH + get_monotonic_time ();
+}
+
+static int
+virtual_poll (struct pollfd *fds,
+              nfds_t         nfds,
+              int            timeout_msec)
+{
+  int result;
+
+  /* Pending wakeups are delivered without moving the time */
+  result = poll (fds, nfds, 0);
+  if (result != 0 || timeout_msec == 0)
+      return result;
+
+  /* Nothing would ever end the wait but another thread */
+  if (timeout_msec < 0)
+      return poll (fds, nfds, -1);
+
+  virtual_clock_advance ((gint64) timeout_msec * 1000);
+
+  return 0;
+}
+
+static const DroidianEncryptionHelperClock virtual_clock = {
+  .get_monotonic_time = get_monotonic_time,
+  .get_real_time = get_real_time,
+  .poll = virtual_poll,
+};
+
+void
+virtual_clock_install (void)
+{
+  droidian_encryption_helper_clock_set (&virtual_clock);
+}
+
+void
+virtual_clock_uninstall (void)
+{
+  droidian_encryption_helper_clock_set (NULL);
+}
+
+gint64
+virtual_clock_get_time (void)
+{
+  return get_monotonic_time ();
+}
+
+void
+virtual_clock_advance (gint64 usec)
+{
+  g_return_if_fail (usec >= 0);
+
+  __atomic_add_fetch (&now, usec, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,41 @@
+/* virtual-clock.h
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DROIDIANENCRYPTIONTESTSVIRTUALCLOCK_H
+#define DROIDIANENCRYPTIONTESTSVIRTUALCLOCK_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * A clock for the helper code that only moves when told to. Waits with a
+ * timeout return at once, as if it had elapsed, unless a wakeup is already
+ * pending. Waits without a timeout still block until an actual wakeup.
+ * Real time is reported as a fixed epoch plus the monotonic time.
+ */
+
+void virtual_clock_install (void);
+void virtual_clock_uninstall (void);
+
+gint64 virtual_clock_get_time (void);
+void virtual_clock_advance (gint64 usec);
+
+G_END_DECLS
+
+#endif /* DROIDIANENCRYPTIONTESTSVIRTUALCLOCK_H */
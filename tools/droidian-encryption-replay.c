@@ -0,0 +1,392 @@
+/* droidian-encryption-replay.c
+ *
+ * Copyright 2022 Eugenio Paolantonio (g7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control-protocol.h"
+
+/*
+ * Replays a block I/O trace against the mapped device while the helper
+ * reencrypts underneath, and reports the latency seen by the replayed
+ * requests, which is what the foreground applications would see.
+ *
+ * Trace lines are "<timestamp usec> <op> <offset> <size>", op being R or W
+ * (blkparse RWBS strings are accepted too) and offset/size in bytes.
+ * Empty lines and lines starting with # are ignored.
+ *
+ * Requests are issued on the trace schedule, whether or not the previous
+ * ones have completed, to a pool of threads doing synchronous I/O: up to
+ * --queue-depth of them are in flight at once, like the applications the
+ * trace comes from would have them. The latency is measured from the
+ * scheduled time, so that a request waiting for a free thread counts too.
+ */
+
+#define DEFAULT_DEVICE "/dev/mapper/droidian_encrypted"
+#define DEFAULT_QUEUE_DEPTH 32
+#define ALIGNMENT 4096
+
+typedef struct {
+  gint64 timestamp;
+  gboolean write;
+  guint64 offset;
+  guint64 size;
+} TraceEntry;
+
+typedef struct {
+  gint64 scheduled;
+  gboolean write;
+  guint64 offset;
+  guint64 size;
+} Request;
+
+typedef struct {
+  int fd;
+  GMutex mutex;
+  GArray *latencies;
+  GError *error;
+} Replay;
+
+static gint64
+now_usec (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (gint64) now.tv_sec * G_USEC_PER_SEC + now.tv_nsec / 1000;
+}
+
+static GArray *
+load_trace (const char  *path,
+            GError     **error)
+{
+  g_autoptr(GArray) entries = g_array_new (FALSE, FALSE, sizeof (TraceEntry));
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  char op[8];
+  guint line;
+  TraceEntry entry;
+
+  if (!g_file_get_contents (path, &contents, NULL, error))
+      return NULL;
+
+  lines = g_strsplit (contents, "\n", -1);
+
+  for (line = 0; lines[line] != NULL; line++)
+    {
+      g_strstrip (lines[line]);
+      if (*lines[line] == '\0' || *lines[line] == '#')
+          continue;
+
+      if (sscanf (lines[line], "%" G_GINT64_FORMAT " %7s %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
+                  &entry.timestamp, op, &entry.offset, &entry.size) != 4 ||
+          (!strchr (op, 'R') && !strchr (op, 'W')))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "%s:%u: unable to parse \"%s\"", path, line + 1, lines[line]);
+          return NULL;
+        }
+
+      entry.write = strchr (op, 'W') != NULL;
+      g_array_append_val (entries, entry);
+    }
+
+  return g_steal_pointer (&entries);
+}
+
+static void
+replay_request (Request *request,
+                Replay  *replay)
+{
+  gpointer buffer = NULL;
+  gint64 latency;
+  ssize_t result;
+  int saved_errno;
+
+  if (posix_memalign (&buffer, ALIGNMENT, request->size) != 0)
+    {
+      result = -1;
+      saved_errno = ENOMEM;
+    }
+  else
+    {
+      if (request->write)
+        {
+          memset (buffer, 0, request->size);
+          result = pwrite (replay->fd, buffer, request->size, request->offset);
+        }
+      else
+        {
+          result = pread (replay->fd, buffer, request->size, request->offset);
+        }
+
+      saved_errno = errno;
+    }
+
+  /* Measured from the scheduled time, so that queueing for a thread or behind the helper counts too */
+  latency = now_usec () - request->scheduled;
+
+  g_mutex_lock (&replay->mutex);
+
+  if (result < 0 && !replay->error)
+      g_set_error (&replay->error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "I/O error at offset %" G_GUINT64_FORMAT ": %s", request->offset, g_strerror (saved_errno));
+  else if (result >= 0)
+      g_array_append_val (replay->latencies, latency);
+
+  g_mutex_unlock (&replay->mutex);
+
+  free (buffer);
+  g_free (request);
+}
+
+static gboolean
+get_helper_offset (guint64 *offset)
+{
+  struct sockaddr_un address = {
+    .sun_family = AF_UNIX,
+  };
+  char reply[DROIDIAN_ENCRYPTION_HELPER_CONTROL_MESSAGE_MAX];
+  const char *value;
+  ssize_t length;
+  int fd;
+
+  g_strlcpy (address.sun_path, DROIDIAN_ENCRYPTION_HELPER_CONTROL_SOCKET, sizeof (address.sun_path));
+
+  if ((fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+      return FALSE;
+
+  if (connect (fd, (struct sockaddr *) &address, sizeof (address)) < 0 ||
+      send (fd, DROIDIAN_ENCRYPTION_HELPER_CONTROL_STATUS,
+            strlen (DROIDIAN_ENCRYPTION_HELPER_CONTROL_STATUS), MSG_NOSIGNAL) < 0 ||
+      (length = recv (fd, reply, sizeof (reply) - 1, 0)) <= 0)
+    {
+      close (fd);
+      return FALSE;
+    }
+
+  close (fd);
+  reply[length] = '\0';
+
+  if (!(value = strstr (reply, " offset=")))
+      return FALSE;
+
+  *offset = g_ascii_strtoull (value + strlen (" offset="), NULL, 10);
+  return TRUE;
+}
+
+static int
+compare_latency (gconstpointer a,
+                 gconstpointer b)
+{
+  gint64 first = *(const gint64 *) a;
+  gint64 second = *(const gint64 *) b;
+
+  return (first > second) - (first < second);
+}
+
+static gint64
+percentile (GArray *latencies,
+            double  fraction)
+{
+  guint index;
+
+  if (!latencies->len)
+      return 0;
+
+  index = MIN ((guint) (fraction * latencies->len), latencies->len - 1);
+  return g_array_index (latencies, gint64, index);
+}
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GArray) entries = NULL;
+  g_autofree char *device = NULL;
+  g_autofree char *trace = NULL;
+  g_autofree char *label = NULL;
+  gboolean allow_writes = FALSE;
+  gboolean buffered = FALSE;
+  double speed = 1.0;
+  gint queue_depth = DEFAULT_QUEUE_DEPTH;
+  gint exit_code = EXIT_FAILURE;
+  Replay replay = { .fd = -1 };
+  GThreadPool *pool = NULL;
+  TraceEntry *entry;
+  Request *request;
+  guint64 device_size;
+  guint64 offset;
+  guint64 size;
+  guint64 helper_start = 0;
+  guint64 helper_end = 0;
+  gboolean have_helper;
+  gint64 started_at;
+  gint64 scheduled;
+  gint64 issued;
+  gint64 elapsed;
+  gboolean failed;
+  guint late = 0;
+
+  GOptionEntry main_entries[] = {
+    { "device", 0, 0, G_OPTION_ARG_FILENAME, &device, "Device to replay the trace on (default: " DEFAULT_DEVICE ")", NULL },
+    { "trace", 0, 0, G_OPTION_ARG_FILENAME, &trace, "Trace to replay", NULL },
+    { "label", 0, 0, G_OPTION_ARG_STRING, &label, "Label of the configuration being measured", NULL },
+    { "speed", 0, 0, G_OPTION_ARG_DOUBLE, &speed, "Replay speed factor (default: 1.0)", NULL },
+    { "queue-depth", 0, 0, G_OPTION_ARG_INT, &queue_depth, "Maximum number of requests in flight (default: 32)", NULL },
+    { "allow-writes", 0, 0, G_OPTION_ARG_NONE, &allow_writes, "Replay writes as writes, destroying the data (default: as reads)", NULL },
+    { "buffered", 0, 0, G_OPTION_ARG_NONE, &buffered, "Go through the page cache instead of using O_DIRECT", NULL },
+    { NULL }
+  };
+
+  g_mutex_init (&replay.mutex);
+
+  context = g_option_context_new ("- replay a block I/O trace during reencryption");
+  g_option_context_add_main_entries (context, main_entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+      goto out;
+
+  if (!trace || speed <= 0 || queue_depth <= 0)
+    {
+      g_set_error (&error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   "A trace (--trace), a positive speed and a positive queue depth are required");
+      goto out;
+    }
+
+  if (!(entries = load_trace (trace, &error)))
+      goto out;
+
+  if ((replay.fd = open (device ? device : DEFAULT_DEVICE,
+                         (allow_writes ? O_RDWR : O_RDONLY) | (buffered ? 0 : O_DIRECT) | O_CLOEXEC)) < 0 ||
+      (device_size = lseek (replay.fd, 0, SEEK_END)) == (guint64) -1)
+    {
+      g_set_error (&error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "Unable to open %s: %s", device ? device : DEFAULT_DEVICE, g_strerror (errno));
+      goto out;
+    }
+
+  replay.latencies = g_array_sized_new (FALSE, FALSE, sizeof (gint64), entries->len);
+
+  /* Exclusive: the threads are all there before the first request is due */
+  if (!(pool = g_thread_pool_new ((GFunc) replay_request, &replay, queue_depth, TRUE, &error)))
+      goto out;
+
+  have_helper = get_helper_offset (&helper_start);
+  started_at = now_usec ();
+
+  for (guint index = 0; index < entries->len; index++)
+    {
+      entry = &g_array_index (entries, TraceEntry, index);
+
+      /* O_DIRECT wants aligned requests, traces from other devices might not fit either */
+      size = MAX ((entry->size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT, ALIGNMENT);
+      if (size > device_size)
+          continue;
+      offset = entry->offset % (device_size - size + 1) / ALIGNMENT * ALIGNMENT;
+
+      g_mutex_lock (&replay.mutex);
+      failed = replay.error != NULL;
+      g_mutex_unlock (&replay.mutex);
+
+      if (failed)
+          break;
+
+      /* Open loop: requests are issued on the trace schedule, not after the previous one */
+      scheduled = started_at + (gint64) ((entry->timestamp - g_array_index (entries, TraceEntry, 0).timestamp) / speed);
+      issued = now_usec ();
+      if (issued < scheduled)
+        {
+          g_usleep (scheduled - issued);
+          issued = now_usec ();
+        }
+      else if (issued - scheduled > 1000)
+        {
+          late++;
+        }
+
+      request = g_new0 (Request, 1);
+      request->scheduled = scheduled;
+      request->write = entry->write && allow_writes;
+      request->offset = offset;
+      request->size = size;
+
+      /* Queued until a thread is free, that wait is part of the latency */
+      if (!g_thread_pool_push (pool, request, &error))
+        {
+          g_free (request);
+          goto out;
+        }
+    }
+
+  /* Let the requests in flight complete */
+  g_thread_pool_free (g_steal_pointer (&pool), FALSE, TRUE);
+
+  if (replay.error)
+    {
+      g_propagate_error (&error, g_steal_pointer (&replay.error));
+      goto out;
+    }
+
+  elapsed = MAX (now_usec () - started_at, 1);
+  have_helper = have_helper && get_helper_offset (&helper_end);
+
+  g_array_sort (replay.latencies, compare_latency);
+
+  printf ("label=%s queue_depth=%d requests=%u late=%u p50_usec=%" G_GINT64_FORMAT " p99_usec=%" G_GINT64_FORMAT
+          " p999_usec=%" G_GINT64_FORMAT " max_usec=%" G_GINT64_FORMAT,
+          label ? label : "default", queue_depth, replay.latencies->len, late,
+          percentile (replay.latencies, 0.5), percentile (replay.latencies, 0.99),
+          percentile (replay.latencies, 0.999),
+          replay.latencies->len ? g_array_index (replay.latencies, gint64, replay.latencies->len - 1) : 0);
+
+  if (have_helper && helper_end >= helper_start)
+      printf (" reencrypted_bytes=%" G_GUINT64_FORMAT " reencrypt_bytes_per_second=%" G_GUINT64_FORMAT,
+              helper_end - helper_start, (helper_end - helper_start) * G_USEC_PER_SEC / elapsed);
+
+  printf ("\n");
+  exit_code = EXIT_SUCCESS;
+
+out:
+  if (pool)
+      g_thread_pool_free (pool, FALSE, TRUE);
+
+  if (error)
+      g_printerr ("%s\n", error->message);
+
+  if (replay.fd > -1)
+      close (replay.fd);
+
+  g_clear_pointer (&replay.latencies, g_array_unref);
+  g_clear_error (&replay.error);
+  g_mutex_clear (&replay.mutex);
+
+  return exit_code;
+}